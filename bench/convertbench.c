@@ -0,0 +1,185 @@
+/* convertbench.c - micro-benchmark for the frame to photo conversion
+ *
+ * Compares the cost of the original multi-pass GrabSample sequence (copy
+ * out of the grabber, alpha fill, row swap flip and the per-pixel
+ * channel reorder done by Tk_PhotoPutBlock for B,G,R,A blocks) with the
+ * single pass VideoConvertToRGBA kernel, for each available instruction
+ * set. Bytes touched are reported as multiples of the frame size.
+ * The YUV camera formats are then converted to R,G,B,A with each
+ * instruction set and checked against the scalar output.
+ *
+ * Usage: convertbench ?width height? ?iterations?
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double
+Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+Report(const char *name, double seconds, int iterations, double bytesRead, double bytesWritten)
+{
+    printf("%-16s %8.3f ms/frame   read %.2fx  written %.2fx  touched %.2fx\n",
+           name, seconds * 1000.0 / iterations, bytesRead, bytesWritten,
+           (bytesRead + bytesWritten) / 2.0);
+}
+
+/*
+ * The sequence GrabSample used to perform on every picture.
+ */
+
+static void
+LegacyGrab(const unsigned char *grabber, unsigned char *photo, int width, int height)
+{
+    const int cbRow = width * 4;
+    const size_t cbData = (size_t)cbRow * height;
+    unsigned char *pData = (unsigned char *)malloc(cbData);
+    unsigned char *pTmp, *p, *srcPtr, *dstPtr;
+    int i, x, y;
+
+    memcpy(pData, grabber, cbData);                     /* GetCurrentBuffer */
+    for (p = pData; p < pData + cbData; p += 4)         /* alpha fill */
+        p[3] = 0xff;
+    pTmp = (unsigned char *)malloc(cbRow);              /* bottom-up flip */
+    for (i = 0; i < height / 2; i++) {
+        unsigned char *pTop = pData + i * cbRow;
+        unsigned char *pBot = pData + (height - i - 1) * cbRow;
+        memcpy(pTmp, pBot, cbRow);
+        memcpy(pBot, pTop, cbRow);
+        memcpy(pTop, pTmp, cbRow);
+    }
+    free(pTmp);
+    for (y = 0; y < height; ++y) {                      /* Tk_PhotoPutBlock */
+        srcPtr = pData + y * cbRow;
+        dstPtr = photo + y * cbRow;
+        for (x = 0; x < width; ++x, srcPtr += 4, dstPtr += 4) {
+            dstPtr[0] = srcPtr[2];
+            dstPtr[1] = srcPtr[1];
+            dstPtr[2] = srcPtr[0];
+            dstPtr[3] = srcPtr[3];
+        }
+    }
+    free(pData);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct { const char *name; int mask; } kernels[] = {
+        { "fused scalar", 0 },
+        { "fused sse2", VIDEO_CPU_SSE2 },
+        { "fused avx2", VIDEO_CPU_SSE2 | VIDEO_CPU_AVX2 },
+    };
+    static const struct { const char *name; int mask; } yuvKernels[] = {
+        { "scalar", 0 },
+        { "sse2", VIDEO_CPU_SSE2 },
+        { "ssse3", VIDEO_CPU_SSE2 | VIDEO_CPU_SSSE3 },
+        { "avx2", VIDEO_CPU_SSE2 | VIDEO_CPU_SSSE3 | VIDEO_CPU_AVX2 },
+    };
+    static const struct { const char *name; int format; } yuvFormats[] = {
+        { "yuy2", VIDEO_FORMAT_YUY2 }, { "uyvy", VIDEO_FORMAT_UYVY },
+        { "nv12", VIDEO_FORMAT_NV12 }, { "i420", VIDEO_FORMAT_I420 },
+    };
+    int width = 1920, height = 1080, iterations = 200;
+    int features = VideoCpuFeatures();
+    unsigned char *grabber, *photo, *check;
+    VideoFrame frame;
+    size_t cbFrame, n;
+    double t;
+    int i, k, f;
+
+    if (argc >= 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4) {
+        iterations = atoi(argv[3]);
+    }
+    cbFrame = (size_t)width * height * 4;
+    grabber = (unsigned char *)malloc(cbFrame);
+    photo = (unsigned char *)malloc(cbFrame);
+    check = (unsigned char *)malloc(cbFrame);
+    for (n = 0; n < cbFrame; ++n) {
+        grabber[n] = (unsigned char)(rand() >> 7);
+    }
+
+    /* A bottom-up RGB32 sample as delivered by the sample grabber. */
+    VideoFrameLayout(&frame, VIDEO_FORMAT_BGRA, width, height, grabber);
+    frame.pitch = -width * 4;
+    frame.data = grabber + (size_t)(height - 1) * width * 4;
+
+    printf("%dx%d frame, %.1f MB, %d iterations\n", width, height,
+           cbFrame / 1048576.0, iterations);
+
+    LegacyGrab(grabber, check, width, height);
+    t = Seconds();
+    for (i = 0; i < iterations; ++i) {
+        LegacyGrab(grabber, photo, width, height);
+    }
+    Report("legacy", Seconds() - t, iterations, 4.5, 4.5);
+
+    for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); ++k) {
+        if ((features & kernels[k].mask) != kernels[k].mask) {
+            continue;
+        }
+        VideoConvertInit(kernels[k].mask);
+        memset(photo, 0, cbFrame);
+        VideoConvertToRGBA(&frame, photo, width * 4);
+        if (memcmp(photo, check, cbFrame) != 0) {
+            printf("%s: output differs from the legacy path\n", kernels[k].name);
+            return 1;
+        }
+        t = Seconds();
+        for (i = 0; i < iterations; ++i) {
+            VideoConvertToRGBA(&frame, photo, width * 4);
+        }
+        Report(kernels[k].name, Seconds() - t, iterations, 1.0, 1.0);
+    }
+
+    /* The grabber buffer is large enough to hold any of the YUV frames. */
+    for (f = 0; f < (int)(sizeof(yuvFormats) / sizeof(yuvFormats[0])); ++f) {
+        double cbSource = (double)VideoFrameLayout(&frame, yuvFormats[f].format,
+                                                   width, height, grabber);
+        char name[32];
+
+        VideoConvertInit(0);
+        VideoConvertToRGBA(&frame, check, width * 4);
+        for (k = 0; k < (int)(sizeof(yuvKernels) / sizeof(yuvKernels[0])); ++k) {
+            if ((features & yuvKernels[k].mask) != yuvKernels[k].mask) {
+                continue;
+            }
+            VideoConvertInit(yuvKernels[k].mask);
+            memset(photo, 0, cbFrame);
+            VideoConvertToRGBA(&frame, photo, width * 4);
+            sprintf(name, "%s %s", yuvFormats[f].name, yuvKernels[k].name);
+            if (memcmp(photo, check, cbFrame) != 0) {
+                printf("%s: output differs from the scalar kernel\n", name);
+                return 1;
+            }
+            t = Seconds();
+            for (i = 0; i < iterations; ++i) {
+                VideoConvertToRGBA(&frame, photo, width * 4);
+            }
+            Report(name, Seconds() - t, iterations, cbSource / cbFrame, 1.0);
+        }
+    }
+
+    free(grabber);
+    free(photo);
+    free(check);
+    return 0;
+}
@@ -0,0 +1,148 @@
+/* poolcheck.c - check that the frame path stops allocating once warm
+ *
+ * Runs frames through the ring, the sinks and the frame pool the way a
+ * capture thread, the widget and two sinks use them: one sink copies
+ * each frame into a pooled buffer and keeps the last few, as the MJPEG
+ * stream does with its encoded frames, and the other holds the buffer
+ * itself until the next frame arrives. After a warm-up of a quarter of
+ * the frames every buffer should come from the free lists, so the
+ * number of pool misses must not rise any further.
+ *
+ * Usage: poolcheck ?width height? ?frames?
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ENCODED_KEEP 3      /* copies kept by the encoding sink */
+
+static Tcl_WideInt notified;
+
+/*
+ * The widget is not involved here, so frame notifications are only
+ * counted.
+ */
+
+void
+VideoNotifyFrame(Video *videoPtr, const VideoFrame *framePtr)
+{
+    ++notified;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int width = 640, height = 360, frames = 2000, warmup, n;
+    void *encoded[ENCODED_KEEP];
+    VideoBuffer *heldPtr = NULL;
+    VideoSink *encodePtr, *holdPtr;
+    VideoFramePool *poolPtr;
+    VideoFrame layout;
+    Tcl_WideInt hits, misses, warmHits, warmMisses;
+    size_t size;
+    Video video;
+
+    if (argc > 2) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc > 3)
+        frames = atoi(argv[3]);
+    if (argc == 2)
+        frames = atoi(argv[1]);
+    if (width < 2 || height < 2 || frames < 4) {
+        fprintf(stderr, "usage: poolcheck ?width height? ?frames?\n");
+        return 2;
+    }
+    Tcl_FindExecutable(argv[0]);
+
+    memset(&video, 0, sizeof(video));
+    video.bufferCount = 3;
+    video.statsPtr = VideoStatsCreate();
+    size = VideoFrameLayout(&layout, VIDEO_FORMAT_YUY2, width, height, NULL);
+    encodePtr = VideoSinkCreate(&video, "encode", ENCODED_KEEP, NULL, NULL);
+    holdPtr = VideoSinkCreate(&video, "hold", 1, NULL, NULL);
+    if (VideoOpenRing(&video, size) != TCL_OK) {
+        fprintf(stderr, "poolcheck: failed to create the ring\n");
+        return 1;
+    }
+    poolPtr = VideoRingPool(video.ringPtr);
+    memset(encoded, 0, sizeof(encoded));
+    warmup = frames / 4;
+    warmHits = warmMisses = 0;
+
+    for (n = 0; n < frames; ++n) {
+        VideoFrame *framePtr = VideoBeginFrame(&video);
+        VideoBuffer *bufferPtr;
+
+        if (n == warmup)
+            VideoFramePoolCounts(poolPtr, &warmHits, &warmMisses);
+
+        if (framePtr != NULL) {
+            VideoFrameLayout(framePtr, VIDEO_FORMAT_YUY2, width, height, framePtr->data);
+            memset(framePtr->data, n & 0xff, size);
+            framePtr->sequence = n;
+            VideoPublishFrame(&video);
+        }
+
+        /* the widget, which looks at every other frame */
+        if (n & 1) {
+            VideoRingAcquire(video.ringPtr);
+            VideoRingRelease(video.ringPtr);
+        }
+
+        /* a stream-like sink keeping copies of the last few frames */
+        bufferPtr = VideoSinkTake(encodePtr);
+        if (bufferPtr != NULL) {
+            int slot = n % ENCODED_KEEP;
+            size_t copySize = size / 8 + (n % 7) * 64;
+
+            if (encoded[slot] != NULL)
+                VideoFramePoolFree(encoded[slot]);
+            encoded[slot] = VideoFramePoolAlloc(VideoBufferPool(bufferPtr), copySize);
+            if (encoded[slot] != NULL)
+                memcpy(encoded[slot], VideoBufferFrame(bufferPtr)->data, copySize);
+            VideoBufferRelease(bufferPtr);
+        }
+
+        /* a sink holding the buffer itself until the next one */
+        bufferPtr = VideoSinkTake(holdPtr);
+        if (bufferPtr != NULL) {
+            if (heldPtr != NULL)
+                VideoBufferRelease(heldPtr);
+            heldPtr = bufferPtr;
+        }
+    }
+    VideoFramePoolCounts(poolPtr, &hits, &misses);
+
+    printf("%dx%d, %d frames, %ld notified, %ld dropped by the ring\n",
+           width, height, frames, (long)notified, (long)VideoRingDropped(video.ringPtr));
+    printf("warm-up    hits %8ld  misses %4ld\n", (long)warmHits, (long)warmMisses);
+    printf("after it   hits %8ld  misses %4ld\n",
+           (long)(hits - warmHits), (long)(misses - warmMisses));
+
+    if (heldPtr != NULL)
+        VideoBufferRelease(heldPtr);
+    for (n = 0; n < ENCODED_KEEP; ++n) {
+        if (encoded[n] != NULL)
+            VideoFramePoolFree(encoded[n]);
+    }
+    VideoSinkDestroy(holdPtr);
+    VideoSinkDestroy(encodePtr);
+    VideoCloseRing(&video);
+    VideoStatsDestroy(video.statsPtr);
+
+    if (misses != warmMisses) {
+        printf("FAILED: the pool kept allocating after the warm-up\n");
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,157 @@
+/* scalebench.c - micro-benchmark for the image scaler
+ *
+ * Scales a frame to a range of tile sizes with the table driven scaler
+ * and its fast paths, for each available instruction set, and compares
+ * the time with a straightforward per-pixel floating point bilinear
+ * scaler. The outputs are checked against that reference, allowing for
+ * the difference between area averaging and bilinear sampling when
+ * shrinking.
+ *
+ * Usage: scalebench ?width height? ?iterations?
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+static double
+Seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Per-pixel bilinear sampling, as a naive renderer would do it.
+ */
+
+static void
+NaiveScale(const unsigned char *srcPtr, int srcWidth, int srcHeight,
+           unsigned char *dstPtr, int dstWidth, int dstHeight)
+{
+    int x, y, c;
+
+    for (y = 0; y < dstHeight; ++y) {
+        double fy = (y + 0.5) * srcHeight / dstHeight - 0.5;
+        int y0 = (int)floor(fy);
+        double wy;
+        if (y0 < 0) { y0 = 0; fy = 0.0; }
+        if (y0 > srcHeight - 2) y0 = srcHeight - 2;
+        wy = fy - y0;
+        if (wy > 1.0) wy = 1.0;
+        for (x = 0; x < dstWidth; ++x) {
+            double fx = (x + 0.5) * srcWidth / dstWidth - 0.5;
+            int x0 = (int)floor(fx);
+            double wx;
+            if (x0 < 0) { x0 = 0; fx = 0.0; }
+            if (x0 > srcWidth - 2) x0 = srcWidth - 2;
+            wx = fx - x0;
+            if (wx > 1.0) wx = 1.0;
+            for (c = 0; c < 4; ++c) {
+                const unsigned char *p = srcPtr + ((size_t)y0 * srcWidth + x0) * 4 + c;
+                const unsigned char *q = p + srcWidth * 4;
+                double top = p[0] * (1.0 - wx) + p[4] * wx;
+                double bottom = q[0] * (1.0 - wx) + q[4] * wx;
+                dstPtr[((size_t)y * dstWidth + x) * 4 + c] =
+                    (unsigned char)(top * (1.0 - wy) + bottom * wy + 0.5);
+            }
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct { const char *name; int mask; } kernels[] = {
+        { "scalar", 0 },
+        { "sse2", VIDEO_CPU_SSE2 },
+    };
+    static const struct { int num, den; } ratios[] = {
+        { 1, 4 }, { 1, 3 }, { 1, 2 }, { 2, 3 }, { 5, 4 }, { 2, 1 },
+    };
+    int width = 1920, height = 1080, iterations = 50;
+    int features = VideoCpuFeatures();
+    VideoScaler *scalerPtr = VideoScalerCreate();
+    unsigned char *src, *dst, *ref;
+    size_t n;
+    int i, k, r;
+
+    if (argc >= 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4) {
+        iterations = atoi(argv[3]);
+    }
+
+    /* A smooth gradient with some noise, so both filters should agree. */
+    src = (unsigned char *)malloc((size_t)width * height * 4);
+    dst = (unsigned char *)malloc((size_t)width * height * 16);
+    ref = (unsigned char *)malloc((size_t)width * height * 16);
+    for (n = 0; n < (size_t)width * height; ++n) {
+        int x = (int)(n % width), y = (int)(n / width);
+        src[n * 4] = (unsigned char)(x * 255 / width);
+        src[n * 4 + 1] = (unsigned char)(y * 255 / height);
+        src[n * 4 + 2] = (unsigned char)((x + y) * 127 / (width + height) + (rand() & 7));
+        src[n * 4 + 3] = 0xff;
+    }
+    printf("%dx%d source, %d iterations\n", width, height, iterations);
+
+    for (r = 0; r < (int)(sizeof(ratios) / sizeof(ratios[0])); ++r) {
+        int dstWidth = width * ratios[r].num / ratios[r].den;
+        int dstHeight = height * ratios[r].num / ratios[r].den;
+        double t, naive;
+        char name[64];
+
+        NaiveScale(src, width, height, ref, dstWidth, dstHeight);
+        t = Seconds();
+        for (i = 0; i < iterations; ++i) {
+            NaiveScale(src, width, height, ref, dstWidth, dstHeight);
+        }
+        naive = (Seconds() - t) * 1000.0 / iterations;
+        sprintf(name, "%dx%d", dstWidth, dstHeight);
+        printf("%-10s naive   %8.3f ms\n", name, naive);
+
+        for (k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); ++k) {
+            int maxDiff = 0;
+            if ((features & kernels[k].mask) != kernels[k].mask) {
+                continue;
+            }
+            VideoScaleInit(kernels[k].mask);
+            t = Seconds();
+            if (VideoScalerSetup(scalerPtr, width, height, dstWidth, dstHeight) != TCL_OK) {
+                printf("setup failed\n");
+                return 1;
+            }
+            printf("%-10s tables  %8.3f ms\n", "", (Seconds() - t) * 1000.0);
+            VideoScaleImage(scalerPtr, src, width * 4, dst, dstWidth * 4);
+            for (n = 0; n < (size_t)dstWidth * dstHeight * 4; ++n) {
+                int d = abs(dst[n] - ref[n]);
+                if (d > maxDiff) maxDiff = d;
+            }
+            t = Seconds();
+            for (i = 0; i < iterations; ++i) {
+                VideoScaleImage(scalerPtr, src, width * 4, dst, dstWidth * 4);
+            }
+            t = (Seconds() - t) * 1000.0 / iterations;
+            printf("%-10s %-7s %8.3f ms  %5.1fx  max diff %d\n", "",
+                   kernels[k].name, t, naive / t, maxDiff);
+            VideoScalerInvalidate(scalerPtr);
+        }
+    }
+
+    VideoScalerDestroy(scalerPtr);
+    free(src);
+    free(dst);
+    free(ref);
+    return 0;
+}
@@ -0,0 +1,56 @@
+# bench.tcl - measure tkvideo frame throughput using a synthetic source.
+#
+# Usage: wish bench.tcl ?source? ?seconds?
+#   eg:  xvfb-run wish demos/bench.tcl synthetic:1920x1080@60 10
+#
+# --------------------------------------------------------------------------
+# See the file "license.terms" for information on usage and redistribution
+# of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+# --------------------------------------------------------------------------
+# $Id$
+
+package require Tk 8.5
+package require tkvideo
+
+proc Main {source seconds} {
+    set v [tkvideo .v -source $source]
+    pack $v -fill both -expand 1
+    update
+    $v start
+
+    # Let the capture thread deliver its first frame.
+    after 200 [list set ::ready 1]
+    vwait ::ready
+
+    puts [format "source:   %s" $source]
+    Measure $v "picture" $seconds {image delete [$v picture]}
+    set img [image create photo]
+    Measure $v "-into" $seconds {$v picture -into $img}
+    image delete $img
+    $v stop
+}
+
+proc Measure {v label seconds script} {
+    set count 0
+    set t0 [lindex [$v tell] 0]
+    set end [expr {[clock milliseconds] + $seconds * 1000}]
+    set elapsed [time {
+        while {[clock milliseconds] < $end} {
+            uplevel 1 $script
+            incr count
+            update
+        }
+    }]
+    set t1 [lindex [$v tell] 0]
+
+    set us [lindex $elapsed 0]
+    puts [format "%-9s %d calls, %.1f per second, %.0f us per call" \
+              $label: $count [expr {$count * 1e6 / $us}] [expr {double($us) / $count}]]
+    puts [format "stream:   %.3f s of video in %.3f s" \
+              [expr {($t1 - $t0) / 1000.0}] [expr {$us / 1e6}]]
+}
+
+set source [expr {[llength $argv] > 0 ? [lindex $argv 0] : "synthetic:1920x1080@60"}]
+set seconds [expr {[llength $argv] > 1 ? [lindex $argv 1] : 5}]
+Main $source $seconds
+exit
@@ -106,21 +106,27 @@ proc every {ms body} {uplevel #0 $body; after $ms [info level 0]}
 
 proc RepeatSnap {Application} {
     upvar #0 $Application app
-    if {[package provide Img] eq {}} {
-        tk_messageBox -message "Feature disabled: Img package not available."
-    } else {
-        set file [tk_getSaveFile -title "Snapshot image location"]
-        if {$file != {}} {
-            every 15000 [list RepeatSnapJob $Application $file]
-        }
+    set file [tk_getSaveFile -title "Snapshot image location" \
+                  -defaultextension .jpg -filetypes {
+                      {"JPEG files"   .jpg {}}
+                      {"PNG files"    .png {}}
+                      {"Bitmap files" .bmp {}}
+                      {"PPM files"    .ppm {}}}]
+    if {$file != {}} {
+        every 15000 [list RepeatSnapJob $Application $file]
     }
 }
 
+# The picture is written to the file in the background.
 proc RepeatSnapJob {Application filename} {
     upvar #0 $Application app
-    set img [$app(video) snapshot]
-    $img write $filename -format JPEG
-    image delete $img
+    $app(video) picture -file $filename -command RepeatSnapDone
+}
+
+proc RepeatSnapDone {filename result} {
+    if {[dict get $result status] ne "ok"} {
+        puts stderr "snapshot $filename: [dict get $result message]"
+    }
 }
 
 proc UpdatePosition {Application} {
@@ -330,119 +336,10 @@ proc SnapSaveAs {img} {
 
 proc StreamServer {Application {port 8020}} {
     upvar #0 $Application app
-    set app(stream_server) [socket -server [list StreamAccept $Application] $port]
-    set app(stream_timer) [after idle [list StreamSend $Application]]
-    set app(stream_interval) 80
-    set app(stream_clients) {}
-    if {[catch {package require vfs::mk4}]} {
-        set tmpdir $::env(TEMP)
-        set app(stream_tempfile) [file join $tmpdir tmp.jpg]
-    } else {
-        vfs::mk4::Mount {} tmpfs
-        set app(stream_tempfile) tmpfs/tmp.jpg
-    }
-}
-proc StreamAccept {Application chan clientaddr clientport} {
-    upvar #0 $Application app
-    variable suid; if {![info exists suid]} { set suid 0 }
-    set token ::stream[incr suid]
-    upvar #0 $token state
-    set state(mode) connect
-    set state(app) $Application
-    set state(chan) $chan
-    set state(client) [list $clientaddr $clientport]
-    set state(request) {}
-    binary scan [binary format f [expr {rand()}]] H* r
-    set state(boundary) "--boundary$r"
-    lappend app(stream_clients) $token
-    fconfigure $chan -encoding utf-8 -translation crlf -buffering line
-    puts stderr "$chan: accepted connection with token $token"
-    fileevent $chan readable [list StreamRead $token]
-}
-proc StreamClose {token} {
-    upvar #0 $token state
-    upvar #0 $state(app) app
-    puts stderr "$state(chan): $state(client) has disconnected"
-    catch {after cancel $state(timer)}
-    catch {close $state(chan)}
-    set ndx [lsearch -exact $app(stream_clients) $token]
-    if {$ndx != -1} {
-        set app(stream_clients) [lreplace $app(stream_clients) $ndx $ndx]
-    }
-    unset $token
-}
-proc StreamRead {token} {
-    upvar #0 $token state
-    switch -exact -- $state(mode) {
-        connect {
-            set count [gets $state(chan) line]
-            puts stderr "$state(chan): connect: read \[$count\] '$line'"
-            if {$count == -1} {
-                StreamClose $token
-            } elseif {$count == 0} {
-                set state(mode) init
-                fileevent $state(chan) writable [list StreamWrite $token]
-            } else {
-                lappend state(request) $line
-            }
-        }
-        default {
-            set data [read $state(chan)]
-            puts stderr "$state(chan): recieved [string length $data] bytes"
-        }
-    }
-    if {[eof $state(chan)]} {
-        puts stderr "$state(chan): eof for token $token"
-        fileevent $state(chan) readable {}
-        StreamClose $token
-        return
-    }
-}
-proc StreamWrite {token} {
-    upvar #0 $token state
-    fileevent $state(chan) writable {}
-    puts $state(chan) "HTTP/1.1 200 OK"
-    puts $state(chan) [clock format [clock seconds] -gmt 1 \
-                           -format "date: %a, %d %b  %Y %H:%M:%S GMT"]
-    puts $state(chan) "server: Tkvideo/1.0"
-    puts $state(chan) "connection: close"
-    puts $state(chan) "content-type: multipart/x-mixed-replace;boundary=$state(boundary)"
-    puts $state(chan) ""
-    set state(mode) transmit
-    puts stderr "$state(chan): ready to transmit"
-}
-proc StreamSend {Application} {
-    upvar #0 $Application app
-    if {[llength $app(stream_clients)] > 0} {
-        if {[catch {
-            set img [$app(video) picture]
-            $img write $app(stream_tempfile) -format jpeg
-            image delete $img
-            set f [open $app(stream_tempfile) r]
-            fconfigure $f -encoding binary -translation binary -eofchar {}
-            set data [read $f]
-            close $f
-            puts stderr "prepared [string length $data] bytes for $app(stream_clients)"
-
-            foreach client $app(stream_clients) {
-                upvar #0 $client state
-                puts stderr [array get state]
-                if {$state(mode) ne "transmit"} continue
-                puts stderr "$client: sending [string length $data]"
-                fconfigure $state(chan) -encoding utf-8 -translation crlf -buffering line
-                puts $state(chan) "$state(boundary)"
-                puts $state(chan) "Content-Type: image/jpeg"
-                puts $state(chan) "Content-Length: [string length $data]"
-                puts $state(chan) ""
-                fconfigure $state(chan) -encoding binary -translation binary -buffering full
-                puts -nonewline $state(chan) $data\r\n
-                flush $state(chan)
-            }
-        } err]} {
-            puts stderr "error: $err"
-        }
+    # The widget encodes and serves the frames itself as MJPEG over HTTP.
+    if {[catch {$app(video) stream listen $port} err]} {
+        puts stderr "stream: $err"
     }
-    set app(stream_timer) [after $app(stream_interval) [list StreamSend $Application]]
 }
 
 # -------------------------------------------------------------------------
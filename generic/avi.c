@@ -0,0 +1,1208 @@
+/* avi.c - Motion JPEG AVI files with OpenDML indexes
+ *
+ * The recorder (see record.c) writes compressed frames here as one
+ * video stream of 'MJPG' chunks. A plain AVI file is a single RIFF of
+ * at most 1 GB, indexed by an idx1 chunk written at the end, so long
+ * recordings use the OpenDML (AVI 2.0) extensions instead: when a RIFF
+ * approaches the limit it is closed with a standard index ('ix00') of
+ * its own frames and a new 'AVIX' RIFF is begun. The stream header
+ * holds a super index ('indx') listing every standard index, with room
+ * reserved for well over a day of checkpoints (see below). The first
+ * RIFF also gets an idx1 so that players without OpenDML support can
+ * still play the first part of the file.
+ *
+ * Data is gathered into a large block and written a whole block at a
+ * time, at offsets that are multiples of the block size, so the disk
+ * sees few, large, aligned writes however small the frames are. Sizes
+ * and counts in the headers are only known later; they are patched in
+ * place, in the block if it has not yet been written or in the file
+ * otherwise.
+ *
+ * A frame of zero bytes is written as an empty chunk, which players
+ * treat as a repeat of the previous frame. The recorder uses these to
+ * keep the timing of the file when frames were lost.
+ *
+ * So that a recording cut short by a crash or a power failure can still
+ * be played, the recorder asks for a checkpoint every few seconds. The
+ * frames since the last checkpoint are indexed by a standard index
+ * written into the movi list like a frame, and the data is flushed to
+ * the disk. Only then are the headers rewritten to include the new
+ * index and the new sizes, so the headers on the disk only ever refer
+ * to data that is already there: a file cut off at any point plays up
+ * to its last checkpoint. VideoAviRepair recovers the frames after that
+ * by scanning the file's chunks and indexing any frames it finds that
+ * are not covered by a standard index.
+ *
+ * So that checkpoints do not fill the super index in the header, the
+ * last standard index is kept open: the next checkpoint writes one that
+ * covers its frames as well and replaces it in the super index. An index
+ * is closed once it holds AVI_INDEX_FRAMES frames.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#define _FILE_OFFSET_BITS 64
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+#include "tkvideo.h"
+#include <stdio.h>
+#include <errno.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define AVI_BLOCK          (1 << 20)    /* bytes written at once */
+#define AVI_ALIGN          4096         /* alignment of the block in memory */
+#define AVI_RIFF_LIMIT     ((Tcl_WideInt)1 << 30)
+#define AVI_SUPER_ENTRIES  4096         /* standard indexes, for checkpoints and RIFFs */
+#define AVI_SUPER_RESERVE  64           /* entries kept for the ends of RIFFs */
+#define AVI_INDEX_FRAMES   4096         /* frames before an open index is closed */
+
+#define AVIF_HASINDEX      0x10
+#define AVIIF_KEYFRAME     0x10
+#define AVI_INDEX_OF_INDEXES  0x00
+#define AVI_INDEX_OF_CHUNKS   0x01
+
+typedef struct {
+    unsigned int offset;        /* of the chunk data from the RIFF start */
+    unsigned int size;
+} AviEntry;
+
+typedef struct {
+    Tcl_WideInt offset;         /* of the ix00 chunk */
+    unsigned int size;          /* including its chunk header */
+    unsigned int duration;      /* frames it indexes */
+} AviSuperEntry;
+
+struct VideoAvi {
+#if defined(_WIN32)
+    HANDLE handle;
+#else
+    int fd;
+#endif
+    int width;
+    int height;
+    int rateNum;                /* frames per second as rateNum/rateDen */
+    int rateDen;
+
+    unsigned char *blockMem;    /* allocation holding the aligned block */
+    unsigned char *block;       /* data not yet written */
+    Tcl_WideInt blockStart;     /* file offset of block[0] */
+    size_t blockUsed;
+
+    size_t headerSize;          /* through the first 'movi' fourcc */
+    Tcl_WideInt riffStart;      /* offset of the current RIFF */
+    Tcl_WideInt moviStart;      /* offset of its LIST movi */
+    AviEntry *entries;          /* frames in the current RIFF */
+    int entryCount;
+    int entrySpace;
+    int indexStart;             /* first entry not yet in a standard index */
+    AviSuperEntry super[AVI_SUPER_ENTRIES];
+    int superCount;
+    int superOpen;              /* the last super entry may be rewritten */
+    int openStart;              /* first entry of that open index */
+
+    Tcl_WideInt frames;         /* in the whole file */
+    Tcl_WideInt firstFrames;    /* in the first RIFF */
+    int indexed;                /* the first RIFF has its idx1 */
+    unsigned int maxChunk;      /* largest frame */
+    int failed;
+    char message[256];
+};
+
+/* ---------------------------------------------------------------------- */
+
+static unsigned char *
+Put16(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    return p + 2;
+}
+
+static unsigned char *
+Put32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+    return p + 4;
+}
+
+static unsigned char *
+Put64(unsigned char *p, Tcl_WideInt v)
+{
+    p = Put32(p, (unsigned int)v);
+    return Put32(p, (unsigned int)((Tcl_WideUInt)v >> 32));
+}
+
+static unsigned char *
+PutTag(unsigned char *p, const char *tag)
+{
+    memcpy(p, tag, 4);
+    return p + 4;
+}
+
+/*
+ * Write to the file at an offset, recording any error.
+ */
+
+static int
+FileWrite(VideoAvi *aviPtr, Tcl_WideInt offset, const unsigned char *data, size_t size)
+{
+#if defined(_WIN32)
+    while (size > 0) {
+        OVERLAPPED ov;
+        DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size, written = 0;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)((Tcl_WideUInt)offset >> 32);
+        if (!WriteFile(aviPtr->handle, data, chunk, &written, &ov)) {
+            sprintf(aviPtr->message, "error writing file: error %lu", GetLastError());
+            aviPtr->failed = 1;
+            return TCL_ERROR;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+#else
+    while (size > 0) {
+        ssize_t n = pwrite(aviPtr->fd, data, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            sprintf(aviPtr->message, "error writing file: %.200s",
+                    n < 0 ? Tcl_ErrnoMsg(errno) : "no space left on device");
+            aviPtr->failed = 1;
+            return TCL_ERROR;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+#endif
+    return TCL_OK;
+}
+
+/*
+ * Read from the file at an offset. Returns the number of bytes read,
+ * which is less than size only at the end of the file, or -1.
+ */
+
+static Tcl_WideInt
+FileRead(VideoAvi *aviPtr, Tcl_WideInt offset, unsigned char *data, size_t size)
+{
+    Tcl_WideInt total = 0;
+#if defined(_WIN32)
+    while (size > 0) {
+        OVERLAPPED ov;
+        DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size, got = 0;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)((Tcl_WideUInt)offset >> 32);
+        if (!ReadFile(aviPtr->handle, data, chunk, &got, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            sprintf(aviPtr->message, "error reading file: error %lu", GetLastError());
+            return -1;
+        }
+        if (got == 0)
+            break;
+        data += got;
+        size -= got;
+        offset += got;
+        total += got;
+    }
+#else
+    while (size > 0) {
+        ssize_t n = pread(aviPtr->fd, data, size, (off_t)offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            sprintf(aviPtr->message, "error reading file: %.200s", Tcl_ErrnoMsg(errno));
+            return -1;
+        }
+        if (n == 0)
+            break;
+        data += n;
+        size -= n;
+        offset += n;
+        total += n;
+    }
+#endif
+    return total;
+}
+
+/*
+ * Wait until everything written has reached the disk.
+ */
+
+static int
+FileSync(VideoAvi *aviPtr)
+{
+#if defined(_WIN32)
+    if (!FlushFileBuffers(aviPtr->handle)) {
+        sprintf(aviPtr->message, "error writing file: error %lu", GetLastError());
+        aviPtr->failed = 1;
+        return TCL_ERROR;
+    }
+#else
+    if (fsync(aviPtr->fd) != 0) {
+        sprintf(aviPtr->message, "error writing file: %.200s", Tcl_ErrnoMsg(errno));
+        aviPtr->failed = 1;
+        return TCL_ERROR;
+    }
+#endif
+    return TCL_OK;
+}
+
+/*
+ * Append data to the block, writing it out each time it fills.
+ */
+
+static int
+Append(VideoAvi *aviPtr, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (size > 0) {
+        size_t n = AVI_BLOCK - aviPtr->blockUsed;
+        if (n > size)
+            n = size;
+        if (p != NULL) {
+            memcpy(aviPtr->block + aviPtr->blockUsed, p, n);
+            p += n;
+        } else {
+            memset(aviPtr->block + aviPtr->blockUsed, 0, n);
+        }
+        aviPtr->blockUsed += n;
+        size -= n;
+        if (aviPtr->blockUsed == AVI_BLOCK) {
+            if (FileWrite(aviPtr, aviPtr->blockStart, aviPtr->block, AVI_BLOCK) != TCL_OK)
+                return TCL_ERROR;
+            aviPtr->blockStart += AVI_BLOCK;
+            aviPtr->blockUsed = 0;
+        }
+    }
+    return TCL_OK;
+}
+
+static Tcl_WideInt
+Position(const VideoAvi *aviPtr)
+{
+    return aviPtr->blockStart + (Tcl_WideInt)aviPtr->blockUsed;
+}
+
+/*
+ * Overwrite data already appended, in the block or in the file.
+ */
+
+static int
+Patch(VideoAvi *aviPtr, Tcl_WideInt offset, const unsigned char *data, size_t size)
+{
+    if (offset < aviPtr->blockStart) {
+        size_t n = (size_t)(aviPtr->blockStart - offset);
+        if (n > size)
+            n = size;
+        if (FileWrite(aviPtr, offset, data, n) != TCL_OK)
+            return TCL_ERROR;
+        offset += n;
+        data += n;
+        size -= n;
+    }
+    if (size > 0) {
+        memcpy(aviPtr->block + (size_t)(offset - aviPtr->blockStart), data, size);
+    }
+    return TCL_OK;
+}
+
+static int
+Patch32(VideoAvi *aviPtr, Tcl_WideInt offset, unsigned int value)
+{
+    unsigned char buf[4];
+    Put32(buf, value);
+    return Patch(aviPtr, offset, buf, 4);
+}
+
+/*
+ * Overwrite data already appended and write it to the file at once,
+ * even the part still held in the block.
+ */
+
+static int
+Commit(VideoAvi *aviPtr, Tcl_WideInt offset, const unsigned char *data, size_t size)
+{
+    size_t skip = 0;
+
+    if (Patch(aviPtr, offset, data, size) != TCL_OK)
+        return TCL_ERROR;
+    if (offset + (Tcl_WideInt)size <= aviPtr->blockStart)
+        return TCL_OK;
+    if (offset < aviPtr->blockStart)
+        skip = (size_t)(aviPtr->blockStart - offset);
+    return FileWrite(aviPtr, offset + skip, data + skip, size - skip);
+}
+
+static int
+Commit32(VideoAvi *aviPtr, Tcl_WideInt offset, unsigned int value)
+{
+    unsigned char buf[4];
+    Put32(buf, value);
+    return Commit(aviPtr, offset, buf, 4);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Build the header from the current state: the hdrl list, padding and
+ * the first LIST movi header. Sizes not yet known are left as zero.
+ */
+
+static void
+BuildHeader(VideoAvi *aviPtr, unsigned char *hdr)
+{
+    unsigned int usec = (unsigned int)((1000000.0 * aviPtr->rateDen) / aviPtr->rateNum + 0.5);
+    unsigned int strlSize = 4 + (8 + 56) + (8 + 40) + (8 + 24 + 16 * AVI_SUPER_ENTRIES);
+    unsigned int hdrlSize = 4 + (8 + 56) + (8 + strlSize) + (12 + 8 + 248);
+    unsigned int buffer = aviPtr->maxChunk + 8;
+    unsigned char *p = hdr, *junk;
+    int n;
+
+    memset(hdr, 0, aviPtr->headerSize);
+    p = PutTag(p, "RIFF");
+    p = Put32(p, 0);                            /* patched when the RIFF ends */
+    p = PutTag(p, "AVI ");
+    p = PutTag(p, "LIST");
+    p = Put32(p, hdrlSize);
+    p = PutTag(p, "hdrl");
+
+    p = PutTag(p, "avih");
+    p = Put32(p, 56);
+    p = Put32(p, usec);
+    p = Put32(p, (unsigned int)(((Tcl_WideInt)buffer * aviPtr->rateNum) / aviPtr->rateDen));
+    p = Put32(p, 0);                            /* padding granularity */
+    p = Put32(p, aviPtr->indexed ? AVIF_HASINDEX : 0);
+    p = Put32(p, (unsigned int)aviPtr->firstFrames);
+    p = Put32(p, 0);                            /* initial frames */
+    p = Put32(p, 1);                            /* streams */
+    p = Put32(p, buffer);
+    p = Put32(p, (unsigned int)aviPtr->width);
+    p = Put32(p, (unsigned int)aviPtr->height);
+    p += 16;
+
+    p = PutTag(p, "LIST");
+    p = Put32(p, strlSize);
+    p = PutTag(p, "strl");
+    p = PutTag(p, "strh");
+    p = Put32(p, 56);
+    p = PutTag(p, "vids");
+    p = PutTag(p, "MJPG");
+    p = Put32(p, 0);                            /* flags */
+    p = Put32(p, 0);                            /* priority, language */
+    p = Put32(p, 0);                            /* initial frames */
+    p = Put32(p, (unsigned int)aviPtr->rateDen);
+    p = Put32(p, (unsigned int)aviPtr->rateNum);
+    p = Put32(p, 0);                            /* start */
+    p = Put32(p, (unsigned int)aviPtr->frames);
+    p = Put32(p, buffer);
+    p = Put32(p, 0xFFFFFFFFu);                  /* quality */
+    p = Put32(p, 0);                            /* sample size */
+    p = Put16(p, 0);
+    p = Put16(p, 0);
+    p = Put16(p, (unsigned int)aviPtr->width);
+    p = Put16(p, (unsigned int)aviPtr->height);
+
+    p = PutTag(p, "strf");
+    p = Put32(p, 40);
+    p = Put32(p, 40);
+    p = Put32(p, (unsigned int)aviPtr->width);
+    p = Put32(p, (unsigned int)aviPtr->height);
+    p = Put16(p, 1);                            /* planes */
+    p = Put16(p, 24);                           /* bit count */
+    p = PutTag(p, "MJPG");
+    p = Put32(p, (unsigned int)aviPtr->width * aviPtr->height * 3);
+    p += 16;
+
+    p = PutTag(p, "indx");
+    p = Put32(p, 24 + 16 * AVI_SUPER_ENTRIES);
+    p = Put16(p, 4);                            /* longs per entry */
+    *p++ = 0;                                   /* sub type */
+    *p++ = AVI_INDEX_OF_INDEXES;
+    p = Put32(p, (unsigned int)aviPtr->superCount);
+    p = PutTag(p, "00dc");
+    p += 12;
+    for (n = 0; n < aviPtr->superCount; ++n) {
+        p = Put64(p, aviPtr->super[n].offset);
+        p = Put32(p, aviPtr->super[n].size);
+        p = Put32(p, aviPtr->super[n].duration);
+    }
+    p += 16 * (AVI_SUPER_ENTRIES - aviPtr->superCount);
+
+    p = PutTag(p, "LIST");
+    p = Put32(p, 4 + 8 + 248);
+    p = PutTag(p, "odml");
+    p = PutTag(p, "dmlh");
+    p = Put32(p, 248);
+    p = Put32(p, (unsigned int)aviPtr->frames);
+    p += 244;
+
+    /* pad so that the frames start on an aligned offset */
+    junk = p;
+    p = PutTag(p, "JUNK");
+    p = Put32(p, (unsigned int)(aviPtr->headerSize - (junk - hdr) - 8 - 12));
+    p = hdr + aviPtr->headerSize - 12;
+    p = PutTag(p, "LIST");
+    p = Put32(p, 0);                            /* patched when the RIFF ends */
+    PutTag(p, "movi");
+}
+
+static size_t
+HeaderSize(void)
+{
+    size_t size = 12 + 12 + (8 + 56) + 12 + (8 + 56) + (8 + 40)
+        + (8 + 24 + 16 * AVI_SUPER_ENTRIES) + 12 + (8 + 248) + 8 + 12;
+    return (size + AVI_ALIGN - 1) & ~(size_t)(AVI_ALIGN - 1);
+}
+
+/*
+ * Append a standard index of frames from the RIFF at base and list it in
+ * the super index at position at.
+ */
+
+static int
+WriteIndex(VideoAvi *aviPtr, Tcl_WideInt base, const AviEntry *entries, int count, int at)
+{
+    Tcl_WideInt ixStart = Position(aviPtr);
+    unsigned char buf[32];
+    unsigned char *p;
+    int n;
+
+    if (aviPtr->superCount == AVI_SUPER_ENTRIES) {
+        strcpy(aviPtr->message, "the recording is too long for the file index");
+        aviPtr->failed = 1;
+        return TCL_ERROR;
+    }
+    p = PutTag(buf, "ix00");
+    p = Put32(p, 24 + 8 * count);
+    p = Put16(p, 2);                            /* longs per entry */
+    *p++ = 0;
+    *p++ = AVI_INDEX_OF_CHUNKS;
+    p = Put32(p, (unsigned int)count);
+    p = PutTag(p, "00dc");
+    p = Put64(p, base);
+    Put32(p, 0);
+    if (Append(aviPtr, buf, 32) != TCL_OK)
+        return TCL_ERROR;
+    for (n = 0; n < count; ++n) {
+        p = Put32(buf, entries[n].offset);
+        Put32(p, entries[n].size);
+        if (Append(aviPtr, buf, 8) != TCL_OK)
+            return TCL_ERROR;
+    }
+    memmove(&aviPtr->super[at + 1], &aviPtr->super[at],
+            (aviPtr->superCount - at) * sizeof(AviSuperEntry));
+    aviPtr->super[at].offset = ixStart;
+    aviPtr->super[at].size = 32 + 8 * count;
+    aviPtr->super[at].duration = count;
+    ++aviPtr->superCount;
+    return TCL_OK;
+}
+
+/*
+ * Index the frames of the current RIFF not yet in a standard index. If
+ * the last index written is still open, a new one replaces it covering
+ * its frames as well, so that checkpoints do not use up the super index.
+ * The index is left open until it holds AVI_INDEX_FRAMES frames.
+ */
+
+static int
+IndexPending(VideoAvi *aviPtr)
+{
+    int first = aviPtr->superOpen ? aviPtr->openStart : aviPtr->indexStart;
+
+    if (aviPtr->superOpen)
+        --aviPtr->superCount;
+    if (WriteIndex(aviPtr, aviPtr->riffStart, aviPtr->entries + first,
+                   aviPtr->entryCount - first, aviPtr->superCount) != TCL_OK)
+        return TCL_ERROR;
+    aviPtr->openStart = first;
+    aviPtr->indexStart = aviPtr->entryCount;
+    aviPtr->superOpen = (aviPtr->entryCount - first < AVI_INDEX_FRAMES);
+    return TCL_OK;
+}
+
+/*
+ * Close the current RIFF: write the standard index of its frames not
+ * yet indexed at the end of its movi list, then for the first RIFF the
+ * idx1, and patch the list and RIFF sizes.
+ */
+
+static int
+EndRiff(VideoAvi *aviPtr)
+{
+    unsigned char buf[16];
+    unsigned char *p;
+    int n;
+
+    if (aviPtr->entryCount > aviPtr->indexStart && IndexPending(aviPtr) != TCL_OK)
+        return TCL_ERROR;
+
+    if (Patch32(aviPtr, aviPtr->moviStart + 4,
+                (unsigned int)(Position(aviPtr) - aviPtr->moviStart - 8)) != TCL_OK)
+        return TCL_ERROR;
+
+    if (aviPtr->riffStart == 0) {
+        /* idx1 offsets are from the 'movi' fourcc to each chunk header */
+        Tcl_WideInt movi = aviPtr->moviStart + 8;
+        p = PutTag(buf, "idx1");
+        Put32(p, 16 * aviPtr->entryCount);
+        if (Append(aviPtr, buf, 8) != TCL_OK)
+            return TCL_ERROR;
+        for (n = 0; n < aviPtr->entryCount; ++n) {
+            p = PutTag(buf, "00dc");
+            p = Put32(p, aviPtr->entries[n].size ? AVIIF_KEYFRAME : 0);
+            p = Put32(p, (unsigned int)(aviPtr->entries[n].offset - 8 - movi));
+            Put32(p, aviPtr->entries[n].size);
+            if (Append(aviPtr, buf, 16) != TCL_OK)
+                return TCL_ERROR;
+        }
+        aviPtr->firstFrames = aviPtr->entryCount;
+        aviPtr->indexed = 1;
+    }
+
+    aviPtr->entryCount = 0;
+    aviPtr->indexStart = 0;
+    aviPtr->superOpen = 0;
+    return Patch32(aviPtr, aviPtr->riffStart + 4,
+                   (unsigned int)(Position(aviPtr) - aviPtr->riffStart - 8));
+}
+
+static int
+BeginRiff(VideoAvi *aviPtr)
+{
+    unsigned char buf[24], *p;
+
+    aviPtr->riffStart = Position(aviPtr);
+    aviPtr->moviStart = aviPtr->riffStart + 12;
+    p = PutTag(buf, "RIFF");
+    p = Put32(p, 0);
+    p = PutTag(p, "AVIX");
+    p = PutTag(p, "LIST");
+    p = Put32(p, 0);
+    PutTag(p, "movi");
+    return Append(aviPtr, buf, 24);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * Create an AVI file for frames of the given size and rate. The name is
+ * a native file name, as returned by Tcl_FSGetNativePath. The file
+ * may be used on any one thread at a time.
+ *
+ * @param message [out] set to a description of any error, at least 256
+ *  bytes.
+ *
+ * @return the new file, or NULL on error.
+ */
+
+VideoAvi *
+VideoAviCreate(const void *native, int width, int height, int rateNum, int rateDen,
+               char *message)
+{
+    VideoAvi *aviPtr;
+    size_t headerSize = HeaderSize();
+
+    aviPtr = (VideoAvi *)attemptckalloc(sizeof(VideoAvi));
+    if (aviPtr != NULL) {
+        memset(aviPtr, 0, sizeof(VideoAvi));
+        aviPtr->blockMem = (unsigned char *)attemptckalloc(AVI_BLOCK + AVI_ALIGN);
+    }
+    if (aviPtr == NULL || aviPtr->blockMem == NULL) {
+        if (aviPtr != NULL)
+            ckfree((char *)aviPtr);
+        strcpy(message, "out of memory");
+        return NULL;
+    }
+    aviPtr->block = (unsigned char *)
+        (((size_t)aviPtr->blockMem + AVI_ALIGN - 1) & ~(size_t)(AVI_ALIGN - 1));
+
+#if defined(_WIN32)
+    aviPtr->handle = CreateFileW((const WCHAR *)native, GENERIC_WRITE, FILE_SHARE_READ,
+                                 NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (aviPtr->handle == INVALID_HANDLE_VALUE) {
+        sprintf(message, "couldn't open file: error %lu", GetLastError());
+#else
+    aviPtr->fd = open((const char *)native, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (aviPtr->fd < 0) {
+        sprintf(message, "couldn't open file: %.200s", Tcl_ErrnoMsg(errno));
+#endif
+        ckfree((char *)aviPtr->blockMem);
+        ckfree((char *)aviPtr);
+        return NULL;
+    }
+
+    aviPtr->width = width;
+    aviPtr->height = height;
+    aviPtr->rateNum = rateNum;
+    aviPtr->rateDen = rateDen;
+    aviPtr->headerSize = headerSize;
+    aviPtr->riffStart = 0;
+    aviPtr->moviStart = headerSize - 12;
+    BuildHeader(aviPtr, aviPtr->block);
+    aviPtr->blockUsed = headerSize;
+    return aviPtr;
+}
+
+/**
+ * Add a frame of JPEG data. An empty frame repeats the previous one.
+ *
+ * @return TCL_OK, or TCL_ERROR if the file could not be written, in
+ *  which case the file should be closed and VideoAviClose describes
+ *  the problem.
+ */
+
+int
+VideoAviWrite(VideoAvi *aviPtr, const unsigned char *data, size_t size)
+{
+    unsigned char header[8];
+    Tcl_WideInt used, reserve;
+
+    if (aviPtr->failed)
+        return TCL_ERROR;
+
+    /* start a new RIFF if this frame and the indexes would not fit */
+    used = Position(aviPtr) - aviPtr->riffStart;
+    reserve = 32 + 8 * (Tcl_WideInt)(aviPtr->entryCount + 1);
+    if (aviPtr->riffStart == 0)
+        reserve += 8 + 16 * (Tcl_WideInt)(aviPtr->entryCount + 1);
+    if (aviPtr->entryCount > 0 && used + 8 + (Tcl_WideInt)size + 1 + reserve > AVI_RIFF_LIMIT) {
+        if (EndRiff(aviPtr) != TCL_OK || BeginRiff(aviPtr) != TCL_OK)
+            return TCL_ERROR;
+    }
+
+    if (aviPtr->entryCount == aviPtr->entrySpace) {
+        int space = aviPtr->entrySpace ? aviPtr->entrySpace * 2 : 4096;
+        AviEntry *newPtr = (AviEntry *)attemptckrealloc((char *)aviPtr->entries,
+                                                        space * sizeof(AviEntry));
+        if (newPtr == NULL) {
+            strcpy(aviPtr->message, "out of memory");
+            aviPtr->failed = 1;
+            return TCL_ERROR;
+        }
+        aviPtr->entries = newPtr;
+        aviPtr->entrySpace = space;
+    }
+    aviPtr->entries[aviPtr->entryCount].offset =
+        (unsigned int)(Position(aviPtr) + 8 - aviPtr->riffStart);
+    aviPtr->entries[aviPtr->entryCount].size = (unsigned int)size;
+    ++aviPtr->entryCount;
+
+    Put32(PutTag(header, "00dc"), (unsigned int)size);
+    if (Append(aviPtr, header, 8) != TCL_OK
+        || Append(aviPtr, data, size) != TCL_OK
+        || ((size & 1) && Append(aviPtr, NULL, 1) != TCL_OK))
+        return TCL_ERROR;
+    if (size > aviPtr->maxChunk)
+        aviPtr->maxChunk = (unsigned int)size;
+    ++aviPtr->frames;
+    return TCL_OK;
+}
+
+/**
+ * Make the file playable as it stands, should it never be closed: index
+ * the frames added since the last checkpoint, flush everything to the
+ * disk and then update the headers to match.
+ *
+ * @return TCL_OK, or TCL_ERROR if the file could not be written, as for
+ *  VideoAviWrite.
+ */
+
+int
+VideoAviCheckpoint(VideoAvi *aviPtr)
+{
+    unsigned char *hdr;
+    int r;
+
+    if (aviPtr->failed)
+        return TCL_ERROR;
+
+    /* once the super index is nearly full, keep its last entries for RIFFs */
+    if (aviPtr->entryCount > aviPtr->indexStart
+        && (aviPtr->superOpen || aviPtr->superCount < AVI_SUPER_ENTRIES - AVI_SUPER_RESERVE)
+        && IndexPending(aviPtr) != TCL_OK)
+        return TCL_ERROR;
+    if (FileWrite(aviPtr, aviPtr->blockStart, aviPtr->block, aviPtr->blockUsed) != TCL_OK
+        || FileSync(aviPtr) != TCL_OK)
+        return TCL_ERROR;
+
+    hdr = (unsigned char *)attemptckalloc(aviPtr->headerSize);
+    if (hdr == NULL) {
+        strcpy(aviPtr->message, "out of memory");
+        aviPtr->failed = 1;
+        return TCL_ERROR;
+    }
+    if (aviPtr->riffStart == 0)
+        aviPtr->firstFrames = aviPtr->indexStart;
+    BuildHeader(aviPtr, hdr);
+    r = Commit(aviPtr, 8, hdr + 8, aviPtr->headerSize - 16);
+    ckfree((char *)hdr);
+    if (r == TCL_OK)
+        r = Commit32(aviPtr, aviPtr->moviStart + 4,
+                     (unsigned int)(Position(aviPtr) - aviPtr->moviStart - 8));
+    if (r == TCL_OK)
+        r = Commit32(aviPtr, aviPtr->riffStart + 4,
+                     (unsigned int)(Position(aviPtr) - aviPtr->riffStart - 8));
+    return r;
+}
+
+/**
+ * Complete the indexes and headers, flush the file to the disk and
+ * close it.
+ *
+ * @return TCL_OK, or TCL_ERROR with the message set to describe the
+ *  first error met while recording or closing.
+ */
+
+int
+VideoAviClose(VideoAvi *aviPtr, char *message)
+{
+    int r = aviPtr->failed ? TCL_ERROR : TCL_OK;
+
+    if (r == TCL_OK)
+        r = EndRiff(aviPtr);
+    if (r == TCL_OK) {
+        unsigned char *hdr = (unsigned char *)attemptckalloc(aviPtr->headerSize);
+        if (hdr == NULL) {
+            strcpy(aviPtr->message, "out of memory");
+            r = TCL_ERROR;
+        } else {
+            /* all but the first RIFF and movi sizes, patched already */
+            BuildHeader(aviPtr, hdr);
+            r = Patch(aviPtr, 8, hdr + 8, aviPtr->headerSize - 16);
+            ckfree((char *)hdr);
+        }
+    }
+    if (r == TCL_OK)
+        r = FileWrite(aviPtr, aviPtr->blockStart, aviPtr->block, aviPtr->blockUsed);
+    if (r == TCL_OK)
+        r = FileSync(aviPtr);
+#if defined(_WIN32)
+    CloseHandle(aviPtr->handle);
+#else
+    close(aviPtr->fd);
+#endif
+    if (r != TCL_OK)
+        strcpy(message, aviPtr->message);
+    if (aviPtr->entries != NULL)
+        ckfree((char *)aviPtr->entries);
+    ckfree((char *)aviPtr->blockMem);
+    ckfree((char *)aviPtr);
+    return r;
+}
+
+/**
+ * @return the number of frames and bytes written so far.
+ */
+
+void
+VideoAviCounts(const VideoAvi *aviPtr, Tcl_WideInt *framesPtr, Tcl_WideInt *bytesPtr)
+{
+    *framesPtr = aviPtr->frames;
+    *bytesPtr = Position(aviPtr);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Reading the file back for VideoAviRepair. The reader holds a block of
+ * the file, read a block at a time, so scanning makes large sequential
+ * reads however small the chunks.
+ */
+
+typedef struct {
+    VideoAvi *aviPtr;
+    Tcl_WideInt fileSize;
+    Tcl_WideInt start;          /* file offset of buffer[0] */
+    size_t length;              /* bytes held */
+    unsigned char *buffer;
+    int failed;                 /* the file could not be read */
+} AviReader;
+
+/*
+ * frames of a RIFF that no standard index in the file covers
+ */
+
+typedef struct {
+    int at;                     /* position in the super index */
+    Tcl_WideInt base;           /* the RIFF holding the frames */
+    AviEntry *entries;
+    int count;
+} AviGap;
+
+static unsigned int
+Get32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static Tcl_WideInt
+Get64(const unsigned char *p)
+{
+    return (Tcl_WideInt)(Get32(p) | ((Tcl_WideUInt)Get32(p + 4) << 32));
+}
+
+/*
+ * Return size bytes of the file at offset, or NULL if the file ends
+ * first. The result is valid until the next call.
+ */
+
+static const unsigned char *
+ReadAt(AviReader *readerPtr, Tcl_WideInt offset, size_t size)
+{
+    Tcl_WideInt got;
+
+    if (offset < readerPtr->start
+        || offset + (Tcl_WideInt)size > readerPtr->start + (Tcl_WideInt)readerPtr->length) {
+        got = FileRead(readerPtr->aviPtr, offset, readerPtr->buffer, AVI_BLOCK);
+        if (got < 0) {
+            readerPtr->failed = 1;
+            return NULL;
+        }
+        readerPtr->start = offset;
+        readerPtr->length = (size_t)got;
+        if (got < (Tcl_WideInt)size)
+            return NULL;
+    }
+    return readerPtr->buffer + (size_t)(offset - readerPtr->start);
+}
+
+/*
+ * Check that the ix00 chunk at offset indexes exactly the frames from
+ * first to count in the RIFF at base, as found by the scan.
+ */
+
+static int
+IndexMatches(AviReader *readerPtr, Tcl_WideInt offset, unsigned int size, Tcl_WideInt base,
+             const AviEntry *entries, int first, int count)
+{
+    const unsigned char *p = ReadAt(readerPtr, offset, 32);
+    int n;
+
+    if (p == NULL || count <= first || Get32(p + 12) != (unsigned int)(count - first)
+        || size != 24 + 8 * Get32(p + 12) || p[8] != 2 || p[11] != AVI_INDEX_OF_CHUNKS
+        || memcmp(p + 16, "00dc", 4) != 0 || Get64(p + 20) != base)
+        return 0;
+    for (n = first; n < count; ++n) {
+        p = ReadAt(readerPtr, offset + 32 + 8 * (Tcl_WideInt)(n - first), 8);
+        if (p == NULL || Get32(p) != entries[n].offset || Get32(p + 4) != entries[n].size)
+            return 0;
+    }
+    return 1;
+}
+
+static int
+AddEntry(VideoAvi *aviPtr, unsigned int offset, unsigned int size)
+{
+    if (aviPtr->entryCount == aviPtr->entrySpace) {
+        int space = aviPtr->entrySpace ? aviPtr->entrySpace * 2 : 4096;
+        AviEntry *newPtr = (AviEntry *)attemptckrealloc((char *)aviPtr->entries,
+                                                        space * sizeof(AviEntry));
+        if (newPtr == NULL) {
+            strcpy(aviPtr->message, "out of memory");
+            return TCL_ERROR;
+        }
+        aviPtr->entries = newPtr;
+        aviPtr->entrySpace = space;
+    }
+    aviPtr->entries[aviPtr->entryCount].offset = offset;
+    aviPtr->entries[aviPtr->entryCount].size = size;
+    ++aviPtr->entryCount;
+    return TCL_OK;
+}
+
+/*
+ * Read the header of a file written by VideoAviCreate into aviPtr.
+ */
+
+static int
+ReadHeader(VideoAvi *aviPtr, AviReader *readerPtr)
+{
+    const unsigned char *p = ReadAt(readerPtr, 0, aviPtr->headerSize);
+
+    if (p == NULL && readerPtr->failed)
+        return TCL_ERROR;
+    if (p == NULL || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "AVI LIST", 8) != 0
+        || memcmp(p + 20, "hdrlavih", 8) != 0 || memcmp(p + 100, "strh", 4) != 0
+        || memcmp(p + 108, "vidsMJPG", 8) != 0 || memcmp(p + 212, "indx", 4) != 0
+        || Get32(p + 216) != 24 + 16 * AVI_SUPER_ENTRIES
+        || memcmp(p + aviPtr->headerSize - 12, "LIST", 4) != 0
+        || memcmp(p + aviPtr->headerSize - 4, "movi", 4) != 0) {
+        strcpy(aviPtr->message, "not a recording made by tkvideo");
+        return TCL_ERROR;
+    }
+    aviPtr->width = (int)Get32(p + 64);
+    aviPtr->height = (int)Get32(p + 68);
+    aviPtr->rateDen = (int)Get32(p + 128);
+    aviPtr->rateNum = (int)Get32(p + 132);
+    if (aviPtr->rateDen <= 0 || aviPtr->rateNum <= 0) {
+        strcpy(aviPtr->message, "not a recording made by tkvideo");
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Walk the chunks of the file from the first frame, finding the frames
+ * of each RIFF and the standard indexes that cover them, and leave
+ * aviPtr as it would be when writing the last frame found. RIFF and movi
+ * sizes of the RIFFs before the last are corrected as they are passed.
+ * Frames of earlier RIFFs that no index covers are added to the gaps.
+ * Returns the end of the last complete chunk in *endPtr.
+ */
+
+static int
+ScanChunks(VideoAvi *aviPtr, AviReader *readerPtr, AviGap **gapsPtr, int *gapCountPtr,
+           Tcl_WideInt *endPtr)
+{
+    Tcl_WideInt pos = aviPtr->headerSize, end = pos, idx1 = -1;
+    int r = TCL_OK;
+
+    while (r == TCL_OK) {
+        const unsigned char *p = ReadAt(readerPtr, pos, 24);
+        unsigned int size;
+        Tcl_WideInt next;
+
+        if (p == NULL && (p = ReadAt(readerPtr, pos, 8)) == NULL)
+            break;
+        size = Get32(p + 4);
+        if (memcmp(p, "RIFF", 4) == 0) {
+            /* the next RIFF: complete this one */
+            unsigned char sizes[4];
+            if (readerPtr->fileSize - pos < 24 || memcmp(p + 8, "AVIXLIST", 8) != 0
+                || memcmp(p + 20, "movi", 4) != 0)
+                break;
+            if (aviPtr->entryCount > aviPtr->indexStart) {
+                AviGap *gapPtr;
+                size_t bytes = (aviPtr->entryCount - aviPtr->indexStart) * sizeof(AviEntry);
+                AviGap *newPtr = (AviGap *)attemptckrealloc((char *)*gapsPtr,
+                                                            (*gapCountPtr + 1) * sizeof(AviGap));
+                if (newPtr == NULL) {
+                    strcpy(aviPtr->message, "out of memory");
+                    return TCL_ERROR;
+                }
+                *gapsPtr = newPtr;
+                gapPtr = &newPtr[(*gapCountPtr)++];
+                gapPtr->at = aviPtr->superCount;
+                gapPtr->base = aviPtr->riffStart;
+                gapPtr->count = aviPtr->entryCount - aviPtr->indexStart;
+                gapPtr->entries = (AviEntry *)attemptckalloc(bytes);
+                if (gapPtr->entries == NULL) {
+                    --*gapCountPtr;
+                    strcpy(aviPtr->message, "out of memory");
+                    return TCL_ERROR;
+                }
+                memcpy(gapPtr->entries, aviPtr->entries + aviPtr->indexStart, bytes);
+            }
+            Put32(sizes, (unsigned int)((idx1 >= 0 ? idx1 : pos) - aviPtr->moviStart - 8));
+            r = FileWrite(aviPtr, aviPtr->moviStart + 4, sizes, 4);
+            Put32(sizes, (unsigned int)(pos - aviPtr->riffStart - 8));
+            if (r == TCL_OK)
+                r = FileWrite(aviPtr, aviPtr->riffStart + 4, sizes, 4);
+            if (aviPtr->riffStart == 0) {
+                aviPtr->firstFrames = aviPtr->entryCount;
+                aviPtr->indexed = (idx1 >= 0);
+            }
+            aviPtr->riffStart = pos;
+            aviPtr->moviStart = pos + 12;
+            aviPtr->entryCount = aviPtr->indexStart = 0;
+            aviPtr->superOpen = 0;
+            idx1 = -1;
+            pos = end = pos + 24;
+            continue;
+        }
+
+        next = pos + 8 + size + (size & 1);
+        if (next > readerPtr->fileSize)
+            break;
+        if (memcmp(p, "00dc", 4) == 0) {
+            r = AddEntry(aviPtr, (unsigned int)(pos + 8 - aviPtr->riffStart), size);
+            ++aviPtr->frames;
+            if (size > aviPtr->maxChunk)
+                aviPtr->maxChunk = size;
+        } else if (memcmp(p, "ix00", 4) == 0) {
+            /* either a new index or one replacing the open index */
+            int first = -1;
+            if (aviPtr->superOpen
+                && IndexMatches(readerPtr, pos, size, aviPtr->riffStart, aviPtr->entries,
+                                aviPtr->openStart, aviPtr->entryCount)) {
+                first = aviPtr->openStart;
+                --aviPtr->superCount;
+            } else if (aviPtr->superCount < AVI_SUPER_ENTRIES - AVI_SUPER_RESERVE
+                       && IndexMatches(readerPtr, pos, size, aviPtr->riffStart,
+                                       aviPtr->entries, aviPtr->indexStart,
+                                       aviPtr->entryCount)) {
+                first = aviPtr->indexStart;
+            }
+            if (first >= 0) {
+                aviPtr->super[aviPtr->superCount].offset = pos;
+                aviPtr->super[aviPtr->superCount].size = size + 8;
+                aviPtr->super[aviPtr->superCount].duration = aviPtr->entryCount - first;
+                ++aviPtr->superCount;
+                aviPtr->openStart = first;
+                aviPtr->indexStart = aviPtr->entryCount;
+                aviPtr->superOpen = (aviPtr->entryCount - first < AVI_INDEX_FRAMES);
+            }
+        } else if (memcmp(p, "idx1", 4) == 0 && aviPtr->riffStart == 0) {
+            /* rewritten when the RIFF is closed again */
+            idx1 = pos;
+            pos = next;
+            continue;
+        } else if (memcmp(p, "JUNK", 4) != 0) {
+            break;
+        }
+        pos = end = next;
+    }
+    *endPtr = end;
+    return readerPtr->failed ? TCL_ERROR : r;
+}
+
+/**
+ * Repair a recording that was never closed, perhaps because of a crash
+ * or a power failure. The chunks of the file are read in order and any
+ * frames that are not covered by a standard index, usually those after
+ * the last checkpoint, are indexed. Anything after the last complete
+ * chunk is discarded. The file is then closed again as by VideoAviClose,
+ * so repairing a complete file leaves it as it was.
+ *
+ * @param framesPtr [out] set to the number of frames in the file
+ * @param message [out] set to a description of any error, at least 256
+ *  bytes.
+ *
+ * @return TCL_OK, or TCL_ERROR on error.
+ */
+
+int
+VideoAviRepair(const void *native, Tcl_WideInt *framesPtr, char *message)
+{
+    VideoAvi *aviPtr;
+    AviReader reader;
+    AviGap *gaps = NULL;
+    Tcl_WideInt end = 0, frames;
+    int gapCount = 0, n, r = TCL_OK;
+
+    aviPtr = (VideoAvi *)attemptckalloc(sizeof(VideoAvi));
+    if (aviPtr != NULL) {
+        memset(aviPtr, 0, sizeof(VideoAvi));
+        aviPtr->blockMem = (unsigned char *)attemptckalloc(AVI_BLOCK + AVI_ALIGN);
+    }
+    memset(&reader, 0, sizeof(reader));
+    reader.buffer = (unsigned char *)attemptckalloc(AVI_BLOCK);
+    if (aviPtr == NULL || aviPtr->blockMem == NULL || reader.buffer == NULL) {
+        if (aviPtr != NULL && aviPtr->blockMem != NULL)
+            ckfree((char *)aviPtr->blockMem);
+        if (aviPtr != NULL)
+            ckfree((char *)aviPtr);
+        if (reader.buffer != NULL)
+            ckfree((char *)reader.buffer);
+        strcpy(message, "out of memory");
+        return TCL_ERROR;
+    }
+    aviPtr->block = (unsigned char *)
+        (((size_t)aviPtr->blockMem + AVI_ALIGN - 1) & ~(size_t)(AVI_ALIGN - 1));
+    aviPtr->headerSize = HeaderSize();
+    aviPtr->moviStart = aviPtr->headerSize - 12;
+    reader.aviPtr = aviPtr;
+
+#if defined(_WIN32)
+    aviPtr->handle = CreateFileW((const WCHAR *)native, GENERIC_READ | GENERIC_WRITE,
+                                 FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                 FILE_ATTRIBUTE_NORMAL, NULL);
+    if (aviPtr->handle == INVALID_HANDLE_VALUE) {
+        sprintf(message, "couldn't open file: error %lu", GetLastError());
+        r = TCL_ERROR;
+    } else {
+        LARGE_INTEGER size;
+        GetFileSizeEx(aviPtr->handle, &size);
+        reader.fileSize = size.QuadPart;
+    }
+#else
+    aviPtr->fd = open((const char *)native, O_RDWR);
+    if (aviPtr->fd < 0) {
+        sprintf(message, "couldn't open file: %.200s", Tcl_ErrnoMsg(errno));
+        r = TCL_ERROR;
+    } else {
+        reader.fileSize = (Tcl_WideInt)lseek(aviPtr->fd, 0, SEEK_END);
+    }
+#endif
+    if (r != TCL_OK) {
+        ckfree((char *)reader.buffer);
+        ckfree((char *)aviPtr->blockMem);
+        ckfree((char *)aviPtr);
+        return TCL_ERROR;
+    }
+
+    r = ReadHeader(aviPtr, &reader);
+    if (r == TCL_OK)
+        r = ScanChunks(aviPtr, &reader, &gaps, &gapCount, &end);
+    ckfree((char *)reader.buffer);
+
+    /* carry on writing after the last complete chunk */
+    if (r == TCL_OK) {
+        Tcl_WideInt got;
+        aviPtr->blockStart = end & ~(Tcl_WideInt)(AVI_BLOCK - 1);
+        aviPtr->blockUsed = (size_t)(end - aviPtr->blockStart);
+        got = FileRead(aviPtr, aviPtr->blockStart, aviPtr->block, aviPtr->blockUsed);
+        if (got >= 0 && got != (Tcl_WideInt)aviPtr->blockUsed)
+            strcpy(aviPtr->message, "the file changed while it was being repaired");
+        if (got != (Tcl_WideInt)aviPtr->blockUsed)
+            r = TCL_ERROR;
+    }
+    if (r == TCL_OK) {
+#if defined(_WIN32)
+        LARGE_INTEGER size;
+        size.QuadPart = end;
+        if (!SetFilePointerEx(aviPtr->handle, size, NULL, FILE_BEGIN)
+            || !SetEndOfFile(aviPtr->handle)) {
+            sprintf(aviPtr->message, "error writing file: error %lu", GetLastError());
+            r = TCL_ERROR;
+        }
+#else
+        if (ftruncate(aviPtr->fd, (off_t)end) != 0) {
+            sprintf(aviPtr->message, "error writing file: %.200s", Tcl_ErrnoMsg(errno));
+            r = TCL_ERROR;
+        }
+#endif
+    }
+    for (n = 0; n < gapCount; ++n) {
+        if (r == TCL_OK)
+            r = WriteIndex(aviPtr, gaps[n].base, gaps[n].entries, gaps[n].count,
+                           gaps[n].at + n);
+        ckfree((char *)gaps[n].entries);
+    }
+    if (gaps != NULL)
+        ckfree((char *)gaps);
+
+    if (r != TCL_OK)
+        aviPtr->failed = 1;
+    frames = aviPtr->frames;
+    if (VideoAviClose(aviPtr, message) != TCL_OK)
+        return TCL_ERROR;
+    *framesPtr = frames;
+    return TCL_OK;
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
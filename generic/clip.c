@@ -0,0 +1,782 @@
+/* clip.c - pre-roll of recent frames and clips saved on demand
+ *
+ *      pathName clip save file ?-post seconds? ?-command cmd?
+ *
+ * With the -preroll option the widget keeps the last few seconds of
+ * video in memory while it runs, so that on a trigger the moments that
+ * led up to it can be saved along with those that follow, without
+ * recording to the disk all the time. The frames are taken as a sink
+ * (see sink.c) and compressed to JPEG, one after another, by a task
+ * given to the worker pool (see pool.c), then copied into a ring: a
+ * single arena of memory allocated when the video is started, with an
+ * index of the frames it holds. The oldest frames are dropped as new
+ * ones arrive, once they are older than the pre-roll or when there is
+ * no room for the new frame, so memory use is fixed however long the
+ * widget runs. The arena is sized for the pre-roll at a generous
+ * compressed size for each frame, within PREROLL_MAX_MEMORY.
+ *
+ * clip save starts a thread that writes the frames in the ring, and
+ * then those arriving until the -post time has passed, to a Motion JPEG
+ * AVI file (see avi.c). The thread copies one frame at a time out of
+ * the ring, so it never holds up the compressor, and as the disk is far
+ * faster than the source it soon catches up with the newest frame. The
+ * script is told when the file is complete through the -command
+ * callback. Frames lost along the way are written as repeats so that
+ * the clip keeps the timing of the source.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stdio.h>
+
+#define PREROLL_QUALITY     85          /* JPEG quality of the kept frames */
+#define PREROLL_MAX_SECONDS 3600        /* longest -preroll */
+#define PREROLL_MAX_MEMORY  ((size_t)256 << 20) /* largest arena */
+#define PREROLL_MAX_FRAMES  131072      /* largest index of the arena */
+#define CLIP_SAVES          4           /* clips being written at once */
+#define CLIP_MAX_GAP        300         /* longest run of lost frames filled in */
+
+#ifdef HAVE_JPEG
+
+typedef struct {
+    Tcl_WideInt sequence;       /* source frame number */
+    Tcl_WideInt timestamp;      /* stream time in microseconds */
+    size_t offset;              /* of the data in the arena */
+    size_t size;
+} PrerollFrame;
+
+typedef struct ClipSave {
+    struct ClipSave *nextPtr;
+    VideoPreroll *prerollPtr;
+    Tcl_ThreadId threadId;
+    char *fileName;             /* normalized file name, for the thread */
+    Tcl_Interp *interp;         /* these belong to the widget thread */
+    Tcl_ThreadId ownerThread;
+    Tcl_Obj *pathPtr;
+    Tcl_Obj *commandPtr;        /* called when the file is written, or NULL */
+    Tcl_WideInt post;           /* microseconds to save after the trigger */
+    Tcl_WideInt endTime;        /* timestamp of the last frame, or -1 */
+    Tcl_WideInt next;           /* ring position of the next frame */
+} ClipSave;
+
+typedef struct {
+    Tcl_Event header;
+    ClipSave *savePtr;          /* the thread, joined by the event */
+    Tcl_Interp *interp;
+    Tcl_Obj *pathPtr;
+    Tcl_Obj *commandPtr;
+    Tcl_WideInt frames;
+    Tcl_WideInt repeated;
+    Tcl_WideInt bytes;
+    int code;
+    char message[256];
+} ClipEvent;
+
+struct VideoPreroll {
+    Video *videoPtr;
+    VideoSink *sinkPtr;
+    VideoJpeg *jpegPtr;         /* used by the encoder's task only */
+    int width;
+    int height;
+    double rate;                /* frames per second */
+    int rateNum;                /* the rate as rateNum/rateDen */
+    int rateDen;
+    Tcl_WideInt keep;           /* microseconds of video kept */
+    unsigned char *arena;       /* compressed frames */
+    size_t capacity;
+    PrerollFrame *frames;       /* index of the frames in the arena */
+    int frameSpace;
+    ClipSave *saveList;         /* clip threads not yet joined */
+    int retired;                /* stopped, and freed by the last clip */
+
+    Tcl_Mutex lock;             /* protects all the fields below */
+    Tcl_Condition cond;         /* wakes the clip threads, and signals the
+                                 * end of the encoder's task */
+    int quit;
+    int scheduled;              /* the encoder's task is given or running */
+    Tcl_WideInt first;          /* ring position of the oldest frame */
+    Tcl_WideInt next;           /* ring position of the next frame added */
+    size_t head;                /* arena offset after the newest frame */
+    size_t used;                /* bytes of the frames kept */
+    Tcl_WideInt dropped;        /* frames that could not be kept */
+    int saving;                 /* clip threads not yet finished */
+};
+
+static void PrerollEncoderTask(ClientData clientData);
+static void PrerollRelease(VideoPreroll *prerollPtr);
+static void PrerollExitHandler(ClientData clientData);
+static void ClipJoin(ClipSave *savePtr);
+static Tcl_ThreadCreateType ClipSaveProc(ClientData clientData);
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Called on the capture thread when a frame is waiting in the sink. The
+ * encoder's task is given to the pool unless it is already waiting or
+ * running, as then it will take the frame before it finishes.
+ */
+
+static void
+PrerollWake(ClientData clientData)
+{
+    VideoPreroll *prerollPtr = (VideoPreroll *)clientData;
+    int submit;
+
+    Tcl_MutexLock(&prerollPtr->lock);
+    submit = !prerollPtr->scheduled && !prerollPtr->quit;
+    if (submit)
+        prerollPtr->scheduled = 1;
+    Tcl_MutexUnlock(&prerollPtr->lock);
+    if (submit)
+        VideoPoolSubmit(prerollPtr->videoPtr, PrerollEncoderTask, prerollPtr);
+}
+
+/*
+ * Add a compressed frame to the ring, first dropping the frames that
+ * are older than the pre-roll and those in the way of the new frame.
+ * Called with the lock held.
+ */
+
+static void
+PrerollAdd(VideoPreroll *prerollPtr, const VideoFrame *framePtr,
+           const unsigned char *data, size_t size)
+{
+    PrerollFrame *entryPtr;
+    size_t at = prerollPtr->head;
+    int wrapped = 0;
+
+    if (size > prerollPtr->capacity) {
+        ++prerollPtr->dropped;
+        return;
+    }
+    if (at + size > prerollPtr->capacity) {
+        at = 0;
+        wrapped = 1;
+    }
+    while (prerollPtr->first < prerollPtr->next) {
+        PrerollFrame *oldPtr = &prerollPtr->frames[prerollPtr->first % prerollPtr->frameSpace];
+        if (!(prerollPtr->next - prerollPtr->first == prerollPtr->frameSpace
+              || oldPtr->timestamp < framePtr->timestamp - prerollPtr->keep
+              || (wrapped && oldPtr->offset >= prerollPtr->head)
+              || (oldPtr->offset < at + size && at < oldPtr->offset + oldPtr->size)))
+            break;
+        prerollPtr->used -= oldPtr->size;
+        ++prerollPtr->first;
+    }
+
+    entryPtr = &prerollPtr->frames[prerollPtr->next % prerollPtr->frameSpace];
+    entryPtr->sequence = framePtr->sequence;
+    entryPtr->timestamp = framePtr->timestamp;
+    entryPtr->offset = at;
+    entryPtr->size = size;
+    memcpy(prerollPtr->arena + at, data, size);
+    prerollPtr->head = at + size;
+    prerollPtr->used += size;
+    ++prerollPtr->next;
+}
+
+static void
+PrerollEncoderTask(ClientData clientData)
+{
+    VideoPreroll *prerollPtr = (VideoPreroll *)clientData;
+
+    Tcl_MutexLock(&prerollPtr->lock);
+    while (!prerollPtr->quit) {
+        VideoBuffer *bufferPtr = VideoSinkTake(prerollPtr->sinkPtr);
+        const VideoFrame *framePtr;
+        const unsigned char *data;
+        size_t size;
+        int failed;
+
+        if (bufferPtr == NULL)
+            break;
+        Tcl_MutexUnlock(&prerollPtr->lock);
+        framePtr = VideoBufferFrame(bufferPtr);
+        failed = (framePtr->width != prerollPtr->width
+                  || framePtr->height != prerollPtr->height
+                  || VideoJpegEncode(prerollPtr->jpegPtr, framePtr, PREROLL_QUALITY,
+                                     &data, &size) != TCL_OK);
+        Tcl_MutexLock(&prerollPtr->lock);
+        if (failed) {
+            ++prerollPtr->dropped;
+        } else {
+            PrerollAdd(prerollPtr, framePtr, data, size);
+            Tcl_ConditionNotify(&prerollPtr->cond);
+        }
+        Tcl_MutexUnlock(&prerollPtr->lock);
+        VideoBufferRelease(bufferPtr);
+        Tcl_MutexLock(&prerollPtr->lock);
+    }
+    prerollPtr->scheduled = 0;
+    Tcl_ConditionNotify(&prerollPtr->cond);
+    Tcl_MutexUnlock(&prerollPtr->lock);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Join the clip's thread, which queued this event as it finished, and
+ * call its command on the widget thread. Errors without a command to
+ * report them to are background errors.
+ */
+
+static int
+ClipEventProc(Tcl_Event *evPtr, int flags)
+{
+    ClipEvent *clipPtr = (ClipEvent *)evPtr;
+    Tcl_Interp *interp = clipPtr->interp;
+
+    if (!(flags & TCL_FILE_EVENTS)) {
+        return 0;
+    }
+    ClipJoin(clipPtr->savePtr);
+
+    if (!Tcl_InterpDeleted(interp)) {
+        if (clipPtr->commandPtr != NULL) {
+            Tcl_Obj *cmdPtr = Tcl_DuplicateObj(clipPtr->commandPtr);
+            Tcl_Obj *dictPtr = Tcl_NewDictObj();
+
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("status", -1),
+                Tcl_NewStringObj(clipPtr->code == TCL_OK ? "ok" : "error", -1));
+            if (clipPtr->code != TCL_OK)
+                Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("message", -1),
+                    Tcl_NewStringObj(clipPtr->message, -1));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("frames", -1),
+                Tcl_NewWideIntObj(clipPtr->frames));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("repeated", -1),
+                Tcl_NewWideIntObj(clipPtr->repeated));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("bytes", -1),
+                Tcl_NewWideIntObj(clipPtr->bytes));
+
+            Tcl_IncrRefCount(cmdPtr);
+            Tcl_Preserve(interp);
+            if (Tcl_ListObjAppendElement(interp, cmdPtr, clipPtr->pathPtr) != TCL_OK
+                || Tcl_ListObjAppendElement(interp, cmdPtr, dictPtr) != TCL_OK
+                || Tcl_EvalObjEx(interp, cmdPtr, TCL_EVAL_GLOBAL) != TCL_OK) {
+                Tcl_BackgroundError(interp);
+            }
+            Tcl_Release(interp);
+            Tcl_DecrRefCount(cmdPtr);
+        } else if (clipPtr->code != TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error saving clip to \"%s\": %s",
+                Tcl_GetString(clipPtr->pathPtr), clipPtr->message));
+            Tcl_BackgroundError(interp);
+        }
+    }
+
+    Tcl_DecrRefCount(clipPtr->pathPtr);
+    if (clipPtr->commandPtr != NULL)
+        Tcl_DecrRefCount(clipPtr->commandPtr);
+    Tcl_Release(interp);
+    return 1;
+}
+
+/*
+ * Write the frames from the oldest in the ring until the end of the
+ * clip, or until the pre-roll is stopped. Each frame is copied out of
+ * the ring with the lock held and written without it.
+ */
+
+static Tcl_ThreadCreateType
+ClipSaveProc(ClientData clientData)
+{
+    ClipSave *savePtr = (ClipSave *)clientData;
+    VideoPreroll *prerollPtr = savePtr->prerollPtr;
+    ClipEvent *clipPtr = (ClipEvent *)ckalloc(sizeof(ClipEvent));
+    Tcl_Obj *nameObj = Tcl_NewStringObj(savePtr->fileName, -1);
+    const void *native;
+    VideoAvi *aviPtr = NULL;
+    unsigned char *data = NULL;
+    size_t space = 0;
+    Tcl_WideInt lastSequence = -1;
+
+    memset(clipPtr, 0, sizeof(ClipEvent));
+    clipPtr->code = TCL_ERROR;
+    Tcl_IncrRefCount(nameObj);
+    native = Tcl_FSGetNativePath(nameObj);
+    if (native == NULL) {
+        sprintf(clipPtr->message, "invalid file name \"%.200s\"", savePtr->fileName);
+    } else {
+        aviPtr = VideoAviCreate(native, prerollPtr->width, prerollPtr->height,
+                                prerollPtr->rateNum, prerollPtr->rateDen, clipPtr->message);
+    }
+    Tcl_DecrRefCount(nameObj);
+
+    Tcl_MutexLock(&prerollPtr->lock);
+    while (aviPtr != NULL) {
+        PrerollFrame frame;
+        Tcl_WideInt gap;
+        int r = TCL_OK;
+
+        if (savePtr->next < prerollPtr->first)
+            savePtr->next = prerollPtr->first;
+        if (savePtr->next == prerollPtr->next) {
+            if (prerollPtr->quit)
+                break;
+            Tcl_ConditionWait(&prerollPtr->cond, &prerollPtr->lock, NULL);
+            continue;
+        }
+        frame = prerollPtr->frames[savePtr->next++ % prerollPtr->frameSpace];
+        if (savePtr->endTime < 0)
+            savePtr->endTime = frame.timestamp + savePtr->post;
+        if (frame.timestamp > savePtr->endTime)
+            break;
+        if (frame.size > space) {
+            unsigned char *newPtr = (unsigned char *)attemptckrealloc((char *)data, frame.size);
+            if (newPtr == NULL) {
+                strcpy(clipPtr->message, "out of memory");
+                break;
+            }
+            data = newPtr;
+            space = frame.size;
+        }
+        memcpy(data, prerollPtr->arena + frame.offset, frame.size);
+        Tcl_MutexUnlock(&prerollPtr->lock);
+
+        gap = frame.sequence - lastSequence - 1;
+        if (lastSequence >= 0 && gap > 0 && gap <= CLIP_MAX_GAP) {
+            clipPtr->repeated += gap;
+            while (gap-- > 0 && r == TCL_OK) {
+                r = VideoAviWrite(aviPtr, NULL, 0);
+            }
+        }
+        if (r == TCL_OK)
+            r = VideoAviWrite(aviPtr, data, frame.size);
+        lastSequence = frame.sequence;
+
+        Tcl_MutexLock(&prerollPtr->lock);
+        if (r != TCL_OK || frame.timestamp >= savePtr->endTime)
+            break;
+    }
+    Tcl_MutexUnlock(&prerollPtr->lock);
+
+    if (data != NULL)
+        ckfree((char *)data);
+    if (aviPtr != NULL) {
+        VideoAviCounts(aviPtr, &clipPtr->frames, &clipPtr->bytes);
+        if (VideoAviClose(aviPtr, clipPtr->message) == TCL_OK && clipPtr->message[0] == 0)
+            clipPtr->code = TCL_OK;
+    }
+
+    clipPtr->header.proc = ClipEventProc;
+    clipPtr->savePtr = savePtr;
+    clipPtr->interp = savePtr->interp;
+    clipPtr->pathPtr = savePtr->pathPtr;
+    clipPtr->commandPtr = savePtr->commandPtr;
+
+    Tcl_MutexLock(&prerollPtr->lock);
+    --prerollPtr->saving;
+    Tcl_MutexUnlock(&prerollPtr->lock);
+    Tcl_ThreadQueueEvent(savePtr->ownerThread, (Tcl_Event *)clipPtr, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(savePtr->ownerThread);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Join a clip thread and release it. The thread has queued its event,
+ * which is the last thing it does, so this does not wait for long. The
+ * last clip of a stopped pre-roll releases the pre-roll too.
+ */
+
+static void
+ClipJoin(ClipSave *savePtr)
+{
+    VideoPreroll *prerollPtr = savePtr->prerollPtr;
+    ClipSave **linkPtr;
+    int result;
+
+    Tcl_JoinThread(savePtr->threadId, &result);
+    for (linkPtr = &prerollPtr->saveList; *linkPtr != NULL; linkPtr = &(*linkPtr)->nextPtr) {
+        if (*linkPtr == savePtr) {
+            *linkPtr = savePtr->nextPtr;
+            break;
+        }
+    }
+    ckfree(savePtr->fileName);
+    ckfree((char *)savePtr);
+    if (prerollPtr->retired && prerollPtr->saveList == NULL) {
+        Tcl_DeleteThreadExitHandler(PrerollExitHandler, prerollPtr);
+        PrerollRelease(prerollPtr);
+    }
+}
+
+/*
+ * Release the memory of a pre-roll that no clip thread is using.
+ */
+
+static void
+PrerollRelease(VideoPreroll *prerollPtr)
+{
+    if (prerollPtr->arena != NULL)
+        ckfree((char *)prerollPtr->arena);
+    if (prerollPtr->frames != NULL)
+        ckfree((char *)prerollPtr->frames);
+    Tcl_ConditionFinalize(&prerollPtr->cond);
+    Tcl_MutexFinalize(&prerollPtr->lock);
+    ckfree((char *)prerollPtr);
+}
+
+/*
+ * The widget thread is exiting with clips of a stopped pre-roll still
+ * being saved. They are completed with the frames already kept, and
+ * joined here as their events will not be handled.
+ */
+
+static void
+PrerollExitHandler(ClientData clientData)
+{
+    VideoPreroll *prerollPtr = (VideoPreroll *)clientData;
+    int result;
+
+    while (prerollPtr->saveList != NULL) {
+        ClipSave *savePtr = prerollPtr->saveList;
+        prerollPtr->saveList = savePtr->nextPtr;
+        Tcl_JoinThread(savePtr->threadId, &result);
+        ckfree(savePtr->fileName);
+        ckfree((char *)savePtr);
+    }
+    PrerollRelease(prerollPtr);
+}
+
+/*
+ * Stop the encoder and release the pre-roll. Clips being saved are
+ * completed with the frames already kept, without waiting for them
+ * here: the pre-roll is left to the last of them to release, when its
+ * event joins it.
+ */
+
+static void
+PrerollFree(VideoPreroll *prerollPtr)
+{
+    Tcl_MutexLock(&prerollPtr->lock);
+    prerollPtr->quit = 1;
+    Tcl_ConditionNotify(&prerollPtr->cond);
+    while (prerollPtr->scheduled)
+        Tcl_ConditionWait(&prerollPtr->cond, &prerollPtr->lock, NULL);
+    Tcl_MutexUnlock(&prerollPtr->lock);
+    if (prerollPtr->sinkPtr != NULL) {
+        VideoSinkDestroy(prerollPtr->sinkPtr);
+    }
+    if (prerollPtr->jpegPtr != NULL)
+        VideoJpegDestroy(prerollPtr->jpegPtr);
+    if (prerollPtr->saveList != NULL) {
+        prerollPtr->retired = 1;
+        Tcl_CreateThreadExitHandler(PrerollExitHandler, prerollPtr);
+        return;
+    }
+    PrerollRelease(prerollPtr);
+}
+
+/*
+ * Start saving a clip: the frames now in the ring and those that follow
+ * for post seconds.
+ */
+
+static int
+ClipSaveStart(Video *videoPtr, Tcl_Obj *pathPtr, double post, Tcl_Obj *commandPtr)
+{
+    Tcl_Interp *interp = videoPtr->interp;
+    VideoPreroll *prerollPtr = videoPtr->prerollPtr;
+    Tcl_Obj *normPtr;
+    ClipSave *savePtr;
+    const char *name;
+
+    normPtr = Tcl_FSGetNormalizedPath(interp, pathPtr);
+    if (normPtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("invalid file name \"%s\"",
+            Tcl_GetString(pathPtr)));
+        return TCL_ERROR;
+    }
+    name = Tcl_GetString(normPtr);
+
+    savePtr = (ClipSave *)ckalloc(sizeof(ClipSave));
+    memset(savePtr, 0, sizeof(ClipSave));
+    savePtr->prerollPtr = prerollPtr;
+    savePtr->fileName = strcpy(ckalloc(strlen(name) + 1), name);
+    savePtr->interp = interp;
+    savePtr->ownerThread = Tcl_GetCurrentThread();
+    savePtr->pathPtr = pathPtr;
+    savePtr->commandPtr = commandPtr;
+    savePtr->post = (Tcl_WideInt)(post * 1000000.0);
+
+    Tcl_MutexLock(&prerollPtr->lock);
+    if (prerollPtr->saving >= CLIP_SAVES) {
+        Tcl_MutexUnlock(&prerollPtr->lock);
+        ckfree(savePtr->fileName);
+        ckfree((char *)savePtr);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "too many clips being saved: the limit is %d", CLIP_SAVES));
+        return TCL_ERROR;
+    }
+    savePtr->next = prerollPtr->first;
+    savePtr->endTime = -1;
+    if (prerollPtr->next > prerollPtr->first) {
+        savePtr->endTime = savePtr->post + prerollPtr->frames[
+            (prerollPtr->next - 1) % prerollPtr->frameSpace].timestamp;
+    }
+    if (Tcl_CreateThread(&savePtr->threadId, ClipSaveProc, savePtr,
+            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+        Tcl_MutexUnlock(&prerollPtr->lock);
+        ckfree(savePtr->fileName);
+        ckfree((char *)savePtr);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("cannot create clip thread", -1));
+        return TCL_ERROR;
+    }
+    ++prerollPtr->saving;
+    Tcl_MutexUnlock(&prerollPtr->lock);
+
+    Tcl_IncrRefCount(pathPtr);
+    if (commandPtr != NULL)
+        Tcl_IncrRefCount(commandPtr);
+    Tcl_Preserve(interp);
+    savePtr->nextPtr = prerollPtr->saveList;
+    prerollPtr->saveList = savePtr;
+    Tcl_SetObjResult(interp, pathPtr);
+    return TCL_OK;
+}
+
+#endif /* HAVE_JPEG */
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * Begin keeping the last -preroll seconds of the widget's frames, for
+ * frames of the current video size at the given rate in frames per
+ * second, until VideoPrerollStop. Does nothing if -preroll is 0.
+ *
+ * @return a Tcl result code.
+ */
+
+int
+VideoPrerollStart(Video *videoPtr, double rate)
+{
+#ifdef HAVE_JPEG
+    Tcl_Interp *interp = videoPtr->interp;
+    VideoPreroll *prerollPtr;
+    double frames = videoPtr->preroll * rate + 2.0;
+    double capacity = frames * videoPtr->videoWidth * videoPtr->videoHeight / 2.0;
+    int rateNum = (int)(rate * 1000.0 + 0.5), rateDen = 1000, a, b, n;
+
+    if (videoPtr->preroll <= 0.0)
+        return TCL_OK;
+
+    prerollPtr = (VideoPreroll *)ckalloc(sizeof(VideoPreroll));
+    memset(prerollPtr, 0, sizeof(VideoPreroll));
+    prerollPtr->videoPtr = videoPtr;
+    prerollPtr->width = videoPtr->videoWidth;
+    prerollPtr->height = videoPtr->videoHeight;
+    prerollPtr->rate = rate;
+    prerollPtr->keep = (Tcl_WideInt)(videoPtr->preroll * 1000000.0);
+    for (a = rateNum, b = rateDen; b != 0; ) {
+        n = a % b;
+        a = b;
+        b = n;
+    }
+    prerollPtr->rateNum = rateNum / a;
+    prerollPtr->rateDen = rateDen / a;
+
+    /* JPEG frames rarely need more than 4 bits a pixel */
+    prerollPtr->frameSpace = (frames < PREROLL_MAX_FRAMES) ? (int)frames : PREROLL_MAX_FRAMES;
+    prerollPtr->capacity = (capacity < (double)PREROLL_MAX_MEMORY)
+        ? (size_t)capacity : PREROLL_MAX_MEMORY;
+    prerollPtr->frames = (PrerollFrame *)
+        attemptckalloc(prerollPtr->frameSpace * sizeof(PrerollFrame));
+    prerollPtr->arena = (unsigned char *)attemptckalloc(prerollPtr->capacity);
+    if (prerollPtr->frames == NULL || prerollPtr->arena == NULL) {
+        PrerollFree(prerollPtr);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "cannot keep the pre-roll: out of memory", -1));
+        return TCL_ERROR;
+    }
+
+    prerollPtr->jpegPtr = VideoJpegCreate();
+    prerollPtr->sinkPtr = VideoSinkCreate(videoPtr, "preroll", 1, PrerollWake, prerollPtr);
+    videoPtr->prerollPtr = prerollPtr;
+    return TCL_OK;
+#else
+    if (videoPtr->preroll <= 0.0)
+        return TCL_OK;
+    Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+        "pre-roll is not available: tkvideo was built without JPEG support", -1));
+    return TCL_ERROR;
+#endif
+}
+
+/**
+ * Stop keeping frames, if the widget is, and release the memory. Clips
+ * being saved are completed with the frames kept so far.
+ */
+
+void
+VideoPrerollStop(Video *videoPtr)
+{
+#ifdef HAVE_JPEG
+    if (videoPtr->prerollPtr != NULL) {
+        PrerollFree(videoPtr->prerollPtr);
+        videoPtr->prerollPtr = NULL;
+    }
+#endif
+}
+
+/**
+ * Apply a new -preroll value while the widget is running. The frames
+ * already kept are discarded.
+ *
+ * @return a Tcl result code.
+ */
+
+int
+VideoPrerollUpdate(Video *videoPtr)
+{
+#ifdef HAVE_JPEG
+    double rate;
+
+    if (videoPtr->prerollPtr == NULL)
+        return TCL_OK;
+    rate = videoPtr->prerollPtr->rate;
+    VideoPrerollStop(videoPtr);
+    return VideoPrerollStart(videoPtr, rate);
+#else
+    return TCL_OK;
+#endif
+}
+
+/**
+ * @return a dictionary describing the pre-roll for the stats command:
+ *  the seconds of video and the frames and bytes kept, the memory set
+ *  aside for them, the frames that could not be kept and the number of
+ *  clips being saved.
+ */
+
+Tcl_Obj *
+VideoPrerollInfo(Video *videoPtr)
+{
+    Tcl_Obj *resultObj = Tcl_NewObj();
+#ifdef HAVE_JPEG
+    VideoPreroll *prerollPtr = videoPtr->prerollPtr;
+    Tcl_WideInt frames, dropped, delivered, missed;
+    double seconds = 0.0;
+    size_t used;
+    int saving;
+
+    VideoSinkCounts(prerollPtr->sinkPtr, &delivered, &missed);
+    Tcl_MutexLock(&prerollPtr->lock);
+    frames = prerollPtr->next - prerollPtr->first;
+    if (frames > 0) {
+        seconds = (prerollPtr->frames[(prerollPtr->next - 1) % prerollPtr->frameSpace].timestamp
+                   - prerollPtr->frames[prerollPtr->first % prerollPtr->frameSpace].timestamp)
+            / 1000000.0 + 1.0 / prerollPtr->rate;
+    }
+    used = prerollPtr->used;
+    dropped = prerollPtr->dropped + missed;
+    saving = prerollPtr->saving;
+    Tcl_MutexUnlock(&prerollPtr->lock);
+
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("seconds", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewDoubleObj(seconds));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("frames", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(frames));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj((Tcl_WideInt)used));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("memory", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj((Tcl_WideInt)
+        (prerollPtr->capacity + prerollPtr->frameSpace * sizeof(PrerollFrame))));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("dropped", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(dropped));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("saving", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(saving));
+#endif
+    return resultObj;
+}
+
+/**
+ * @return TCL_OK if the value is a valid -preroll, otherwise TCL_ERROR
+ *  with a message in the interpreter.
+ */
+
+int
+VideoPrerollCheck(Tcl_Interp *interp, double seconds)
+{
+    if (seconds >= 0.0 && seconds <= PREROLL_MAX_SECONDS)
+        return TCL_OK;
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+        "invalid pre-roll %g: must be from 0 to %d seconds", seconds, PREROLL_MAX_SECONDS));
+    return TCL_ERROR;
+}
+
+/**
+ * Implement the clip subcommand:
+ *
+ *     pathName clip save file ?-post seconds? ?-command cmd?
+ *
+ * Save the frames kept by -preroll and those of the next post seconds
+ * to an AVI file on a separate thread. The command is called with the
+ * file name and a dictionary of the outcome when the file is complete.
+ */
+
+int
+VideoWidgetClipCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+#ifdef HAVE_JPEG
+    Video *videoPtr = (Video *)clientData;
+    static const char *commands[] = { "save", NULL };
+    static const char *options[] = { "-command", "-post", NULL };
+    enum { CLIP_OPT_COMMAND, CLIP_OPT_POST };
+    Tcl_Obj *commandPtr = NULL;
+    double post = 0.0;
+    int index, n;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "command ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], commands, "command", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc < 4 || (objc % 2) != 0) {
+        Tcl_WrongNumArgs(interp, 3, objv, "file ?-post seconds? ?-command cmd?");
+        return TCL_ERROR;
+    }
+    for (n = 4; n < objc; n += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        switch (index) {
+        case CLIP_OPT_COMMAND:
+            commandPtr = objv[n + 1];
+            break;
+        case CLIP_OPT_POST:
+            if (Tcl_GetDoubleFromObj(interp, objv[n + 1], &post) != TCL_OK)
+                return TCL_ERROR;
+            if (!(post >= 0.0 && post <= PREROLL_MAX_SECONDS)) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "invalid post time %g: must be from 0 to %d seconds", post,
+                    PREROLL_MAX_SECONDS));
+                return TCL_ERROR;
+            }
+            break;
+        }
+    }
+    if (videoPtr->prerollPtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "no frames are being kept: set -preroll and start the video", -1));
+        return TCL_ERROR;
+    }
+    return ClipSaveStart(videoPtr, objv[3], post, commandPtr);
+#else
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        "clips are not available: tkvideo was built without JPEG support", -1));
+    return TCL_ERROR;
+#endif
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,333 @@
+/* composite.c - overlay compositing for the tkvideo widget
+ *
+ * An overlay is a photo image blended over each frame before it is
+ * displayed or delivered to a photo by picture or -image. The photo is
+ * converted once, when the overlay is set, into a premultiplied B,G,R,A
+ * surface so that blending a pixel needs no division:
+ *
+ *      dst = src + dst * (255 - srcAlpha) / 255
+ *
+ * For each row of the surface the span from the first to the last pixel
+ * that is not fully transparent is recorded. Rows that are entirely
+ * transparent are skipped and only the span of the others is read, so a
+ * logo in one corner of a large, mostly empty image costs no more than
+ * the logo itself.
+ *
+ * The position and a global opacity are applied while blending and can
+ * be changed without converting the photo again. The global opacity
+ * scales every channel of the premultiplied source, which is the same
+ * as scaling its alpha before premultiplying. Division by 255 uses the
+ * exact rounding form (x + 128 + ((x + 128) >> 8)) >> 8 so the scalar
+ * and SIMD kernels give identical results.
+ *
+ * An overlay covering most of a large frame is blended in horizontal
+ * stripes on the worker pool (see VideoPoolStripes). The work is
+ * counted from the spans, so a small logo is still blended at once.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define VIDEO_X86 1
+#include <emmintrin.h>
+#endif
+
+typedef void (BlendProc)(const unsigned char *srcPtr, unsigned char *dstPtr,
+                         int count, int alpha, int rgba);
+
+static BlendProc BlendScalar;
+#ifdef VIDEO_X86
+static BlendProc BlendSSE2;
+#endif
+
+static BlendProc *blendProc = BlendScalar;
+
+typedef struct {
+    const VideoOverlay *overlayPtr;
+    unsigned char *dstPtr;
+    int dstPitch;
+    int width;                  /* of the image */
+    int y0;                     /* first overlay row within the image */
+    int rgba;
+} BlendJob;
+
+static VideoStripeProc BlendStripe;
+
+#define DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+/**
+ * Select the blending kernel. Called once from the package
+ * initialization with the result of VideoCpuFeatures.
+ */
+
+void
+VideoCompositeInit(int features)
+{
+    blendProc = BlendScalar;
+#ifdef VIDEO_X86
+    if (features & VIDEO_CPU_SSE2) {
+        blendProc = BlendSSE2;
+    }
+#endif
+}
+
+/**
+ * Create an empty, fully opaque overlay at the origin.
+ */
+
+VideoOverlay *
+VideoOverlayCreate(void)
+{
+    VideoOverlay *overlayPtr = (VideoOverlay *)ckalloc(sizeof(VideoOverlay));
+    memset(overlayPtr, 0, sizeof(VideoOverlay));
+    overlayPtr->alpha = 255;
+    return overlayPtr;
+}
+
+void
+VideoOverlayDestroy(VideoOverlay *overlayPtr)
+{
+    if (overlayPtr->pixels != NULL) {
+        ckfree((char *)overlayPtr->pixels);
+    }
+    if (overlayPtr->spans != NULL) {
+        ckfree((char *)overlayPtr->spans);
+    }
+    ckfree((char *)overlayPtr);
+}
+
+/**
+ * Convert a photo into the overlay surface, replacing any previous
+ * image. The position and opacity are kept. A photo block without an
+ * alpha channel is treated as opaque.
+ *
+ * @return TCL_OK, or TCL_ERROR if the surface could not be allocated in
+ *  which case the overlay is left unchanged.
+ */
+
+int
+VideoOverlayLoad(VideoOverlay *overlayPtr, Tk_PhotoHandle photo)
+{
+    Tk_PhotoImageBlock block;
+    unsigned char *pixels;
+    int *spans;
+    int x, y, hasAlpha;
+
+    Tk_PhotoGetImage(photo, &block);
+    pixels = (unsigned char *)attemptckalloc(
+        (size_t)block.width * block.height * 4 + 1);
+    spans = (int *)attemptckalloc(sizeof(int) * 2 * block.height + 1);
+    if (pixels == NULL || spans == NULL) {
+        if (pixels != NULL)
+            ckfree((char *)pixels);
+        if (spans != NULL)
+            ckfree((char *)spans);
+        return TCL_ERROR;
+    }
+
+    hasAlpha = (block.pixelSize >= 4 && block.offset[3] < block.pixelSize);
+    for (y = 0; y < block.height; ++y) {
+        const unsigned char *srcPtr = block.pixelPtr + (size_t)y * block.pitch;
+        unsigned char *dstPtr = pixels + (size_t)y * block.width * 4;
+        int first = block.width, last = 0;
+
+        for (x = 0; x < block.width; ++x, srcPtr += block.pixelSize, dstPtr += 4) {
+            int a = hasAlpha ? srcPtr[block.offset[3]] : 255;
+            dstPtr[0] = (unsigned char)DIV255(srcPtr[block.offset[2]] * a);
+            dstPtr[1] = (unsigned char)DIV255(srcPtr[block.offset[1]] * a);
+            dstPtr[2] = (unsigned char)DIV255(srcPtr[block.offset[0]] * a);
+            dstPtr[3] = (unsigned char)a;
+            if (a != 0) {
+                if (x < first)
+                    first = x;
+                last = x + 1;
+            }
+        }
+        if (first >= last)
+            first = last = 0;
+        spans[2 * y] = first;
+        spans[2 * y + 1] = last;
+    }
+
+    if (overlayPtr->pixels != NULL)
+        ckfree((char *)overlayPtr->pixels);
+    if (overlayPtr->spans != NULL)
+        ckfree((char *)overlayPtr->spans);
+    overlayPtr->pixels = pixels;
+    overlayPtr->spans = spans;
+    overlayPtr->width = block.width;
+    overlayPtr->height = block.height;
+    return TCL_OK;
+}
+
+/**
+ * Blend the overlay into a 32 bit image of width by height pixels. The
+ * image is B,G,R,A, or R,G,B,A if rgba is set, and a negative pitch may
+ * be used for a bottom-up image. The overlay is clipped to the image.
+ */
+
+void
+VideoOverlayBlend(const VideoOverlay *overlayPtr, unsigned char *dstPtr, int dstPitch,
+                  int width, int height, int rgba)
+{
+    BlendJob job;
+    Tcl_WideInt pixels = 0;
+    int y, y0, y1;
+
+    if (overlayPtr->pixels == NULL || overlayPtr->alpha <= 0) {
+        return;
+    }
+    y0 = overlayPtr->y < 0 ? -overlayPtr->y : 0;
+    y1 = overlayPtr->height;
+    if (overlayPtr->y + y1 > height)
+        y1 = height - overlayPtr->y;
+    if (y0 >= y1) {
+        return;
+    }
+    for (y = y0; y < y1; ++y) {
+        pixels += overlayPtr->spans[2 * y + 1] - overlayPtr->spans[2 * y];
+    }
+
+    job.overlayPtr = overlayPtr;
+    job.dstPtr = dstPtr;
+    job.dstPitch = dstPitch;
+    job.width = width;
+    job.y0 = y0;
+    job.rgba = rgba;
+    VideoPoolStripes(y1 - y0, pixels, BlendStripe, &job);
+}
+
+/*
+ * Blend the overlay rows y0 + first to y0 + last - 1.
+ */
+
+static void
+BlendStripe(ClientData clientData, int lane, int first, int last)
+{
+    BlendJob *jobPtr = (BlendJob *)clientData;
+    const VideoOverlay *overlayPtr = jobPtr->overlayPtr;
+    const int alpha = overlayPtr->alpha > 255 ? 255 : overlayPtr->alpha;
+    int y;
+
+    for (y = jobPtr->y0 + first; y < jobPtr->y0 + last; ++y) {
+        int x0 = overlayPtr->spans[2 * y];
+        int x1 = overlayPtr->spans[2 * y + 1];
+
+        if (overlayPtr->x + x0 < 0)
+            x0 = -overlayPtr->x;
+        if (overlayPtr->x + x1 > jobPtr->width)
+            x1 = jobPtr->width - overlayPtr->x;
+        if (x0 >= x1)
+            continue;
+        blendProc(overlayPtr->pixels + ((size_t)y * overlayPtr->width + x0) * 4,
+                  jobPtr->dstPtr + (ptrdiff_t)(overlayPtr->y + y) * jobPtr->dstPitch
+                  + (size_t)(overlayPtr->x + x0) * 4,
+                  x1 - x0, alpha, jobPtr->rgba);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+BlendScalar(const unsigned char *srcPtr, unsigned char *dstPtr,
+            int count, int alpha, int rgba)
+{
+    const int r = rgba ? 0 : 2, b = rgba ? 2 : 0;
+    int n;
+
+    for (n = 0; n < count; ++n, srcPtr += 4, dstPtr += 4) {
+        int sb = srcPtr[0], sg = srcPtr[1], sr = srcPtr[2], sa = srcPtr[3], inv;
+
+        if (sa == 0) {
+            continue;
+        }
+        if (alpha != 255) {
+            sb = DIV255(sb * alpha);
+            sg = DIV255(sg * alpha);
+            sr = DIV255(sr * alpha);
+            sa = DIV255(sa * alpha);
+        }
+        inv = 255 - sa;
+        dstPtr[b] = (unsigned char)(sb + DIV255(dstPtr[b] * inv));
+        dstPtr[1] = (unsigned char)(sg + DIV255(dstPtr[1] * inv));
+        dstPtr[r] = (unsigned char)(sr + DIV255(dstPtr[r] * inv));
+        dstPtr[3] = (unsigned char)(sa + DIV255(dstPtr[3] * inv));
+    }
+}
+
+#ifdef VIDEO_X86
+
+/*
+ * Divide eight 16 bit products of two bytes by 255 with rounding.
+ */
+
+static __inline __m128i
+Div255SSE2(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/*
+ * Blend two pixels held as 16 bit channels. The source channels are
+ * reordered for an R,G,B,A destination and scaled by the global opacity
+ * before their alpha is spread over all four channels.
+ */
+
+static __inline __m128i
+BlendPairSSE2(__m128i s, __m128i d, __m128i alpha, int rgba)
+{
+    __m128i a;
+
+    if (rgba) {
+        s = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 0, 1, 2));
+        s = _mm_shufflehi_epi16(s, _MM_SHUFFLE(3, 0, 1, 2));
+    }
+    s = Div255SSE2(_mm_mullo_epi16(s, alpha));
+    a = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+    a = _mm_sub_epi16(_mm_set1_epi16(255), a);
+    return _mm_add_epi16(s, Div255SSE2(_mm_mullo_epi16(d, a)));
+}
+
+static void
+BlendSSE2(const unsigned char *srcPtr, unsigned char *dstPtr,
+          int count, int alpha, int rgba)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i galpha = _mm_set1_epi16((short)alpha);
+    int n = 0;
+
+    for ( ; n + 4 <= count; n += 4, srcPtr += 16, dstPtr += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)srcPtr);
+        __m128i d, lo, hi;
+
+        /* Skip four fully transparent pixels without touching dst. */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+                _mm_srli_epi32(s, 24), zero)) == 0xffff) {
+            continue;
+        }
+        d = _mm_loadu_si128((const __m128i *)dstPtr);
+        lo = BlendPairSSE2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero),
+                           galpha, rgba);
+        hi = BlendPairSSE2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero),
+                           galpha, rgba);
+        _mm_storeu_si128((__m128i *)dstPtr, _mm_packus_epi16(lo, hi));
+    }
+    BlendScalar(srcPtr, dstPtr, count - n, alpha, rgba);
+}
+
+#endif /* VIDEO_X86 */
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,730 @@
+/* convert.c - pixel format conversion for the tkvideo widget
+ *
+ * Frames arrive from the platform code in the capture format, which for
+ * DirectShow RGB32 is B,G,R,X with an undefined X byte and commonly
+ * stored bottom-up. Tk photos want R,G,B,A top-down with a valid alpha.
+ * The kernels here do the channel swap, the alpha fill and the vertical
+ * flip in a single pass over the source: the flip is expressed by a
+ * negative frame pitch, so each output row is simply read from the
+ * appropriate source row.
+ *
+ * Cameras commonly deliver YUV rather than RGB: packed 4:2:2 as YUY2
+ * (Y0,U,Y1,V) or UYVY (U,Y0,V,Y1), and planar 4:2:0 as NV12 (a Y plane
+ * followed by interleaved U,V) or I420 (Y, U and V planes). These are
+ * converted using the BT.601 studio range coefficients in 6 bit fixed
+ * point, which keeps the arithmetic within 16 bit lanes. The packed and
+ * semi-planar layouts are first split into separate Y, U and V rows in a
+ * small buffer that stays in the L1 cache and the colour conversion
+ * itself then only has to handle planar input.
+ *
+ * The SIMD kernels to use are chosen once at package load from the
+ * features reported by the processor. Every kernel produces exactly the
+ * same output as the scalar code.
+ *
+ * Each output row depends only on its own source rows, so a large frame
+ * is converted in horizontal stripes on the worker pool (see
+ * VideoPoolStripes) and the conversion returns once all are done.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define VIDEO_X86 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#else
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif /* x86 */
+
+/*
+ * Number of pixels split from a packed row at a time. The split rows
+ * for one chunk occupy 3 kB.
+ */
+
+#define YUV_CHUNK 1024
+
+/*
+ * BT.601 studio range coefficients scaled by 64.
+ */
+
+#define YUV_YG   75     /* 1.164 */
+#define YUV_VR  102     /* 1.596 */
+#define YUV_UG   25     /* 0.391 */
+#define YUV_VG   52     /* 0.813 */
+#define YUV_UB  129     /* 2.018 */
+
+typedef void (RowConvertProc)(const unsigned char *srcPtr, unsigned char *dstPtr, int width);
+typedef void (SplitProc)(const unsigned char *srcPtr, unsigned char *evenPtr,
+                         unsigned char *oddPtr, int count);
+typedef void (YuvRowProc)(const unsigned char *yPtr, const unsigned char *uPtr,
+                          const unsigned char *vPtr, unsigned char *dstPtr,
+                          int width, int rgba);
+
+static RowConvertProc BgraToRgbaScalar;
+static RowConvertProc BgrToRgbaScalar;
+static RowConvertProc BgrToBgraScalar;
+static SplitProc SplitScalar;
+static YuvRowProc YuvRowScalar;
+#ifdef VIDEO_X86
+static RowConvertProc BgraToRgbaSSE2;
+static RowConvertProc BgraToRgbaAVX2;
+static SplitProc SplitSSE2;
+static SplitProc SplitSSSE3;
+static SplitProc SplitAVX2;
+static YuvRowProc YuvRowSSE2;
+static YuvRowProc YuvRowAVX2;
+#endif
+
+typedef struct {
+    const VideoFrame *framePtr;
+    unsigned char *dstPtr;      /* the first output row */
+    int dstPitch;
+    int rgba;                   /* R,G,B,A rather than B,G,R,A */
+} ConvertJob;
+
+static VideoStripeProc ConvertStripe;
+static void ConvertYuvRows(const VideoFrame *framePtr, unsigned char *dstPtr,
+                           int dstPitch, int first, int last, int rgba);
+
+static RowConvertProc *bgraToRgbaProc = BgraToRgbaScalar;
+static SplitProc *splitProc = SplitScalar;
+static YuvRowProc *yuvRowProc = YuvRowScalar;
+static const char *kernelName = "scalar";
+
+/**
+ * Query the processor for the SIMD instruction sets that the kernels in
+ * this package can use.
+ *
+ * @return a mask of VIDEO_CPU_* flags.
+ */
+
+int
+VideoCpuFeatures(void)
+{
+    int features = 0;
+#if defined(VIDEO_X86) && defined(_MSC_VER)
+    int info[4], maxLeaf;
+
+    __cpuid(info, 0);
+    maxLeaf = info[0];
+    __cpuid(info, 1);
+    if (info[3] & (1 << 26))
+        features |= VIDEO_CPU_SSE2;
+    if (info[2] & (1 << 9))
+        features |= VIDEO_CPU_SSSE3;
+    /* AVX2 also needs the OS to save the YMM state (OSXSAVE + XCR0) */
+    if (maxLeaf >= 7 && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+            features |= VIDEO_CPU_AVX2;
+    }
+#elif defined(VIDEO_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        features |= VIDEO_CPU_SSE2;
+    if (__builtin_cpu_supports("ssse3"))
+        features |= VIDEO_CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        features |= VIDEO_CPU_AVX2;
+#endif
+    return features;
+}
+
+/**
+ * Select the conversion kernels. Called once from the package
+ * initialization with the result of VideoCpuFeatures. A reduced set of
+ * features may be passed to force a slower kernel for comparison.
+ */
+
+void
+VideoConvertInit(int features)
+{
+    bgraToRgbaProc = BgraToRgbaScalar;
+    splitProc = SplitScalar;
+    yuvRowProc = YuvRowScalar;
+    kernelName = "scalar";
+#ifdef VIDEO_X86
+    if (features & VIDEO_CPU_SSE2) {
+        bgraToRgbaProc = BgraToRgbaSSE2;
+        splitProc = SplitSSE2;
+        yuvRowProc = YuvRowSSE2;
+        kernelName = "sse2";
+    }
+    if ((features & VIDEO_CPU_SSE2) && (features & VIDEO_CPU_SSSE3)) {
+        splitProc = SplitSSSE3;
+        kernelName = "ssse3";
+    }
+    if (features & VIDEO_CPU_AVX2) {
+        bgraToRgbaProc = BgraToRgbaAVX2;
+        splitProc = SplitAVX2;
+        yuvRowProc = YuvRowAVX2;
+        kernelName = "avx2";
+    }
+#endif
+}
+
+/**
+ * @return the name of the instruction set used by the selected kernels.
+ */
+
+const char *
+VideoConvertKernel(void)
+{
+    return kernelName;
+}
+
+/**
+ * Describe a tightly packed frame buffer of the given format and size.
+ * For the planar formats the chroma planes follow the Y plane in the
+ * same buffer, as DirectShow and most camera drivers lay them out.
+ *
+ * @param framePtr [out] the frame description to fill in
+ * @param format [in] one of the VIDEO_FORMAT_* values
+ * @param width [in] frame width in pixels
+ * @param height [in] frame height in pixels
+ * @param data [in] the buffer, which may be NULL to only size it
+ *
+ * @return the number of bytes the frame occupies.
+ */
+
+size_t
+VideoFrameLayout(VideoFrame *framePtr, int format, int width, int height,
+                 unsigned char *data)
+{
+    const int chromaWidth = (width + 1) / 2;
+    const int chromaHeight = (height + 1) / 2;
+    size_t lumaSize, size;
+
+    framePtr->data = data;
+    framePtr->width = width;
+    framePtr->height = height;
+    framePtr->format = format;
+    framePtr->chroma[0] = framePtr->chroma[1] = NULL;
+    framePtr->chromaPitch = 0;
+
+    switch (format) {
+    case VIDEO_FORMAT_BGR24:
+        framePtr->pitch = (width * 3 + 3) & ~3;
+        size = (size_t)framePtr->pitch * height;
+        break;
+    case VIDEO_FORMAT_YUY2:
+    case VIDEO_FORMAT_UYVY:
+        framePtr->pitch = chromaWidth * 4;
+        size = (size_t)framePtr->pitch * height;
+        break;
+    case VIDEO_FORMAT_NV12:
+    case VIDEO_FORMAT_I420:
+        framePtr->pitch = width;
+        framePtr->chromaPitch = (format == VIDEO_FORMAT_NV12)
+            ? chromaWidth * 2 : chromaWidth;
+        lumaSize = (size_t)width * height;
+        size = lumaSize + (size_t)chromaWidth * chromaHeight * 2;
+        if (data != NULL) {
+            framePtr->chroma[0] = data + lumaSize;
+            if (format == VIDEO_FORMAT_I420) {
+                framePtr->chroma[1] = framePtr->chroma[0]
+                    + (size_t)chromaWidth * chromaHeight;
+            }
+        }
+        break;
+    default:
+        framePtr->pitch = width * 4;
+        size = (size_t)framePtr->pitch * height;
+        break;
+    }
+    return size;
+}
+
+/**
+ * Convert a frame into R,G,B,A rows with an opaque alpha channel. The
+ * source is read once. A frame with a negative pitch is stored bottom-up
+ * and is flipped as it is converted.
+ *
+ * @param framePtr [in] the frame to convert
+ * @param dstPtr [out] the first output row
+ * @param dstPitch [in] bytes between output rows
+ */
+
+void
+VideoConvertToRGBA(const VideoFrame *framePtr, unsigned char *dstPtr, int dstPitch)
+{
+    ConvertJob job;
+
+    job.framePtr = framePtr;
+    job.dstPtr = dstPtr;
+    job.dstPitch = dstPitch;
+    job.rgba = 1;
+    VideoPoolStripes(framePtr->height, (Tcl_WideInt)framePtr->width * framePtr->height,
+                     ConvertStripe, &job);
+}
+
+/**
+ * Convert a frame into B,G,R,A rows, the layout of the common 24 bit
+ * TrueColor visuals. As for VideoConvertToRGBA the source is read once
+ * and a negative pitch flips the image. The alpha byte is opaque except
+ * for BGRA frames, whose fourth byte is copied unchanged.
+ *
+ * @param framePtr [in] the frame to convert
+ * @param dstPtr [out] the first output row
+ * @param dstPitch [in] bytes between output rows
+ */
+
+void
+VideoConvertToBGRA(const VideoFrame *framePtr, unsigned char *dstPtr, int dstPitch)
+{
+    ConvertJob job;
+
+    job.framePtr = framePtr;
+    job.dstPtr = dstPtr;
+    job.dstPitch = dstPitch;
+    job.rgba = 0;
+    VideoPoolStripes(framePtr->height, (Tcl_WideInt)framePtr->width * framePtr->height,
+                     ConvertStripe, &job);
+}
+
+/*
+ * Convert the rows first to last - 1 of a frame.
+ */
+
+static void
+ConvertStripe(ClientData clientData, int lane, int first, int last)
+{
+    ConvertJob *jobPtr = (ConvertJob *)clientData;
+    const VideoFrame *framePtr = jobPtr->framePtr;
+    const unsigned char *srcPtr = framePtr->data + (ptrdiff_t)first * framePtr->pitch;
+    unsigned char *dstPtr = jobPtr->dstPtr + (ptrdiff_t)first * jobPtr->dstPitch;
+    RowConvertProc *rowProc;
+    int y;
+
+    if (framePtr->format >= VIDEO_FORMAT_YUY2) {
+        ConvertYuvRows(framePtr, dstPtr, jobPtr->dstPitch, first, last, jobPtr->rgba);
+        return;
+    }
+    if (framePtr->format == VIDEO_FORMAT_BGR24) {
+        rowProc = jobPtr->rgba ? BgrToRgbaScalar : BgrToBgraScalar;
+    } else {
+        rowProc = jobPtr->rgba ? bgraToRgbaProc : NULL;
+    }
+    for (y = first; y < last; ++y) {
+        if (rowProc != NULL) {
+            rowProc(srcPtr, dstPtr, framePtr->width);
+        } else {
+            memcpy(dstPtr, srcPtr, framePtr->width * 4);
+        }
+        srcPtr += framePtr->pitch;
+        dstPtr += jobPtr->dstPitch;
+    }
+}
+
+/*
+ * Convert rows first to last - 1 of one of the YUV formats. Planar rows
+ * go straight to the colour conversion; packed and semi-planar rows are
+ * split into planar rows one chunk at a time. A packed row is split
+ * twice: into Y and U,V and then the U,V row into U and V.
+ */
+
+static void
+ConvertYuvRows(const VideoFrame *framePtr, unsigned char *dstPtr, int dstPitch,
+               int first, int last, int rgba)
+{
+    unsigned char yRow[YUV_CHUNK], cRow[YUV_CHUNK];
+    unsigned char uRow[YUV_CHUNK / 2], vRow[YUV_CHUNK / 2];
+    const int width = framePtr->width;
+    int x, y;
+
+    for (y = first; y < last; ++y, dstPtr += dstPitch) {
+        const unsigned char *srcPtr = framePtr->data + (ptrdiff_t)y * framePtr->pitch;
+        const unsigned char *chromaPtr = NULL;
+
+        if (framePtr->chroma[0] != NULL) {
+            chromaPtr = framePtr->chroma[0]
+                + (ptrdiff_t)(y / 2) * framePtr->chromaPitch;
+        }
+        if (framePtr->format == VIDEO_FORMAT_I420) {
+            yuvRowProc(srcPtr, chromaPtr,
+                       framePtr->chroma[1] + (ptrdiff_t)(y / 2) * framePtr->chromaPitch,
+                       dstPtr, width, rgba);
+            continue;
+        }
+        for (x = 0; x < width; x += YUV_CHUNK) {
+            const int n = (width - x < YUV_CHUNK) ? width - x : YUV_CHUNK;
+            const int pairs = (n + 1) & ~1;
+
+            switch (framePtr->format) {
+            case VIDEO_FORMAT_NV12:
+                splitProc(chromaPtr + x, uRow, vRow, pairs / 2);
+                yuvRowProc(srcPtr + x, uRow, vRow, dstPtr + x * 4, n, rgba);
+                break;
+            case VIDEO_FORMAT_YUY2:
+                splitProc(srcPtr + x * 2, yRow, cRow, pairs);
+                splitProc(cRow, uRow, vRow, pairs / 2);
+                yuvRowProc(yRow, uRow, vRow, dstPtr + x * 4, n, rgba);
+                break;
+            case VIDEO_FORMAT_UYVY:
+                splitProc(srcPtr + x * 2, cRow, yRow, pairs);
+                splitProc(cRow, uRow, vRow, pairs / 2);
+                yuvRowProc(yRow, uRow, vRow, dstPtr + x * 4, n, rgba);
+                break;
+            }
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+BgraToRgbaScalar(const unsigned char *srcPtr, unsigned char *dstPtr, int width)
+{
+    int x;
+    for (x = 0; x < width; ++x, srcPtr += 4, dstPtr += 4) {
+        dstPtr[0] = srcPtr[2];
+        dstPtr[1] = srcPtr[1];
+        dstPtr[2] = srcPtr[0];
+        dstPtr[3] = 0xff;
+    }
+}
+
+static void
+BgrToRgbaScalar(const unsigned char *srcPtr, unsigned char *dstPtr, int width)
+{
+    int x;
+    for (x = 0; x < width; ++x, srcPtr += 3, dstPtr += 4) {
+        dstPtr[0] = srcPtr[2];
+        dstPtr[1] = srcPtr[1];
+        dstPtr[2] = srcPtr[0];
+        dstPtr[3] = 0xff;
+    }
+}
+
+static void
+BgrToBgraScalar(const unsigned char *srcPtr, unsigned char *dstPtr, int width)
+{
+    int x;
+    for (x = 0; x < width; ++x, srcPtr += 3, dstPtr += 4) {
+        dstPtr[0] = srcPtr[0];
+        dstPtr[1] = srcPtr[1];
+        dstPtr[2] = srcPtr[2];
+        dstPtr[3] = 0xff;
+    }
+}
+
+static void
+SplitScalar(const unsigned char *srcPtr, unsigned char *evenPtr,
+            unsigned char *oddPtr, int count)
+{
+    int n;
+    for (n = 0; n < count; ++n, srcPtr += 2) {
+        evenPtr[n] = srcPtr[0];
+        oddPtr[n] = srcPtr[1];
+    }
+}
+
+/*
+ * The scalar colour conversion mirrors the 16 bit SIMD arithmetic,
+ * including the one sum that can saturate, so all kernels agree.
+ */
+
+static unsigned char
+ClampPixel(int v)
+{
+    v = (v > 32767 ? 32767 : v) >> 6;
+    v &= ~(v >> 31);                    /* negative to 0 */
+    return (unsigned char)(v | ((255 - v) >> 31));  /* over 255 to 255 */
+}
+
+static void
+YuvRowScalar(const unsigned char *yPtr, const unsigned char *uPtr,
+             const unsigned char *vPtr, unsigned char *dstPtr, int width, int rgba)
+{
+    const int ri = rgba ? 0 : 2, bi = rgba ? 2 : 0;
+    int x;
+
+    for (x = 0; x < width; x += 2) {
+        const int u = uPtr[x / 2] - 128, v = vPtr[x / 2] - 128;
+        const int r = v * YUV_VR, g = -u * YUV_UG - v * YUV_VG, b = u * YUV_UB;
+        int n;
+
+        for (n = x; n < x + 2 && n < width; ++n, dstPtr += 4) {
+            const int c = (yPtr[n] - 16) * YUV_YG + 32;
+            dstPtr[ri] = ClampPixel(c + r);
+            dstPtr[1] = ClampPixel(c + g);
+            dstPtr[bi] = ClampPixel(c + b);
+            dstPtr[3] = 0xff;
+        }
+    }
+}
+
+#ifdef VIDEO_X86
+
+/*
+ * SSE2 has no byte shuffle so the red and blue bytes are exchanged with
+ * 32 bit shifts of the masked pixels: (B | R << 16) becomes (R | B << 16).
+ */
+
+static void
+BgraToRgbaSSE2(const unsigned char *srcPtr, unsigned char *dstPtr, int width)
+{
+    const __m128i maskRB = _mm_set1_epi32(0x00ff00ff);
+    const __m128i maskG = _mm_set1_epi32(0x0000ff00);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    int x = 0;
+
+    for ( ; x + 4 <= width; x += 4, srcPtr += 16, dstPtr += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)srcPtr);
+        __m128i rb = _mm_and_si128(v, maskRB);
+        __m128i g = _mm_and_si128(v, maskG);
+        rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+        _mm_storeu_si128((__m128i *)dstPtr, _mm_or_si128(_mm_or_si128(rb, g), alpha));
+    }
+    BgraToRgbaScalar(srcPtr, dstPtr, width - x);
+}
+
+TARGET_AVX2 static void
+BgraToRgbaAVX2(const unsigned char *srcPtr, unsigned char *dstPtr, int width)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    int x = 0;
+
+    for ( ; x + 16 <= width; x += 16, srcPtr += 64, dstPtr += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)srcPtr);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(srcPtr + 32));
+        a = _mm256_or_si256(_mm256_shuffle_epi8(a, shuffle), alpha);
+        b = _mm256_or_si256(_mm256_shuffle_epi8(b, shuffle), alpha);
+        _mm256_storeu_si256((__m256i *)dstPtr, a);
+        _mm256_storeu_si256((__m256i *)(dstPtr + 32), b);
+    }
+    for ( ; x + 8 <= width; x += 8, srcPtr += 32, dstPtr += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)srcPtr);
+        a = _mm256_or_si256(_mm256_shuffle_epi8(a, shuffle), alpha);
+        _mm256_storeu_si256((__m256i *)dstPtr, a);
+    }
+    BgraToRgbaScalar(srcPtr, dstPtr, width - x);
+}
+
+/*
+ * Splitting byte pairs: SSE2 masks and shifts each 16 bit lane and packs
+ * the results, SSSE3 and AVX2 gather the even and odd bytes with a
+ * shuffle. The AVX2 shuffle works within 128 bit lanes, so the 64 bit
+ * halves are put back in order with a permute.
+ */
+
+static void
+SplitSSE2(const unsigned char *srcPtr, unsigned char *evenPtr,
+          unsigned char *oddPtr, int count)
+{
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int n = 0;
+
+    for ( ; n + 16 <= count; n += 16, srcPtr += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)srcPtr);
+        __m128i b = _mm_loadu_si128((const __m128i *)(srcPtr + 16));
+        _mm_storeu_si128((__m128i *)(evenPtr + n), _mm_packus_epi16(
+                             _mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i *)(oddPtr + n), _mm_packus_epi16(
+                             _mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    SplitScalar(srcPtr, evenPtr + n, oddPtr + n, count - n);
+}
+
+TARGET_SSSE3 static void
+SplitSSSE3(const unsigned char *srcPtr, unsigned char *evenPtr,
+           unsigned char *oddPtr, int count)
+{
+    const __m128i shuffle = _mm_setr_epi8(
+        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int n = 0;
+
+    for ( ; n + 16 <= count; n += 16, srcPtr += 32) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)srcPtr), shuffle);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(srcPtr + 16)), shuffle);
+        _mm_storeu_si128((__m128i *)(evenPtr + n), _mm_unpacklo_epi64(a, b));
+        _mm_storeu_si128((__m128i *)(oddPtr + n), _mm_unpackhi_epi64(a, b));
+    }
+    SplitScalar(srcPtr, evenPtr + n, oddPtr + n, count - n);
+}
+
+TARGET_AVX2 static void
+SplitAVX2(const unsigned char *srcPtr, unsigned char *evenPtr,
+          unsigned char *oddPtr, int count)
+{
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int n = 0;
+
+    for ( ; n + 32 <= count; n += 32, srcPtr += 64) {
+        __m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)srcPtr), shuffle);
+        __m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(srcPtr + 32)), shuffle);
+        _mm256_storeu_si256((__m256i *)(evenPtr + n), _mm256_permute4x64_epi64(
+                                _mm256_unpacklo_epi64(a, b), 0xd8));
+        _mm256_storeu_si256((__m256i *)(oddPtr + n), _mm256_permute4x64_epi64(
+                                _mm256_unpackhi_epi64(a, b), 0xd8));
+    }
+    SplitScalar(srcPtr, evenPtr + n, oddPtr + n, count - n);
+}
+
+/*
+ * Colour conversion of 16 bit lanes holding Y, and U and V already
+ * duplicated for each pixel pair. The results are left as 16 bit values
+ * scaled by 64 for the caller to shift and pack.
+ */
+
+static void
+YuvPixelsSSE2(__m128i y, __m128i u, __m128i v, __m128i *bPtr, __m128i *gPtr, __m128i *rPtr)
+{
+    const __m128i c = _mm_add_epi16(_mm_mullo_epi16(
+        _mm_sub_epi16(y, _mm_set1_epi16(16)), _mm_set1_epi16(YUV_YG)), _mm_set1_epi16(32));
+
+    u = _mm_sub_epi16(u, _mm_set1_epi16(128));
+    v = _mm_sub_epi16(v, _mm_set1_epi16(128));
+    *rPtr = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(v, _mm_set1_epi16(YUV_VR))), 6);
+    *gPtr = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(
+        c, _mm_mullo_epi16(u, _mm_set1_epi16(YUV_UG))),
+        _mm_mullo_epi16(v, _mm_set1_epi16(YUV_VG))), 6);
+    *bPtr = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(u, _mm_set1_epi16(YUV_UB))), 6);
+}
+
+/*
+ * Interleave 16 pixels of packed B, G and R bytes (or R, G and B) with
+ * an opaque alpha and store them.
+ */
+
+static void
+StorePixelsSSE2(unsigned char *dstPtr, __m128i b, __m128i g, __m128i r)
+{
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
+    __m128i bg = _mm_unpacklo_epi8(b, g), ra = _mm_unpacklo_epi8(r, alpha);
+
+    _mm_storeu_si128((__m128i *)dstPtr, _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128((__m128i *)(dstPtr + 16), _mm_unpackhi_epi16(bg, ra));
+    bg = _mm_unpackhi_epi8(b, g);
+    ra = _mm_unpackhi_epi8(r, alpha);
+    _mm_storeu_si128((__m128i *)(dstPtr + 32), _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128((__m128i *)(dstPtr + 48), _mm_unpackhi_epi16(bg, ra));
+}
+
+static void
+YuvRowSSE2(const unsigned char *yPtr, const unsigned char *uPtr,
+           const unsigned char *vPtr, unsigned char *dstPtr, int width, int rgba)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for ( ; x + 16 <= width; x += 16, dstPtr += 64) {
+        __m128i y = _mm_loadu_si128((const __m128i *)(yPtr + x));
+        __m128i u = _mm_loadl_epi64((const __m128i *)(uPtr + x / 2));
+        __m128i v = _mm_loadl_epi64((const __m128i *)(vPtr + x / 2));
+        __m128i b0, g0, r0, b1, g1, r1;
+
+        u = _mm_unpacklo_epi8(u, u);
+        v = _mm_unpacklo_epi8(v, v);
+        YuvPixelsSSE2(_mm_unpacklo_epi8(y, zero), _mm_unpacklo_epi8(u, zero),
+                      _mm_unpacklo_epi8(v, zero), &b0, &g0, &r0);
+        YuvPixelsSSE2(_mm_unpackhi_epi8(y, zero), _mm_unpackhi_epi8(u, zero),
+                      _mm_unpackhi_epi8(v, zero), &b1, &g1, &r1);
+        b0 = _mm_packus_epi16(b0, b1);
+        g0 = _mm_packus_epi16(g0, g1);
+        r0 = _mm_packus_epi16(r0, r1);
+        if (rgba) {
+            StorePixelsSSE2(dstPtr, r0, g0, b0);
+        } else {
+            StorePixelsSSE2(dstPtr, b0, g0, r0);
+        }
+    }
+    YuvRowScalar(yPtr + x, uPtr + x / 2, vPtr + x / 2, dstPtr, width - x, rgba);
+}
+
+TARGET_AVX2 static void
+YuvPixelsAVX2(__m256i y, __m256i u, __m256i v, __m256i *bPtr, __m256i *gPtr, __m256i *rPtr)
+{
+    const __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(
+        _mm256_sub_epi16(y, _mm256_set1_epi16(16)), _mm256_set1_epi16(YUV_YG)),
+        _mm256_set1_epi16(32));
+
+    u = _mm256_sub_epi16(u, _mm256_set1_epi16(128));
+    v = _mm256_sub_epi16(v, _mm256_set1_epi16(128));
+    *rPtr = _mm256_srai_epi16(_mm256_adds_epi16(
+        c, _mm256_mullo_epi16(v, _mm256_set1_epi16(YUV_VR))), 6);
+    *gPtr = _mm256_srai_epi16(_mm256_sub_epi16(_mm256_sub_epi16(
+        c, _mm256_mullo_epi16(u, _mm256_set1_epi16(YUV_UG))),
+        _mm256_mullo_epi16(v, _mm256_set1_epi16(YUV_VG))), 6);
+    *bPtr = _mm256_srai_epi16(_mm256_adds_epi16(
+        c, _mm256_mullo_epi16(u, _mm256_set1_epi16(YUV_UB))), 6);
+}
+
+/*
+ * The 256 bit pack and unpack instructions work within 128 bit lanes.
+ * After packing, a permute restores pixel order in each channel; after
+ * interleaving, each register holds pixels n..n+3 and n+16..n+19 and the
+ * final 128 bit permutes gather them into runs of eight.
+ */
+
+TARGET_AVX2 static void
+StorePixelsAVX2(unsigned char *dstPtr, __m256i b, __m256i g, __m256i r)
+{
+    const __m256i alpha = _mm256_set1_epi8((char)0xff);
+    __m256i bgLo = _mm256_unpacklo_epi8(b, g), bgHi = _mm256_unpackhi_epi8(b, g);
+    __m256i raLo = _mm256_unpacklo_epi8(r, alpha), raHi = _mm256_unpackhi_epi8(r, alpha);
+    __m256i p0 = _mm256_unpacklo_epi16(bgLo, raLo), p1 = _mm256_unpackhi_epi16(bgLo, raLo);
+    __m256i p2 = _mm256_unpacklo_epi16(bgHi, raHi), p3 = _mm256_unpackhi_epi16(bgHi, raHi);
+
+    _mm256_storeu_si256((__m256i *)dstPtr, _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256((__m256i *)(dstPtr + 32), _mm256_permute2x128_si256(p2, p3, 0x20));
+    _mm256_storeu_si256((__m256i *)(dstPtr + 64), _mm256_permute2x128_si256(p0, p1, 0x31));
+    _mm256_storeu_si256((__m256i *)(dstPtr + 96), _mm256_permute2x128_si256(p2, p3, 0x31));
+}
+
+TARGET_AVX2 static void
+YuvRowAVX2(const unsigned char *yPtr, const unsigned char *uPtr,
+           const unsigned char *vPtr, unsigned char *dstPtr, int width, int rgba)
+{
+    int x = 0;
+
+    for ( ; x + 32 <= width; x += 32, dstPtr += 128) {
+        __m128i y0 = _mm_loadu_si128((const __m128i *)(yPtr + x));
+        __m128i y1 = _mm_loadu_si128((const __m128i *)(yPtr + x + 16));
+        __m128i u = _mm_loadu_si128((const __m128i *)(uPtr + x / 2));
+        __m128i v = _mm_loadu_si128((const __m128i *)(vPtr + x / 2));
+        __m256i b0, g0, r0, b1, g1, r1;
+
+        YuvPixelsAVX2(_mm256_cvtepu8_epi16(y0),
+                      _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(u, u)),
+                      _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(v, v)), &b0, &g0, &r0);
+        YuvPixelsAVX2(_mm256_cvtepu8_epi16(y1),
+                      _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(u, u)),
+                      _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(v, v)), &b1, &g1, &r1);
+        b0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(b0, b1), 0xd8);
+        g0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(g0, g1), 0xd8);
+        r0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(r0, r1), 0xd8);
+        if (rgba) {
+            StorePixelsAVX2(dstPtr, r0, g0, b0);
+        } else {
+            StorePixelsAVX2(dstPtr, b0, g0, r0);
+        }
+    }
+    YuvRowSSE2(yPtr + x, uPtr + x / 2, vPtr + x / 2, dstPtr, width - x, rgba);
+}
+
+#endif /* VIDEO_X86 */
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
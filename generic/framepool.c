@@ -0,0 +1,305 @@
+/* framepool.c - recycled, aligned frame buffers for each source
+ *
+ * Each source has a pool of the frame sized buffers made for it: the
+ * slots of its frame ring and the buffers its consumers make for every
+ * frame, such as the compressed parts sent by the stream server. A
+ * buffer given back to the pool is kept on a free list for its size
+ * class and handed out again, so that once the pipeline has warmed up a
+ * frame passes through it without a call to the heap. The pool counts
+ * the buffers it hands out from the lists as hits and those it must
+ * allocate as misses, and the stats command reports both.
+ *
+ * Sizes are rounded up to classes a quarter of a power of two apart,
+ * above a smallest class of 4KB, so buffers whose sizes vary from frame
+ * to frame, as compressed frames do, mostly fall in a few classes and
+ * no more than a fifth of a buffer is ever wasted. Only a few free
+ * buffers are kept of each class.
+ *
+ * Every buffer starts on a 64 byte boundary, the cache line size and
+ * the widest SIMD load, with the header that records its class and pool
+ * just before it. Buffers of 4MB and more, such as the slots for 4K
+ * frames, are aligned to 2MB and on Linux the kernel is asked to back
+ * them with transparent huge pages, which saves the TLB misses of
+ * walking a frame through thousands of 4KB pages.
+ *
+ * The pool is reference counted by its owner, the ring, and by every
+ * buffer handed out, so a buffer may be given back after the source has
+ * closed. Once the owner has released the pool its free buffers are
+ * freed and buffers given back are freed at once.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stddef.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#define FRAMEPOOL_ALIGN      64         /* alignment of every buffer */
+#define FRAMEPOOL_MIN_BITS   12         /* the smallest class is 4KB */
+#define FRAMEPOOL_MAX_BITS   30         /* buffers over 1GB are not kept */
+#define FRAMEPOOL_CLASSES    (4 * (FRAMEPOOL_MAX_BITS - FRAMEPOOL_MIN_BITS + 2))
+#define FRAMEPOOL_KEEP       8          /* free buffers kept of each class */
+#define FRAMEPOOL_HUGE       (4 << 20)  /* buffers given huge pages */
+#define FRAMEPOOL_HUGE_ALIGN (2 << 20)  /* the huge page size */
+
+typedef struct FrameHeader {
+    VideoFramePool *poolPtr;
+    struct FrameHeader *nextPtr;    /* on a free list */
+    char *block;                    /* as allocated */
+    int sizeClass;                  /* or -1 if not kept */
+} FrameHeader;
+
+struct VideoFramePool {
+    Tcl_Mutex lock;                 /* protects all the fields below */
+    int refCount;                   /* the owner plus each buffer handed out */
+    int closed;                     /* the owner has released the pool */
+    FrameHeader *freeList[FRAMEPOOL_CLASSES];
+    int freeCount[FRAMEPOOL_CLASSES];
+    Tcl_WideInt hits;
+    Tcl_WideInt misses;
+};
+
+/*
+ * The class of a buffer of the given size and the size of buffers in
+ * it. A size n with 2^b < n <= 2^(b+1) falls in one of the four classes
+ * 2^b + k * 2^(b-2).
+ *
+ * Returns -1 for sizes too large to keep.
+ */
+
+static int
+FrameClass(size_t size, size_t *classSizePtr)
+{
+    size_t step;
+    int bits = FRAMEPOOL_MIN_BITS - 1, k;
+
+    if (size < ((size_t)1 << FRAMEPOOL_MIN_BITS)) {
+        size = (size_t)1 << FRAMEPOOL_MIN_BITS;
+    }
+    while (((size - 1) >> (bits + 1)) != 0) {
+        if (++bits >= FRAMEPOOL_MAX_BITS) {
+            *classSizePtr = size;
+            return -1;
+        }
+    }
+    step = (size_t)1 << (bits - 2);
+    k = (int)((size - ((size_t)1 << bits) + step - 1) / step);
+    *classSizePtr = ((size_t)1 << bits) + k * step;
+    return (bits - (FRAMEPOOL_MIN_BITS - 1)) * 4 + k - 1;
+}
+
+/*
+ * Allocate a buffer of the given size from the heap.
+ *
+ * Returns its header, or NULL if there is not enough memory.
+ */
+
+static FrameHeader *
+FrameAllocate(size_t size)
+{
+    size_t align = (size >= FRAMEPOOL_HUGE) ? FRAMEPOOL_HUGE_ALIGN : FRAMEPOOL_ALIGN;
+    char *block, *data;
+    FrameHeader *hdrPtr;
+
+    block = attemptckalloc(size + sizeof(FrameHeader) + align - 1);
+    if (block == NULL) {
+        return NULL;
+    }
+    data = (char *)(((size_t)block + sizeof(FrameHeader) + align - 1) & ~(align - 1));
+#if defined(MADV_HUGEPAGE)
+    if (size >= FRAMEPOOL_HUGE) {
+        madvise(data, size & ~((size_t)FRAMEPOOL_HUGE_ALIGN - 1), MADV_HUGEPAGE);
+    }
+#endif
+    hdrPtr = (FrameHeader *)data - 1;
+    hdrPtr->block = block;
+    return hdrPtr;
+}
+
+/*
+ * Drop a reference to the pool, freeing it with the last.
+ */
+
+static void
+FramePoolDrop(VideoFramePool *poolPtr)
+{
+    int last;
+
+    Tcl_MutexLock(&poolPtr->lock);
+    last = (--poolPtr->refCount == 0);
+    Tcl_MutexUnlock(&poolPtr->lock);
+    if (last) {
+        Tcl_MutexFinalize(&poolPtr->lock);
+        ckfree((char *)poolPtr);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * Create an empty pool. It is freed once VideoFramePoolRelease has been
+ * called and every buffer has been given back.
+ *
+ * @return the pool, or NULL if it could not be allocated.
+ */
+
+VideoFramePool *
+VideoFramePoolCreate(void)
+{
+    VideoFramePool *poolPtr;
+
+    poolPtr = (VideoFramePool *)attemptckalloc(sizeof(VideoFramePool));
+    if (poolPtr != NULL) {
+        memset(poolPtr, 0, sizeof(VideoFramePool));
+        poolPtr->refCount = 1;
+    }
+    return poolPtr;
+}
+
+/**
+ * Give up the owner's reference to a pool. The free buffers are freed
+ * now and those still handed out when they are given back.
+ */
+
+void
+VideoFramePoolRelease(VideoFramePool *poolPtr)
+{
+    FrameHeader *freeList = NULL;
+    int n;
+
+    Tcl_MutexLock(&poolPtr->lock);
+    poolPtr->closed = 1;
+    for (n = 0; n < FRAMEPOOL_CLASSES; ++n) {
+        while (poolPtr->freeList[n] != NULL) {
+            FrameHeader *hdrPtr = poolPtr->freeList[n];
+            poolPtr->freeList[n] = hdrPtr->nextPtr;
+            hdrPtr->nextPtr = freeList;
+            freeList = hdrPtr;
+        }
+        poolPtr->freeCount[n] = 0;
+    }
+    Tcl_MutexUnlock(&poolPtr->lock);
+
+    while (freeList != NULL) {
+        FrameHeader *hdrPtr = freeList;
+        freeList = hdrPtr->nextPtr;
+        ckfree(hdrPtr->block);
+    }
+    FramePoolDrop(poolPtr);
+}
+
+/**
+ * Take a buffer of at least size bytes, aligned to 64 bytes, from the
+ * pool. May be called on any thread.
+ *
+ * @return the buffer, or NULL if there is not enough memory.
+ */
+
+void *
+VideoFramePoolAlloc(VideoFramePool *poolPtr, size_t size)
+{
+    FrameHeader *hdrPtr = NULL;
+    size_t classSize;
+    int sizeClass = FrameClass(size, &classSize);
+
+    Tcl_MutexLock(&poolPtr->lock);
+    if (sizeClass >= 0 && poolPtr->freeList[sizeClass] != NULL) {
+        hdrPtr = poolPtr->freeList[sizeClass];
+        poolPtr->freeList[sizeClass] = hdrPtr->nextPtr;
+        --poolPtr->freeCount[sizeClass];
+        ++poolPtr->hits;
+    } else {
+        ++poolPtr->misses;
+    }
+    ++poolPtr->refCount;
+    Tcl_MutexUnlock(&poolPtr->lock);
+
+    if (hdrPtr == NULL) {
+        hdrPtr = FrameAllocate(classSize);
+        if (hdrPtr == NULL) {
+            FramePoolDrop(poolPtr);
+            return NULL;
+        }
+        hdrPtr->poolPtr = poolPtr;
+        hdrPtr->sizeClass = sizeClass;
+    }
+    hdrPtr->nextPtr = NULL;
+    return hdrPtr + 1;
+}
+
+/*
+ * Give a buffer back to its pool, keeping it on the free list if keep is
+ * set and there is room, and otherwise freeing it.
+ */
+
+static void
+FramePoolPut(void *buffer, int keep)
+{
+    FrameHeader *hdrPtr = (FrameHeader *)buffer - 1;
+    VideoFramePool *poolPtr = hdrPtr->poolPtr;
+    int sizeClass = hdrPtr->sizeClass;
+
+    Tcl_MutexLock(&poolPtr->lock);
+    if (keep && sizeClass >= 0 && !poolPtr->closed
+        && poolPtr->freeCount[sizeClass] < FRAMEPOOL_KEEP) {
+        hdrPtr->nextPtr = poolPtr->freeList[sizeClass];
+        poolPtr->freeList[sizeClass] = hdrPtr;
+        ++poolPtr->freeCount[sizeClass];
+        hdrPtr = NULL;
+    }
+    Tcl_MutexUnlock(&poolPtr->lock);
+    if (hdrPtr != NULL) {
+        ckfree(hdrPtr->block);
+    }
+    FramePoolDrop(poolPtr);
+}
+
+/**
+ * Give a buffer from VideoFramePoolAlloc back to its pool. May be called
+ * on any thread, and after the owner has released the pool.
+ */
+
+void
+VideoFramePoolFree(void *buffer)
+{
+    FramePoolPut(buffer, 1);
+}
+
+/**
+ * Free a buffer from VideoFramePoolAlloc rather than keep it, for one
+ * that is not expected to be needed again, such as a ring slot that is
+ * no longer reserved.
+ */
+
+void
+VideoFramePoolDiscard(void *buffer)
+{
+    FramePoolPut(buffer, 0);
+}
+
+/**
+ * Read the numbers of buffers handed out from the free lists and made
+ * afresh since the pool was created.
+ */
+
+void
+VideoFramePoolCounts(VideoFramePool *poolPtr, Tcl_WideInt *hitsPtr,
+                     Tcl_WideInt *missesPtr)
+{
+    Tcl_MutexLock(&poolPtr->lock);
+    *hitsPtr = poolPtr->hits;
+    *missesPtr = poolPtr->misses;
+    Tcl_MutexUnlock(&poolPtr->lock);
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,304 @@
+/* jpeg.c - JPEG encoding of video frames
+ *
+ * Frames are compressed with libjpeg, which for libjpeg-turbo uses SIMD
+ * colour conversion, downsampling and DCT. An encoder is created once
+ * for each thread that compresses frames and reused for every frame:
+ * the compressor state, the RGBA staging buffer and the output buffer
+ * are kept between calls so that encoding a stream does not allocate.
+ *
+ * The frame is converted to RGBA with the same kernels used for display
+ * and passed to libjpeg directly as R,G,B,X when the library supports
+ * the libjpeg-turbo colour space extensions. Other builds of libjpeg
+ * are given each row packed as R,G,B.
+ *
+ * libjpeg reports errors by calling an error handler that must not
+ * return. The handler here records the message and jumps back to the
+ * encode call, which abandons the image and leaves the encoder ready
+ * for the next one.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+
+#ifdef HAVE_JPEG
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#define OUTPUT_CHUNK  65536
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmpbuf;
+} JpegError;
+
+struct VideoJpeg {
+    struct jpeg_compress_struct cinfo;
+    JpegError error;
+    struct jpeg_destination_mgr dest;
+    unsigned char *output;      /* compressed image */
+    size_t outputSize;          /* allocated size of output */
+    unsigned char *stage;       /* frame converted to RGBA */
+    size_t stageSize;
+#ifndef JCS_EXTENSIONS
+    unsigned char *row;         /* one row packed as R,G,B */
+    size_t rowSize;
+#endif
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void
+JpegErrorExit(j_common_ptr cinfo)
+{
+    JpegError *errorPtr = (JpegError *)cinfo->err;
+    longjmp(errorPtr->jmpbuf, 1);
+}
+
+static void
+JpegOutputMessage(j_common_ptr cinfo)
+{
+    /* warnings are not reported */
+}
+
+/*
+ * The destination manager compresses into the encoder's output buffer,
+ * growing it as required. The buffer is kept for the next image.
+ */
+
+static void
+JpegInitDestination(j_compress_ptr cinfo)
+{
+    VideoJpeg *jpegPtr = (VideoJpeg *)cinfo->client_data;
+    jpegPtr->dest.next_output_byte = jpegPtr->output;
+    jpegPtr->dest.free_in_buffer = jpegPtr->outputSize;
+}
+
+static boolean
+JpegEmptyOutputBuffer(j_compress_ptr cinfo)
+{
+    VideoJpeg *jpegPtr = (VideoJpeg *)cinfo->client_data;
+    size_t used = jpegPtr->outputSize;
+    size_t size = jpegPtr->outputSize * 2 + OUTPUT_CHUNK;
+    unsigned char *newPtr = (unsigned char *)
+        attemptckrealloc((char *)jpegPtr->output, size);
+
+    if (newPtr == NULL) {
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    }
+    jpegPtr->output = newPtr;
+    jpegPtr->outputSize = size;
+    jpegPtr->dest.next_output_byte = newPtr + used;
+    jpegPtr->dest.free_in_buffer = size - used;
+    return TRUE;
+}
+
+static void
+JpegTermDestination(j_compress_ptr cinfo)
+{
+}
+
+/**
+ * Create an encoder. It may be used on any one thread at a time.
+ *
+ * @return the encoder.
+ */
+
+VideoJpeg *
+VideoJpegCreate(void)
+{
+    VideoJpeg *jpegPtr = (VideoJpeg *)ckalloc(sizeof(VideoJpeg));
+
+    memset(jpegPtr, 0, sizeof(VideoJpeg));
+    jpegPtr->cinfo.err = jpeg_std_error(&jpegPtr->error.pub);
+    jpegPtr->error.pub.error_exit = JpegErrorExit;
+    jpegPtr->error.pub.output_message = JpegOutputMessage;
+    jpeg_create_compress(&jpegPtr->cinfo);
+    jpegPtr->cinfo.client_data = jpegPtr;
+    jpegPtr->dest.init_destination = JpegInitDestination;
+    jpegPtr->dest.empty_output_buffer = JpegEmptyOutputBuffer;
+    jpegPtr->dest.term_destination = JpegTermDestination;
+    jpegPtr->cinfo.dest = &jpegPtr->dest;
+    return jpegPtr;
+}
+
+void
+VideoJpegDestroy(VideoJpeg *jpegPtr)
+{
+    jpeg_destroy_compress(&jpegPtr->cinfo);
+    if (jpegPtr->output != NULL)
+        ckfree((char *)jpegPtr->output);
+    if (jpegPtr->stage != NULL)
+        ckfree((char *)jpegPtr->stage);
+#ifndef JCS_EXTENSIONS
+    if (jpegPtr->row != NULL)
+        ckfree((char *)jpegPtr->row);
+#endif
+    ckfree((char *)jpegPtr);
+}
+
+/*
+ * Make sure a kept buffer holds at least size bytes.
+ */
+
+static int
+Reserve(unsigned char **bufferPtr, size_t *sizePtr, size_t size)
+{
+    if (size > *sizePtr) {
+        unsigned char *newPtr = (unsigned char *)attemptckrealloc((char *)*bufferPtr, size);
+        if (newPtr == NULL) {
+            return TCL_ERROR;
+        }
+        *bufferPtr = newPtr;
+        *sizePtr = size;
+    }
+    return TCL_OK;
+}
+
+/**
+ * Compress an R,G,B,A image. The result remains valid until the encoder
+ * is next used or destroyed.
+ *
+ * @param quality [in] the libjpeg quality, from 1 to 100
+ * @param dataPtr [out] set to the compressed image
+ * @param sizePtr [out] set to its size in bytes
+ *
+ * @return TCL_OK, or TCL_ERROR in which case VideoJpegError describes
+ *  the problem.
+ */
+
+int
+VideoJpegEncodeRGBA(VideoJpeg *jpegPtr, const unsigned char *rgbaPtr, int width, int height,
+                    int pitch, int quality, const unsigned char **dataPtr, size_t *sizePtr)
+{
+    j_compress_ptr cinfo = &jpegPtr->cinfo;
+
+    if (jpegPtr->output == NULL
+        && Reserve(&jpegPtr->output, &jpegPtr->outputSize, OUTPUT_CHUNK) != TCL_OK) {
+        strcpy(jpegPtr->message, "out of memory");
+        return TCL_ERROR;
+    }
+#ifndef JCS_EXTENSIONS
+    if (Reserve(&jpegPtr->row, &jpegPtr->rowSize, (size_t)width * 3) != TCL_OK) {
+        strcpy(jpegPtr->message, "out of memory");
+        return TCL_ERROR;
+    }
+#endif
+    if (setjmp(jpegPtr->error.jmpbuf)) {
+        cinfo->err->format_message((j_common_ptr)cinfo, jpegPtr->message);
+        jpeg_abort_compress(cinfo);
+        return TCL_ERROR;
+    }
+
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+#ifdef JCS_EXTENSIONS
+    cinfo->input_components = 4;
+    cinfo->in_color_space = JCS_EXT_RGBX;
+#else
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+#endif
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+    jpeg_start_compress(cinfo, TRUE);
+    while (cinfo->next_scanline < cinfo->image_height) {
+        const unsigned char *srcPtr = rgbaPtr + (size_t)cinfo->next_scanline * pitch;
+        JSAMPROW row;
+#ifdef JCS_EXTENSIONS
+        row = (JSAMPROW)srcPtr;
+#else
+        unsigned char *dstPtr = jpegPtr->row;
+        int x;
+        for (x = 0; x < width; ++x, srcPtr += 4, dstPtr += 3) {
+            dstPtr[0] = srcPtr[0];
+            dstPtr[1] = srcPtr[1];
+            dstPtr[2] = srcPtr[2];
+        }
+        row = jpegPtr->row;
+#endif
+        jpeg_write_scanlines(cinfo, &row, 1);
+    }
+    jpeg_finish_compress(cinfo);
+
+    *dataPtr = jpegPtr->output;
+    *sizePtr = jpegPtr->outputSize - jpegPtr->dest.free_in_buffer;
+    return TCL_OK;
+}
+
+/**
+ * Compress a video frame of any format. As VideoJpegEncodeRGBA.
+ */
+
+int
+VideoJpegEncode(VideoJpeg *jpegPtr, const VideoFrame *framePtr, int quality,
+                const unsigned char **dataPtr, size_t *sizePtr)
+{
+    size_t size = (size_t)framePtr->width * framePtr->height * 4;
+
+    if (Reserve(&jpegPtr->stage, &jpegPtr->stageSize, size) != TCL_OK) {
+        strcpy(jpegPtr->message, "out of memory");
+        return TCL_ERROR;
+    }
+    VideoConvertToRGBA(framePtr, jpegPtr->stage, framePtr->width * 4);
+    return VideoJpegEncodeRGBA(jpegPtr, jpegPtr->stage, framePtr->width, framePtr->height,
+                               framePtr->width * 4, quality, dataPtr, sizePtr);
+}
+
+/**
+ * @return a description of the last error.
+ */
+
+const char *
+VideoJpegError(const VideoJpeg *jpegPtr)
+{
+    return jpegPtr->message;
+}
+
+#endif /* HAVE_JPEG */
+
+/**
+ * Compress the widget's staged frame, with any overlay already blended
+ * into it, and set the interpreter result to the JPEG data as a byte
+ * array. The encoder is kept for the next picture.
+ *
+ * @return a Tcl result code.
+ */
+
+int
+VideoStagedJpeg(Video *videoPtr, int quality)
+{
+#ifdef HAVE_JPEG
+    const unsigned char *data;
+    size_t size;
+
+    if (videoPtr->jpegPtr == NULL) {
+        videoPtr->jpegPtr = VideoJpegCreate();
+    }
+    if (VideoJpegEncodeRGBA(videoPtr->jpegPtr, videoPtr->stagePtr, videoPtr->stageWidth,
+                            videoPtr->stageHeight, videoPtr->stageWidth * 4, quality,
+                            &data, &size) != TCL_OK) {
+        Tcl_SetObjResult(videoPtr->interp, Tcl_ObjPrintf(
+            "failed to encode image: %s", VideoJpegError(videoPtr->jpegPtr)));
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(videoPtr->interp, Tcl_NewByteArrayObj(data, (int)size));
+    return TCL_OK;
+#else
+    Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+        "JPEG is not available: tkvideo was built without JPEG support", -1));
+    return TCL_ERROR;
+#endif
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,738 @@
+/* mosaic.c - a video wall of tkvideo widgets in a single window
+ *
+ *      tkvideo::mosaic pathName ?-videos list? ?-columns n? ?options?
+ *      pathName configure ?option? ?value option value ...?
+ *      pathName cget option
+ *      pathName stats ?-reset?
+ *
+ * A mosaic shows the frames of a list of tkvideo widgets as the tiles
+ * of one window. The widgets keep their sources and are started,
+ * stopped and recorded as usual, but need not be mapped, so a wall of
+ * many feeds has one window, one renderer and one geometry cycle
+ * instead of one for each.
+ *
+ * Each tile takes the frames of its widget as a sink (see sink.c). The
+ * sinks wake the mosaic from the capture threads with a single pending
+ * event, and when it is next idle every tile whose sink holds a new
+ * frame converts it and scales it into its part of one back buffer.
+ * The back buffer is then presented to the window once. Tiles whose
+ * source has no new frame are left as they are and cost nothing, and
+ * an exposure presents the back buffer again without composing any
+ * tile. Each tile keeps its last frame, converted, so that it can be
+ * composed again when the window is resized.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+
+#define DEF_MOSAIC_BACKGROUND  "black"
+#define DEF_MOSAIC_COLUMNS     "0"
+#define DEF_MOSAIC_WIDTH       "640"
+#define DEF_MOSAIC_HEIGHT      "480"
+#define DEF_MOSAIC_VIDEOS      ""
+
+#define MOSAIC_VIDEOS_CHANGED  0x01
+#define MOSAIC_LAYOUT_CHANGED  0x02
+
+/*
+ * Flag bits for the mosaic widget
+ */
+
+#define REDRAW_PENDING   0x01
+#define LAYOUT_TILES     0x02   /* the tile positions must be recomputed */
+#define PRESENT_BUFFER   0x04   /* present even if no tile was composed */
+
+typedef struct VideoMosaic VideoMosaic;
+
+struct VideoTile {
+    VideoMosaic *mosaicPtr;
+    Video      *videoPtr;       /* the widget shown, or NULL once destroyed */
+    VideoSink  *sinkPtr;
+    VideoTile  *nextPtr;        /* next tile showing the same widget */
+    int         x;              /* the tile's part of the back buffer */
+    int         y;
+    int         width;
+    int         height;
+    int         damaged;        /* compose even without a new frame */
+    VideoScaler *scalerPtr;
+    unsigned char *work;        /* the last frame, converted to BGRA */
+    size_t      workSize;
+    int         frameWidth;     /* its size, 0 if there is none */
+    int         frameHeight;
+};
+
+struct VideoMosaic {
+    Tk_Window   tkwin;
+    Display    *display;
+    Tcl_Interp *interp;
+    Tcl_Command widgetCmd;
+    Tk_OptionTable optionTable;
+    int         flags;
+
+    Tcl_Obj    *videosPtr;      /* -videos */
+    int         columns;        /* -columns, 0 to choose */
+    int         width;          /* -width and -height */
+    int         height;
+    Tk_3DBorder background;     /* -background */
+
+    VideoTile **tiles;
+    int         tileCount;
+    ClientData  presenter;      /* the platform's window renderer */
+    VideoFrame  back;           /* the back buffer, BGRA */
+    size_t      backSize;
+
+    Tcl_ThreadId ownerThread;
+    Tcl_Mutex   notifyLock;     /* protects notifyPending */
+    int         notifyPending;
+
+    Tcl_WideInt presents;       /* back buffer presented */
+    Tcl_WideInt composed;       /* tiles composed into it */
+    Tcl_WideInt skipped;        /* idle tiles passed over */
+};
+
+typedef struct {
+    Tcl_Event header;
+    VideoMosaic *mosaicPtr;
+} MosaicEvent;
+
+static Tk_OptionSpec mosaicOptionSpec[] = {
+    {TK_OPTION_SYNONYM, "-bg", (char *) NULL, (char *) NULL,
+        (char *) NULL, 0, -1, 0, (ClientData) "-background"},
+    {TK_OPTION_BORDER, "-background", "background", "Background",
+        DEF_MOSAIC_BACKGROUND, -1, Tk_Offset(VideoMosaic, background), 0, 0,
+        MOSAIC_LAYOUT_CHANGED },
+    {TK_OPTION_INT, "-columns", "columns", "Columns",
+        DEF_MOSAIC_COLUMNS, -1, Tk_Offset(VideoMosaic, columns), 0, 0, MOSAIC_LAYOUT_CHANGED },
+    {TK_OPTION_PIXELS, "-height", "height", "Height",
+        DEF_MOSAIC_HEIGHT, -1, Tk_Offset(VideoMosaic, height), 0, 0, 0 },
+    {TK_OPTION_STRING, "-videos", "videos", "Videos",
+        DEF_MOSAIC_VIDEOS, Tk_Offset(VideoMosaic, videosPtr), -1, 0, 0, MOSAIC_VIDEOS_CHANGED },
+    {TK_OPTION_PIXELS, "-width", "width", "Width",
+        DEF_MOSAIC_WIDTH, -1, Tk_Offset(VideoMosaic, width), 0, 0, 0 },
+    {TK_OPTION_END, (char *)NULL, (char *)NULL, (char*)NULL,
+        (char *)NULL, 0, 0, 0, 0}
+};
+
+static int  MosaicWidgetObjCmd(ClientData clientData, Tcl_Interp *interp,
+                               int objc, Tcl_Obj *CONST objv[]);
+static int  MosaicConfigure(Tcl_Interp *interp, VideoMosaic *mosaicPtr,
+                            int objc, Tcl_Obj *CONST objv[]);
+static int  MosaicSetVideos(Tcl_Interp *interp, VideoMosaic *mosaicPtr);
+static void MosaicClearTiles(VideoMosaic *mosaicPtr);
+static void MosaicEventProc(ClientData clientData, XEvent *eventPtr);
+static void MosaicDeletedProc(ClientData clientData);
+static void MosaicCleanup(char *memPtr);
+static void MosaicRedraw(ClientData clientData);
+static void MosaicPresentAgain(ClientData clientData);
+static void MosaicDisplay(ClientData clientData);
+static void MosaicLayout(VideoMosaic *mosaicPtr);
+static void ComposeTile(VideoMosaic *mosaicPtr, VideoTile *tilePtr);
+static void FillBackground(VideoMosaic *mosaicPtr, unsigned char *dstPtr,
+                           int width, int height);
+static void TakeFrame(VideoTile *tilePtr, VideoBuffer *bufferPtr);
+static void MosaicWake(ClientData clientData);
+static int  MosaicFrameEventProc(Tcl_Event *evPtr, int flags);
+static int  MosaicEventDeleteProc(Tcl_Event *evPtr, ClientData clientData);
+
+/**
+ * Implements the tkvideo::mosaic command, which creates a mosaic widget.
+ */
+
+int
+VideoMosaicObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    VideoMosaic *mosaicPtr;
+    Tk_Window tkwin;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "pathName ?options?");
+        return TCL_ERROR;
+    }
+
+    tkwin = Tk_CreateWindowFromPath(interp, Tk_MainWindow(interp),
+        Tcl_GetString(objv[1]), (char *)NULL);
+    if (tkwin == NULL) {
+        return TCL_ERROR;
+    }
+    Tk_SetClass(tkwin, "VideoMosaic");
+
+    mosaicPtr = (VideoMosaic *)ckalloc(sizeof(VideoMosaic));
+    memset(mosaicPtr, 0, sizeof(VideoMosaic));
+    mosaicPtr->tkwin = tkwin;
+    mosaicPtr->display = Tk_Display(tkwin);
+    mosaicPtr->interp = interp;
+    mosaicPtr->ownerThread = Tcl_GetCurrentThread();
+    mosaicPtr->optionTable = Tk_CreateOptionTable(interp, mosaicOptionSpec);
+    mosaicPtr->back.format = VIDEO_FORMAT_BGRA;
+
+    if (Tk_InitOptions(interp, (char *)mosaicPtr, mosaicPtr->optionTable, tkwin) != TCL_OK) {
+        Tk_DestroyWindow(tkwin);
+        ckfree((char *)mosaicPtr);
+        return TCL_ERROR;
+    }
+    mosaicPtr->widgetCmd = Tcl_CreateObjCommand(interp, Tk_PathName(tkwin),
+        MosaicWidgetObjCmd, (ClientData)mosaicPtr, MosaicDeletedProc);
+    Tk_CreateEventHandler(tkwin, ExposureMask | StructureNotifyMask,
+        MosaicEventProc, (ClientData)mosaicPtr);
+
+    if (MosaicConfigure(interp, mosaicPtr, objc - 2, objv + 2) != TCL_OK) {
+        Tk_DestroyWindow(tkwin);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(Tk_PathName(tkwin), -1));
+    return TCL_OK;
+}
+
+static int
+MosaicWidgetObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)clientData;
+    static const char *commands[] = { "cget", "configure", "stats", NULL };
+    enum { MOSAIC_CGET, MOSAIC_CONFIGURE, MOSAIC_STATS };
+    static const char *options[] = { "-reset", NULL };
+    Tcl_Obj *resultPtr = NULL;
+    int index, r = TCL_OK;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?arg arg...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    Tcl_Preserve(clientData);
+    switch (index) {
+        case MOSAIC_CGET:
+            if (objc != 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "option");
+                r = TCL_ERROR;
+                break;
+            }
+            resultPtr = Tk_GetOptionValue(interp, (char *)mosaicPtr,
+                mosaicPtr->optionTable, objv[2], mosaicPtr->tkwin);
+            r = (resultPtr != NULL) ? TCL_OK : TCL_ERROR;
+            break;
+        case MOSAIC_CONFIGURE:
+            if (objc < 4) {
+                resultPtr = Tk_GetOptionInfo(interp, (char *)mosaicPtr,
+                    mosaicPtr->optionTable, (objc == 3) ? objv[2] : NULL, mosaicPtr->tkwin);
+                r = (resultPtr != NULL) ? TCL_OK : TCL_ERROR;
+            } else {
+                r = MosaicConfigure(interp, mosaicPtr, objc - 2, objv + 2);
+            }
+            break;
+        case MOSAIC_STATS:
+            if (objc > 3) {
+                Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+                r = TCL_ERROR;
+                break;
+            }
+            if (objc == 3 && Tcl_GetIndexFromObj(interp, objv[2], options, "option", 0,
+                                                 &index) != TCL_OK) {
+                r = TCL_ERROR;
+                break;
+            }
+            resultPtr = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj("tiles", -1));
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewIntObj(mosaicPtr->tileCount));
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj("presents", -1));
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewWideIntObj(mosaicPtr->presents));
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj("composed", -1));
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewWideIntObj(mosaicPtr->composed));
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewStringObj("skipped", -1));
+            Tcl_ListObjAppendElement(NULL, resultPtr, Tcl_NewWideIntObj(mosaicPtr->skipped));
+            if (objc == 3) {
+                mosaicPtr->presents = mosaicPtr->composed = mosaicPtr->skipped = 0;
+            }
+            break;
+    }
+    if (resultPtr != NULL) {
+        Tcl_SetObjResult(interp, resultPtr);
+    }
+    Tcl_Release(clientData);
+    return r;
+}
+
+static int
+MosaicConfigure(Tcl_Interp *interp, VideoMosaic *mosaicPtr, int objc, Tcl_Obj *CONST objv[])
+{
+    Tk_SavedOptions savedOptions;
+    int flags = 0, r;
+
+    r = Tk_SetOptions(interp, (char *)mosaicPtr, mosaicPtr->optionTable, objc, objv,
+                      mosaicPtr->tkwin, &savedOptions, &flags);
+    if (r == TCL_OK && mosaicPtr->columns < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "invalid column count %d: must be 0 or more", mosaicPtr->columns));
+        r = TCL_ERROR;
+    }
+    if (r == TCL_OK && (flags & MOSAIC_VIDEOS_CHANGED)) {
+        r = MosaicSetVideos(interp, mosaicPtr);
+    }
+    if (r != TCL_OK) {
+        Tk_RestoreSavedOptions(&savedOptions);
+        Tk_FreeSavedOptions(&savedOptions);
+        return r;
+    }
+    Tk_FreeSavedOptions(&savedOptions);
+
+    Tk_SetWindowBackground(mosaicPtr->tkwin, Tk_3DBorderColor(mosaicPtr->background)->pixel);
+    Tk_GeometryRequest(mosaicPtr->tkwin, mosaicPtr->width, mosaicPtr->height);
+    if (flags & (MOSAIC_VIDEOS_CHANGED | MOSAIC_LAYOUT_CHANGED)) {
+        mosaicPtr->flags |= LAYOUT_TILES;
+    }
+    MosaicRedraw((ClientData)mosaicPtr);
+    return TCL_OK;
+}
+
+/*
+ * Replace the tiles with one for each widget named by -videos. Nothing
+ * is changed unless every name is a tkvideo widget.
+ */
+
+static int
+MosaicSetVideos(Tcl_Interp *interp, VideoMosaic *mosaicPtr)
+{
+    Tcl_Obj **objv;
+    Video **videos;
+    int objc, n;
+
+    if (Tcl_ListObjGetElements(interp, mosaicPtr->videosPtr, &objc, &objv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    videos = (Video **)ckalloc(sizeof(Video *) * (objc + 1));
+    for (n = 0; n < objc; ++n) {
+        if (VideoGetFromObj(interp, objv[n], &videos[n]) != TCL_OK) {
+            ckfree((char *)videos);
+            return TCL_ERROR;
+        }
+    }
+
+    MosaicClearTiles(mosaicPtr);
+    mosaicPtr->tiles = (VideoTile **)ckalloc(sizeof(VideoTile *) * (objc + 1));
+    for (n = 0; n < objc; ++n) {
+        VideoTile *tilePtr = (VideoTile *)ckalloc(sizeof(VideoTile));
+
+        memset(tilePtr, 0, sizeof(VideoTile));
+        tilePtr->mosaicPtr = mosaicPtr;
+        tilePtr->videoPtr = videos[n];
+        tilePtr->scalerPtr = VideoScalerCreate();
+        tilePtr->damaged = 1;
+        tilePtr->nextPtr = videos[n]->tileList;
+        videos[n]->tileList = tilePtr;
+        tilePtr->sinkPtr = VideoSinkCreate(videos[n], "mosaic", 1, MosaicWake,
+                                           (ClientData)mosaicPtr);
+        mosaicPtr->tiles[n] = tilePtr;
+    }
+    mosaicPtr->tileCount = objc;
+    ckfree((char *)videos);
+    return TCL_OK;
+}
+
+/*
+ * Remove a tile from the list of those showing its widget and stop
+ * taking the widget's frames.
+ */
+
+static void
+DetachTile(VideoTile *tilePtr)
+{
+    VideoTile **linkPtr;
+
+    if (tilePtr->videoPtr == NULL) {
+        return;
+    }
+    for (linkPtr = &tilePtr->videoPtr->tileList; *linkPtr != NULL;
+         linkPtr = &(*linkPtr)->nextPtr) {
+        if (*linkPtr == tilePtr) {
+            *linkPtr = tilePtr->nextPtr;
+            break;
+        }
+    }
+    VideoSinkDestroy(tilePtr->sinkPtr);
+    tilePtr->sinkPtr = NULL;
+    tilePtr->videoPtr = NULL;
+}
+
+static void
+MosaicClearTiles(VideoMosaic *mosaicPtr)
+{
+    int n;
+
+    for (n = 0; n < mosaicPtr->tileCount; ++n) {
+        VideoTile *tilePtr = mosaicPtr->tiles[n];
+
+        DetachTile(tilePtr);
+        VideoScalerDestroy(tilePtr->scalerPtr);
+        if (tilePtr->work != NULL) {
+            ckfree((char *)tilePtr->work);
+        }
+        ckfree((char *)tilePtr);
+    }
+    if (mosaicPtr->tiles != NULL) {
+        ckfree((char *)mosaicPtr->tiles);
+        mosaicPtr->tiles = NULL;
+    }
+    mosaicPtr->tileCount = 0;
+}
+
+/**
+ * Called when a tkvideo widget is destroyed. The tiles that showed it
+ * are left empty.
+ */
+
+void
+VideoMosaicForget(Video *videoPtr)
+{
+    while (videoPtr->tileList != NULL) {
+        VideoTile *tilePtr = videoPtr->tileList;
+
+        DetachTile(tilePtr);
+        tilePtr->frameWidth = tilePtr->frameHeight = 0;
+        tilePtr->damaged = 1;
+        MosaicRedraw((ClientData)tilePtr->mosaicPtr);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+MosaicEventProc(ClientData clientData, XEvent *eventPtr)
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)clientData;
+
+    if (eventPtr->type == Expose) {
+        MosaicPresentAgain(clientData);
+    } else if (eventPtr->type == ConfigureNotify) {
+        mosaicPtr->flags |= LAYOUT_TILES;
+        MosaicRedraw(clientData);
+    } else if (eventPtr->type == DestroyNotify) {
+        if (mosaicPtr->tkwin != NULL) {
+            MosaicClearTiles(mosaicPtr);
+            Tcl_DeleteEvents(MosaicEventDeleteProc, clientData);
+            if (mosaicPtr->presenter != NULL) {
+                VideopPresenterDestroy(mosaicPtr->presenter);
+                mosaicPtr->presenter = NULL;
+            }
+            Tk_FreeConfigOptions((char *)mosaicPtr, mosaicPtr->optionTable,
+                mosaicPtr->tkwin);
+            mosaicPtr->tkwin = NULL;
+            Tcl_DeleteCommandFromToken(mosaicPtr->interp, mosaicPtr->widgetCmd);
+        }
+        if (mosaicPtr->flags & REDRAW_PENDING) {
+            Tcl_CancelIdleCall(MosaicDisplay, clientData);
+            mosaicPtr->flags &= ~REDRAW_PENDING;
+        }
+        Tcl_EventuallyFree(clientData, MosaicCleanup);
+    }
+}
+
+static void
+MosaicDeletedProc(ClientData clientData)
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)clientData;
+
+    if (mosaicPtr->tkwin != NULL) {
+        Tk_DestroyWindow(mosaicPtr->tkwin);
+    }
+}
+
+static void
+MosaicCleanup(char *memPtr)
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)memPtr;
+
+    if (mosaicPtr->back.data != NULL) {
+        ckfree((char *)mosaicPtr->back.data);
+    }
+    Tcl_MutexFinalize(&mosaicPtr->notifyLock);
+    ckfree(memPtr);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Called on a capture thread when a frame is put in a tile's sink. One
+ * event at a time is queued to the mosaic's thread, so a wall of busy
+ * sources is composed once each time the thread is idle.
+ */
+
+static void
+MosaicWake(ClientData clientData)
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)clientData;
+
+    Tcl_MutexLock(&mosaicPtr->notifyLock);
+    if (!mosaicPtr->notifyPending) {
+        MosaicEvent *evPtr = (MosaicEvent *)ckalloc(sizeof(MosaicEvent));
+        evPtr->header.proc = MosaicFrameEventProc;
+        evPtr->mosaicPtr = mosaicPtr;
+        mosaicPtr->notifyPending = 1;
+        Tcl_ThreadQueueEvent(mosaicPtr->ownerThread, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(mosaicPtr->ownerThread);
+    }
+    Tcl_MutexUnlock(&mosaicPtr->notifyLock);
+}
+
+static int
+MosaicFrameEventProc(Tcl_Event *evPtr, int flags)
+{
+    VideoMosaic *mosaicPtr = ((MosaicEvent *)evPtr)->mosaicPtr;
+
+    if (!(flags & TCL_WINDOW_EVENTS)) {
+        return 0;
+    }
+    Tcl_MutexLock(&mosaicPtr->notifyLock);
+    mosaicPtr->notifyPending = 0;
+    Tcl_MutexUnlock(&mosaicPtr->notifyLock);
+    if (mosaicPtr->tkwin != NULL) {
+        MosaicRedraw((ClientData)mosaicPtr);
+    }
+    return 1;
+}
+
+static int
+MosaicEventDeleteProc(Tcl_Event *evPtr, ClientData clientData)
+{
+    return (evPtr->proc == MosaicFrameEventProc
+            && ((MosaicEvent *)evPtr)->mosaicPtr == (VideoMosaic *)clientData);
+}
+
+/*
+ * Present the back buffer again when the thread is next idle, after an
+ * exposure or when the platform renderer dropped a present because the
+ * display was busy.
+ */
+
+static void
+MosaicPresentAgain(ClientData clientData)
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)clientData;
+
+    mosaicPtr->flags |= PRESENT_BUFFER;
+    MosaicRedraw(clientData);
+}
+
+/*
+ * Arrange for the mosaic to be brought up to date when the thread is
+ * next idle.
+ */
+
+static void
+MosaicRedraw(ClientData clientData)
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)clientData;
+
+    if (!(mosaicPtr->flags & REDRAW_PENDING)) {
+        Tcl_DoWhenIdle(MosaicDisplay, clientData);
+        mosaicPtr->flags |= REDRAW_PENDING;
+    }
+}
+
+/*
+ * Compose the tiles that have a new frame, or must be drawn again, into
+ * the back buffer and present it if anything changed.
+ */
+
+static void
+MosaicDisplay(ClientData clientData)
+{
+    VideoMosaic *mosaicPtr = (VideoMosaic *)clientData;
+    Tk_Window tkwin = mosaicPtr->tkwin;
+    int n, changed = 0;
+
+    mosaicPtr->flags &= ~REDRAW_PENDING;
+    if (tkwin == NULL || !Tk_IsMapped(tkwin)) {
+        return;
+    }
+    if (mosaicPtr->presenter == NULL) {
+        mosaicPtr->presenter = VideopPresenterCreate(tkwin, MosaicPresentAgain, clientData);
+        if (mosaicPtr->presenter == NULL) {
+            return;
+        }
+        mosaicPtr->flags |= LAYOUT_TILES;
+    }
+    if (mosaicPtr->flags & LAYOUT_TILES) {
+        MosaicLayout(mosaicPtr);
+        changed = 1;
+    }
+    if (mosaicPtr->back.data == NULL) {
+        return;
+    }
+
+    for (n = 0; n < mosaicPtr->tileCount; ++n) {
+        VideoTile *tilePtr = mosaicPtr->tiles[n];
+        VideoBuffer *bufferPtr = NULL;
+
+        if (tilePtr->sinkPtr != NULL) {
+            bufferPtr = VideoSinkTake(tilePtr->sinkPtr);
+        }
+        if (bufferPtr != NULL) {
+            TakeFrame(tilePtr, bufferPtr);
+            VideoBufferRelease(bufferPtr);
+        }
+        if (tilePtr->damaged) {
+            ComposeTile(mosaicPtr, tilePtr);
+            ++mosaicPtr->composed;
+            changed = 1;
+        } else {
+            ++mosaicPtr->skipped;
+        }
+    }
+
+    if (changed || (mosaicPtr->flags & PRESENT_BUFFER)) {
+        mosaicPtr->flags &= ~PRESENT_BUFFER;
+        if (VideopPresent(mosaicPtr->presenter, Tk_WindowId(tkwin), &mosaicPtr->back)) {
+            ++mosaicPtr->presents;
+        }
+    }
+}
+
+/*
+ * Size the back buffer to the window and divide it into tiles, in the
+ * given number of columns or else the smallest square grid that holds
+ * them all. Every tile is composed again.
+ */
+
+static void
+MosaicLayout(VideoMosaic *mosaicPtr)
+{
+    int width = Tk_Width(mosaicPtr->tkwin), height = Tk_Height(mosaicPtr->tkwin);
+    int columns = mosaicPtr->columns, rows, n;
+    size_t size = (size_t)width * height * 4;
+
+    mosaicPtr->flags &= ~LAYOUT_TILES;
+    if (size > mosaicPtr->backSize) {
+        unsigned char *dataPtr = (unsigned char *)
+            attemptckrealloc((char *)mosaicPtr->back.data, size);
+        if (dataPtr == NULL) {
+            return;
+        }
+        mosaicPtr->back.data = dataPtr;
+        mosaicPtr->backSize = size;
+    }
+    mosaicPtr->back.width = width;
+    mosaicPtr->back.height = height;
+    mosaicPtr->back.pitch = width * 4;
+
+    if (columns == 0) {
+        while (columns * columns < mosaicPtr->tileCount) {
+            ++columns;
+        }
+    }
+    if (columns == 0) {
+        columns = 1;
+    }
+    rows = (mosaicPtr->tileCount + columns - 1) / columns;
+    if (rows == 0) {
+        rows = 1;
+    }
+
+    /* whatever the tiles do not cover shows the background */
+    FillBackground(mosaicPtr, mosaicPtr->back.data, width, height);
+
+    for (n = 0; n < mosaicPtr->tileCount; ++n) {
+        VideoTile *tilePtr = mosaicPtr->tiles[n];
+        int column = n % columns, row = n / columns;
+
+        tilePtr->x = column * width / columns;
+        tilePtr->y = row * height / rows;
+        tilePtr->width = (column + 1) * width / columns - tilePtr->x;
+        tilePtr->height = (row + 1) * height / rows - tilePtr->y;
+        tilePtr->damaged = 1;
+    }
+}
+
+/*
+ * Keep a converted copy of a tile's new frame, from which the tile is
+ * composed now and whenever the layout changes.
+ */
+
+static void
+TakeFrame(VideoTile *tilePtr, VideoBuffer *bufferPtr)
+{
+    const VideoFrame *framePtr = VideoBufferFrame(bufferPtr);
+    size_t size = (size_t)framePtr->width * framePtr->height * 4;
+
+    if (size > tilePtr->workSize) {
+        unsigned char *workPtr = (unsigned char *)
+            attemptckrealloc((char *)tilePtr->work, size);
+        if (workPtr == NULL) {
+            return;
+        }
+        tilePtr->work = workPtr;
+        tilePtr->workSize = size;
+    }
+    VideoConvertToBGRA(framePtr, tilePtr->work, framePtr->width * 4);
+    tilePtr->frameWidth = framePtr->width;
+    tilePtr->frameHeight = framePtr->height;
+    tilePtr->damaged = 1;
+}
+
+/*
+ * Scale a tile's frame into its part of the back buffer, or fill that
+ * with the background if it has no frame or is too small to scale to.
+ */
+
+static void
+ComposeTile(VideoMosaic *mosaicPtr, VideoTile *tilePtr)
+{
+    const int pitch = mosaicPtr->back.pitch;
+    unsigned char *dstPtr = mosaicPtr->back.data + (size_t)tilePtr->y * pitch + tilePtr->x * 4;
+    int y;
+
+    tilePtr->damaged = 0;
+    if (tilePtr->width <= 0 || tilePtr->height <= 0) {
+        return;
+    }
+    if (tilePtr->frameWidth == tilePtr->width && tilePtr->frameHeight == tilePtr->height) {
+        for (y = 0; y < tilePtr->height; ++y) {
+            memcpy(dstPtr + (size_t)y * pitch, tilePtr->work + (size_t)y * tilePtr->width * 4,
+                   tilePtr->width * 4);
+        }
+        return;
+    }
+    if (tilePtr->frameWidth > 0
+        && VideoScalerSetup(tilePtr->scalerPtr, tilePtr->frameWidth, tilePtr->frameHeight,
+                            tilePtr->width, tilePtr->height) == TCL_OK) {
+        VideoScaleImage(tilePtr->scalerPtr, tilePtr->work, tilePtr->frameWidth * 4,
+                        dstPtr, pitch);
+        return;
+    }
+    FillBackground(mosaicPtr, dstPtr, tilePtr->width, tilePtr->height);
+}
+
+static void
+FillBackground(VideoMosaic *mosaicPtr, unsigned char *dstPtr, int width, int height)
+{
+    XColor *colorPtr = Tk_3DBorderColor(mosaicPtr->background);
+    const int pitch = mosaicPtr->back.pitch;
+    unsigned char pixel[4];
+    int x, y;
+
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    pixel[0] = colorPtr->blue >> 8;
+    pixel[1] = colorPtr->green >> 8;
+    pixel[2] = colorPtr->red >> 8;
+    pixel[3] = 0xff;
+    for (x = 0; x < width; ++x) {
+        memcpy(dstPtr + x * 4, pixel, 4);
+    }
+    for (y = 1; y < height; ++y) {
+        memcpy(dstPtr + (size_t)y * pitch, dstPtr, width * 4);
+    }
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
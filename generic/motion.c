@@ -0,0 +1,924 @@
+/* motion.c - motion detection on the widget's frames
+ *
+ *      pathName motion start ?-threshold level? ?-cells n? ?-decay frames?
+ *      pathName motion info
+ *      pathName motion stop
+ *
+ * The detector takes the frames as a sink (see sink.c) and analyses
+ * them in a task given to the worker pool (see pool.c) when they
+ * arrive, so it costs the widget and capture threads nothing. Only one
+ * task of a detector is given at a time, and it takes frames until the
+ * sink is empty, so the frames are analysed one after another.
+ * The luma of each frame is first reduced to a small image in which
+ * each pixel is the mean of an 8x8 block of the frame, sampled on
+ * alternate rows. The Y plane of the YUV formats is used as it is, and
+ * for the RGB formats the green channel stands in for luma, which is
+ * close enough to find movement. The block sums are taken with the SAD
+ * instruction against zero, eight bytes at a time. This is the only
+ * pass whose cost depends on the frame size and it is limited by memory
+ * bandwidth, which is why only half of the rows are read.
+ *
+ * The small image is divided into cells of 8x8 of its pixels, 64x64 of
+ * the frame, and each is compared with a background kept as 8.8 fixed
+ * point, which moves 1/2^n of the way towards each new frame so that it
+ * follows slow changes of light and settles on things that stop moving
+ * after about -decay frames. With cells eight pixels wide the sum of
+ * absolute differences for a row of a cell is again one SAD lane. A
+ * cell is moving when its mean difference is above -threshold, and when
+ * at least -cells of them are a <<VideoMotion>> event is sent to the
+ * widget. Like <<VideoFrame>>, the events are coalesced, so a busy
+ * script is told about the newest frame with motion.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define VIDEO_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif /* x86 */
+
+#define MOTION_BLOCK      8     /* frame pixels in each side of a block */
+#define MOTION_ROWS       4     /* rows of each block that are read */
+#define MOTION_CELL       8     /* small pixels in each side of a cell */
+#define MOTION_MAX_DECAY  1024  /* longest background time constant */
+
+typedef struct {
+    Tcl_Event header;
+    Video *videoPtr;
+} MotionEvent;
+
+struct VideoMotion {
+    Video *videoPtr;
+    VideoSink *sinkPtr;
+
+    /* used by the detector's task only */
+    int width;                  /* frame size the buffers were made for */
+    int height;
+    int blocksX;                /* size of the small image in use */
+    int blocksY;
+    int columns;                /* cells */
+    int rows;
+    int stride;                 /* columns rounded up for the kernels */
+    unsigned char *small;       /* stride * MOTION_CELL bytes a row */
+    unsigned short *background; /* the same size as small, 8.8 fixed point */
+    unsigned int *sad;          /* stride sums for a row of cells */
+    unsigned char *luma;        /* MOTION_ROWS rows of packed luma */
+    unsigned char *flags;       /* moving cells of the current frame */
+    int learning;               /* the background is not yet set */
+
+    Tcl_Mutex lock;             /* protects all the fields below */
+    Tcl_Condition cond;         /* signalled when the task finishes */
+    int quit;
+    int scheduled;              /* a task is given to the pool or running */
+    int threshold;              /* mean difference of a moving cell */
+    int cells;                  /* moving cells needed for an event */
+    int shift;                  /* log2 of the decay in frames */
+    int pending;                /* an event is queued and not yet handled */
+    Tcl_WideInt sequence;       /* newest frame with motion */
+    Tcl_WideInt timestamp;
+    int score;                  /* highest mean difference in it */
+    int count;                  /* cells moving in it */
+    int eventColumns;
+    int eventRows;
+    unsigned char *moving;      /* its moving cells, eventColumns a row */
+    int movingSpace;
+    Tcl_WideInt analysed;       /* frames compared with the background */
+    Tcl_WideInt events;         /* frames that found motion */
+    Tcl_WideInt totalTime;      /* microseconds spent analysing */
+    Tcl_WideInt peakTime;
+};
+
+typedef void (BlockRowProc)(const unsigned char *const rows[MOTION_ROWS],
+                            unsigned char *dstPtr, int blocks);
+typedef void (CellRowProc)(const unsigned char *curPtr, unsigned short *bgPtr,
+                           unsigned int *sadPtr, int cells, int shift);
+typedef void (LumaRowProc)(const unsigned char *srcPtr, unsigned char *dstPtr,
+                           int width, int step, int offset);
+
+static BlockRowProc BlockRowScalar;
+static CellRowProc CellRowScalar;
+static LumaRowProc LumaRowScalar;
+#ifdef VIDEO_X86
+static BlockRowProc BlockRowSSE2;
+static BlockRowProc BlockRowAVX2;
+static CellRowProc CellRowSSE2;
+static CellRowProc CellRowAVX2;
+static LumaRowProc LumaRowSSE2;
+#endif
+
+static BlockRowProc *blockRowProc = BlockRowScalar;
+static CellRowProc *cellRowProc = CellRowScalar;
+static LumaRowProc *lumaRowProc = LumaRowScalar;
+static const char *kernelName = "scalar";
+
+static void MotionTask(ClientData clientData);
+
+/**
+ * Select the detector kernels for the instruction sets available.
+ *
+ * @param features [in] the VIDEO_CPU_* flags from VideoCpuFeatures
+ */
+
+void
+VideoMotionInit(int features)
+{
+    blockRowProc = BlockRowScalar;
+    cellRowProc = CellRowScalar;
+    lumaRowProc = LumaRowScalar;
+    kernelName = "scalar";
+#ifdef VIDEO_X86
+    if (features & VIDEO_CPU_SSE2) {
+        blockRowProc = BlockRowSSE2;
+        cellRowProc = CellRowSSE2;
+        lumaRowProc = LumaRowSSE2;
+        kernelName = "sse2";
+    }
+    if (features & VIDEO_CPU_AVX2) {
+        blockRowProc = BlockRowAVX2;
+        cellRowProc = CellRowAVX2;
+        kernelName = "avx2";
+    }
+#endif
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Reduce the rows read from a band of the frame to one row of the small
+ * image, each pixel the rounded mean of the samples of its block.
+ */
+
+static void
+BlockRowScalar(const unsigned char *const rows[MOTION_ROWS], unsigned char *dstPtr,
+               int blocks)
+{
+    int b, r, i;
+
+    for (b = 0; b < blocks; ++b) {
+        unsigned int sum = 0;
+        for (r = 0; r < MOTION_ROWS; ++r) {
+            const unsigned char *p = rows[r] + b * MOTION_BLOCK;
+            for (i = 0; i < MOTION_BLOCK; ++i)
+                sum += p[i];
+        }
+        dstPtr[b] = (unsigned char)((sum + 16) >> 5);
+    }
+}
+
+/*
+ * Compare a row of the small image with the background, adding the sum
+ * of absolute differences for each cell to sadPtr, then move the
+ * background 1/2^shift of the way towards the image. The background
+ * pixel compared is its integer part. cells is a multiple of 4 and the
+ * rows are padded to match.
+ */
+
+static void
+CellRowScalar(const unsigned char *curPtr, unsigned short *bgPtr, unsigned int *sadPtr,
+              int cells, int shift)
+{
+    int c, i;
+
+    for (c = 0; c < cells; ++c) {
+        unsigned int sum = 0;
+        for (i = 0; i < MOTION_CELL; ++i) {
+            int cur = curPtr[i];
+            int bg = bgPtr[i];
+            int cur16 = cur << 8;
+
+            sum += (cur > (bg >> 8)) ? cur - (bg >> 8) : (bg >> 8) - cur;
+            if (cur16 > bg)
+                bg += (cur16 - bg) >> shift;
+            else
+                bg -= (bg - cur16) >> shift;
+            bgPtr[i] = (unsigned short)bg;
+        }
+        sadPtr[c] += sum;
+        curPtr += MOTION_CELL;
+        bgPtr += MOTION_CELL;
+    }
+}
+
+/*
+ * Gather the luma samples of a packed row: every step bytes from offset.
+ */
+
+static void
+LumaRowScalar(const unsigned char *srcPtr, unsigned char *dstPtr, int width,
+              int step, int offset)
+{
+    int i;
+
+    srcPtr += offset;
+    for (i = 0; i < width; ++i) {
+        dstPtr[i] = *srcPtr;
+        srcPtr += step;
+    }
+}
+
+#ifdef VIDEO_X86
+
+/*
+ * SSE2 versions. Each SAD of 16 bytes against zero yields the sums of
+ * two blocks, and each SAD against the background the sums for a row
+ * of two cells.
+ */
+
+static void
+BlockRowSSE2(const unsigned char *const rows[MOTION_ROWS], unsigned char *dstPtr,
+             int blocks)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int b = 0, r;
+
+    for (; b + 2 <= blocks; b += 2) {
+        __m128i sum = zero;
+        for (r = 0; r < MOTION_ROWS; ++r) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(rows[r] + b * MOTION_BLOCK));
+            sum = _mm_add_epi32(sum, _mm_sad_epu8(v, zero));
+        }
+        dstPtr[b] = (unsigned char)((_mm_cvtsi128_si32(sum) + 16) >> 5);
+        dstPtr[b + 1] = (unsigned char)((_mm_extract_epi16(sum, 4) + 16) >> 5);
+    }
+    if (b < blocks) {
+        const unsigned char *tail[MOTION_ROWS];
+        for (r = 0; r < MOTION_ROWS; ++r)
+            tail[r] = rows[r] + b * MOTION_BLOCK;
+        BlockRowScalar(tail, dstPtr + b, blocks - b);
+    }
+}
+
+static void
+CellRowSSE2(const unsigned char *curPtr, unsigned short *bgPtr, unsigned int *sadPtr,
+            int cells, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int c;
+
+    for (c = 0; c < cells; c += 2) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)curPtr);
+        __m128i bg0 = _mm_loadu_si128((const __m128i *)bgPtr);
+        __m128i bg1 = _mm_loadu_si128((const __m128i *)(bgPtr + 8));
+        __m128i bg = _mm_packus_epi16(_mm_srli_epi16(bg0, 8), _mm_srli_epi16(bg1, 8));
+        __m128i sad = _mm_sad_epu8(cur, bg);
+        __m128i cur0 = _mm_unpacklo_epi8(zero, cur);
+        __m128i cur1 = _mm_unpackhi_epi8(zero, cur);
+
+        sadPtr[c] += (unsigned int)_mm_cvtsi128_si32(sad);
+        sadPtr[c + 1] += (unsigned int)_mm_extract_epi16(sad, 4);
+        bg0 = _mm_sub_epi16(
+            _mm_add_epi16(bg0, _mm_srl_epi16(_mm_subs_epu16(cur0, bg0), count)),
+            _mm_srl_epi16(_mm_subs_epu16(bg0, cur0), count));
+        bg1 = _mm_sub_epi16(
+            _mm_add_epi16(bg1, _mm_srl_epi16(_mm_subs_epu16(cur1, bg1), count)),
+            _mm_srl_epi16(_mm_subs_epu16(bg1, cur1), count));
+        _mm_storeu_si128((__m128i *)bgPtr, bg0);
+        _mm_storeu_si128((__m128i *)(bgPtr + 8), bg1);
+        curPtr += 16;
+        bgPtr += 16;
+    }
+}
+
+static void
+LumaRowSSE2(const unsigned char *srcPtr, unsigned char *dstPtr, int width,
+            int step, int offset)
+{
+    const __m128i mask16 = _mm_set1_epi16(0x00ff);
+    const __m128i mask32 = _mm_set1_epi32(0x000000ff);
+    const __m128i count = _mm_cvtsi32_si128(offset * 8);
+    int i = 0;
+
+    if (step == 2) {
+        for (; i + 16 <= width; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(srcPtr + i * 2));
+            __m128i b = _mm_loadu_si128((const __m128i *)(srcPtr + i * 2 + 16));
+            if (offset) {
+                a = _mm_srli_epi16(a, 8);
+                b = _mm_srli_epi16(b, 8);
+            } else {
+                a = _mm_and_si128(a, mask16);
+                b = _mm_and_si128(b, mask16);
+            }
+            _mm_storeu_si128((__m128i *)(dstPtr + i), _mm_packus_epi16(a, b));
+        }
+    } else if (step == 4) {
+        for (; i + 16 <= width; i += 16) {
+            const __m128i *p = (const __m128i *)(srcPtr + i * 4);
+            __m128i a = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p), count), mask32);
+            __m128i b = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 1), count), mask32);
+            __m128i c = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 2), count), mask32);
+            __m128i d = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(p + 3), count), mask32);
+            _mm_storeu_si128((__m128i *)(dstPtr + i),
+                _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+        }
+    }
+    if (i < width)
+        LumaRowScalar(srcPtr + i * step, dstPtr + i, width - i, step, offset);
+}
+
+/*
+ * AVX2 versions, four blocks or cells at a time. The byte packing works
+ * within each 128 bit lane, so the packed background is put back in
+ * order before it is compared.
+ */
+
+TARGET_AVX2 static void
+BlockRowAVX2(const unsigned char *const rows[MOTION_ROWS], unsigned char *dstPtr,
+             int blocks)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int b = 0, r;
+
+    for (; b + 4 <= blocks; b += 4) {
+        __m256i sum = zero;
+        __m128i lo, hi;
+        for (r = 0; r < MOTION_ROWS; ++r) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(rows[r] + b * MOTION_BLOCK));
+            sum = _mm256_add_epi32(sum, _mm256_sad_epu8(v, zero));
+        }
+        lo = _mm256_castsi256_si128(sum);
+        hi = _mm256_extracti128_si256(sum, 1);
+        dstPtr[b] = (unsigned char)((_mm_cvtsi128_si32(lo) + 16) >> 5);
+        dstPtr[b + 1] = (unsigned char)((_mm_extract_epi16(lo, 4) + 16) >> 5);
+        dstPtr[b + 2] = (unsigned char)((_mm_cvtsi128_si32(hi) + 16) >> 5);
+        dstPtr[b + 3] = (unsigned char)((_mm_extract_epi16(hi, 4) + 16) >> 5);
+    }
+    if (b < blocks) {
+        const unsigned char *tail[MOTION_ROWS];
+        for (r = 0; r < MOTION_ROWS; ++r)
+            tail[r] = rows[r] + b * MOTION_BLOCK;
+        BlockRowScalar(tail, dstPtr + b, blocks - b);
+    }
+}
+
+TARGET_AVX2 static void
+CellRowAVX2(const unsigned char *curPtr, unsigned short *bgPtr, unsigned int *sadPtr,
+            int cells, int shift)
+{
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int c;
+
+    for (c = 0; c < cells; c += 4) {
+        __m256i cur = _mm256_loadu_si256((const __m256i *)curPtr);
+        __m256i bg0 = _mm256_loadu_si256((const __m256i *)bgPtr);
+        __m256i bg1 = _mm256_loadu_si256((const __m256i *)(bgPtr + 16));
+        __m256i bg = _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(_mm256_srli_epi16(bg0, 8), _mm256_srli_epi16(bg1, 8)), 0xd8);
+        __m256i sad = _mm256_sad_epu8(cur, bg);
+        __m256i cur0 = _mm256_slli_epi16(
+            _mm256_cvtepu8_epi16(_mm256_castsi256_si128(cur)), 8);
+        __m256i cur1 = _mm256_slli_epi16(
+            _mm256_cvtepu8_epi16(_mm256_extracti128_si256(cur, 1)), 8);
+        __m128i lo = _mm256_castsi256_si128(sad);
+        __m128i hi = _mm256_extracti128_si256(sad, 1);
+
+        sadPtr[c] += (unsigned int)_mm_cvtsi128_si32(lo);
+        sadPtr[c + 1] += (unsigned int)_mm_extract_epi16(lo, 4);
+        sadPtr[c + 2] += (unsigned int)_mm_cvtsi128_si32(hi);
+        sadPtr[c + 3] += (unsigned int)_mm_extract_epi16(hi, 4);
+        bg0 = _mm256_sub_epi16(
+            _mm256_add_epi16(bg0, _mm256_srl_epi16(_mm256_subs_epu16(cur0, bg0), count)),
+            _mm256_srl_epi16(_mm256_subs_epu16(bg0, cur0), count));
+        bg1 = _mm256_sub_epi16(
+            _mm256_add_epi16(bg1, _mm256_srl_epi16(_mm256_subs_epu16(cur1, bg1), count)),
+            _mm256_srl_epi16(_mm256_subs_epu16(bg1, cur1), count));
+        _mm256_storeu_si256((__m256i *)bgPtr, bg0);
+        _mm256_storeu_si256((__m256i *)(bgPtr + 16), bg1);
+        curPtr += 32;
+        bgPtr += 32;
+    }
+}
+
+#endif /* VIDEO_X86 */
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Release the detector's buffers.
+ */
+
+static void
+MotionFreeBuffers(VideoMotion *motionPtr)
+{
+    if (motionPtr->small != NULL)
+        ckfree((char *)motionPtr->small);
+    if (motionPtr->background != NULL)
+        ckfree((char *)motionPtr->background);
+    if (motionPtr->sad != NULL)
+        ckfree((char *)motionPtr->sad);
+    if (motionPtr->luma != NULL)
+        ckfree((char *)motionPtr->luma);
+    if (motionPtr->flags != NULL)
+        ckfree((char *)motionPtr->flags);
+    motionPtr->small = NULL;
+    motionPtr->background = NULL;
+    motionPtr->sad = NULL;
+    motionPtr->luma = NULL;
+    motionPtr->flags = NULL;
+}
+
+/*
+ * Size the buffers for a frame and start learning the background
+ * again. Frames too small to hold a block are ignored.
+ */
+
+static void
+MotionResize(VideoMotion *motionPtr, int width, int height)
+{
+    size_t pixels;
+
+    MotionFreeBuffers(motionPtr);
+    motionPtr->width = width;
+    motionPtr->height = height;
+    motionPtr->blocksX = width / MOTION_BLOCK;
+    motionPtr->blocksY = height / MOTION_BLOCK;
+    motionPtr->columns = (motionPtr->blocksX + MOTION_CELL - 1) / MOTION_CELL;
+    motionPtr->rows = (motionPtr->blocksY + MOTION_CELL - 1) / MOTION_CELL;
+    motionPtr->stride = (motionPtr->columns + 3) & ~3;
+    motionPtr->learning = 1;
+    if (motionPtr->columns == 0 || motionPtr->rows == 0)
+        return;
+
+    pixels = (size_t)motionPtr->stride * MOTION_CELL * motionPtr->rows * MOTION_CELL;
+    motionPtr->small = (unsigned char *)ckalloc(pixels);
+    memset(motionPtr->small, 0, pixels);
+    motionPtr->background = (unsigned short *)ckalloc(pixels * sizeof(unsigned short));
+    memset(motionPtr->background, 0, pixels * sizeof(unsigned short));
+    motionPtr->sad = (unsigned int *)ckalloc(motionPtr->stride * sizeof(unsigned int));
+    motionPtr->luma = (unsigned char *)ckalloc(
+        (size_t)motionPtr->blocksX * MOTION_BLOCK * MOTION_ROWS);
+    motionPtr->flags = (unsigned char *)ckalloc((size_t)motionPtr->columns * motionPtr->rows);
+}
+
+/*
+ * Reduce the frame's luma to the small image.
+ */
+
+static void
+MotionReduce(VideoMotion *motionPtr, const VideoFrame *framePtr)
+{
+    const unsigned char *rows[MOTION_ROWS];
+    int smallPitch = motionPtr->stride * MOTION_CELL;
+    int used = motionPtr->blocksX * MOTION_BLOCK;
+    int step = 0, offset = 0, y, r;
+
+    switch (framePtr->format) {
+    case VIDEO_FORMAT_BGRA:  step = 4; offset = 1; break;
+    case VIDEO_FORMAT_BGR24: step = 3; offset = 1; break;
+    case VIDEO_FORMAT_YUY2:  step = 2; offset = 0; break;
+    case VIDEO_FORMAT_UYVY:  step = 2; offset = 1; break;
+    }
+
+    for (y = 0; y < motionPtr->blocksY; ++y) {
+        for (r = 0; r < MOTION_ROWS; ++r) {
+            const unsigned char *srcPtr = framePtr->data
+                + (y * MOTION_BLOCK + r * (MOTION_BLOCK / MOTION_ROWS))
+                * (ptrdiff_t)framePtr->pitch;
+            if (step == 0) {
+                rows[r] = srcPtr;
+            } else {
+                unsigned char *dstPtr = motionPtr->luma + r * used;
+                lumaRowProc(srcPtr, dstPtr, used, step, offset);
+                rows[r] = dstPtr;
+            }
+        }
+        blockRowProc(rows, motionPtr->small + y * smallPitch, motionPtr->blocksX);
+    }
+}
+
+/*
+ * Compare the small image with the background and mark the moving
+ * cells in the flags.
+ *
+ * @return the number of moving cells; the highest mean difference of
+ *         any cell is stored in scorePtr.
+ */
+
+static int
+MotionCompare(VideoMotion *motionPtr, int threshold, int shift, int *scorePtr)
+{
+    int smallPitch = motionPtr->stride * MOTION_CELL;
+    int count = 0, score = 0, cy, cx, y;
+
+    for (cy = 0; cy < motionPtr->rows; ++cy) {
+        int top = cy * MOTION_CELL;
+        int high = motionPtr->blocksY - top;
+
+        if (high > MOTION_CELL)
+            high = MOTION_CELL;
+        memset(motionPtr->sad, 0, motionPtr->stride * sizeof(unsigned int));
+        for (y = top; y < top + high; ++y) {
+            cellRowProc(motionPtr->small + y * smallPitch,
+                        motionPtr->background + y * smallPitch,
+                        motionPtr->sad, motionPtr->stride, shift);
+        }
+        for (cx = 0; cx < motionPtr->columns; ++cx) {
+            int wide = motionPtr->blocksX - cx * MOTION_CELL;
+            unsigned int pixels, mean;
+
+            if (wide > MOTION_CELL)
+                wide = MOTION_CELL;
+            pixels = (unsigned int)(wide * high);
+            mean = motionPtr->sad[cx] / pixels;
+            if ((int)mean > score)
+                score = (int)mean;
+            if (motionPtr->sad[cx] > (unsigned int)threshold * pixels) {
+                motionPtr->flags[cy * motionPtr->columns + cx] = 1;
+                ++count;
+            } else {
+                motionPtr->flags[cy * motionPtr->columns + cx] = 0;
+            }
+        }
+    }
+    *scorePtr = score;
+    return count;
+}
+
+/*
+ * Start the background from the small image.
+ */
+
+static void
+MotionLearn(VideoMotion *motionPtr)
+{
+    size_t n, pixels = (size_t)motionPtr->stride * MOTION_CELL * motionPtr->rows * MOTION_CELL;
+
+    for (n = 0; n < pixels; ++n)
+        motionPtr->background[n] = (unsigned short)(motionPtr->small[n] << 8);
+    motionPtr->learning = 0;
+}
+
+static int
+MotionEventProc(Tcl_Event *evPtr, int flags)
+{
+    Video *videoPtr = ((MotionEvent *)evPtr)->videoPtr;
+    VideoMotion *motionPtr = videoPtr->motionPtr;
+    Tcl_Obj *dataObj, *cellsObj;
+    int x, y;
+
+    if (!(flags & TCL_WINDOW_EVENTS)) {
+        return 0;
+    }
+    if (motionPtr == NULL || videoPtr->tkwin == NULL) {
+        return 1;
+    }
+
+    dataObj = Tcl_NewObj();
+    cellsObj = Tcl_NewObj();
+    Tcl_MutexLock(&motionPtr->lock);
+    motionPtr->pending = 0;
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("sequence", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewWideIntObj(motionPtr->sequence));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("timestamp", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewWideIntObj(motionPtr->timestamp));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("score", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewIntObj(motionPtr->score));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("count", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewIntObj(motionPtr->count));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("columns", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewIntObj(motionPtr->eventColumns));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("rows", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewIntObj(motionPtr->eventRows));
+    for (y = 0; y < motionPtr->eventRows; ++y) {
+        Tcl_Obj *rowObj = Tcl_NewObj();
+        char *p;
+
+        Tcl_SetObjLength(rowObj, motionPtr->eventColumns);
+        p = Tcl_GetString(rowObj);
+        for (x = 0; x < motionPtr->eventColumns; ++x)
+            p[x] = motionPtr->moving[y * motionPtr->eventColumns + x] ? '1' : '0';
+        Tcl_ListObjAppendElement(NULL, cellsObj, rowObj);
+    }
+    Tcl_MutexUnlock(&motionPtr->lock);
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("cells", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, cellsObj);
+    SendVirtualEventData(videoPtr->tkwin, "VideoMotion", 0, dataObj);
+    return 1;
+}
+
+static int
+MotionEventDeleteProc(Tcl_Event *evPtr, ClientData clientData)
+{
+    return (evPtr->proc == MotionEventProc
+            && ((MotionEvent *)evPtr)->videoPtr == (Video *)clientData);
+}
+
+/*
+ * Record a frame with motion for the widget thread and queue an event
+ * unless one is already pending. Called with the lock held.
+ */
+
+static void
+MotionReport(VideoMotion *motionPtr, const VideoFrame *framePtr, int count, int score)
+{
+    int cells = motionPtr->columns * motionPtr->rows;
+
+    if (cells > motionPtr->movingSpace) {
+        if (motionPtr->moving != NULL)
+            ckfree((char *)motionPtr->moving);
+        motionPtr->moving = (unsigned char *)ckalloc(cells);
+        motionPtr->movingSpace = cells;
+    }
+    memcpy(motionPtr->moving, motionPtr->flags, cells);
+    motionPtr->eventColumns = motionPtr->columns;
+    motionPtr->eventRows = motionPtr->rows;
+    motionPtr->sequence = framePtr->sequence;
+    motionPtr->timestamp = framePtr->timestamp;
+    motionPtr->score = score;
+    motionPtr->count = count;
+    ++motionPtr->events;
+    if (!motionPtr->pending) {
+        Video *videoPtr = motionPtr->videoPtr;
+        MotionEvent *evPtr = (MotionEvent *)ckalloc(sizeof(MotionEvent));
+        evPtr->header.proc = MotionEventProc;
+        evPtr->videoPtr = videoPtr;
+        motionPtr->pending = 1;
+        Tcl_ThreadQueueEvent(videoPtr->ownerThread, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(videoPtr->ownerThread);
+    }
+}
+
+/*
+ * Called on the capture thread when a frame is put in the sink. The
+ * task is given to the pool unless one is already waiting or running,
+ * as that will take the frame before it finishes.
+ */
+
+static void
+MotionWake(ClientData clientData)
+{
+    VideoMotion *motionPtr = (VideoMotion *)clientData;
+    int submit;
+
+    Tcl_MutexLock(&motionPtr->lock);
+    submit = !motionPtr->scheduled && !motionPtr->quit;
+    if (submit)
+        motionPtr->scheduled = 1;
+    Tcl_MutexUnlock(&motionPtr->lock);
+    if (submit)
+        VideoPoolSubmit(motionPtr->videoPtr, MotionTask, motionPtr);
+}
+
+static void
+MotionTask(ClientData clientData)
+{
+    VideoMotion *motionPtr = (VideoMotion *)clientData;
+
+    Tcl_MutexLock(&motionPtr->lock);
+    while (!motionPtr->quit) {
+        VideoBuffer *bufferPtr = VideoSinkTake(motionPtr->sinkPtr);
+        const VideoFrame *framePtr;
+        int threshold = motionPtr->threshold;
+        int cells = motionPtr->cells;
+        int shift = motionPtr->shift;
+        int count = 0, score = 0, compared = 0;
+        Tcl_WideInt start, elapsed;
+
+        if (bufferPtr == NULL)
+            break;
+        Tcl_MutexUnlock(&motionPtr->lock);
+        framePtr = VideoBufferFrame(bufferPtr);
+        start = VideoStatsClock();
+        if (framePtr->width != motionPtr->width || framePtr->height != motionPtr->height)
+            MotionResize(motionPtr, framePtr->width, framePtr->height);
+        if (motionPtr->small != NULL) {
+            MotionReduce(motionPtr, framePtr);
+            if (motionPtr->learning) {
+                MotionLearn(motionPtr);
+            } else {
+                count = MotionCompare(motionPtr, threshold, shift, &score);
+                compared = 1;
+            }
+        }
+        elapsed = VideoStatsClock() - start;
+        Tcl_MutexLock(&motionPtr->lock);
+        if (compared) {
+            ++motionPtr->analysed;
+            motionPtr->totalTime += elapsed;
+            if (elapsed > motionPtr->peakTime)
+                motionPtr->peakTime = elapsed;
+            if (count >= cells)
+                MotionReport(motionPtr, framePtr, count, score);
+        }
+        Tcl_MutexUnlock(&motionPtr->lock);
+        VideoBufferRelease(bufferPtr);
+        Tcl_MutexLock(&motionPtr->lock);
+    }
+    motionPtr->scheduled = 0;
+    Tcl_ConditionNotify(&motionPtr->cond);
+    Tcl_MutexUnlock(&motionPtr->lock);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Stop the detector, waiting for a task that is running to finish, and
+ * release everything, along with any event still queued for it.
+ */
+
+static void
+MotionStop(VideoMotion *motionPtr)
+{
+    Tcl_MutexLock(&motionPtr->lock);
+    motionPtr->quit = 1;
+    while (motionPtr->scheduled)
+        Tcl_ConditionWait(&motionPtr->cond, &motionPtr->lock, NULL);
+    Tcl_MutexUnlock(&motionPtr->lock);
+    if (motionPtr->sinkPtr != NULL) {
+        VideoSinkDestroy(motionPtr->sinkPtr);
+    }
+    Tcl_DeleteEvents(MotionEventDeleteProc, (ClientData)motionPtr->videoPtr);
+    MotionFreeBuffers(motionPtr);
+    if (motionPtr->moving != NULL)
+        ckfree((char *)motionPtr->moving);
+    Tcl_ConditionFinalize(&motionPtr->cond);
+    Tcl_MutexFinalize(&motionPtr->lock);
+    ckfree((char *)motionPtr);
+}
+
+/*
+ * Start the detector, or change its settings if it is already running.
+ * Options not given keep their current values.
+ */
+
+static int
+MotionStart(Video *videoPtr, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *options[] = { "-cells", "-decay", "-threshold", NULL };
+    enum { OPT_CELLS, OPT_DECAY, OPT_THRESHOLD };
+    VideoMotion *motionPtr = videoPtr->motionPtr;
+    int threshold = 16, cells = 1, shift = 5;
+    int index, value, n;
+
+    if ((objc % 2) != 1) {
+        Tcl_WrongNumArgs(interp, 3, objv, "?-threshold level? ?-cells n? ?-decay frames?");
+        return TCL_ERROR;
+    }
+    if (motionPtr != NULL) {
+        Tcl_MutexLock(&motionPtr->lock);
+        threshold = motionPtr->threshold;
+        cells = motionPtr->cells;
+        shift = motionPtr->shift;
+        Tcl_MutexUnlock(&motionPtr->lock);
+    }
+    for (n = 3; n < objc; n += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index) != TCL_OK
+            || Tcl_GetIntFromObj(interp, objv[n + 1], &value) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        switch (index) {
+        case OPT_THRESHOLD:
+            if (value < 1 || value > 255) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "invalid threshold %d: must be from 1 to 255", value));
+                return TCL_ERROR;
+            }
+            threshold = value;
+            break;
+        case OPT_CELLS:
+            if (value < 1) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "invalid cell count %d: must be at least 1", value));
+                return TCL_ERROR;
+            }
+            cells = value;
+            break;
+        case OPT_DECAY:
+            if (value < 1 || value > MOTION_MAX_DECAY) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "invalid decay %d: must be from 1 to %d frames",
+                    value, MOTION_MAX_DECAY));
+                return TCL_ERROR;
+            }
+            for (shift = 0; (2 << shift) <= value; ++shift)
+                ;
+            break;
+        }
+    }
+
+    if (motionPtr != NULL) {
+        Tcl_MutexLock(&motionPtr->lock);
+        motionPtr->threshold = threshold;
+        motionPtr->cells = cells;
+        motionPtr->shift = shift;
+        Tcl_MutexUnlock(&motionPtr->lock);
+        return TCL_OK;
+    }
+
+    motionPtr = (VideoMotion *)ckalloc(sizeof(VideoMotion));
+    memset(motionPtr, 0, sizeof(VideoMotion));
+    motionPtr->videoPtr = videoPtr;
+    motionPtr->threshold = threshold;
+    motionPtr->cells = cells;
+    motionPtr->shift = shift;
+    motionPtr->sinkPtr = VideoSinkCreate(videoPtr, "motion", 1, MotionWake, motionPtr);
+    videoPtr->motionPtr = motionPtr;
+    return TCL_OK;
+}
+
+static Tcl_Obj *
+MotionInfo(VideoMotion *motionPtr)
+{
+    Tcl_Obj *resultObj = Tcl_NewObj();
+    Tcl_WideInt delivered, dropped;
+
+    VideoSinkCounts(motionPtr->sinkPtr, &delivered, &dropped);
+    Tcl_MutexLock(&motionPtr->lock);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("threshold", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(motionPtr->threshold));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("cells", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(motionPtr->cells));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("decay", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(1 << motionPtr->shift));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("analysed", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(motionPtr->analysed));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("events", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(motionPtr->events));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("dropped", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(dropped));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("time", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(motionPtr->analysed
+        ? motionPtr->totalTime / motionPtr->analysed : 0));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("peak", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(motionPtr->peakTime));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("kernel", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(kernelName, -1));
+    Tcl_MutexUnlock(&motionPtr->lock);
+    return resultObj;
+}
+
+/**
+ * Stop any motion detector for a widget. Called when the widget is
+ * destroyed.
+ */
+
+void
+VideoMotionClose(Video *videoPtr)
+{
+    if (videoPtr->motionPtr != NULL) {
+        MotionStop(videoPtr->motionPtr);
+        videoPtr->motionPtr = NULL;
+    }
+}
+
+/**
+ * Implement the motion widget subcommand.
+ */
+
+int
+VideoWidgetMotionCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    static const char *commands[] = { "info", "start", "stop", NULL };
+    enum { MOTION_INFO, MOTION_START, MOTION_STOP };
+    int index;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "command ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], commands, "command", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    switch (index) {
+    case MOTION_START:
+        return MotionStart(videoPtr, interp, objc, objv);
+    case MOTION_STOP:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, "");
+            return TCL_ERROR;
+        }
+        VideoMotionClose(videoPtr);
+        return TCL_OK;
+    case MOTION_INFO:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, "");
+            return TCL_ERROR;
+        }
+        if (videoPtr->motionPtr != NULL) {
+            Tcl_SetObjResult(interp, MotionInfo(videoPtr->motionPtr));
+        }
+        return TCL_OK;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,716 @@
+/* pool.c - worker threads shared by every widget
+ *
+ *      tkvideo::pool configure ?-threads n?
+ *      tkvideo::pool cget -threads
+ *      tkvideo::pool info
+ *
+ * The work on frames that costs processor time, such as compressing
+ * them or looking for motion in them, is done by one pool of threads
+ * for the whole process rather than by threads belonging to each
+ * widget, so that forty widgets do not start many times more threads
+ * than there are processors to run them. The pool is created by
+ * Tkvideo_Init with a thread for each processor and may be resized at
+ * any time with tkvideo::pool configure -threads.
+ *
+ * A task is a procedure and its client data, given to VideoPoolSubmit
+ * with an affinity, normally the widget it works for. Each worker has a
+ * deque of tasks and the tasks of a widget are all put on the same one,
+ * so that they tend to run on the thread whose cache already holds the
+ * widget's buffers. A worker runs the tasks on its own deque in the
+ * order they were given, so that no widget is starved by another, and
+ * when it has none it steals the newest task from the far end of
+ * another worker's deque. Each deque has a lock of its own and the
+ * owner and the thieves work at opposite ends of it.
+ *
+ * Idle workers sleep on a count of the tasks not yet taken, kept under
+ * the pool's lock. A worker reserves a task from the count before it
+ * looks for one, so it never searches for a task that another worker
+ * has already claimed, and the count is raised only once the task is on
+ * a deque.
+ *
+ * Tasks must not block for long. Stages that wait on the disk or the
+ * network, such as the recording writer or the streaming server, keep
+ * threads of their own and give only their processor work to the pool.
+ *
+ * A single large frame is shared out too. VideoPoolStripes cuts the
+ * rows of work on a frame, such as converting or scaling it, into
+ * horizontal stripes small enough to stay in the processor's cache and
+ * gives helper tasks to the pool. The calling thread and the helpers
+ * each claim the next stripe until none are left, and the call returns
+ * once every stripe is done, so the frame is complete before it is
+ * shown or handed on. The caller never waits for a helper that has not
+ * started, which may be queued behind it when the caller is itself a
+ * worker; a helper that starts late finds nothing to do. Frames smaller
+ * than VIDEO_STRIPE_PIXELS are done on the calling thread alone, as
+ * the cost of sharing them out is more than the gain.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+#include "tkvideo.h"
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#define POOL_MAX_THREADS  128   /* largest -threads */
+#define POOL_DEQUE_SIZE   16    /* tasks a deque first has room for */
+#define POOL_STRIPE_PIXELS 32768 /* pixels in a stripe: 128KB of RGBA */
+
+typedef struct {
+    VideoTaskProc *proc;
+    ClientData clientData;
+} PoolTask;
+
+typedef struct {
+    int index;                  /* position in pool.workers */
+    Tcl_ThreadId threadId;
+    int started;                /* has a thread, protected by pool.lock */
+
+    Tcl_Mutex lock;             /* protects the deque */
+    PoolTask *tasks;            /* circular, size a power of two */
+    int size;
+    int head;                   /* the oldest task, run next by the owner */
+    int count;
+} PoolWorker;
+
+typedef struct PoolStripes {
+    struct PoolStripes *nextPtr; /* on the free list */
+    VideoStripeProc *proc;
+    ClientData clientData;
+    int rows;                   /* rows in the frame */
+    int stripe;                 /* rows in each stripe */
+    int next;                   /* first row of the next stripe to claim */
+    int running;                /* stripes claimed and not yet done */
+    int lanes;                  /* lanes handed out */
+    int refCount;               /* the caller and helpers yet to run */
+    Tcl_Condition done;         /* notified when the last stripe is done */
+} PoolStripes;
+
+static struct {
+    Tcl_Mutex lock;             /* protects all the fields below */
+    Tcl_Condition cond;         /* wakes idle workers */
+    int initialized;
+    int quit;                   /* the process is exiting */
+    int threads;                /* workers wanted */
+    int slots;                  /* workers that have ever been started */
+    int pending;                /* tasks on the deques and not reserved */
+    unsigned int next;          /* deque for tasks without an affinity */
+    Tcl_WideInt submitted;
+    Tcl_WideInt executed;
+    Tcl_WideInt stolen;         /* taken from another worker's deque */
+    PoolWorker workers[POOL_MAX_THREADS];
+} pool;
+
+TCL_DECLARE_MUTEX(resizeLock)   /* held while threads are started or joined */
+TCL_DECLARE_MUTEX(stripeLock)   /* protects every PoolStripes and those below */
+static Tcl_WideInt striped;     /* frames shared out in stripes */
+static PoolStripes *stripesFree; /* finished jobs, kept with their condition */
+
+static Tcl_ThreadCreateType PoolThreadProc(ClientData clientData);
+static void PoolExitHandler(ClientData clientData);
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * @return the number of processors the process may run on.
+ */
+
+static int
+PoolProcessors(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    long n;
+
+    GetSystemInfo(&info);
+    n = (long)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return n < 1 ? 1 : (n > POOL_MAX_THREADS ? POOL_MAX_THREADS : (int)n);
+}
+
+/*
+ * The worker whose deque holds the tasks of an affinity. The pointer is
+ * mixed so that widgets allocated one after another spread evenly over
+ * the workers. Called with the pool's lock held.
+ */
+
+static int
+PoolHome(ClientData affinity)
+{
+    size_t h = (size_t)affinity;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return (int)(h % (size_t)pool.threads);
+}
+
+/*
+ * The worker running on the current thread, or -1 if it is not one of
+ * the pool's. A worker's thread id is stored under the pool's lock as
+ * it is created, so it is known before the worker can run any task.
+ * Called with the pool's lock held.
+ */
+
+static int
+PoolSelf(void)
+{
+    Tcl_ThreadId self = Tcl_GetCurrentThread();
+    int n;
+
+    for (n = 0; n < pool.slots; ++n) {
+        if (pool.workers[n].started && pool.workers[n].threadId == self)
+            return n;
+    }
+    return -1;
+}
+
+/*
+ * Add a task at the tail of a worker's deque, doubling it when full.
+ * Called with the deque's lock held.
+ */
+
+static void
+DequePush(PoolWorker *workerPtr, VideoTaskProc *proc, ClientData clientData)
+{
+    PoolTask *taskPtr;
+
+    if (workerPtr->count == workerPtr->size) {
+        int size = workerPtr->size ? workerPtr->size * 2 : POOL_DEQUE_SIZE;
+        PoolTask *tasks = (PoolTask *)ckalloc(size * sizeof(PoolTask));
+        int n;
+
+        for (n = 0; n < workerPtr->count; ++n) {
+            tasks[n] = workerPtr->tasks[(workerPtr->head + n) & (workerPtr->size - 1)];
+        }
+        if (workerPtr->tasks != NULL)
+            ckfree((char *)workerPtr->tasks);
+        workerPtr->tasks = tasks;
+        workerPtr->size = size;
+        workerPtr->head = 0;
+    }
+    taskPtr = &workerPtr->tasks[(workerPtr->head + workerPtr->count) & (workerPtr->size - 1)];
+    taskPtr->proc = proc;
+    taskPtr->clientData = clientData;
+    ++workerPtr->count;
+}
+
+/*
+ * Find the task a worker has reserved: the oldest on its own deque or
+ * else the newest on the first other deque that has one. There is
+ * always one somewhere, as every reservation is matched by a task, but
+ * the worker may have to look more than once while others take theirs.
+ *
+ * @return 1 if the task was stolen from another worker.
+ */
+
+static int
+PoolTake(PoolWorker *workerPtr, int slots, PoolTask *taskPtr)
+{
+    int n;
+
+    for (;;) {
+        for (n = 0; n < slots; ++n) {
+            PoolWorker *otherPtr = &pool.workers[(workerPtr->index + n) % slots];
+
+            Tcl_MutexLock(&otherPtr->lock);
+            if (otherPtr->count > 0) {
+                if (n == 0) {
+                    *taskPtr = otherPtr->tasks[otherPtr->head];
+                    otherPtr->head = (otherPtr->head + 1) & (otherPtr->size - 1);
+                } else {
+                    *taskPtr = otherPtr->tasks[(otherPtr->head + otherPtr->count - 1)
+                                               & (otherPtr->size - 1)];
+                }
+                --otherPtr->count;
+                Tcl_MutexUnlock(&otherPtr->lock);
+                return n != 0;
+            }
+            Tcl_MutexUnlock(&otherPtr->lock);
+        }
+    }
+}
+
+/*
+ * A worker runs tasks until the pool is made smaller than its place in
+ * it or, as the process exits, until no tasks remain. Tasks left on the
+ * deque of a worker that has gone are taken by the others.
+ */
+
+static Tcl_ThreadCreateType
+PoolThreadProc(ClientData clientData)
+{
+    PoolWorker *workerPtr = (PoolWorker *)clientData;
+
+    Tcl_MutexLock(&pool.lock);
+    for (;;) {
+        PoolTask task;
+        int slots, stolen;
+
+        if (workerPtr->index >= pool.threads)
+            break;
+        if (pool.pending == 0) {
+            if (pool.quit)
+                break;
+            Tcl_ConditionWait(&pool.cond, &pool.lock, NULL);
+            continue;
+        }
+        --pool.pending;
+        slots = pool.slots;
+        Tcl_MutexUnlock(&pool.lock);
+
+        stolen = PoolTake(workerPtr, slots, &task);
+        task.proc(task.clientData);
+
+        Tcl_MutexLock(&pool.lock);
+        ++pool.executed;
+        pool.stolen += stolen;
+    }
+    Tcl_MutexUnlock(&pool.lock);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Start or stop workers to leave the given number running. Those that
+ * are no longer wanted finish the task they are running and are
+ * joined before this returns. Called with resizeLock held.
+ *
+ * Returns TCL_ERROR, with the pool left at the size it reached, if a
+ * thread cannot be created.
+ */
+
+static int
+PoolResize(int threads)
+{
+    Tcl_ThreadId joinIds[POOL_MAX_THREADS];
+    int n, result, joins = 0, r = TCL_OK;
+
+    Tcl_MutexLock(&pool.lock);
+    for (n = 0; n < threads && r == TCL_OK; ++n) {
+        PoolWorker *workerPtr = &pool.workers[n];
+
+        if (workerPtr->started)
+            continue;
+        workerPtr->index = n;
+        pool.threads = n + 1;
+        if (Tcl_CreateThread(&workerPtr->threadId, PoolThreadProc, workerPtr,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+            pool.threads = n;
+            r = TCL_ERROR;
+            break;
+        }
+        workerPtr->started = 1;
+        if (n >= pool.slots)
+            pool.slots = n + 1;
+    }
+    if (r == TCL_OK)
+        pool.threads = threads;
+    for (n = pool.threads; n < pool.slots; ++n) {
+        if (pool.workers[n].started) {
+            pool.workers[n].started = 0;
+            joinIds[joins++] = pool.workers[n].threadId;
+        }
+    }
+    Tcl_ConditionNotify(&pool.cond);
+    Tcl_MutexUnlock(&pool.lock);
+
+    for (n = 0; n < joins; ++n) {
+        Tcl_JoinThread(joinIds[n], &result);
+    }
+    return r;
+}
+
+/*
+ * On exit the tasks already given are run, so that the stages waiting
+ * for them, such as the picture writer, can finish, and the workers are
+ * then joined. Any task given as the last of them left is run here.
+ */
+
+static void
+PoolExitHandler(ClientData clientData)
+{
+    Tcl_ThreadId joinIds[POOL_MAX_THREADS];
+    int n, result, joins = 0;
+
+    Tcl_MutexLock(&resizeLock);
+    Tcl_MutexLock(&pool.lock);
+    pool.quit = 1;
+    for (n = 0; n < pool.slots; ++n) {
+        if (pool.workers[n].started) {
+            pool.workers[n].started = 0;
+            joinIds[joins++] = pool.workers[n].threadId;
+        }
+    }
+    Tcl_ConditionNotify(&pool.cond);
+    Tcl_MutexUnlock(&pool.lock);
+    for (n = 0; n < joins; ++n) {
+        Tcl_JoinThread(joinIds[n], &result);
+    }
+
+    Tcl_MutexLock(&pool.lock);
+    pool.threads = 0;
+    while (pool.pending > 0) {
+        PoolTask task;
+
+        --pool.pending;
+        PoolTake(&pool.workers[0], pool.slots, &task);
+        Tcl_MutexUnlock(&pool.lock);
+        task.proc(task.clientData);
+        Tcl_MutexLock(&pool.lock);
+    }
+    for (n = 0; n < pool.slots; ++n) {
+        PoolWorker *workerPtr = &pool.workers[n];
+
+        if (workerPtr->tasks != NULL)
+            ckfree((char *)workerPtr->tasks);
+        Tcl_MutexFinalize(&workerPtr->lock);
+        memset(workerPtr, 0, sizeof(PoolWorker));
+    }
+    pool.slots = 0;
+    pool.initialized = 0;
+    Tcl_MutexUnlock(&pool.lock);
+    Tcl_MutexUnlock(&resizeLock);
+
+    Tcl_MutexLock(&stripeLock);
+    while (stripesFree != NULL) {
+        PoolStripes *jobPtr = stripesFree;
+        stripesFree = jobPtr->nextPtr;
+        Tcl_ConditionFinalize(&jobPtr->done);
+        ckfree((char *)jobPtr);
+    }
+    Tcl_MutexUnlock(&stripeLock);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * Create the pool, with a worker for each processor, unless it already
+ * exists. Called by Tkvideo_Init in each interpreter that loads the
+ * package; the pool is shared by all of them.
+ *
+ * @return a Tcl result code, with an error in the interpreter if no
+ *  worker could be started.
+ */
+
+int
+VideoPoolInit(Tcl_Interp *interp)
+{
+    int r = TCL_OK;
+
+    Tcl_MutexLock(&resizeLock);
+    if (!pool.initialized) {
+        pool.initialized = 1;
+        pool.quit = 0;
+        Tcl_CreateExitHandler(PoolExitHandler, NULL);
+        r = PoolResize(PoolProcessors());
+    }
+    Tcl_MutexUnlock(&resizeLock);
+    if (r != TCL_OK && VideoPoolThreads() == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("cannot create pool thread", -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/**
+ * @return the number of workers in the pool.
+ */
+
+int
+VideoPoolThreads(void)
+{
+    int threads;
+
+    Tcl_MutexLock(&pool.lock);
+    threads = pool.threads;
+    Tcl_MutexUnlock(&pool.lock);
+    return threads;
+}
+
+/**
+ * Give the pool a task: proc is called with clientData on one of the
+ * workers. Tasks with the same affinity, normally the widget they work
+ * for, are put on the same worker's deque and run in the order given
+ * unless other workers are idle and steal them. A task given by a
+ * worker without an affinity is put on that worker's own deque; others
+ * are shared out in turn.
+ *
+ * May be called on any thread. It must not be called with a lock held
+ * that the task takes: once the pool has been shut down, as the process
+ * exits, the task is run at once on the calling thread.
+ */
+
+void
+VideoPoolSubmit(ClientData affinity, VideoTaskProc *proc, ClientData clientData)
+{
+    PoolWorker *workerPtr;
+    int index;
+
+    Tcl_MutexLock(&pool.lock);
+    if (pool.threads == 0) {
+        Tcl_MutexUnlock(&pool.lock);
+        proc(clientData);
+        return;
+    }
+    if (affinity != NULL) {
+        index = PoolHome(affinity);
+    } else if ((index = PoolSelf()) < 0 || index >= pool.threads) {
+        index = (int)(pool.next++ % (unsigned int)pool.threads);
+    }
+    workerPtr = &pool.workers[index];
+    Tcl_MutexLock(&workerPtr->lock);
+    DequePush(workerPtr, proc, clientData);
+    Tcl_MutexUnlock(&workerPtr->lock);
+    ++pool.pending;
+    ++pool.submitted;
+    Tcl_ConditionNotify(&pool.cond);
+    Tcl_MutexUnlock(&pool.lock);
+}
+
+/*
+ * Claim and run stripes of a frame until none are left. Each thread
+ * taking part is given a lane the first time it claims a stripe.
+ */
+
+static void
+StripesRun(PoolStripes *jobPtr)
+{
+    int lane = -1;
+
+    Tcl_MutexLock(&stripeLock);
+    while (jobPtr->next < jobPtr->rows) {
+        int first = jobPtr->next;
+        int last = first + jobPtr->stripe;
+
+        if (last > jobPtr->rows)
+            last = jobPtr->rows;
+        jobPtr->next = last;
+        if (lane < 0)
+            lane = jobPtr->lanes++;
+        ++jobPtr->running;
+        Tcl_MutexUnlock(&stripeLock);
+
+        jobPtr->proc(jobPtr->clientData, lane, first, last);
+
+        Tcl_MutexLock(&stripeLock);
+        if (--jobPtr->running == 0 && jobPtr->next >= jobPtr->rows)
+            Tcl_ConditionNotify(&jobPtr->done);
+    }
+    Tcl_MutexUnlock(&stripeLock);
+}
+
+/*
+ * A helper task. The last of the caller and its helpers to finish with
+ * the job puts it on the free list.
+ */
+
+static void
+StripesTask(ClientData clientData)
+{
+    PoolStripes *jobPtr = (PoolStripes *)clientData;
+
+    StripesRun(jobPtr);
+    Tcl_MutexLock(&stripeLock);
+    if (--jobPtr->refCount == 0) {
+        jobPtr->nextPtr = stripesFree;
+        stripesFree = jobPtr;
+    }
+    Tcl_MutexUnlock(&stripeLock);
+}
+
+/**
+ * Run proc over the rows of a frame, in stripes shared between the
+ * calling thread and the pool when the frame is large. pixels is the
+ * work on the whole frame, counted in pixels, which sets the number of
+ * rows in a stripe. proc is called with clientData, the lane of the
+ * thread running it and the rows, first to last - 1, of a stripe. Lanes
+ * are numbered from 0 and there are never more than VIDEO_STRIPE_LANES
+ * of them, so that proc may keep scratch buffers for each. Every stripe
+ * is done when this returns.
+ *
+ * May be called on any thread, including the workers.
+ */
+
+void
+VideoPoolStripes(int rows, Tcl_WideInt pixels, VideoStripeProc *proc,
+                 ClientData clientData)
+{
+    PoolStripes *jobPtr;
+    Tcl_Condition done;
+    int helpers, stripes, stripe, n;
+
+    helpers = VideoPoolThreads();
+    if (helpers > VIDEO_STRIPE_LANES - 1)
+        helpers = VIDEO_STRIPE_LANES - 1;
+    if (pixels < VIDEO_STRIPE_PIXELS || rows < 2 || helpers == 0) {
+        proc(clientData, 0, 0, rows);
+        return;
+    }
+    stripe = (int)(POOL_STRIPE_PIXELS * (Tcl_WideInt)rows / pixels);
+    if (stripe < 1)
+        stripe = 1;
+    stripes = (rows + stripe - 1) / stripe;
+    if (helpers > stripes - 1)
+        helpers = stripes - 1;
+
+    Tcl_MutexLock(&stripeLock);
+    jobPtr = stripesFree;
+    if (jobPtr != NULL)
+        stripesFree = jobPtr->nextPtr;
+    ++striped;
+    Tcl_MutexUnlock(&stripeLock);
+    if (jobPtr == NULL) {
+        jobPtr = (PoolStripes *)ckalloc(sizeof(PoolStripes));
+        jobPtr->done = NULL;
+    }
+    done = jobPtr->done;
+    memset(jobPtr, 0, sizeof(PoolStripes));
+    jobPtr->done = done;
+    jobPtr->proc = proc;
+    jobPtr->clientData = clientData;
+    jobPtr->rows = rows;
+    jobPtr->stripe = stripe;
+    jobPtr->refCount = 1 + helpers;
+    for (n = 0; n < helpers; ++n) {
+        VideoPoolSubmit(NULL, StripesTask, jobPtr);
+    }
+
+    StripesRun(jobPtr);
+    Tcl_MutexLock(&stripeLock);
+    while (jobPtr->running > 0) {
+        Tcl_ConditionWait(&jobPtr->done, &stripeLock, NULL);
+    }
+    if (--jobPtr->refCount == 0) {
+        jobPtr->nextPtr = stripesFree;
+        stripesFree = jobPtr;
+    }
+    Tcl_MutexUnlock(&stripeLock);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static Tcl_Obj *
+PoolInfo(void)
+{
+    Tcl_Obj *resultObj = Tcl_NewObj();
+    Tcl_WideInt stripedFrames;
+
+    Tcl_MutexLock(&stripeLock);
+    stripedFrames = striped;
+    Tcl_MutexUnlock(&stripeLock);
+
+    Tcl_MutexLock(&pool.lock);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("threads", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(pool.threads));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("queued", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(pool.pending));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("submitted", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(pool.submitted));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("executed", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(pool.executed));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("stolen", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(pool.stolen));
+    Tcl_MutexUnlock(&pool.lock);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("striped", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(stripedFrames));
+    return resultObj;
+}
+
+/**
+ * The tkvideo::pool command, to tune the pool and see how busy it is.
+ *
+ * @return a Tcl result code.
+ */
+
+int
+VideoPoolObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *commands[] = { "cget", "configure", "info", NULL };
+    enum { CMD_CGET, CMD_CONFIGURE, CMD_INFO };
+    static const char *options[] = { "-threads", NULL };
+    int index, option, threads, r;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "command ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    switch (index) {
+    case CMD_CGET:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "option");
+            return TCL_ERROR;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[2], options, "option", 0, &option) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(VideoPoolThreads()));
+        return TCL_OK;
+
+    case CMD_CONFIGURE:
+        if (objc == 2) {
+            Tcl_Obj *resultObj = Tcl_NewObj();
+            Tcl_ListObjAppendElement(interp, resultObj, Tcl_NewStringObj("-threads", -1));
+            Tcl_ListObjAppendElement(interp, resultObj, Tcl_NewIntObj(VideoPoolThreads()));
+            Tcl_SetObjResult(interp, resultObj);
+            return TCL_OK;
+        }
+        if (objc == 3) {
+            if (Tcl_GetIndexFromObj(interp, objv[2], options, "option", 0, &option) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(VideoPoolThreads()));
+            return TCL_OK;
+        }
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "?-threads n?");
+            return TCL_ERROR;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[2], options, "option", 0, &option) != TCL_OK
+            || Tcl_GetIntFromObj(interp, objv[3], &threads) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (threads < 1 || threads > POOL_MAX_THREADS) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "invalid thread count %d: must be from 1 to %d", threads, POOL_MAX_THREADS));
+            return TCL_ERROR;
+        }
+        Tcl_MutexLock(&resizeLock);
+        r = PoolResize(threads);
+        Tcl_MutexUnlock(&resizeLock);
+        if (r != TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "cannot create pool thread: the pool has %d threads", VideoPoolThreads()));
+            return TCL_ERROR;
+        }
+        return TCL_OK;
+
+    case CMD_INFO:
+        if (objc != 2) {
+            Tcl_WrongNumArgs(interp, 2, objv, "");
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, PoolInfo());
+        return TCL_OK;
+    }
+    return TCL_OK;
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
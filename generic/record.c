@@ -0,0 +1,757 @@
+/* record.c - recording the widget's frames to a file
+ *
+ * Where the platform has no recording of its own the -output option is
+ * implemented here, writing Motion JPEG AVI files (see avi.c). The
+ * recorder is a sink (see sink.c), so the capture thread only hands it
+ * a reference to each frame and is never held up by compression or by
+ * the disk.
+ *
+ * Frames are taken from the sink as they arrive and compressed in
+ * parallel by up to RECORD_ENCODERS tasks given to the worker pool (see
+ * pool.c), each keeping one of the recorder's JPEG encoders while it
+ * runs and taking frames until the sink is empty. The writer and the
+ * segment thread below wait on the disk and so keep threads of their
+ * own. Each frame is given a place in a fixed queue as it is taken, so
+ * the order of the frames is kept however the encoders finish. A single
+ * writer thread takes the compressed frames from the queue in order and
+ * adds them to the file, which gathers them into large blocks, and every
+ * few seconds checkpoints the file so that it can be played even if the
+ * recording is never stopped. The queue is bounded: when the disk falls
+ * behind the encoders stop taking frames and the sink drops them
+ * instead, so memory use stays fixed. Frames that were dropped, here or
+ * because the source skipped them, are written as empty chunks so that
+ * the file keeps the timing of the source.
+ *
+ * With the -segment option the recording is split into a series of
+ * files of a given duration or size. A segment thread opens each file
+ * ahead of time, so that the writer moves from one file to the next
+ * between two frames without waiting, and then completes the previous
+ * file while the writer carries on. Every frame is a key frame, so each
+ * file plays on its own. Should the next file not be ready in time the
+ * writer carries on with the current one until it is.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RECORD_ENCODERS  2      /* tasks compressing frames at once */
+#define RECORD_QUEUE     16     /* frames compressed and not yet written */
+#define RECORD_QUALITY   85     /* JPEG quality of the recorded frames */
+#define RECORD_MAX_GAP   300    /* longest run of lost frames filled in */
+#define RECORD_CHECKPOINT 5     /* seconds of frames between checkpoints */
+
+static const struct {
+    const char *unit;
+    double seconds;
+    double bytes;
+} segmentUnits[] = {
+    { "",   1.0,    0.0 },
+    { "s",  1.0,    0.0 },
+    { "m",  60.0,   0.0 },
+    { "h",  3600.0, 0.0 },
+    { "KB", 0.0,    1024.0 },
+    { "MB", 0.0,    1024.0 * 1024.0 },
+    { "GB", 0.0,    1024.0 * 1024.0 * 1024.0 },
+    { NULL, 0.0,    0.0 }
+};
+
+/**
+ * Parse a -segment value: a duration in seconds, with an optional unit
+ * of s, m or h, or a size with a unit of KB, MB or GB. An empty value
+ * means the recording is not split.
+ *
+ * @param secondsPtr [out] set to the duration of each file, or 0
+ * @param bytesPtr [out] set to the size of each file, or 0
+ *
+ * @return a Tcl result code.
+ */
+
+int
+VideoRecordParseSegment(Tcl_Interp *interp, Tcl_Obj *objPtr, double *secondsPtr,
+                        Tcl_WideInt *bytesPtr)
+{
+    const char *value = Tcl_GetString(objPtr);
+    char *end;
+    double n;
+    int u;
+
+    *secondsPtr = 0.0;
+    *bytesPtr = 0;
+    if (*value == 0)
+        return TCL_OK;
+    n = strtod(value, &end);
+    for (u = 0; segmentUnits[u].unit != NULL; ++u) {
+        if (end != value && strcmp(end, segmentUnits[u].unit) == 0 && n > 0.0
+            && n * (segmentUnits[u].seconds + segmentUnits[u].bytes) < 1e15) {
+            *secondsPtr = n * segmentUnits[u].seconds;
+            *bytesPtr = (Tcl_WideInt)(n * segmentUnits[u].bytes);
+            return TCL_OK;
+        }
+    }
+    if (interp != NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("invalid segment \"%s\": must be a"
+            " duration such as 600, 10m or 1h, or a size such as 500MB or 2GB", value));
+    }
+    return TCL_ERROR;
+}
+
+#ifdef HAVE_JPEG
+
+enum {
+    SLOT_FREE, SLOT_BUSY, SLOT_READY
+};
+
+typedef struct {
+    int state;                  /* one of the SLOT_* values */
+    Tcl_WideInt sequence;       /* source frame number */
+    int width;
+    int height;
+    unsigned char *data;        /* compressed frame */
+    size_t size;
+    size_t space;               /* allocated size of data */
+    int failed;                 /* the frame could not be compressed */
+} RecordSlot;
+
+struct VideoRecord {
+    Video *videoPtr;
+    VideoSink *sinkPtr;
+    VideoAvi *aviPtr;           /* used by the writer thread alone */
+    Tcl_Obj *pathPtr;           /* the file name */
+    char *baseName;             /* normalized file name, for any thread */
+    int width;
+    int height;
+    int rateNum;                /* frames per second as rateNum/rateDen */
+    int rateDen;
+    Tcl_WideInt checkpointFrames; /* frames between checkpoints of the file */
+    Tcl_WideInt checkpoint;     /* writer: frames in the file at the last one */
+    Tcl_WideInt segmentFrames;  /* frames in each file, or 0 */
+    Tcl_WideInt segmentBytes;   /* size of each file, or 0 */
+    Tcl_ThreadId writerId;
+    int haveWriter;
+    Tcl_ThreadId segmenterId;
+    int haveSegmenter;
+
+    Tcl_Mutex lock;             /* protects all the fields below */
+    Tcl_Condition cond;         /* wakes the writer and the segment thread,
+                                 * and signals the end of an encoding task */
+    int quit;
+    int encoding;               /* encoding tasks given or running */
+    VideoJpeg *idle[RECORD_ENCODERS]; /* encoders not in use by a task */
+    int idleCount;
+    RecordSlot slots[RECORD_QUEUE];
+    Tcl_WideInt nextTicket;     /* queue position of the next frame taken */
+    Tcl_WideInt nextWrite;      /* queue position the writer waits for */
+    Tcl_WideInt lastSequence;   /* source frame number last written */
+    Tcl_WideInt frames;         /* frames written */
+    Tcl_WideInt repeated;       /* empty chunks written for lost frames */
+    Tcl_WideInt bytes;
+    int segment;                /* number of the file being written, from 1 */
+    VideoAvi *nextAviPtr;       /* the next file, opened ahead */
+    VideoAvi *closingPtr;       /* a finished file still to be completed */
+    Tcl_WideInt doneFrames;     /* frames and bytes in finished files */
+    Tcl_WideInt doneBytes;
+    int segmentQuit;
+    int noNext;                 /* the next file could not be opened */
+    int failed;
+    char message[256];
+};
+
+static void RecordEncoderTask(ClientData clientData);
+static Tcl_ThreadCreateType RecordWriterProc(ClientData clientData);
+static Tcl_ThreadCreateType RecordSegmentProc(ClientData clientData);
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * The name of a file of the recording: the -output name itself or, when
+ * segmenting, with the file number before the extension, as in
+ * "name-0001.avi".
+ */
+
+static Tcl_Obj *
+RecordFileName(const VideoRecord *recordPtr, int number)
+{
+    const char *base = recordPtr->baseName;
+    const char *ext = strrchr(base, '.');
+
+    if (recordPtr->segmentFrames == 0 && recordPtr->segmentBytes == 0)
+        return Tcl_NewStringObj(base, -1);
+    if (ext == NULL || strchr(ext, '/') != NULL || strchr(ext, '\\') != NULL)
+        ext = base + strlen(base);
+    return Tcl_ObjPrintf("%.*s-%04d%s", (int)(ext - base), base, number, ext);
+}
+
+/*
+ * Create a file of the recording. May be called on any thread.
+ */
+
+static VideoAvi *
+RecordOpen(const VideoRecord *recordPtr, int number, char *message)
+{
+    Tcl_Obj *nameObj = RecordFileName(recordPtr, number);
+    const void *native;
+    VideoAvi *aviPtr = NULL;
+
+    Tcl_IncrRefCount(nameObj);
+    native = Tcl_FSGetNativePath(nameObj);
+    if (native == NULL) {
+        sprintf(message, "invalid file name \"%.200s\"", Tcl_GetString(nameObj));
+    } else {
+        aviPtr = VideoAviCreate(native, recordPtr->width, recordPtr->height,
+                                recordPtr->rateNum, recordPtr->rateDen, message);
+    }
+    Tcl_DecrRefCount(nameObj);
+    return aviPtr;
+}
+
+/*
+ * Note an error, to be reported when the recording is stopped. Only the
+ * first is kept. Called with the lock held.
+ */
+
+static void
+RecordFailed(VideoRecord *recordPtr, const char *message)
+{
+    if (!recordPtr->failed) {
+        recordPtr->failed = 1;
+        strcpy(recordPtr->message, message);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Called on the capture thread when a frame is waiting in the sink, and
+ * on the writer thread when it makes room in a full queue. Another
+ * encoding task is given to the pool unless RECORD_ENCODERS of them are
+ * already waiting or running, as then one of those will take the frame.
+ */
+
+static void
+RecordWake(ClientData clientData)
+{
+    VideoRecord *recordPtr = (VideoRecord *)clientData;
+    int submit;
+
+    Tcl_MutexLock(&recordPtr->lock);
+    submit = recordPtr->encoding < RECORD_ENCODERS && !recordPtr->quit;
+    if (submit)
+        ++recordPtr->encoding;
+    Tcl_MutexUnlock(&recordPtr->lock);
+    if (submit)
+        VideoPoolSubmit(recordPtr->videoPtr, RecordEncoderTask, recordPtr);
+}
+
+static void
+RecordEncoderTask(ClientData clientData)
+{
+    VideoRecord *recordPtr = (VideoRecord *)clientData;
+    VideoJpeg *jpegPtr;
+
+    Tcl_MutexLock(&recordPtr->lock);
+    jpegPtr = recordPtr->idle[--recordPtr->idleCount];
+    while (!recordPtr->quit) {
+        VideoBuffer *bufferPtr = NULL;
+        const VideoFrame *framePtr;
+        RecordSlot *slotPtr;
+        const unsigned char *data;
+        size_t size;
+        int failed;
+
+        if (recordPtr->nextTicket - recordPtr->nextWrite >= RECORD_QUEUE
+            || (bufferPtr = VideoSinkTake(recordPtr->sinkPtr)) == NULL) {
+            break;
+        }
+        slotPtr = &recordPtr->slots[recordPtr->nextTicket++ % RECORD_QUEUE];
+        slotPtr->state = SLOT_BUSY;
+        Tcl_MutexUnlock(&recordPtr->lock);
+
+        framePtr = VideoBufferFrame(bufferPtr);
+        slotPtr->sequence = framePtr->sequence;
+        slotPtr->width = framePtr->width;
+        slotPtr->height = framePtr->height;
+        failed = VideoJpegEncode(jpegPtr, framePtr, RECORD_QUALITY, &data, &size) != TCL_OK;
+        VideoBufferRelease(bufferPtr);
+        if (!failed && size > slotPtr->space) {
+            unsigned char *newPtr = (unsigned char *)
+                attemptckrealloc((char *)slotPtr->data, size);
+            if (newPtr != NULL) {
+                slotPtr->data = newPtr;
+                slotPtr->space = size;
+            }
+            failed = (newPtr == NULL);
+        }
+        if (!failed) {
+            memcpy(slotPtr->data, data, size);
+            slotPtr->size = size;
+        }
+        slotPtr->failed = failed;
+
+        Tcl_MutexLock(&recordPtr->lock);
+        slotPtr->state = SLOT_READY;
+        Tcl_ConditionNotify(&recordPtr->cond);
+    }
+    recordPtr->idle[recordPtr->idleCount++] = jpegPtr;
+    --recordPtr->encoding;
+    Tcl_ConditionNotify(&recordPtr->cond);
+    Tcl_MutexUnlock(&recordPtr->lock);
+}
+
+/*
+ * Before writing a frame of size bytes, move to the next file if the
+ * current one is full and the next is ready. Called on the writer
+ * thread.
+ */
+
+static void
+RecordSegmentDue(VideoRecord *recordPtr, size_t size)
+{
+    Tcl_WideInt frames, bytes;
+
+    VideoAviCounts(recordPtr->aviPtr, &frames, &bytes);
+    if (frames == 0
+        || !((recordPtr->segmentFrames > 0 && frames >= recordPtr->segmentFrames)
+             || (recordPtr->segmentBytes > 0
+                 && bytes + 8 + (Tcl_WideInt)size > recordPtr->segmentBytes)))
+        return;
+
+    Tcl_MutexLock(&recordPtr->lock);
+    if (recordPtr->nextAviPtr != NULL && recordPtr->closingPtr == NULL) {
+        recordPtr->closingPtr = recordPtr->aviPtr;
+        recordPtr->aviPtr = recordPtr->nextAviPtr;
+        recordPtr->nextAviPtr = NULL;
+        recordPtr->doneFrames += frames;
+        recordPtr->doneBytes += bytes;
+        ++recordPtr->segment;
+        recordPtr->checkpoint = 0;
+        Tcl_ConditionNotify(&recordPtr->cond);
+    }
+    Tcl_MutexUnlock(&recordPtr->lock);
+}
+
+/*
+ * Add one compressed frame to the file, preceded by an empty chunk for
+ * each frame lost since the last one. Frames that could not be
+ * compressed, or whose size does not match the file, are lost frames.
+ */
+
+static int
+RecordWriteSlot(VideoRecord *recordPtr, RecordSlot *slotPtr, Tcl_WideInt *repeatedPtr)
+{
+    Tcl_WideInt gap = slotPtr->sequence - recordPtr->lastSequence - 1;
+    int r = TCL_OK;
+
+    if (slotPtr->failed || slotPtr->width != recordPtr->width
+        || slotPtr->height != recordPtr->height) {
+        return TCL_OK;
+    }
+    if (recordPtr->lastSequence >= 0 && gap > 0 && gap <= RECORD_MAX_GAP) {
+        *repeatedPtr += gap;
+        while (gap-- > 0 && r == TCL_OK) {
+            r = VideoAviWrite(recordPtr->aviPtr, NULL, 0);
+        }
+    }
+    if (r == TCL_OK && (recordPtr->segmentFrames > 0 || recordPtr->segmentBytes > 0))
+        RecordSegmentDue(recordPtr, slotPtr->size);
+    if (r == TCL_OK)
+        r = VideoAviWrite(recordPtr->aviPtr, slotPtr->data, slotPtr->size);
+    recordPtr->lastSequence = slotPtr->sequence;
+    return r;
+}
+
+static Tcl_ThreadCreateType
+RecordWriterProc(ClientData clientData)
+{
+    VideoRecord *recordPtr = (VideoRecord *)clientData;
+    char message[256];
+    int failed = 0;
+
+    Tcl_MutexLock(&recordPtr->lock);
+    for (;;) {
+        RecordSlot *slotPtr = &recordPtr->slots[recordPtr->nextWrite % RECORD_QUEUE];
+        Tcl_WideInt repeated = 0, frames, bytes;
+        int full;
+
+        if (slotPtr->state == SLOT_READY) {
+            Tcl_MutexUnlock(&recordPtr->lock);
+            if (!failed && RecordWriteSlot(recordPtr, slotPtr, &repeated) != TCL_OK) {
+                failed = 1;
+            }
+            VideoAviCounts(recordPtr->aviPtr, &frames, &bytes);
+            Tcl_MutexLock(&recordPtr->lock);
+            slotPtr->state = SLOT_FREE;
+            full = (recordPtr->nextTicket - recordPtr->nextWrite >= RECORD_QUEUE);
+            ++recordPtr->nextWrite;
+            recordPtr->frames = recordPtr->doneFrames + frames;
+            recordPtr->bytes = recordPtr->doneBytes + bytes;
+            recordPtr->repeated += repeated;
+            Tcl_ConditionNotify(&recordPtr->cond);
+            if (full) {
+                /* the encoders left a frame in the sink for want of room */
+                Tcl_MutexUnlock(&recordPtr->lock);
+                RecordWake(recordPtr);
+                Tcl_MutexLock(&recordPtr->lock);
+            }
+            if (failed || frames - recordPtr->checkpoint < recordPtr->checkpointFrames)
+                continue;
+
+            /* keep the file playable should the recording never be stopped */
+            Tcl_MutexUnlock(&recordPtr->lock);
+            failed = (VideoAviCheckpoint(recordPtr->aviPtr) != TCL_OK);
+            recordPtr->checkpoint = frames;
+            Tcl_MutexLock(&recordPtr->lock);
+            continue;
+        }
+        if (recordPtr->quit && recordPtr->nextWrite == recordPtr->nextTicket) {
+            break;
+        }
+        Tcl_ConditionWait(&recordPtr->cond, &recordPtr->lock, NULL);
+    }
+    Tcl_MutexUnlock(&recordPtr->lock);
+
+    if (VideoAviClose(recordPtr->aviPtr, message) != TCL_OK) {
+        Tcl_MutexLock(&recordPtr->lock);
+        RecordFailed(recordPtr, message);
+        Tcl_MutexUnlock(&recordPtr->lock);
+    }
+    recordPtr->aviPtr = NULL;
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * The segment thread completes each file the writer has finished with
+ * and then opens the one after the file now being written.
+ */
+
+static Tcl_ThreadCreateType
+RecordSegmentProc(ClientData clientData)
+{
+    VideoRecord *recordPtr = (VideoRecord *)clientData;
+    char message[256];
+
+    Tcl_MutexLock(&recordPtr->lock);
+    for (;;) {
+        VideoAvi *aviPtr = recordPtr->closingPtr;
+        int number;
+
+        if (aviPtr != NULL) {
+            Tcl_MutexUnlock(&recordPtr->lock);
+            if (VideoAviClose(aviPtr, message) != TCL_OK) {
+                Tcl_MutexLock(&recordPtr->lock);
+                RecordFailed(recordPtr, message);
+            } else {
+                Tcl_MutexLock(&recordPtr->lock);
+            }
+            recordPtr->closingPtr = NULL;
+            continue;
+        }
+        if (recordPtr->nextAviPtr == NULL && !recordPtr->segmentQuit && !recordPtr->noNext) {
+            number = recordPtr->segment + 1;
+            Tcl_MutexUnlock(&recordPtr->lock);
+            aviPtr = RecordOpen(recordPtr, number, message);
+            Tcl_MutexLock(&recordPtr->lock);
+            if (aviPtr == NULL) {
+                recordPtr->noNext = 1;
+                RecordFailed(recordPtr, message);
+            }
+            recordPtr->nextAviPtr = aviPtr;
+            continue;
+        }
+        if (recordPtr->segmentQuit)
+            break;
+        Tcl_ConditionWait(&recordPtr->cond, &recordPtr->lock, NULL);
+    }
+    Tcl_MutexUnlock(&recordPtr->lock);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Wait for the encoding tasks and stop the threads, which completes the
+ * file, and release the recorder. Returns TCL_ERROR with the message set
+ * if the recording failed.
+ */
+
+static int
+RecordFree(VideoRecord *recordPtr, char *message)
+{
+    int n, result, r = TCL_OK;
+
+    Tcl_MutexLock(&recordPtr->lock);
+    recordPtr->quit = 1;
+    Tcl_ConditionNotify(&recordPtr->cond);
+    while (recordPtr->encoding > 0)
+        Tcl_ConditionWait(&recordPtr->cond, &recordPtr->lock, NULL);
+    Tcl_MutexUnlock(&recordPtr->lock);
+    if (recordPtr->haveWriter) {
+        Tcl_JoinThread(recordPtr->writerId, &result);
+    } else if (recordPtr->aviPtr != NULL) {
+        VideoAviClose(recordPtr->aviPtr, recordPtr->message);
+    }
+    if (recordPtr->haveSegmenter) {
+        Tcl_MutexLock(&recordPtr->lock);
+        recordPtr->segmentQuit = 1;
+        Tcl_ConditionNotify(&recordPtr->cond);
+        Tcl_MutexUnlock(&recordPtr->lock);
+        Tcl_JoinThread(recordPtr->segmenterId, &result);
+    }
+    if (recordPtr->nextAviPtr != NULL) {
+        /* the file opened ahead was never used */
+        char unused[256];
+        Tcl_Obj *nameObj = RecordFileName(recordPtr, recordPtr->segment + 1);
+        Tcl_IncrRefCount(nameObj);
+        VideoAviClose(recordPtr->nextAviPtr, unused);
+        Tcl_FSDeleteFile(nameObj);
+        Tcl_DecrRefCount(nameObj);
+    }
+    if (recordPtr->failed) {
+        strcpy(message, recordPtr->message);
+        r = TCL_ERROR;
+    }
+    if (recordPtr->sinkPtr != NULL) {
+        VideoSinkDestroy(recordPtr->sinkPtr);
+    }
+    for (n = 0; n < recordPtr->idleCount; ++n) {
+        VideoJpegDestroy(recordPtr->idle[n]);
+    }
+    for (n = 0; n < RECORD_QUEUE; ++n) {
+        if (recordPtr->slots[n].data != NULL)
+            ckfree((char *)recordPtr->slots[n].data);
+    }
+    Tcl_DecrRefCount(recordPtr->pathPtr);
+    if (recordPtr->baseName != NULL)
+        ckfree(recordPtr->baseName);
+    Tcl_ConditionFinalize(&recordPtr->cond);
+    Tcl_MutexFinalize(&recordPtr->lock);
+    ckfree((char *)recordPtr);
+    return r;
+}
+
+#endif /* HAVE_JPEG */
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * Begin recording the widget's frames to the file named by its -output
+ * option. The file is created at once, for frames of the current video
+ * size at the given rate in frames per second, and the frames captured
+ * from now on are added to it until VideoRecordStop.
+ *
+ * @return a Tcl result code.
+ */
+
+int
+VideoRecordStart(Video *videoPtr, double rate)
+{
+#ifdef HAVE_JPEG
+    Tcl_Interp *interp = videoPtr->interp;
+    VideoRecord *recordPtr;
+    Tcl_Obj *normPtr, *nameObj;
+    char message[256];
+    double seconds;
+    Tcl_WideInt bytes;
+    int rateNum = (int)(rate * 1000.0 + 0.5), rateDen = 1000, a, b, n;
+
+    if (VideoRecordParseSegment(interp, videoPtr->segmentPtr, &seconds, &bytes) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    normPtr = Tcl_FSGetNormalizedPath(interp, videoPtr->outputPtr);
+    if (normPtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("invalid file name \"%s\"",
+            Tcl_GetString(videoPtr->outputPtr)));
+        return TCL_ERROR;
+    }
+
+    recordPtr = (VideoRecord *)ckalloc(sizeof(VideoRecord));
+    memset(recordPtr, 0, sizeof(VideoRecord));
+    recordPtr->videoPtr = videoPtr;
+    recordPtr->pathPtr = videoPtr->outputPtr;
+    Tcl_IncrRefCount(recordPtr->pathPtr);
+    recordPtr->baseName = strcpy(ckalloc(strlen(Tcl_GetString(normPtr)) + 1),
+                                 Tcl_GetString(normPtr));
+    recordPtr->width = videoPtr->videoWidth;
+    recordPtr->height = videoPtr->videoHeight;
+    recordPtr->lastSequence = -1;
+    recordPtr->checkpointFrames = (Tcl_WideInt)(rate * RECORD_CHECKPOINT);
+    if (recordPtr->checkpointFrames < 1)
+        recordPtr->checkpointFrames = 1;
+    if (seconds > 0.0) {
+        recordPtr->segmentFrames = (Tcl_WideInt)(seconds * rate + 0.5);
+        if (recordPtr->segmentFrames < 1)
+            recordPtr->segmentFrames = 1;
+    }
+    recordPtr->segmentBytes = bytes;
+    recordPtr->segment = 1;
+
+    /* the rate as a reduced fraction */
+    for (a = rateNum, b = rateDen; b != 0; ) {
+        n = a % b;
+        a = b;
+        b = n;
+    }
+    recordPtr->rateNum = rateNum / a;
+    recordPtr->rateDen = rateDen / a;
+    recordPtr->aviPtr = RecordOpen(recordPtr, 1, message);
+    if (recordPtr->aviPtr == NULL) {
+        nameObj = RecordFileName(recordPtr, 1);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error recording to \"%s\": %s",
+            Tcl_GetString(nameObj), message));
+        Tcl_DecrRefCount(nameObj);
+        RecordFree(recordPtr, message);
+        return TCL_ERROR;
+    }
+
+    for (n = 0; n < RECORD_ENCODERS; ++n) {
+        recordPtr->idle[recordPtr->idleCount++] = VideoJpegCreate();
+    }
+    recordPtr->sinkPtr = VideoSinkCreate(videoPtr, "record", RECORD_ENCODERS,
+                                         RecordWake, recordPtr);
+    if (Tcl_CreateThread(&recordPtr->writerId, RecordWriterProc, recordPtr,
+            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("cannot create recording thread", -1));
+        RecordFree(recordPtr, message);
+        return TCL_ERROR;
+    }
+    recordPtr->haveWriter = 1;
+    if (recordPtr->segmentFrames > 0 || recordPtr->segmentBytes > 0) {
+        if (Tcl_CreateThread(&recordPtr->segmenterId, RecordSegmentProc, recordPtr,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("cannot create recording thread", -1));
+            RecordFree(recordPtr, message);
+            return TCL_ERROR;
+        }
+        recordPtr->haveSegmenter = 1;
+    }
+    videoPtr->recordPtr = recordPtr;
+    return TCL_OK;
+#else
+    Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+        "recording is not available: tkvideo was built without JPEG support", -1));
+    return TCL_ERROR;
+#endif
+}
+
+/**
+ * Stop recording, if the widget is recording. The frames already taken
+ * are written and the file is completed and flushed to the disk.
+ *
+ * @return a Tcl result code. An error met at any time while recording
+ *  is reported here.
+ */
+
+int
+VideoRecordStop(Video *videoPtr)
+{
+#ifdef HAVE_JPEG
+    VideoRecord *recordPtr = videoPtr->recordPtr;
+    Tcl_Obj *pathPtr;
+    char message[256];
+
+    if (recordPtr == NULL)
+        return TCL_OK;
+    videoPtr->recordPtr = NULL;
+    pathPtr = recordPtr->pathPtr;
+    Tcl_IncrRefCount(pathPtr);
+    if (RecordFree(recordPtr, message) != TCL_OK) {
+        Tcl_SetObjResult(videoPtr->interp, Tcl_ObjPrintf("recording to \"%s\" failed: %s",
+            Tcl_GetString(pathPtr), message));
+        Tcl_DecrRefCount(pathPtr);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(pathPtr);
+    return TCL_OK;
+#else
+    return TCL_OK;
+#endif
+}
+
+/**
+ * @return a dictionary describing the recording for the stats command:
+ *  the file being written and, when segmenting, its number, the frames
+ *  and bytes written to all the files, the frames repeated to fill in
+ *  for lost frames and those dropped because the recorder was busy.
+ */
+
+Tcl_Obj *
+VideoRecordInfo(Video *videoPtr)
+{
+    Tcl_Obj *resultObj = Tcl_NewObj();
+#ifdef HAVE_JPEG
+    VideoRecord *recordPtr = videoPtr->recordPtr;
+    Tcl_WideInt delivered, dropped, frames, repeated, bytes;
+    int segment, segmenting = recordPtr->segmentFrames > 0 || recordPtr->segmentBytes > 0;
+
+    VideoSinkCounts(recordPtr->sinkPtr, &delivered, &dropped);
+    Tcl_MutexLock(&recordPtr->lock);
+    frames = recordPtr->frames;
+    repeated = recordPtr->repeated;
+    bytes = recordPtr->bytes;
+    segment = recordPtr->segment;
+    Tcl_MutexUnlock(&recordPtr->lock);
+
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("file", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, segmenting
+                             ? RecordFileName(recordPtr, segment) : recordPtr->pathPtr);
+    if (segmenting) {
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("segment", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(segment));
+    }
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("frames", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(frames));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("repeated", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(repeated));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("dropped", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(dropped));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(bytes));
+#endif
+    return resultObj;
+}
+
+/**
+ * Implement the tkvideo::repair command:
+ *
+ *     tkvideo::repair file
+ *
+ * Rebuild the index of a recording that was not stopped, by a crash or
+ * a loss of power for instance, so that every frame written to the disk
+ * can be played and seeked. Returns the number of frames in the file.
+ */
+
+int
+VideoRepairObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    const void *native;
+    Tcl_WideInt frames;
+    char message[256];
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "file");
+        return TCL_ERROR;
+    }
+    native = Tcl_FSGetNativePath(objv[1]);
+    if (native == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("invalid file name \"%s\"",
+            Tcl_GetString(objv[1])));
+        return TCL_ERROR;
+    }
+    if (VideoAviRepair(native, &frames, message) != TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("error repairing \"%s\": %s",
+            Tcl_GetString(objv[1]), message));
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(frames));
+    return TCL_OK;
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,561 @@
+/* ring.c - frame ring shared by a capture thread and the widget thread
+ *
+ * The platform code captures frames on its own thread and the widget
+ * reads them on the Tcl thread. Frames are passed through a ring of
+ * preallocated slots without any lock and without copying: the capture
+ * thread fills a free slot and publishes it, and the widget thread holds
+ * the newest published slot while it converts or draws it.
+ *
+ * There is exactly one producer and one consumer. The ring keeps two
+ * indices, shared between them:
+ *
+ *      published  the slot holding the newest complete frame, or -1
+ *      reading    the slot the consumer is using, or -1
+ *
+ * The producer only ever writes into a slot that is neither of these,
+ * so it needs at least two slots and with three or more it never has to
+ * drop a frame. The consumer claims the newest frame by storing its
+ * index in reading and then checking that it is still the published
+ * frame; if the producer published another in between, the consumer
+ * tries again with that one. Once the check succeeds the producer will
+ * see the claim before it next chooses a slot, so the frame cannot be
+ * overwritten until it is released. Both indices are accessed with
+ * sequentially consistent atomic operations, which this ordering relies
+ * on.
+ *
+ * Extra slots let a slow consumer hold a frame for longer while the
+ * producer keeps capturing.
+ *
+ * When several widgets show the same source (see source.c) they share
+ * one ring, and each of them holds the newest frame by taking a
+ * reference to its buffer with VideoRingNewest rather than through the
+ * reading index. The same check applies: the reference is taken first
+ * and kept only if the buffer is still the published one, after which
+ * the producer will not choose it.
+ *
+ * Each slot is also a reference counted buffer that other consumers,
+ * the sinks in sink.c, hold while they process it on their own threads.
+ * The producer never writes into a slot that has references, so all the
+ * consumers share the one captured frame. Each sink reserves slots for
+ * the frames it may hold, so that a sink holding frames does not starve
+ * the others, and gives them back when it goes. The ring itself is
+ * reference counted by the buffers held from it, so a source can be
+ * closed while a sink still holds a frame and the memory is released
+ * with the last reference.
+ *
+ * Slots are added at once when more are reserved than the ring has. When
+ * the reservation falls the spare slots are freed from the top, while
+ * the producer may be running: the slot count is lowered first and the
+ * slot is only freed if the producer is not filling it, which it checks
+ * after claiming a slot in the same way as the consumer checks its claim
+ * on the published frame, and if nobody holds it. A slot that is in use
+ * is retried as the consumers take their next frames.
+ *
+ * The slot buffers come from the frame pool of the ring (see
+ * framepool.c), which the consumers of the source share for the buffers
+ * they make for each frame, and so are aligned for the SIMD kernels.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#pragma intrinsic(_InterlockedExchange, _InterlockedCompareExchange)
+#pragma intrinsic(_InterlockedIncrement, _InterlockedDecrement)
+#define RingLoad(p)      _InterlockedCompareExchange((long volatile *)(p), 0, 0)
+#define RingStore(p, v)  _InterlockedExchange((long volatile *)(p), (v))
+#define RingIncr(p)      _InterlockedIncrement((long volatile *)(p))
+#define RingDecr(p)      _InterlockedDecrement((long volatile *)(p))
+#else
+#define RingLoad(p)      __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define RingStore(p, v)  __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define RingIncr(p)      __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define RingDecr(p)      __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#endif
+
+#define RING_CAPACITY  (VIDEO_RING_MAX_SLOTS * 2)
+
+TCL_DECLARE_MUTEX(growLock)     /* a shared ring may be resized by any view */
+
+struct VideoBuffer {
+    VideoRing     *ringPtr;
+    int            index;
+    long           refCount;    /* references held by sinks */
+    unsigned char *buffer;
+    VideoFrame     frame;
+};
+
+struct VideoRing {
+    long      slots;        /* slots the producer may use */
+    long      reserved;     /* slots asked for, protected by growLock */
+    long      wanted;       /* reserved within the ring's limits */
+    size_t    slotSize;
+    VideoBuffer *slot;      /* RING_CAPACITY entries */
+    VideoFramePool *poolPtr; /* the source's frame buffers */
+    long      refCount;     /* the owner plus each buffer reference */
+    long      published;    /* newest complete frame, or -1 */
+    long      reading;      /* slot held by the consumer, or -1 */
+    long      writing;      /* slot being filled, or -1 */
+    int       next;         /* producer only: where to look for a slot */
+    Tcl_WideInt dropped;    /* producer only: frames with no free slot */
+};
+
+static void FreeRing(VideoRing *ringPtr);
+static int  RingResize(VideoRing *ringPtr);
+static void RingTrim(VideoRing *ringPtr);
+
+/**
+ * Create a ring of slots buffers, each of slotSize bytes. All the memory
+ * is allocated here, or in VideoRingReserve, so that capturing never
+ * allocates.
+ *
+ * @return the ring, or NULL if it could not be allocated.
+ */
+
+VideoRing *
+VideoRingCreate(int slots, size_t slotSize)
+{
+    VideoRing *ringPtr;
+    int n;
+
+    ringPtr = (VideoRing *)attemptckalloc(sizeof(VideoRing));
+    if (ringPtr == NULL) {
+        return NULL;
+    }
+    memset(ringPtr, 0, sizeof(VideoRing));
+    ringPtr->slot = (VideoBuffer *)attemptckalloc(sizeof(VideoBuffer) * RING_CAPACITY);
+    if (ringPtr->slot == NULL) {
+        ckfree((char *)ringPtr);
+        return NULL;
+    }
+    memset(ringPtr->slot, 0, sizeof(VideoBuffer) * RING_CAPACITY);
+    ringPtr->poolPtr = VideoFramePoolCreate();
+    if (ringPtr->poolPtr == NULL) {
+        FreeRing(ringPtr);
+        return NULL;
+    }
+    for (n = 0; n < RING_CAPACITY; ++n) {
+        ringPtr->slot[n].ringPtr = ringPtr;
+        ringPtr->slot[n].index = n;
+    }
+    ringPtr->slotSize = slotSize;
+    ringPtr->refCount = 1;
+    ringPtr->published = -1;
+    ringPtr->reading = -1;
+    ringPtr->writing = -1;
+    if (VideoRingReserve(ringPtr, slots) != TCL_OK) {
+        FreeRing(ringPtr);
+        return NULL;
+    }
+    return ringPtr;
+}
+
+/**
+ * Add an owner's reference to the ring, for a widget sharing it with
+ * others. Each reference is given up with VideoRingDestroy.
+ */
+
+void
+VideoRingRetain(VideoRing *ringPtr)
+{
+    RingIncr(&ringPtr->refCount);
+}
+
+/**
+ * Give up the owner's reference to the ring. The producer must have
+ * stopped and the consumer must not hold a frame. Sinks may still hold
+ * buffers, and the ring is freed when the last of them is released.
+ */
+
+void
+VideoRingDestroy(VideoRing *ringPtr)
+{
+    if (RingDecr(&ringPtr->refCount) == 0) {
+        FreeRing(ringPtr);
+    }
+}
+
+static void
+FreeRing(VideoRing *ringPtr)
+{
+    int n;
+
+    for (n = 0; n < RING_CAPACITY; ++n) {
+        if (ringPtr->slot[n].buffer != NULL) {
+            VideoFramePoolFree(ringPtr->slot[n].buffer);
+        }
+    }
+    if (ringPtr->poolPtr != NULL) {
+        VideoFramePoolRelease(ringPtr->poolPtr);
+    }
+    ckfree((char *)ringPtr->slot);
+    ckfree((char *)ringPtr);
+}
+
+/**
+ * Change the number of slots reserved in the ring by slots, which is
+ * negative to give slots back. This may be called on any consumer
+ * thread while the producer is running: new buffers are allocated
+ * before the slot count that makes them visible is raised, and spare
+ * ones are freed once the producer and the consumers have finished with
+ * them.
+ *
+ * @return TCL_OK, or TCL_ERROR if the buffers could not be allocated,
+ *  in which case the ring keeps the slots it has.
+ */
+
+int
+VideoRingReserve(VideoRing *ringPtr, int slots)
+{
+    int r;
+
+    Tcl_MutexLock(&growLock);
+    ringPtr->reserved += slots;
+    r = RingResize(ringPtr);
+    Tcl_MutexUnlock(&growLock);
+    return r;
+}
+
+/*
+ * Bring the slots of the ring to the number reserved, adding or freeing
+ * buffers. Called with growLock held.
+ */
+
+static int
+RingResize(VideoRing *ringPtr)
+{
+    long count = RingLoad(&ringPtr->slots), wanted = ringPtr->reserved, n;
+
+    if (wanted < VIDEO_RING_MIN_SLOTS) {
+        wanted = VIDEO_RING_MIN_SLOTS;
+    }
+    if (wanted > RING_CAPACITY) {
+        wanted = RING_CAPACITY;
+    }
+    RingStore(&ringPtr->wanted, wanted);
+    if (count >= wanted) {
+        RingTrim(ringPtr);
+        return TCL_OK;
+    }
+    for (n = count; n < wanted; ++n) {
+        ringPtr->slot[n].buffer = (unsigned char *)
+            VideoFramePoolAlloc(ringPtr->poolPtr, ringPtr->slotSize + 1);
+        if (ringPtr->slot[n].buffer == NULL) {
+            break;
+        }
+    }
+    RingStore(&ringPtr->slots, n);
+    return (n == wanted) ? TCL_OK : TCL_ERROR;
+}
+
+/*
+ * Free the spare slots above the number wanted, from the top down,
+ * stopping at the first that is in use. Called with growLock held.
+ *
+ * The slot is hidden from the producer before it is checked. A producer
+ * that claimed it before then is seen in writing; one that claims it
+ * after sees the lower count and gives it up.
+ */
+
+static void
+RingTrim(VideoRing *ringPtr)
+{
+    long count = RingLoad(&ringPtr->slots);
+
+    while (count > RingLoad(&ringPtr->wanted)) {
+        VideoBuffer *slotPtr = &ringPtr->slot[count - 1];
+
+        RingStore(&ringPtr->slots, count - 1);
+        if (RingLoad(&ringPtr->writing) == count - 1
+            || RingLoad(&ringPtr->published) == count - 1
+            || RingLoad(&ringPtr->reading) == count - 1
+            || RingLoad(&slotPtr->refCount) != 0) {
+            RingStore(&ringPtr->slots, count);
+            break;
+        }
+        VideoFramePoolDiscard(slotPtr->buffer);
+        slotPtr->buffer = NULL;
+        --count;
+    }
+}
+
+/*
+ * Consumer: finish freeing the spare slots if some were in use when the
+ * reservation fell.
+ */
+
+static void
+RingTrimPending(VideoRing *ringPtr)
+{
+    if (RingLoad(&ringPtr->slots) > RingLoad(&ringPtr->wanted)) {
+        Tcl_MutexLock(&growLock);
+        RingTrim(ringPtr);
+        Tcl_MutexUnlock(&growLock);
+    }
+}
+
+int
+VideoRingSlots(const VideoRing *ringPtr)
+{
+    return (int)RingLoad((long *)&ringPtr->slots);
+}
+
+size_t
+VideoRingSlotSize(const VideoRing *ringPtr)
+{
+    return ringPtr->slotSize;
+}
+
+/**
+ * @return the frame pool of the ring's source.
+ */
+
+VideoFramePool *
+VideoRingPool(const VideoRing *ringPtr)
+{
+    return ringPtr->poolPtr;
+}
+
+/**
+ * Producer: claim a free slot to capture into. The returned frame has
+ * its data pointing at the start of the slot buffer and the rest of the
+ * frame description is left for the producer to fill in, typically with
+ * VideoFrameLayout.
+ *
+ * @return the frame to fill, or NULL if every slot is in use, in which
+ *  case the frame should be dropped.
+ */
+
+VideoFrame *
+VideoRingBeginWrite(VideoRing *ringPtr)
+{
+    long published = RingLoad(&ringPtr->published);
+    long reading = RingLoad(&ringPtr->reading);
+    long slots = RingLoad(&ringPtr->slots);
+    int n;
+
+    for (n = 0; n < slots; ++n) {
+        int index = (ringPtr->next + n) % slots;
+        VideoBuffer *slotPtr = &ringPtr->slot[index];
+        if (index != published && index != reading
+            && RingLoad(&slotPtr->refCount) == 0) {
+            RingStore(&ringPtr->writing, index);
+            if (index >= RingLoad(&ringPtr->slots)) {
+                RingStore(&ringPtr->writing, -1);   /* being freed */
+                continue;
+            }
+            ringPtr->next = (index + 1) % slots;
+            slotPtr->frame.data = slotPtr->buffer;
+            return &slotPtr->frame;
+        }
+    }
+    ++ringPtr->dropped;
+    return NULL;
+}
+
+/**
+ * Producer: make the slot claimed by VideoRingBeginWrite the newest
+ * frame. It replaces the previously published frame, which becomes free
+ * unless the consumer or a sink holds it.
+ *
+ * @return the buffer just published, to be passed on to the sinks, or
+ *  NULL if no slot had been claimed.
+ */
+
+VideoBuffer *
+VideoRingPublish(VideoRing *ringPtr)
+{
+    long index = RingLoad(&ringPtr->writing);
+
+    if (index == -1) {
+        return NULL;
+    }
+    RingStore(&ringPtr->published, index);
+    RingStore(&ringPtr->writing, -1);
+    return &ringPtr->slot[index];
+}
+
+/**
+ * Producer: the number of frames dropped because no slot was free.
+ */
+
+Tcl_WideInt
+VideoRingDropped(const VideoRing *ringPtr)
+{
+    return ringPtr->dropped;
+}
+
+/**
+ * Consumer: hold the newest frame. Any frame already held is released.
+ * The frame remains valid and unchanged until VideoRingRelease or the
+ * next call to this function.
+ *
+ * @return the newest frame, or NULL if none has been published.
+ */
+
+const VideoFrame *
+VideoRingAcquire(VideoRing *ringPtr)
+{
+    long index;
+
+    RingTrimPending(ringPtr);
+    index = RingLoad(&ringPtr->published);
+
+    for (;;) {
+        long check;
+        RingStore(&ringPtr->reading, index);
+        if (index == -1) {
+            return NULL;
+        }
+        check = RingLoad(&ringPtr->published);
+        if (check == index) {
+            return &ringPtr->slot[index].frame;
+        }
+        index = check;
+    }
+}
+
+/**
+ * Consumer: release the frame held since VideoRingAcquire.
+ */
+
+void
+VideoRingRelease(VideoRing *ringPtr)
+{
+    RingStore(&ringPtr->reading, -1);
+}
+
+/**
+ * Any consumer of a shared ring: take a reference to the newest frame.
+ * Unlike VideoRingAcquire this may be used by any number of consumers,
+ * each of which passes the buffer to VideoBufferRelease when done.
+ *
+ * @return the newest buffer, or NULL if none has been published.
+ */
+
+VideoBuffer *
+VideoRingNewest(VideoRing *ringPtr)
+{
+    long index;
+
+    RingTrimPending(ringPtr);
+    index = RingLoad(&ringPtr->published);
+
+    while (index != -1) {
+        VideoBuffer *bufferPtr = &ringPtr->slot[index];
+        long check;
+
+        VideoBufferRetain(bufferPtr);
+        check = RingLoad(&ringPtr->published);
+        if (check == index) {
+            return bufferPtr;
+        }
+        VideoBufferRelease(bufferPtr);
+        index = check;
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/**
+ * The frame held in a buffer. It must not be modified; a consumer that
+ * needs to change it takes a copy with VideoBufferWritable.
+ */
+
+const VideoFrame *
+VideoBufferFrame(const VideoBuffer *bufferPtr)
+{
+    return &bufferPtr->frame;
+}
+
+/**
+ * @return the frame pool of the source a buffer came from, for a sink to
+ *  take the buffers it makes from the frame.
+ */
+
+VideoFramePool *
+VideoBufferPool(const VideoBuffer *bufferPtr)
+{
+    return bufferPtr->ringPtr->poolPtr;
+}
+
+/**
+ * Add a reference to a buffer, and to the ring it belongs to. This is
+ * called by the producer as it hands a buffer to a sink, and the sink
+ * releases it from any thread.
+ */
+
+void
+VideoBufferRetain(VideoBuffer *bufferPtr)
+{
+    RingIncr(&bufferPtr->ringPtr->refCount);
+    RingIncr(&bufferPtr->refCount);
+}
+
+void
+VideoBufferRelease(VideoBuffer *bufferPtr)
+{
+    VideoRing *ringPtr = bufferPtr->ringPtr;
+
+    RingDecr(&bufferPtr->refCount);
+    if (RingDecr(&ringPtr->refCount) == 0) {
+        FreeRing(ringPtr);
+    }
+}
+
+/**
+ * Get a frame that the caller holding bufferPtr may modify. If nobody
+ * else can read the buffer, because the caller holds the only reference
+ * and it is no longer the newest frame, it is returned as it is.
+ * Otherwise the frame is copied into the caller's own memory at
+ * *copyPtr, which is grown as needed and should be freed with ckfree.
+ *
+ * @return the writable frame, described in *framePtr, or NULL if the
+ *  copy could not be allocated.
+ */
+
+VideoFrame *
+VideoBufferWritable(VideoBuffer *bufferPtr, VideoFrame *framePtr,
+                    unsigned char **copyPtr, size_t *copySizePtr)
+{
+    VideoRing *ringPtr = bufferPtr->ringPtr;
+    ptrdiff_t offset;
+
+    *framePtr = bufferPtr->frame;
+    if (RingLoad(&bufferPtr->refCount) == 1
+        && RingLoad(&ringPtr->published) != bufferPtr->index
+        && RingLoad(&ringPtr->reading) != bufferPtr->index) {
+        return framePtr;
+    }
+    if (*copySizePtr < ringPtr->slotSize) {
+        unsigned char *newPtr = (unsigned char *)
+            attemptckrealloc((char *)*copyPtr, ringPtr->slotSize);
+        if (newPtr == NULL) {
+            return NULL;
+        }
+        *copyPtr = newPtr;
+        *copySizePtr = ringPtr->slotSize;
+    }
+    memcpy(*copyPtr, bufferPtr->buffer, ringPtr->slotSize);
+    offset = *copyPtr - bufferPtr->buffer;
+    framePtr->data += offset;
+    if (framePtr->chroma[0] != NULL)
+        framePtr->chroma[0] += offset;
+    if (framePtr->chroma[1] != NULL)
+        framePtr->chroma[1] += offset;
+    return framePtr;
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,816 @@
+/* scale.c - image scaling for the tkvideo widget
+ *
+ * Frames drawn with -stretch, or into a tile smaller than the frame, are
+ * scaled in software. The scaler works on 32 bit pixels and treats the
+ * four channels alike, so it serves B,G,R,A and R,G,B,A images equally.
+ *
+ * Each axis is scaled separately. Shrinking uses an area average, in
+ * which each output pixel is the mean of the source pixels it covers,
+ * with partly covered pixels weighted by their coverage. Enlarging uses
+ * bilinear interpolation between the two nearest pixel centres. The
+ * weights are 14 bit fixed point and are computed once per combination
+ * of source and destination size. The tables are rebuilt only after the
+ * scaler has been invalidated, which the renderer does when the window
+ * is reconfigured, or if the frame size has changed.
+ *
+ * A row of output is made by first combining the source rows with the
+ * vertical weights, then applying the horizontal weights to that row.
+ * Exact halving, quartering and doubling in both directions are common
+ * enough for video walls that they have their own kernels, which need
+ * no tables and read each source pixel once.
+ *
+ * Output rows are independent of each other, so a large image is scaled
+ * in horizontal stripes on the worker pool (see VideoPoolStripes). Each
+ * thread working on the image has a lane of its own scratch rows, which
+ * are allocated with the tables for every lane that can be used.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define VIDEO_X86 1
+#include <emmintrin.h>
+#endif
+
+#define SCALE_BITS   14
+#define SCALE_ONE    (1 << SCALE_BITS)
+#define SCALE_ROUND  (1 << (SCALE_BITS - 1))
+#define SCALE_BLOCK  512    /* bytes summed at a time by VerticalScalar */
+
+enum {
+    SCALE_FILTER,   /* general case using the weight tables */
+    SCALE_HALF,     /* 2x2 box average */
+    SCALE_QUARTER,  /* 4x4 box average */
+    SCALE_DOUBLE,   /* 2x bilinear */
+};
+
+/*
+ * Weights for one axis. Output pixel i is the sum of taps source pixels
+ * from start[i] multiplied by weights[i * taps ...]. The window is
+ * always entirely within the source so no bounds checks are needed.
+ */
+
+typedef struct {
+    int    taps;
+    int   *start;
+    short *weights;
+} ScaleTable;
+
+struct VideoScaler {
+    int         valid;        /* the tables match the sizes below */
+    int         srcWidth;
+    int         srcHeight;
+    int         dstWidth;
+    int         dstHeight;
+    int         path;         /* one of the SCALE_* values */
+    ScaleTable  horiz;
+    ScaleTable  vert;
+    int         lanes;        /* lanes with scratch rows */
+    unsigned char *row[VIDEO_STRIPE_LANES];    /* vertically filtered source row */
+    unsigned short *sums[VIDEO_STRIPE_LANES];  /* blended row for SCALE_DOUBLE */
+    const unsigned char **rows[VIDEO_STRIPE_LANES]; /* source rows for one output row */
+};
+
+typedef struct {
+    VideoScaler *scalerPtr;
+    const unsigned char *srcPtr;
+    int srcPitch;
+    unsigned char *dstPtr;
+    int dstPitch;
+} ScaleJob;
+
+typedef void (VerticalProc)(const unsigned char **rows, const short *weights,
+                            int taps, unsigned char *dstPtr, int bytes);
+typedef void (HorizontalProc)(const unsigned char *srcPtr, const ScaleTable *tablePtr,
+                              unsigned char *dstPtr, int width);
+typedef void (HalfProc)(const unsigned char *srcPtr, int srcPitch,
+                        unsigned char *dstPtr, int width);
+typedef void (DoubleProc)(const unsigned short *sumPtr, unsigned char *dstPtr,
+                          int srcWidth);
+
+static VerticalProc VerticalScalar;
+static HorizontalProc HorizontalScalar;
+static HalfProc HalfScalar;
+static HalfProc QuarterScalar;
+static DoubleProc DoubleRowScalar;
+#ifdef VIDEO_X86
+static VerticalProc VerticalSSE2;
+static HorizontalProc HorizontalSSE2;
+static HalfProc HalfSSE2;
+static HalfProc QuarterSSE2;
+static DoubleProc DoubleRowSSE2;
+#endif
+
+static VerticalProc *verticalProc = VerticalScalar;
+static HorizontalProc *horizontalProc = HorizontalScalar;
+static HalfProc *halfProc = HalfScalar;
+static HalfProc *quarterProc = QuarterScalar;
+static DoubleProc *doubleRowProc = DoubleRowScalar;
+
+static int  BuildTable(ScaleTable *tablePtr, int srcSize, int dstSize);
+static void FreeTable(ScaleTable *tablePtr);
+static VideoStripeProc ScaleStripe;
+static void ScaleFiltered(VideoScaler *scalerPtr, int lane, const unsigned char *srcPtr,
+                          int srcPitch, unsigned char *dstPtr, int dstPitch,
+                          int first, int last);
+static void ScaleDouble(VideoScaler *scalerPtr, int lane, const unsigned char *srcPtr,
+                        int srcPitch, unsigned char *dstPtr, int dstPitch,
+                        int first, int last);
+
+/**
+ * Select the scaling kernels. Called once from the package
+ * initialization with the result of VideoCpuFeatures.
+ */
+
+void
+VideoScaleInit(int features)
+{
+    verticalProc = VerticalScalar;
+    horizontalProc = HorizontalScalar;
+    halfProc = HalfScalar;
+    quarterProc = QuarterScalar;
+    doubleRowProc = DoubleRowScalar;
+#ifdef VIDEO_X86
+    if (features & VIDEO_CPU_SSE2) {
+        verticalProc = VerticalSSE2;
+        horizontalProc = HorizontalSSE2;
+        halfProc = HalfSSE2;
+        quarterProc = QuarterSSE2;
+        doubleRowProc = DoubleRowSSE2;
+    }
+#endif
+}
+
+/**
+ * Create a scaler. No tables are built until VideoScalerSetup is called.
+ */
+
+VideoScaler *
+VideoScalerCreate(void)
+{
+    VideoScaler *scalerPtr = (VideoScaler *)ckalloc(sizeof(VideoScaler));
+    memset(scalerPtr, 0, sizeof(VideoScaler));
+    return scalerPtr;
+}
+
+void
+VideoScalerDestroy(VideoScaler *scalerPtr)
+{
+    VideoScalerInvalidate(scalerPtr);
+    ckfree((char *)scalerPtr);
+}
+
+/**
+ * Discard the tables. The next call to VideoScalerSetup rebuilds them.
+ */
+
+void
+VideoScalerInvalidate(VideoScaler *scalerPtr)
+{
+    int lane;
+
+    FreeTable(&scalerPtr->horiz);
+    FreeTable(&scalerPtr->vert);
+    for (lane = 0; lane < VIDEO_STRIPE_LANES; ++lane) {
+        if (scalerPtr->row[lane] != NULL) {
+            ckfree((char *)scalerPtr->row[lane]);
+            scalerPtr->row[lane] = NULL;
+        }
+        if (scalerPtr->sums[lane] != NULL) {
+            ckfree((char *)scalerPtr->sums[lane]);
+            scalerPtr->sums[lane] = NULL;
+        }
+        if (scalerPtr->rows[lane] != NULL) {
+            ckfree((char *)scalerPtr->rows[lane]);
+            scalerPtr->rows[lane] = NULL;
+        }
+    }
+    scalerPtr->lanes = 0;
+    scalerPtr->valid = 0;
+}
+
+/**
+ * Prepare to scale images of one size to another. This is cheap if the
+ * scaler is still valid for these sizes.
+ *
+ * @return TCL_OK, or TCL_ERROR if a size is less than 2 pixels or the
+ *  tables cannot be allocated.
+ */
+
+int
+VideoScalerSetup(VideoScaler *scalerPtr, int srcWidth, int srcHeight,
+                 int dstWidth, int dstHeight)
+{
+    int lane;
+
+    if (scalerPtr->valid && scalerPtr->srcWidth == srcWidth
+        && scalerPtr->srcHeight == srcHeight && scalerPtr->dstWidth == dstWidth
+        && scalerPtr->dstHeight == dstHeight) {
+        return TCL_OK;
+    }
+    VideoScalerInvalidate(scalerPtr);
+    if (srcWidth < 2 || srcHeight < 2 || dstWidth < 1 || dstHeight < 1) {
+        return TCL_ERROR;
+    }
+    scalerPtr->srcWidth = srcWidth;
+    scalerPtr->srcHeight = srcHeight;
+    scalerPtr->dstWidth = dstWidth;
+    scalerPtr->dstHeight = dstHeight;
+    scalerPtr->lanes = 1;
+    if ((Tcl_WideInt)srcWidth * srcHeight >= VIDEO_STRIPE_PIXELS
+        || (Tcl_WideInt)dstWidth * dstHeight >= VIDEO_STRIPE_PIXELS) {
+        scalerPtr->lanes = VIDEO_STRIPE_LANES;
+    }
+
+    if (srcWidth == dstWidth * 2 && srcHeight == dstHeight * 2) {
+        scalerPtr->path = SCALE_HALF;
+    } else if (srcWidth == dstWidth * 4 && srcHeight == dstHeight * 4) {
+        scalerPtr->path = SCALE_QUARTER;
+    } else if (dstWidth == srcWidth * 2 && dstHeight == srcHeight * 2) {
+        scalerPtr->path = SCALE_DOUBLE;
+        for (lane = 0; lane < scalerPtr->lanes; ++lane) {
+            scalerPtr->sums[lane] = (unsigned short *)attemptckalloc(
+                (size_t)srcWidth * 4 * sizeof(unsigned short));
+            if (scalerPtr->sums[lane] == NULL) {
+                VideoScalerInvalidate(scalerPtr);
+                return TCL_ERROR;
+            }
+        }
+    } else {
+        scalerPtr->path = SCALE_FILTER;
+        if (BuildTable(&scalerPtr->horiz, srcWidth, dstWidth) != TCL_OK
+            || BuildTable(&scalerPtr->vert, srcHeight, dstHeight) != TCL_OK) {
+            VideoScalerInvalidate(scalerPtr);
+            return TCL_ERROR;
+        }
+        for (lane = 0; lane < scalerPtr->lanes; ++lane) {
+            scalerPtr->row[lane] = (unsigned char *)attemptckalloc((size_t)srcWidth * 4);
+            scalerPtr->rows[lane] = (const unsigned char **)attemptckalloc(
+                scalerPtr->vert.taps * sizeof(unsigned char *));
+            if (scalerPtr->row[lane] == NULL || scalerPtr->rows[lane] == NULL) {
+                VideoScalerInvalidate(scalerPtr);
+                return TCL_ERROR;
+            }
+        }
+    }
+    scalerPtr->valid = 1;
+    return TCL_OK;
+}
+
+/**
+ * Scale an image of 32 bit pixels using the sizes given to the last
+ * successful call of VideoScalerSetup. A negative source pitch reads
+ * the image bottom-up.
+ *
+ * @param scalerPtr [in] a scaler that has been set up
+ * @param srcPtr [in] the first source row
+ * @param srcPitch [in] bytes between source rows
+ * @param dstPtr [out] the first output row
+ * @param dstPitch [in] bytes between output rows
+ */
+
+void
+VideoScaleImage(VideoScaler *scalerPtr, const unsigned char *srcPtr, int srcPitch,
+                unsigned char *dstPtr, int dstPitch)
+{
+    Tcl_WideInt srcPixels = (Tcl_WideInt)scalerPtr->srcWidth * scalerPtr->srcHeight;
+    Tcl_WideInt dstPixels = (Tcl_WideInt)scalerPtr->dstWidth * scalerPtr->dstHeight;
+    ScaleJob job;
+
+    job.scalerPtr = scalerPtr;
+    job.srcPtr = srcPtr;
+    job.srcPitch = srcPitch;
+    job.dstPtr = dstPtr;
+    job.dstPitch = dstPitch;
+    if (scalerPtr->lanes < VIDEO_STRIPE_LANES) {
+        ScaleStripe(&job, 0, 0, scalerPtr->path == SCALE_DOUBLE
+                    ? scalerPtr->srcHeight : scalerPtr->dstHeight);
+        return;
+    }
+    VideoPoolStripes(scalerPtr->path == SCALE_DOUBLE
+                     ? scalerPtr->srcHeight : scalerPtr->dstHeight,
+                     srcPixels > dstPixels ? srcPixels : dstPixels, ScaleStripe, &job);
+}
+
+/*
+ * Scale a stripe of output rows, first to last - 1, or for SCALE_DOUBLE
+ * the output rows made from those source rows.
+ */
+
+static void
+ScaleStripe(ClientData clientData, int lane, int first, int last)
+{
+    ScaleJob *jobPtr = (ScaleJob *)clientData;
+    VideoScaler *scalerPtr = jobPtr->scalerPtr;
+    const unsigned char *srcPtr = jobPtr->srcPtr;
+    const int srcPitch = jobPtr->srcPitch, dstPitch = jobPtr->dstPitch;
+    int y;
+
+    switch (scalerPtr->path) {
+    case SCALE_HALF:
+        for (y = first; y < last; ++y) {
+            halfProc(srcPtr + (ptrdiff_t)y * 2 * srcPitch, srcPitch,
+                     jobPtr->dstPtr + (ptrdiff_t)y * dstPitch, scalerPtr->dstWidth);
+        }
+        break;
+    case SCALE_QUARTER:
+        for (y = first; y < last; ++y) {
+            quarterProc(srcPtr + (ptrdiff_t)y * 4 * srcPitch, srcPitch,
+                        jobPtr->dstPtr + (ptrdiff_t)y * dstPitch, scalerPtr->dstWidth);
+        }
+        break;
+    case SCALE_DOUBLE:
+        ScaleDouble(scalerPtr, lane, srcPtr, srcPitch, jobPtr->dstPtr, dstPitch, first, last);
+        break;
+    default:
+        ScaleFiltered(scalerPtr, lane, srcPtr, srcPitch, jobPtr->dstPtr, dstPitch,
+                      first, last);
+        break;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Compute the weights for one axis. Weights are rounded to fixed point
+ * and any rounding error is added to the largest weight so each set sums
+ * to exactly one.
+ */
+
+static int
+BuildTable(ScaleTable *tablePtr, int srcSize, int dstSize)
+{
+    const double scale = (double)srcSize / dstSize;
+    double *fp;
+    int taps, i, k;
+
+    if (dstSize < srcSize && srcSize % dstSize == 0) {
+        taps = srcSize / dstSize;   /* the windows never straddle a pixel */
+    } else if (dstSize < srcSize) {
+        taps = (int)ceil(scale) + 1;
+    } else {
+        taps = 2;
+    }
+    if (taps > srcSize) {
+        taps = srcSize;
+    }
+    tablePtr->taps = taps;
+    tablePtr->start = (int *)attemptckalloc(dstSize * sizeof(int));
+    tablePtr->weights = (short *)attemptckalloc((size_t)dstSize * taps * sizeof(short));
+    fp = (double *)attemptckalloc(taps * sizeof(double));
+    if (tablePtr->start == NULL || tablePtr->weights == NULL || fp == NULL) {
+        if (fp != NULL) {
+            ckfree((char *)fp);
+        }
+        return TCL_ERROR;
+    }
+
+    for (i = 0; i < dstSize; ++i) {
+        short *w = tablePtr->weights + (size_t)i * taps;
+        int start, sum = 0, largest = 0;
+
+        if (dstSize < srcSize) {
+            double lo = i * scale, hi = lo + scale;
+            start = (int)floor(lo);
+            if (start > srcSize - taps) start = srcSize - taps;
+            for (k = 0; k < taps; ++k) {
+                double a = (start + k > lo) ? start + k : lo;
+                double b = (start + k + 1 < hi) ? start + k + 1 : hi;
+                fp[k] = (b > a) ? (b - a) / scale : 0.0;
+            }
+        } else {
+            double centre = (i + 0.5) * scale - 0.5;
+            if (centre < 0.0) centre = 0.0;
+            start = (int)floor(centre);
+            if (start > srcSize - 2) start = srcSize - 2;
+            fp[0] = 1.0 - (centre - start);
+            fp[1] = centre - start;
+            if (fp[0] < 0.0) { fp[0] = 0.0; fp[1] = 1.0; }
+        }
+        for (k = 0; k < taps; ++k) {
+            w[k] = (short)floor(fp[k] * SCALE_ONE + 0.5);
+            sum += w[k];
+            if (w[k] > w[largest]) largest = k;
+        }
+        w[largest] += SCALE_ONE - sum;
+        tablePtr->start[i] = start;
+    }
+    ckfree((char *)fp);
+    return TCL_OK;
+}
+
+static void
+FreeTable(ScaleTable *tablePtr)
+{
+    if (tablePtr->start != NULL) {
+        ckfree((char *)tablePtr->start);
+    }
+    if (tablePtr->weights != NULL) {
+        ckfree((char *)tablePtr->weights);
+    }
+    tablePtr->start = NULL;
+    tablePtr->weights = NULL;
+    tablePtr->taps = 0;
+}
+
+/*
+ * The general case, for output rows first to last - 1. An axis that is
+ * not scaled skips its pass.
+ */
+
+static void
+ScaleFiltered(VideoScaler *scalerPtr, int lane, const unsigned char *srcPtr,
+              int srcPitch, unsigned char *dstPtr, int dstPitch, int first, int last)
+{
+    const ScaleTable *vertPtr = &scalerPtr->vert;
+    const unsigned char **rows = scalerPtr->rows[lane];
+    const int sameWidth = (scalerPtr->srcWidth == scalerPtr->dstWidth);
+    const int sameHeight = (scalerPtr->srcHeight == scalerPtr->dstHeight);
+    int y, k;
+
+    dstPtr += (ptrdiff_t)first * dstPitch;
+    for (y = first; y < last; ++y, dstPtr += dstPitch) {
+        const unsigned char *rowPtr;
+        unsigned char *outPtr = sameWidth ? dstPtr : scalerPtr->row[lane];
+
+        if (sameHeight) {
+            rowPtr = srcPtr + (ptrdiff_t)y * srcPitch;
+            if (sameWidth) {
+                memcpy(dstPtr, rowPtr, scalerPtr->srcWidth * 4);
+                continue;
+            }
+        } else {
+            for (k = 0; k < vertPtr->taps; ++k) {
+                rows[k] = srcPtr + (ptrdiff_t)(vertPtr->start[y] + k) * srcPitch;
+            }
+            verticalProc(rows, vertPtr->weights + (size_t)y * vertPtr->taps,
+                         vertPtr->taps, outPtr, scalerPtr->srcWidth * 4);
+            rowPtr = outPtr;
+        }
+        if (!sameWidth) {
+            horizontalProc(rowPtr, &scalerPtr->horiz, dstPtr, scalerPtr->dstWidth);
+        }
+    }
+}
+
+/*
+ * Doubling with bilinear interpolation gives weights of 3/4 and 1/4 on
+ * each axis. Each pair of output rows is made from one source row
+ * blended with the row above and with the row below; the blend is kept
+ * at 16 bits and the horizontal step applies the final rounding. The
+ * output rows made are those of source rows first to last - 1.
+ */
+
+static void
+ScaleDouble(VideoScaler *scalerPtr, int lane, const unsigned char *srcPtr,
+            int srcPitch, unsigned char *dstPtr, int dstPitch, int first, int last)
+{
+    unsigned short *sums = scalerPtr->sums[lane];
+    const int bytes = scalerPtr->srcWidth * 4;
+    int y, n, x;
+
+    dstPtr += (ptrdiff_t)first * 2 * dstPitch;
+    for (y = first; y < last; ++y) {
+        const unsigned char *a = srcPtr + (ptrdiff_t)y * srcPitch;
+        for (n = 0; n < 2; ++n, dstPtr += dstPitch) {
+            int other = (n == 0) ? y - 1 : y + 1;
+            const unsigned char *b;
+            if (other < 0) other = 0;
+            if (other >= scalerPtr->srcHeight) other = scalerPtr->srcHeight - 1;
+            b = srcPtr + (ptrdiff_t)other * srcPitch;
+            for (x = 0; x < bytes; ++x) {
+                sums[x] = (unsigned short)(a[x] * 3 + b[x]);
+            }
+            doubleRowProc(sums, dstPtr, scalerPtr->srcWidth);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * The scalar kernels keep the inner loops simple and free of indirection
+ * so that the compiler can unroll them. The vertical pass sums two or
+ * three rows directly, which covers enlarging and shrinking by up to 2:1
+ * or by exactly 3:1, and otherwise adds pairs of rows into a block of
+ * sums. The others keep the four channels of a pixel in separate sums.
+ */
+
+static void
+VerticalScalar(const unsigned char **rows, const short *weights, int taps,
+               unsigned char *dstPtr, int bytes)
+{
+    int sums[SCALE_BLOCK];
+    int x, n, k, count;
+
+    /* only the ends of the window can be uncovered */
+    while (taps > 1 && weights[taps - 1] == 0) {
+        --taps;
+    }
+    while (taps > 1 && weights[0] == 0) {
+        ++rows, ++weights, --taps;
+    }
+
+    if (taps == 2) {
+        const unsigned char *p = rows[0], *q = rows[1];
+        const int wp = weights[0], wq = weights[1];
+        for (x = 0; x < bytes; ++x) {
+            dstPtr[x] = (unsigned char)((SCALE_ROUND + p[x] * wp + q[x] * wq) >> SCALE_BITS);
+        }
+        return;
+    }
+    if (taps == 3) {
+        const unsigned char *p = rows[0], *q = rows[1], *r = rows[2];
+        const int wp = weights[0], wq = weights[1], wr = weights[2];
+        for (x = 0; x < bytes; ++x) {
+            dstPtr[x] = (unsigned char)((SCALE_ROUND + p[x] * wp + q[x] * wq
+                                         + r[x] * wr) >> SCALE_BITS);
+        }
+        return;
+    }
+
+    for (x = 0; x < bytes; x += count) {
+        count = (bytes - x < SCALE_BLOCK) ? bytes - x : SCALE_BLOCK;
+        for (n = 0; n < count; ++n) {
+            sums[n] = SCALE_ROUND;
+        }
+        for (k = 0; k + 1 < taps; k += 2) {
+            const unsigned char *p = rows[k] + x, *q = rows[k + 1] + x;
+            const int wp = weights[k], wq = weights[k + 1];
+            for (n = 0; n < count; ++n) {
+                sums[n] += p[n] * wp + q[n] * wq;
+            }
+        }
+        if (k < taps) {
+            const unsigned char *p = rows[k] + x;
+            const int wp = weights[k];
+            for (n = 0; n < count; ++n) {
+                dstPtr[x + n] = (unsigned char)((sums[n] + p[n] * wp) >> SCALE_BITS);
+            }
+        } else {
+            for (n = 0; n < count; ++n) {
+                dstPtr[x + n] = (unsigned char)(sums[n] >> SCALE_BITS);
+            }
+        }
+    }
+}
+
+static void
+HorizontalScalar(const unsigned char *srcPtr, const ScaleTable *tablePtr,
+                 unsigned char *dstPtr, int width)
+{
+    const int taps = tablePtr->taps;
+    const short *w = tablePtr->weights;
+    int i, k;
+
+    for (i = 0; i < width; ++i, dstPtr += 4, w += taps) {
+        const unsigned char *p = srcPtr + tablePtr->start[i] * 4;
+        int s0 = SCALE_ROUND, s1 = SCALE_ROUND, s2 = SCALE_ROUND, s3 = SCALE_ROUND;
+        for (k = 0; k < taps; ++k, p += 4) {
+            s0 += p[0] * w[k];
+            s1 += p[1] * w[k];
+            s2 += p[2] * w[k];
+            s3 += p[3] * w[k];
+        }
+        dstPtr[0] = (unsigned char)(s0 >> SCALE_BITS);
+        dstPtr[1] = (unsigned char)(s1 >> SCALE_BITS);
+        dstPtr[2] = (unsigned char)(s2 >> SCALE_BITS);
+        dstPtr[3] = (unsigned char)(s3 >> SCALE_BITS);
+    }
+}
+
+static void
+HalfScalar(const unsigned char *srcPtr, int srcPitch, unsigned char *dstPtr, int width)
+{
+    const unsigned char *p = srcPtr, *q = srcPtr + srcPitch;
+    int i, c;
+
+    for (i = 0; i < width; ++i, p += 8, q += 8, dstPtr += 4) {
+        for (c = 0; c < 4; ++c) {
+            dstPtr[c] = (unsigned char)((p[c] + p[c + 4] + q[c] + q[c + 4] + 2) >> 2);
+        }
+    }
+}
+
+static void
+QuarterScalar(const unsigned char *srcPtr, int srcPitch, unsigned char *dstPtr, int width)
+{
+    int i, j;
+
+    for (i = 0; i < width; ++i, srcPtr += 16, dstPtr += 4) {
+        int s0 = 8, s1 = 8, s2 = 8, s3 = 8;
+        const unsigned char *p = srcPtr;
+        for (j = 0; j < 4; ++j, p += srcPitch) {
+            s0 += p[0] + p[4] + p[8] + p[12];
+            s1 += p[1] + p[5] + p[9] + p[13];
+            s2 += p[2] + p[6] + p[10] + p[14];
+            s3 += p[3] + p[7] + p[11] + p[15];
+        }
+        dstPtr[0] = (unsigned char)(s0 >> 4);
+        dstPtr[1] = (unsigned char)(s1 >> 4);
+        dstPtr[2] = (unsigned char)(s2 >> 4);
+        dstPtr[3] = (unsigned char)(s3 >> 4);
+    }
+}
+
+/*
+ * Output pixels 2i and 2i+1 take 3/4 of source pixel i and 1/4 of the
+ * pixel to the left and to the right respectively, clamped at the edges.
+ */
+
+static void
+DoubleRowScalar(const unsigned short *sumPtr, unsigned char *dstPtr, int srcWidth)
+{
+    int i, c;
+
+    for (i = 0; i < srcWidth; ++i, dstPtr += 8) {
+        const unsigned short *left = sumPtr + (i > 0 ? i - 1 : 0) * 4;
+        const unsigned short *right = sumPtr + (i + 1 < srcWidth ? i + 1 : i) * 4;
+        for (c = 0; c < 4; ++c) {
+            int centre = sumPtr[i * 4 + c] * 3;
+            dstPtr[c] = (unsigned char)((centre + left[c] + 8) >> 4);
+            dstPtr[c + 4] = (unsigned char)((centre + right[c] + 8) >> 4);
+        }
+    }
+}
+
+#ifdef VIDEO_X86
+
+/*
+ * The filter kernels take the weighted sum of two sources at a time with
+ * pmaddwd: bytes from the two sources are interleaved, widened to 16
+ * bits and multiplied by the interleaved pair of weights, giving 32 bit
+ * sums. An odd final tap is paired with a zero weight.
+ */
+
+static void
+VerticalSSE2(const unsigned char **rows, const short *weights, int taps,
+             unsigned char *dstPtr, int bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(SCALE_ROUND);
+    int x = 0, k;
+
+    for ( ; x + 16 <= bytes; x += 16) {
+        __m128i s0 = round, s1 = round, s2 = round, s3 = round;
+        for (k = 0; k < taps; k += 2) {
+            const int more = (k + 1 < taps);
+            const __m128i w = _mm_set1_epi32(
+                (int)(((unsigned int)(more ? weights[k + 1] : 0) << 16)
+                      | (unsigned short)weights[k]));
+            const __m128i p = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+            const __m128i q = more ? _mm_loadu_si128((const __m128i *)(rows[k + 1] + x)) : zero;
+            const __m128i lo = _mm_unpacklo_epi8(p, q), hi = _mm_unpackhi_epi8(p, q);
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+        s0 = _mm_packs_epi32(_mm_srai_epi32(s0, SCALE_BITS), _mm_srai_epi32(s1, SCALE_BITS));
+        s2 = _mm_packs_epi32(_mm_srai_epi32(s2, SCALE_BITS), _mm_srai_epi32(s3, SCALE_BITS));
+        _mm_storeu_si128((__m128i *)(dstPtr + x), _mm_packus_epi16(s0, s2));
+    }
+    for ( ; x < bytes; ++x) {
+        int sum = SCALE_ROUND;
+        for (k = 0; k < taps; ++k) {
+            sum += rows[k][x] * weights[k];
+        }
+        dstPtr[x] = (unsigned char)(sum >> SCALE_BITS);
+    }
+}
+
+static void
+HorizontalSSE2(const unsigned char *srcPtr, const ScaleTable *tablePtr,
+               unsigned char *dstPtr, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const int taps = tablePtr->taps;
+    int i, k;
+
+    for (i = 0; i < width; ++i, dstPtr += 4) {
+        const unsigned char *p = srcPtr + tablePtr->start[i] * 4;
+        const short *w = tablePtr->weights + (size_t)i * taps;
+        __m128i sum = _mm_set1_epi32(SCALE_ROUND);
+        int pixel;
+
+        for (k = 0; k + 1 < taps; k += 2) {
+            __m128i v = _mm_loadl_epi64((const __m128i *)(p + k * 4));
+            v = _mm_unpacklo_epi8(_mm_unpacklo_epi8(v, _mm_srli_si128(v, 4)), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(v, _mm_set1_epi32(
+                (int)(((unsigned int)w[k + 1] << 16) | (unsigned short)w[k]))));
+        }
+        if (k < taps) {
+            __m128i v;
+            memcpy(&pixel, p + k * 4, 4);
+            v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(v, _mm_set1_epi32((unsigned short)w[k])));
+        }
+        sum = _mm_srai_epi32(sum, SCALE_BITS);
+        sum = _mm_packus_epi16(_mm_packs_epi32(sum, sum), zero);
+        pixel = _mm_cvtsi128_si32(sum);
+        memcpy(dstPtr, &pixel, 4);
+    }
+}
+
+/*
+ * Two source rows of four pixels give two output pixels: the rows are
+ * added as 16 bit values and adjacent pixels are then added by folding
+ * the upper half of each register onto the lower.
+ */
+
+static void
+HalfSSE2(const unsigned char *srcPtr, int srcPitch, unsigned char *dstPtr, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    const unsigned char *p = srcPtr, *q = srcPtr + srcPitch;
+    int i = 0;
+
+    for ( ; i + 2 <= width; i += 2, p += 16, q += 16, dstPtr += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)q);
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+        hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+        _mm_storel_epi64((__m128i *)dstPtr, _mm_packus_epi16(lo, zero));
+    }
+    HalfScalar(p, srcPitch, dstPtr, width - i);
+}
+
+static void
+QuarterSSE2(const unsigned char *srcPtr, int srcPitch, unsigned char *dstPtr, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i eight = _mm_set1_epi16(8);
+    int i, j, pixel;
+
+    for (i = 0; i < width; ++i, dstPtr += 4) {
+        __m128i sum = zero;
+        for (j = 0; j < 4; ++j) {
+            __m128i a = _mm_loadu_si128((const __m128i *)
+                                        (srcPtr + (ptrdiff_t)j * srcPitch + i * 16));
+            sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                                   _mm_unpackhi_epi8(a, zero)));
+        }
+        sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, eight), 4);
+        pixel = _mm_cvtsi128_si32(_mm_packus_epi16(sum, zero));
+        memcpy(dstPtr, &pixel, 4);
+    }
+}
+
+/*
+ * Two source pixels per step: the blended row is read at offsets of one
+ * pixel either side, the even outputs take the left neighbour and the
+ * odd outputs the right, and the results are interleaved back into
+ * pixel order. The first and last pixels, whose neighbours are clamped,
+ * are left to the scalar code.
+ */
+
+static void
+DoubleRowSSE2(const unsigned short *sumPtr, unsigned char *dstPtr, int srcWidth)
+{
+    const __m128i eight = _mm_set1_epi16(8);
+    int i = 1, c;
+
+    for (c = 0; c < 4; ++c) {
+        int centre = sumPtr[c] * 3;
+        dstPtr[c] = (unsigned char)((centre + sumPtr[c] + 8) >> 4);
+        dstPtr[c + 4] = (unsigned char)((centre + sumPtr[4 + c] + 8) >> 4);
+    }
+    for ( ; i + 3 <= srcWidth; i += 2) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(sumPtr + i * 4));
+        __m128i l = _mm_loadu_si128((const __m128i *)(sumPtr + (i - 1) * 4));
+        __m128i r = _mm_loadu_si128((const __m128i *)(sumPtr + (i + 1) * 4));
+        __m128i c3 = _mm_add_epi16(_mm_add_epi16(c, c), c);
+        __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(c3, l), eight), 4);
+        __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(c3, r), eight), 4);
+        _mm_storeu_si128((__m128i *)(dstPtr + i * 8), _mm_packus_epi16(
+                             _mm_unpacklo_epi64(even, odd), _mm_unpackhi_epi64(even, odd)));
+    }
+    for ( ; i < srcWidth; ++i) {
+        const unsigned short *right = sumPtr + (i + 1 < srcWidth ? i + 1 : i) * 4;
+        for (c = 0; c < 4; ++c) {
+            int centre = sumPtr[i * 4 + c] * 3;
+            dstPtr[i * 8 + c] = (unsigned char)((centre + sumPtr[(i - 1) * 4 + c] + 8) >> 4);
+            dstPtr[i * 8 + c + 4] = (unsigned char)((centre + right[c] + 8) >> 4);
+        }
+    }
+}
+
+#endif /* VIDEO_X86 */
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,282 @@
+/* sink.c - fan out captured frames to the consumers of a widget
+ *
+ * Each frame captured for a widget is published once into the widget's
+ * frame ring (see ring.c). The widget thread reads the newest frame
+ * from there to draw it and for picture and -image. Anything else that
+ * wants every frame, such as a recorder or a network stream working on
+ * its own thread, registers a sink.
+ *
+ * When a frame is published each sink is given a reference to the same
+ * buffer; nothing is copied or converted on its behalf. A sink has a
+ * mailbox of one frame. If the sink has not taken the previous frame
+ * when the next arrives, the previous one is released and counted as
+ * dropped, so a slow sink only ever loses its own frames and never holds
+ * up the capture thread or the other sinks. A sink therefore holds the
+ * buffer in its mailbox and those it is working on, of which it says at
+ * most how many there may be when it registers, and that many slots
+ * plus one for the mailbox are reserved in the ring so that the capture
+ * thread always has somewhere to write. They are given back when the
+ * sink is unregistered.
+ *
+ * Buffers are shared and must not be modified. A sink that needs to
+ * change a frame, to blend an overlay for instance, asks for a writable
+ * frame with VideoBufferWritable and is only given a copy if some other
+ * consumer could still read the buffer.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SinkExchange(p, v) \
+    ((VideoBuffer *)_InterlockedExchangePointer((void * volatile *)(p), (v)))
+#else
+#define SinkExchange(p, v)  __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+struct VideoSink {
+    Video         *videoPtr;
+    char          *name;
+    int            slots;       /* ring slots reserved for the sink */
+    VideoSinkProc *wakeProc;    /* called when a frame is put in the mailbox */
+    ClientData     clientData;
+    VideoBuffer   *pending;     /* mailbox, exchanged atomically */
+    Tcl_WideInt    delivered;   /* frames put in the mailbox */
+    Tcl_WideInt    dropped;     /* frames replaced before being taken */
+    struct VideoSink *nextPtr;
+};
+
+/**
+ * Create the frame ring for a newly opened source, with -buffercount
+ * slots for the widget and room for the registered sinks. Any previous
+ * ring must have been closed.
+ *
+ * @return TCL_OK, or TCL_ERROR if the ring could not be allocated.
+ */
+
+int
+VideoOpenRing(Video *videoPtr, size_t slotSize)
+{
+    VideoRing *ringPtr;
+
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    ringPtr = VideoRingCreate(videoPtr->bufferCount + videoPtr->sinkSlots, slotSize);
+    videoPtr->ringPtr = ringPtr;
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+    return (ringPtr != NULL) ? TCL_OK : TCL_ERROR;
+}
+
+/**
+ * Release the frame ring. Frames still in sink mailboxes are released
+ * and the slots reserved for the sinks are given back, for a ring shared
+ * with other widgets; a sink working on a frame keeps it, and the ring,
+ * until it releases it. The capture thread must have stopped unless the
+ * ring is shared.
+ */
+
+void
+VideoCloseRing(Video *videoPtr)
+{
+    VideoSink *sinkPtr;
+
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    for (sinkPtr = videoPtr->sinkList; sinkPtr != NULL; sinkPtr = sinkPtr->nextPtr) {
+        VideoBuffer *bufferPtr = SinkExchange(&sinkPtr->pending, NULL);
+        if (bufferPtr != NULL) {
+            VideoBufferRelease(bufferPtr);
+        }
+    }
+    if (videoPtr->ringPtr != NULL) {
+        VideoRingReserve(videoPtr->ringPtr, -videoPtr->sinkSlots);
+        VideoRingDestroy(videoPtr->ringPtr);
+        videoPtr->ringPtr = NULL;
+    }
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+}
+
+/**
+ * Called by the capture thread when a frame arrives from the source to
+ * obtain a ring slot to fill, as VideoRingBeginWrite, and count the
+ * frame. The arrival time is recorded in the frame for the stats
+ * command; the caller sets up the rest of the frame.
+ *
+ * @return the frame to fill, or NULL if the frame must be dropped.
+ */
+
+VideoFrame *
+VideoBeginFrame(Video *videoPtr)
+{
+    VideoFrame *framePtr = VideoRingBeginWrite(videoPtr->ringPtr);
+
+    VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_CAPTURE, VIDEO_STAT_CAPTURE_IN, 1);
+    if (framePtr == NULL) {
+        VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_CAPTURE, VIDEO_STAT_DROP_RING, 1);
+        return NULL;
+    }
+    framePtr->captured = VideoStatsClock();
+    return framePtr;
+}
+
+/**
+ * Called by the capture thread once it has filled the slot it obtained
+ * from VideoBeginFrame. The frame becomes the newest frame for the
+ * widget, is handed to every sink and the widget is notified.
+ */
+
+void
+VideoPublishFrame(Video *videoPtr)
+{
+    VideoBuffer *bufferPtr = VideoRingPublish(videoPtr->ringPtr);
+
+    if (bufferPtr != NULL) {
+        VideoDeliverFrame(videoPtr, bufferPtr);
+    }
+}
+
+/**
+ * Hand a newly published frame to every sink of a widget and notify the
+ * widget. Used by VideoPublishFrame, and for each widget showing a
+ * shared source.
+ */
+
+void
+VideoDeliverFrame(Video *videoPtr, VideoBuffer *bufferPtr)
+{
+    VideoSink *sinkPtr;
+
+    VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_CAPTURE, VIDEO_STAT_CAPTURE_OUT, 1);
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    for (sinkPtr = videoPtr->sinkList; sinkPtr != NULL; sinkPtr = sinkPtr->nextPtr) {
+        VideoBuffer *oldPtr;
+
+        VideoBufferRetain(bufferPtr);
+        oldPtr = SinkExchange(&sinkPtr->pending, bufferPtr);
+        if (oldPtr != NULL) {
+            VideoBufferRelease(oldPtr);
+            ++sinkPtr->dropped;
+            VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_CAPTURE, VIDEO_STAT_DROP_SINK, 1);
+        }
+        ++sinkPtr->delivered;
+        if (sinkPtr->wakeProc != NULL) {
+            sinkPtr->wakeProc(sinkPtr->clientData);
+        }
+    }
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+    VideoNotifyFrame(videoPtr, VideoBufferFrame(bufferPtr));
+}
+
+/**
+ * Register a sink to receive every frame captured for a widget. The
+ * sink may take up to holds frames from its mailbox before releasing
+ * any of them. The wake procedure, if given, is called on the capture
+ * thread each time a frame is put in the sink's mailbox. It must not
+ * block or call any of the sink functions; typically it signals a
+ * condition or alerts the thread that will call VideoSinkTake.
+ *
+ * @return the new sink.
+ */
+
+VideoSink *
+VideoSinkCreate(Video *videoPtr, const char *name, int holds, VideoSinkProc *wakeProc,
+                ClientData clientData)
+{
+    VideoSink *sinkPtr = (VideoSink *)ckalloc(sizeof(VideoSink));
+
+    memset(sinkPtr, 0, sizeof(VideoSink));
+    sinkPtr->videoPtr = videoPtr;
+    sinkPtr->name = strcpy(ckalloc(strlen(name) + 1), name);
+    sinkPtr->slots = holds + 1;
+    sinkPtr->wakeProc = wakeProc;
+    sinkPtr->clientData = clientData;
+
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    sinkPtr->nextPtr = videoPtr->sinkList;
+    videoPtr->sinkList = sinkPtr;
+    videoPtr->sinkSlots += sinkPtr->slots;
+    if (videoPtr->ringPtr != NULL) {
+        VideoRingReserve(videoPtr->ringPtr, sinkPtr->slots);
+    }
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+    return sinkPtr;
+}
+
+/**
+ * Unregister a sink and release any frame in its mailbox. The caller
+ * must have released the frame it took last, if any. The slots reserved
+ * for the sink are given back to the ring, which frees the spare slots
+ * once nothing holds them.
+ */
+
+void
+VideoSinkDestroy(VideoSink *sinkPtr)
+{
+    Video *videoPtr = sinkPtr->videoPtr;
+    VideoSink **linkPtr;
+    VideoBuffer *bufferPtr;
+
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    for (linkPtr = &videoPtr->sinkList; *linkPtr != NULL; linkPtr = &(*linkPtr)->nextPtr) {
+        if (*linkPtr == sinkPtr) {
+            *linkPtr = sinkPtr->nextPtr;
+            videoPtr->sinkSlots -= sinkPtr->slots;
+            break;
+        }
+    }
+    bufferPtr = SinkExchange(&sinkPtr->pending, NULL);
+    if (bufferPtr != NULL) {
+        VideoBufferRelease(bufferPtr);
+    }
+    if (videoPtr->ringPtr != NULL) {
+        VideoRingReserve(videoPtr->ringPtr, -sinkPtr->slots);
+    }
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+    ckfree(sinkPtr->name);
+    ckfree((char *)sinkPtr);
+}
+
+/**
+ * Take the frame waiting in a sink's mailbox. The caller owns the
+ * reference and must pass the buffer to VideoBufferRelease when done.
+ *
+ * @return the newest frame not yet taken, or NULL.
+ */
+
+VideoBuffer *
+VideoSinkTake(VideoSink *sinkPtr)
+{
+    return SinkExchange(&sinkPtr->pending, NULL);
+}
+
+const char *
+VideoSinkName(const VideoSink *sinkPtr)
+{
+    return sinkPtr->name;
+}
+
+/**
+ * Report the frames delivered to a sink and the number of those it
+ * missed because it was too slow to take them.
+ */
+
+void
+VideoSinkCounts(VideoSink *sinkPtr, Tcl_WideInt *deliveredPtr, Tcl_WideInt *droppedPtr)
+{
+    Video *videoPtr = sinkPtr->videoPtr;
+
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    *deliveredPtr = sinkPtr->delivered;
+    *droppedPtr = sinkPtr->dropped;
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
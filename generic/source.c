@@ -0,0 +1,307 @@
+/* source.c - capture sources shared between widgets
+ *
+ * Widgets configured with the same source share one capture pipeline
+ * rather than each opening the device, or decoding the file, for
+ * itself. The platform code names the source in a normal form, so that
+ * every way of writing the same source gives the same name, and
+ * attaches the widget to it with VideoSourceAttach. The first widget
+ * to attach opens the source, with the platform's open procedure, and
+ * the last to detach closes it. The sources are kept in a table for the
+ * whole process, so widgets in different interpreters and threads
+ * share them too.
+ *
+ * A source owns the frame ring (see ring.c) that its capture thread
+ * fills. Each widget attached to it is a view of the source: it holds a
+ * reference to the ring, reads the newest frame with VideoRingNewest to
+ * draw it with its own scaling and placement, and has its own sinks,
+ * statistics and <<VideoFrame>> events. The capture thread calls
+ * VideoSourceBeginFrame and VideoSourcePublish in place of
+ * VideoBeginFrame and VideoPublishFrame, and each frame is captured
+ * once and handed to every view that is accepting frames. A running
+ * view accepts them all, a stopped one none, and a view that is paused
+ * before it has shown anything accepts just one so that it has a
+ * picture, as a paused graph shows the first frame. The source is run
+ * while any view accepts frames.
+ *
+ * Each view reserves slots in the ring for its sinks and one for the
+ * frame it is drawing, and gives them back when it detaches. The slots
+ * of the first view are those the ring was created with and stay with
+ * the ring. A later view with a larger -buffercount than the ring has
+ * slots also reserves the difference, so the ring is never smaller
+ * than any of its views asked for.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+
+typedef struct SourceView {
+    struct SourceView *nextPtr;
+    Video *videoPtr;
+    int slots;                  /* ring slots reserved for the view itself */
+    int accept;                 /* one of the VIDEO_ACCEPT_* values */
+    int haveFrame;              /* a frame has been delivered to it */
+} SourceView;
+
+struct VideoSource {
+    char *name;                 /* key in the table of sources */
+    int refCount;               /* views attached, protected by sourcesLock */
+    VideoRing *ringPtr;
+    ClientData clientData;      /* the platform's capture data */
+    VideoSourceCloseProc *closeProc;
+
+    Tcl_Mutex lock;             /* protects the list of views */
+    SourceView *viewList;
+};
+
+static Tcl_HashTable sources;
+static int sourcesInitialized = 0;
+TCL_DECLARE_MUTEX(sourcesLock)
+
+/**
+ * Attach a widget to the source of the given name, opening the source
+ * if no other widget has it open. openProc is called, with the widget
+ * and clientData, once the source's ring has been created, and returns
+ * the platform's capture data for the source or NULL, leaving an error
+ * in the widget's interpreter, if the source cannot be opened.
+ * closeProc is called with that data when the last view detaches.
+ *
+ * @return the source, or NULL with an error in the widget's interpreter.
+ */
+
+VideoSource *
+VideoSourceAttach(Video *videoPtr, const char *name, size_t slotSize,
+                  VideoSourceOpenProc *openProc, VideoSourceCloseProc *closeProc,
+                  ClientData clientData)
+{
+    VideoSource *sourcePtr;
+    SourceView *viewPtr;
+    Tcl_HashEntry *entryPtr;
+    int isNew, slots;
+
+    Tcl_MutexLock(&sourcesLock);
+    if (!sourcesInitialized) {
+        Tcl_InitHashTable(&sources, TCL_STRING_KEYS);
+        sourcesInitialized = 1;
+    }
+    entryPtr = Tcl_CreateHashEntry(&sources, name, &isNew);
+    if (isNew) {
+        sourcePtr = (VideoSource *)ckalloc(sizeof(VideoSource));
+        memset(sourcePtr, 0, sizeof(VideoSource));
+        sourcePtr->name = strcpy(ckalloc(strlen(name) + 1), name);
+        sourcePtr->closeProc = closeProc;
+        sourcePtr->ringPtr = VideoRingCreate(videoPtr->bufferCount, slotSize);
+        if (sourcePtr->ringPtr == NULL) {
+            Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+                "failed to initialize video source: out of memory", -1));
+        } else {
+            sourcePtr->clientData = openProc(sourcePtr, videoPtr, clientData);
+        }
+        if (sourcePtr->clientData == NULL) {
+            Tcl_DeleteHashEntry(entryPtr);
+            Tcl_MutexUnlock(&sourcesLock);
+            if (sourcePtr->ringPtr != NULL) {
+                VideoRingDestroy(sourcePtr->ringPtr);
+            }
+            ckfree(sourcePtr->name);
+            ckfree((char *)sourcePtr);
+            return NULL;
+        }
+        Tcl_SetHashValue(entryPtr, sourcePtr);
+        slots = 0;
+    } else {
+        sourcePtr = (VideoSource *)Tcl_GetHashValue(entryPtr);
+        slots = videoPtr->bufferCount - VideoRingSlots(sourcePtr->ringPtr);
+        slots = 1 + (slots > 0 ? slots : 0);
+    }
+    ++sourcePtr->refCount;
+    Tcl_MutexUnlock(&sourcesLock);
+
+    viewPtr = (SourceView *)ckalloc(sizeof(SourceView));
+    memset(viewPtr, 0, sizeof(SourceView));
+    viewPtr->slots = slots;
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    VideoRingRetain(sourcePtr->ringPtr);
+    videoPtr->ringPtr = sourcePtr->ringPtr;
+    VideoRingReserve(sourcePtr->ringPtr, slots + videoPtr->sinkSlots);
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+
+    viewPtr->videoPtr = videoPtr;
+    viewPtr->accept = VIDEO_ACCEPT_NONE;
+    Tcl_MutexLock(&sourcePtr->lock);
+    viewPtr->nextPtr = sourcePtr->viewList;
+    sourcePtr->viewList = viewPtr;
+    Tcl_MutexUnlock(&sourcePtr->lock);
+    return sourcePtr;
+}
+
+/**
+ * Detach a widget from its source. Frames in the widget's sink mailboxes
+ * are released, the slots the view reserved are given back to the ring
+ * and, if this was the last view, the source is closed.
+ */
+
+void
+VideoSourceDetach(VideoSource *sourcePtr, Video *videoPtr)
+{
+    SourceView **linkPtr, *viewPtr = NULL;
+    int last;
+
+    Tcl_MutexLock(&sourcePtr->lock);
+    for (linkPtr = &sourcePtr->viewList; *linkPtr != NULL; linkPtr = &(*linkPtr)->nextPtr) {
+        if ((*linkPtr)->videoPtr == videoPtr) {
+            viewPtr = *linkPtr;
+            *linkPtr = viewPtr->nextPtr;
+            break;
+        }
+    }
+    Tcl_MutexUnlock(&sourcePtr->lock);
+    VideoCloseRing(videoPtr);
+    if (viewPtr != NULL) {
+        VideoRingReserve(sourcePtr->ringPtr, -viewPtr->slots);
+        ckfree((char *)viewPtr);
+    }
+
+    Tcl_MutexLock(&sourcesLock);
+    last = (--sourcePtr->refCount == 0);
+    if (last) {
+        Tcl_DeleteHashEntry(Tcl_FindHashEntry(&sources, sourcePtr->name));
+    }
+    Tcl_MutexUnlock(&sourcesLock);
+
+    if (last) {
+        sourcePtr->closeProc(sourcePtr->clientData);
+        VideoRingDestroy(sourcePtr->ringPtr);
+        Tcl_MutexFinalize(&sourcePtr->lock);
+        ckfree(sourcePtr->name);
+        ckfree((char *)sourcePtr);
+    }
+}
+
+/**
+ * @return the platform's capture data for a source.
+ */
+
+ClientData
+VideoSourceData(VideoSource *sourcePtr)
+{
+    return sourcePtr->clientData;
+}
+
+/**
+ * @return the number of widgets attached to a source.
+ */
+
+int
+VideoSourceViews(VideoSource *sourcePtr)
+{
+    int views;
+
+    Tcl_MutexLock(&sourcesLock);
+    views = sourcePtr->refCount;
+    Tcl_MutexUnlock(&sourcesLock);
+    return views;
+}
+
+/**
+ * Set which frames a view accepts: VIDEO_ACCEPT_NONE, VIDEO_ACCEPT_ONE
+ * for the next frame only, or VIDEO_ACCEPT_ALL. A view asking for one
+ * frame while it already has one is given none, unless force is set as
+ * it is after a seek.
+ *
+ * @return the most that any view of the source accepts, which tells the
+ *  platform code whether to run the source, deliver one frame or idle.
+ */
+
+int
+VideoSourceAccept(VideoSource *sourcePtr, Video *videoPtr, int accept, int force)
+{
+    SourceView *viewPtr;
+    int most = VIDEO_ACCEPT_NONE;
+
+    Tcl_MutexLock(&sourcePtr->lock);
+    for (viewPtr = sourcePtr->viewList; viewPtr != NULL; viewPtr = viewPtr->nextPtr) {
+        if (viewPtr->videoPtr == videoPtr) {
+            viewPtr->accept = accept;
+            if (accept == VIDEO_ACCEPT_ONE && viewPtr->haveFrame && !force) {
+                viewPtr->accept = VIDEO_ACCEPT_NONE;
+            }
+        }
+        if (viewPtr->accept > most) {
+            most = viewPtr->accept;
+        }
+    }
+    Tcl_MutexUnlock(&sourcePtr->lock);
+    return most;
+}
+
+/**
+ * Called by the capture thread when a frame arrives from the source, as
+ * VideoBeginFrame, counting the frame for each view that accepts it.
+ *
+ * @return the frame to fill, or NULL if the frame must be dropped.
+ */
+
+VideoFrame *
+VideoSourceBeginFrame(VideoSource *sourcePtr)
+{
+    VideoFrame *framePtr = VideoRingBeginWrite(sourcePtr->ringPtr);
+    SourceView *viewPtr;
+
+    Tcl_MutexLock(&sourcePtr->lock);
+    for (viewPtr = sourcePtr->viewList; viewPtr != NULL; viewPtr = viewPtr->nextPtr) {
+        VideoStats *statsPtr = viewPtr->videoPtr->statsPtr;
+
+        if (viewPtr->accept == VIDEO_ACCEPT_NONE) {
+            continue;
+        }
+        VideoStatsCount(statsPtr, VIDEO_STATS_CAPTURE, VIDEO_STAT_CAPTURE_IN, 1);
+        if (framePtr == NULL) {
+            VideoStatsCount(statsPtr, VIDEO_STATS_CAPTURE, VIDEO_STAT_DROP_RING, 1);
+        }
+    }
+    Tcl_MutexUnlock(&sourcePtr->lock);
+    if (framePtr != NULL) {
+        framePtr->captured = VideoStatsClock();
+    }
+    return framePtr;
+}
+
+/**
+ * Called by the capture thread once it has filled the slot it obtained
+ * from VideoSourceBeginFrame. The frame becomes the newest frame of the
+ * source and is delivered to each view that accepts it.
+ */
+
+void
+VideoSourcePublish(VideoSource *sourcePtr)
+{
+    VideoBuffer *bufferPtr = VideoRingPublish(sourcePtr->ringPtr);
+    SourceView *viewPtr;
+
+    if (bufferPtr == NULL) {
+        return;
+    }
+    Tcl_MutexLock(&sourcePtr->lock);
+    for (viewPtr = sourcePtr->viewList; viewPtr != NULL; viewPtr = viewPtr->nextPtr) {
+        if (viewPtr->accept == VIDEO_ACCEPT_NONE) {
+            continue;
+        }
+        VideoDeliverFrame(viewPtr->videoPtr, bufferPtr);
+        viewPtr->haveFrame = 1;
+        if (viewPtr->accept == VIDEO_ACCEPT_ONE) {
+            viewPtr->accept = VIDEO_ACCEPT_NONE;
+        }
+    }
+    Tcl_MutexUnlock(&sourcePtr->lock);
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
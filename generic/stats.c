@@ -0,0 +1,361 @@
+/* stats.c - frame counters and latency histograms for the stats command
+ *
+ * Each stage a frame passes through counts the frames it is given and
+ * the frames it completes, and the time taken between stages is
+ * recorded in a histogram. Counting must cost nothing measurable, so no
+ * lock is taken and no locked instruction is used. Every counter is
+ * written by one thread only: the capture thread writes the capture
+ * block and the widget thread writes the widget block, and the two
+ * blocks are kept on separate cache lines. The writer updates a counter
+ * with a plain atomic load and store and the stats command reads it
+ * with an atomic load, so a value may be a frame out of date but is
+ * never torn.
+ *
+ * A reset cannot clear counters owned by another thread, so it records
+ * the current values instead and later reports are taken relative to
+ * them. The same is done for the hits and misses of the frame pool of
+ * the widget's source (see framepool.c), which counts under its own
+ * lock for all the threads that use it.
+ *
+ * The histograms are log-linear, in the manner of HdrHistogram. Values
+ * below 32 microseconds have a bucket each and every power of two above
+ * that is split into 16 buckets, so a reported percentile is within
+ * about 6% of the true value. Percentiles and the maximum are reported
+ * as the highest value that falls in their bucket.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+
+#if defined(_MSC_VER)
+/* Aligned 64 bit loads and stores are atomic on the 64 bit targets. */
+#define StatLoad(p)      (*(volatile Tcl_WideInt *)(p))
+#define StatStore(p, v)  (*(volatile Tcl_WideInt *)(p) = (v))
+#else
+#define StatLoad(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define StatStore(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
+
+#define SUB_BITS     4
+#define SUB_COUNT    (1 << SUB_BITS)
+#define MAX_BITS     26         /* values are clamped to 2^26 us, about a minute */
+#define BUCKETS      (2 * SUB_COUNT + (MAX_BITS - SUB_BITS - 1) * SUB_COUNT)
+
+typedef struct {
+    Tcl_WideInt count[VIDEO_STAT_COUNTERS];
+    Tcl_WideInt hist[VIDEO_LATENCIES][BUCKETS];
+    char pad[64];               /* keep the blocks off each other's cache lines */
+} StatsBlock;
+
+struct VideoStats {
+    StatsBlock block[2];        /* indexed by VIDEO_STATS_CAPTURE or _WIDGET */
+    StatsBlock base[2];         /* widget thread: values at the last reset */
+    Tcl_WideInt lastSequence;   /* widget thread: last frame converted */
+    VideoFramePool *basePool;   /* widget thread: the pool at the last reset */
+    Tcl_WideInt baseHits;
+    Tcl_WideInt baseMisses;
+};
+
+static const char *const latencyNames[VIDEO_LATENCIES] = {
+    "capture-convert", "convert-display", "picture"
+};
+
+VideoStats *
+VideoStatsCreate(void)
+{
+    VideoStats *statsPtr = (VideoStats *)ckalloc(sizeof(VideoStats));
+    memset(statsPtr, 0, sizeof(VideoStats));
+    statsPtr->lastSequence = -1;
+    return statsPtr;
+}
+
+void
+VideoStatsDestroy(VideoStats *statsPtr)
+{
+    ckfree((char *)statsPtr);
+}
+
+/**
+ * The clock used to time frames, in microseconds.
+ */
+
+Tcl_WideInt
+VideoStatsClock(void)
+{
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (Tcl_WideInt)now.sec * 1000000 + now.usec;
+}
+
+/**
+ * Add to a counter. Only the thread that owns the block may call this.
+ */
+
+void
+VideoStatsCount(VideoStats *statsPtr, int block, int counter, Tcl_WideInt n)
+{
+    Tcl_WideInt *countPtr = &statsPtr->block[block].count[counter];
+    StatStore(countPtr, StatLoad(countPtr) + n);
+}
+
+static int
+BucketIndex(Tcl_WideInt value)
+{
+    int msb = SUB_BITS, shift;
+
+    if (value < 2 * SUB_COUNT) {
+        return value < 0 ? 0 : (int)value;
+    }
+    if (value >= ((Tcl_WideInt)1 << MAX_BITS)) {
+        value = ((Tcl_WideInt)1 << MAX_BITS) - 1;
+    }
+    while ((value >> (msb + 1)) != 0) {
+        ++msb;
+    }
+    shift = msb - SUB_BITS;
+    return 2 * SUB_COUNT + (shift - 1) * SUB_COUNT
+        + (int)(value >> shift) - SUB_COUNT;
+}
+
+static Tcl_WideInt
+BucketHighest(int index)
+{
+    int shift;
+
+    if (index < 2 * SUB_COUNT) {
+        return index;
+    }
+    shift = (index - 2 * SUB_COUNT) / SUB_COUNT + 1;
+    return ((Tcl_WideInt)(SUB_COUNT + (index % SUB_COUNT) + 1) << shift) - 1;
+}
+
+/**
+ * Record a time in microseconds in one of the latency histograms. Only
+ * the thread that owns the block may call this.
+ */
+
+void
+VideoStatsLatency(VideoStats *statsPtr, int block, int latency, Tcl_WideInt usec)
+{
+    Tcl_WideInt *countPtr = &statsPtr->block[block].hist[latency][BucketIndex(usec)];
+    StatStore(countPtr, StatLoad(countPtr) + 1);
+}
+
+/**
+ * Account for the widget thread starting to convert a frame: the frame
+ * enters the convert stage and the time since it was captured is
+ * recorded. A frame that was not the one converted last is counted as
+ * fresh, so frames that were published but superseded before the
+ * widget got to them can be reported as skipped.
+ *
+ * @return the current time, for the caller to time the next stage.
+ */
+
+Tcl_WideInt
+VideoStatsFrame(VideoStats *statsPtr, const VideoFrame *framePtr)
+{
+    Tcl_WideInt now = VideoStatsClock();
+
+    VideoStatsCount(statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_CONVERT_IN, 1);
+    if (framePtr->sequence != statsPtr->lastSequence) {
+        statsPtr->lastSequence = framePtr->sequence;
+        VideoStatsCount(statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_FRESH, 1);
+    }
+    if (framePtr->captured != 0) {
+        VideoStatsLatency(statsPtr, VIDEO_STATS_WIDGET, VIDEO_LATENCY_CAPTURE_CONVERT,
+                          now - framePtr->captured);
+    }
+    return now;
+}
+
+/*
+ * Read both blocks, relative to the last reset, into a single block.
+ */
+
+static void
+StatsSnapshot(VideoStats *statsPtr, StatsBlock *totalPtr)
+{
+    int b, n, i;
+
+    memset(totalPtr, 0, sizeof(StatsBlock));
+    for (b = 0; b < 2; ++b) {
+        const StatsBlock *blockPtr = &statsPtr->block[b];
+        const StatsBlock *basePtr = &statsPtr->base[b];
+
+        for (n = 0; n < VIDEO_STAT_COUNTERS; ++n) {
+            totalPtr->count[n] += StatLoad(&blockPtr->count[n]) - basePtr->count[n];
+        }
+        for (n = 0; n < VIDEO_LATENCIES; ++n) {
+            for (i = 0; i < BUCKETS; ++i) {
+                totalPtr->hist[n][i] += StatLoad(&blockPtr->hist[n][i]) - basePtr->hist[n][i];
+            }
+        }
+    }
+}
+
+static Tcl_WideInt
+Percentile(const Tcl_WideInt *hist, Tcl_WideInt total, int percent)
+{
+    Tcl_WideInt want = (total * percent + 99) / 100, seen = 0;
+    int i;
+
+    for (i = 0; i < BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen >= want) {
+            return BucketHighest(i);
+        }
+    }
+    return BucketHighest(BUCKETS - 1);
+}
+
+static Tcl_Obj *
+LatencyObj(const Tcl_WideInt *hist)
+{
+    Tcl_Obj *resultObj = Tcl_NewObj();
+    Tcl_WideInt total = 0, p50 = 0, p99 = 0, max = 0;
+    int i;
+
+    for (i = 0; i < BUCKETS; ++i) {
+        total += hist[i];
+        if (hist[i] > 0) {
+            max = BucketHighest(i);
+        }
+    }
+    if (total > 0) {
+        p50 = Percentile(hist, total, 50);
+        p99 = Percentile(hist, total, 99);
+    }
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("count", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(total));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("p50", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(p50));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("p99", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(p99));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("max", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(max));
+    return resultObj;
+}
+
+static void
+AppendPair(Tcl_Obj *dictObj, const char *key, Tcl_Obj *valueObj)
+{
+    Tcl_ListObjAppendElement(NULL, dictObj, Tcl_NewStringObj(key, -1));
+    Tcl_ListObjAppendElement(NULL, dictObj, valueObj);
+}
+
+static Tcl_Obj *
+StageObj(const StatsBlock *totalPtr, int in, int out)
+{
+    Tcl_Obj *resultObj = Tcl_NewObj();
+    AppendPair(resultObj, "in", Tcl_NewWideIntObj(totalPtr->count[in]));
+    AppendPair(resultObj, "out", Tcl_NewWideIntObj(totalPtr->count[out]));
+    return resultObj;
+}
+
+/*
+ * Read the frame pool counters relative to the last reset. A pool other
+ * than the one reset, from a new source, is counted from its creation.
+ */
+
+static void
+BuffersSnapshot(VideoStats *statsPtr, VideoFramePool *poolPtr,
+                Tcl_WideInt *hitsPtr, Tcl_WideInt *missesPtr)
+{
+    *hitsPtr = *missesPtr = 0;
+    if (poolPtr != NULL) {
+        VideoFramePoolCounts(poolPtr, hitsPtr, missesPtr);
+        if (poolPtr == statsPtr->basePool) {
+            *hitsPtr -= statsPtr->baseHits;
+            *missesPtr -= statsPtr->baseMisses;
+        }
+    }
+}
+
+/**
+ * Report the counters as a dictionary. Called on the widget thread,
+ * with the frame pool of the widget's source or NULL if it has none.
+ *
+ * @return a new dictionary object of the stages, drops, latencies and
+ *  frame buffers.
+ */
+
+Tcl_Obj *
+VideoStatsGet(VideoStats *statsPtr, VideoFramePool *poolPtr)
+{
+    StatsBlock *totalPtr = (StatsBlock *)ckalloc(sizeof(StatsBlock));
+    Tcl_Obj *resultObj = Tcl_NewObj(), *dropObj, *latencyObj, *buffersObj;
+    Tcl_WideInt skipped, hits, misses;
+    int n;
+
+    StatsSnapshot(statsPtr, totalPtr);
+
+    AppendPair(resultObj, "capture",
+               StageObj(totalPtr, VIDEO_STAT_CAPTURE_IN, VIDEO_STAT_CAPTURE_OUT));
+    AppendPair(resultObj, "convert",
+               StageObj(totalPtr, VIDEO_STAT_CONVERT_IN, VIDEO_STAT_CONVERT_OUT));
+    AppendPair(resultObj, "display",
+               StageObj(totalPtr, VIDEO_STAT_DISPLAY_IN, VIDEO_STAT_DISPLAY_OUT));
+    AppendPair(resultObj, "picture",
+               StageObj(totalPtr, VIDEO_STAT_PICTURE_IN, VIDEO_STAT_PICTURE_OUT));
+
+    skipped = totalPtr->count[VIDEO_STAT_CAPTURE_OUT] - totalPtr->count[VIDEO_STAT_FRESH];
+    dropObj = Tcl_NewObj();
+    AppendPair(dropObj, "ring", Tcl_NewWideIntObj(totalPtr->count[VIDEO_STAT_DROP_RING]));
+    AppendPair(dropObj, "sink", Tcl_NewWideIntObj(totalPtr->count[VIDEO_STAT_DROP_SINK]));
+    AppendPair(dropObj, "skipped", Tcl_NewWideIntObj(skipped < 0 ? 0 : skipped));
+    AppendPair(resultObj, "dropped", dropObj);
+
+    latencyObj = Tcl_NewObj();
+    for (n = 0; n < VIDEO_LATENCIES; ++n) {
+        AppendPair(latencyObj, latencyNames[n], LatencyObj(totalPtr->hist[n]));
+    }
+    AppendPair(resultObj, "latency", latencyObj);
+
+    BuffersSnapshot(statsPtr, poolPtr, &hits, &misses);
+    buffersObj = Tcl_NewObj();
+    AppendPair(buffersObj, "hits", Tcl_NewWideIntObj(hits));
+    AppendPair(buffersObj, "misses", Tcl_NewWideIntObj(misses));
+    AppendPair(resultObj, "buffers", buffersObj);
+
+    ckfree((char *)totalPtr);
+    return resultObj;
+}
+
+/**
+ * Start counting again from zero. Called on the widget thread, with the
+ * frame pool of the widget's source or NULL.
+ */
+
+void
+VideoStatsReset(VideoStats *statsPtr, VideoFramePool *poolPtr)
+{
+    int b, n, i;
+
+    statsPtr->basePool = poolPtr;
+    statsPtr->baseHits = statsPtr->baseMisses = 0;
+    if (poolPtr != NULL) {
+        VideoFramePoolCounts(poolPtr, &statsPtr->baseHits, &statsPtr->baseMisses);
+    }
+
+    for (b = 0; b < 2; ++b) {
+        for (n = 0; n < VIDEO_STAT_COUNTERS; ++n) {
+            statsPtr->base[b].count[n] = StatLoad(&statsPtr->block[b].count[n]);
+        }
+        for (n = 0; n < VIDEO_LATENCIES; ++n) {
+            for (i = 0; i < BUCKETS; ++i) {
+                statsPtr->base[b].hist[n][i] = StatLoad(&statsPtr->block[b].hist[n][i]);
+            }
+        }
+    }
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,794 @@
+/* stream.c - MJPEG over HTTP streaming of the widget's frames
+ *
+ *      pathName stream listen ?-quality q? port
+ *      pathName stream info
+ *      pathName stream close
+ *
+ * The server runs on its own thread and receives frames as a sink (see
+ * sink.c), so the widget thread does nothing for it. Each frame is
+ * compressed to JPEG once, if any client is waiting for it, by a task on
+ * the worker pool (see pool.c), and the same compressed buffer is then
+ * sent to every client as one part of a multipart/x-mixed-replace
+ * response, which browsers and most video tools display as a moving
+ * image. The server thread itself only polls and sends.
+ *
+ * All sockets are non-blocking and the thread waits for any of them
+ * with poll. A part is sent with a single gathering write of the part
+ * header, the JPEG data and the trailing line break. A client that
+ * cannot take the whole part keeps its place in it and the rest is sent
+ * when the socket becomes writable again. Until it has finished the
+ * client is not given new frames; when it is ready again it is given
+ * the newest frame and the ones it missed are counted as dropped. A
+ * slow client therefore only ever holds one compressed frame and
+ * never delays the other clients or the capture thread. The socket send
+ * buffers are kept small so that frames are dropped here, rather than
+ * queued by the system where they would only add to the delay.
+ *
+ * The widget thread wakes the server, to stop it, and the encoding task
+ * wakes it when a compressed frame is ready, by sending a byte to a
+ * loopback datagram socket that the server also polls.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include "tkvideo.h"
+#include <stdio.h>
+
+#ifdef HAVE_JPEG
+
+#if defined(_WIN32)
+typedef SOCKET StreamSocket;
+typedef WSABUF StreamBuffer;
+#define STREAM_INVALID       INVALID_SOCKET
+#define StreamClose(s)       closesocket(s)
+#define StreamPoll           WSAPoll
+#define StreamWouldBlock()   (WSAGetLastError() == WSAEWOULDBLOCK)
+#define StreamBufferSet(b, p, n)  ((b)->buf = (char *)(p), (b)->len = (ULONG)(n))
+#define StreamBufferLen(b)   ((b)->len)
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+typedef int StreamSocket;
+typedef struct iovec StreamBuffer;
+#define STREAM_INVALID       (-1)
+#define StreamClose(s)       close(s)
+#define StreamPoll           poll
+#define StreamWouldBlock()   (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#define StreamBufferSet(b, p, n)  ((b)->iov_base = (void *)(p), (b)->iov_len = (n))
+#define StreamBufferLen(b)   ((b)->iov_len)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+#define STREAM_BOUNDARY "tkvideoframe"
+#define STREAM_REQUEST_MAX 4096
+#define STREAM_SEND_BUFFER 65536
+
+static const char streamResponse[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Server: tkvideo/" PACKAGE_VERSION "\r\n"
+    "Connection: close\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "Content-Type: multipart/x-mixed-replace;boundary=" STREAM_BOUNDARY "\r\n"
+    "\r\n";
+
+/*
+ * A compressed frame shared by the clients sending it. Once the server
+ * thread has taken one from the encoding task only it uses the frame, so
+ * the reference count is not atomic. They are taken from the frame pool
+ * of the source and given back to it when the last client has sent the
+ * frame.
+ */
+
+typedef struct {
+    int refCount;
+    Tcl_WideInt index;          /* frames compressed before this one */
+    char head[128];             /* the part header */
+    size_t headLen;
+    size_t size;
+    unsigned char data[1];      /* size bytes of JPEG */
+} StreamFrame;
+
+typedef struct {
+    StreamSocket sock;
+    int streaming;              /* the request has been read */
+    int responseSent;           /* the response header has been sent */
+    char request[STREAM_REQUEST_MAX];
+    int requestLen;
+    StreamFrame *framePtr;      /* part being sent, or NULL */
+    size_t offset;              /* bytes of it sent so far */
+    Tcl_WideInt lastIndex;      /* index of the last frame sent, or -1 */
+} StreamClient;
+
+struct VideoStream {
+    Video *videoPtr;
+    VideoSink *sinkPtr;
+    Tcl_ThreadId threadId;
+    StreamSocket listener;
+    StreamSocket wakeSock;      /* loopback datagram socket sent to itself */
+    int port;
+    int quality;
+    volatile int quit;
+
+    /* encoding task only */
+    VideoJpeg *jpegPtr;
+
+    /* server thread only */
+    StreamClient **clients;
+    int clientCount;
+    int clientSpace;
+    StreamFrame *latestPtr;     /* the newest compressed frame */
+    Tcl_WideInt dropped;        /* frames clients were too busy to be sent */
+
+    /* shared with the task and the widget thread, under lock */
+    Tcl_Mutex lock;
+    Tcl_Condition cond;         /* signalled when the task finishes */
+    int scheduled;              /* a task is given to the pool or running */
+    int wanted;                 /* a client is waiting for frames */
+    StreamFrame *readyPtr;      /* compressed and not yet taken, or NULL */
+    Tcl_WideInt encoded;
+    int infoClients;
+    Tcl_WideInt infoSent;
+    Tcl_WideInt infoDropped;
+};
+
+static Tcl_ThreadCreateType StreamThreadProc(ClientData clientData);
+static void StreamWake(ClientData clientData);
+static void StreamEncodeTask(ClientData clientData);
+static void StreamStop(VideoStream *streamPtr);
+
+static int
+SetNonBlocking(StreamSocket sock)
+{
+#if defined(_WIN32)
+    u_long on = 1;
+    return ioctlsocket(sock, FIONBIO, &on) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return (flags == -1) ? -1 : fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+/*
+ * Open the listening socket and the wake socket.
+ */
+
+static int
+StreamOpenSockets(Tcl_Interp *interp, VideoStream *streamPtr, int port)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int on = 1;
+
+    streamPtr->listener = socket(AF_INET, SOCK_STREAM, 0);
+    streamPtr->wakeSock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (streamPtr->listener == STREAM_INVALID || streamPtr->wakeSock == STREAM_INVALID) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("couldn't open socket", -1));
+        return TCL_ERROR;
+    }
+    setsockopt(streamPtr->listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((unsigned short)port);
+    if (bind(streamPtr->listener, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(streamPtr->listener, 16) != 0
+        || getsockname(streamPtr->listener, (struct sockaddr *)&addr, &len) != 0
+        || SetNonBlocking(streamPtr->listener) != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "couldn't open socket: cannot listen on port %d", port));
+        return TCL_ERROR;
+    }
+    streamPtr->port = ntohs(addr.sin_port);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(addr);
+    if (bind(streamPtr->wakeSock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || getsockname(streamPtr->wakeSock, (struct sockaddr *)&addr, &len) != 0
+        || connect(streamPtr->wakeSock, (struct sockaddr *)&addr, len) != 0
+        || SetNonBlocking(streamPtr->wakeSock) != 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("couldn't open socket", -1));
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static void
+StreamFrameRelease(StreamFrame *framePtr)
+{
+    if (--framePtr->refCount == 0) {
+        VideoFramePoolFree(framePtr);
+    }
+}
+
+static void
+ClientFree(StreamClient *clientPtr)
+{
+    StreamClose(clientPtr->sock);
+    if (clientPtr->framePtr != NULL) {
+        StreamFrameRelease(clientPtr->framePtr);
+    }
+    ckfree((char *)clientPtr);
+}
+
+/*
+ * Accept every pending connection.
+ */
+
+static void
+StreamAccept(VideoStream *streamPtr)
+{
+    int sendBuffer = STREAM_SEND_BUFFER;
+
+    for (;;) {
+        StreamSocket sock = accept(streamPtr->listener, NULL, NULL);
+        StreamClient *clientPtr;
+
+        if (sock == STREAM_INVALID) {
+            return;
+        }
+        if (SetNonBlocking(sock) != 0) {
+            StreamClose(sock);
+            continue;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char *)&sendBuffer, sizeof(sendBuffer));
+        if (streamPtr->clientCount == streamPtr->clientSpace) {
+            streamPtr->clientSpace = streamPtr->clientSpace * 2 + 4;
+            streamPtr->clients = (StreamClient **)ckrealloc((char *)streamPtr->clients,
+                sizeof(StreamClient *) * streamPtr->clientSpace);
+        }
+        clientPtr = (StreamClient *)ckalloc(sizeof(StreamClient));
+        memset(clientPtr, 0, sizeof(StreamClient));
+        clientPtr->sock = sock;
+        clientPtr->lastIndex = -1;
+        streamPtr->clients[streamPtr->clientCount++] = clientPtr;
+    }
+}
+
+/*
+ * Read from a client. Until the end of the request headers has been seen
+ * the request is collected; after that anything sent is discarded.
+ *
+ * Returns 0 if the client has gone or sent an unreasonable request.
+ */
+
+static int
+ClientRead(StreamClient *clientPtr)
+{
+    char discard[512];
+    int n;
+
+    if (!clientPtr->streaming) {
+        int space = STREAM_REQUEST_MAX - 1 - clientPtr->requestLen;
+        if (space <= 0) {
+            return 0;
+        }
+        n = recv(clientPtr->sock, clientPtr->request + clientPtr->requestLen, space, 0);
+        if (n > 0) {
+            clientPtr->requestLen += n;
+            clientPtr->request[clientPtr->requestLen] = '\0';
+            if (strstr(clientPtr->request, "\r\n\r\n") != NULL
+                || strstr(clientPtr->request, "\n\n") != NULL) {
+                clientPtr->streaming = 1;
+            }
+        }
+    } else {
+        n = recv(clientPtr->sock, discard, sizeof(discard), 0);
+    }
+    return (n > 0 || (n < 0 && StreamWouldBlock()));
+}
+
+/*
+ * Send as much of the response header and the current part as the
+ * socket will take in one gathering write.
+ *
+ * Returns 0 if the client has gone.
+ */
+
+static int
+ClientSend(VideoStream *streamPtr, StreamClient *clientPtr)
+{
+    StreamBuffer iov[4];
+    StreamFrame *framePtr = clientPtr->framePtr;
+    size_t skip = clientPtr->offset, total = 0;
+    int count = 0, n, i;
+
+    if (!clientPtr->responseSent) {
+        StreamBufferSet(&iov[count], streamResponse, sizeof(streamResponse) - 1);
+        ++count;
+    }
+    if (framePtr != NULL) {
+        StreamBufferSet(&iov[count], framePtr->head, framePtr->headLen);
+        ++count;
+        StreamBufferSet(&iov[count], framePtr->data, framePtr->size);
+        ++count;
+        StreamBufferSet(&iov[count], "\r\n", 2);
+        ++count;
+    }
+    for (i = 0; i < count; ++i) {
+        total += StreamBufferLen(&iov[i]);
+    }
+
+    /* Drop what was sent by earlier calls. */
+    for (i = 0; i < count && skip >= StreamBufferLen(&iov[i]); ++i) {
+        skip -= StreamBufferLen(&iov[i]);
+    }
+    if (i < count) {
+#if defined(_WIN32)
+        DWORD sent = 0;
+        iov[i].buf += skip;
+        iov[i].len -= (ULONG)skip;
+        n = (WSASend(clientPtr->sock, iov + i, count - i, &sent, 0, NULL, NULL) == 0)
+            ? (int)sent : -1;
+#else
+        struct msghdr msg;
+        iov[i].iov_base = (char *)iov[i].iov_base + skip;
+        iov[i].iov_len -= skip;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov + i;
+        msg.msg_iovlen = count - i;
+        n = (int)sendmsg(clientPtr->sock, &msg, MSG_NOSIGNAL);
+#endif
+        if (n < 0) {
+            return StreamWouldBlock();
+        }
+        clientPtr->offset += n;
+    }
+
+    if (clientPtr->offset == total) {
+        clientPtr->responseSent = 1;
+        clientPtr->offset = 0;
+        if (framePtr != NULL) {
+            clientPtr->framePtr = NULL;
+            StreamFrameRelease(framePtr);
+            Tcl_MutexLock(&streamPtr->lock);
+            ++streamPtr->infoSent;
+            Tcl_MutexUnlock(&streamPtr->lock);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Called on the capture thread when a frame is put in the sink. The
+ * encoding task is given to the pool, using the widget's affinity,
+ * unless one is already waiting or running, as that will take the frame
+ * before it finishes, or no client is waiting for frames.
+ */
+
+static void
+StreamFrameWake(ClientData clientData)
+{
+    VideoStream *streamPtr = (VideoStream *)clientData;
+    int submit;
+
+    Tcl_MutexLock(&streamPtr->lock);
+    submit = !streamPtr->scheduled && streamPtr->wanted && !streamPtr->quit;
+    if (submit)
+        streamPtr->scheduled = 1;
+    Tcl_MutexUnlock(&streamPtr->lock);
+    if (submit)
+        VideoPoolSubmit(streamPtr->videoPtr, StreamEncodeTask, streamPtr);
+}
+
+/*
+ * Compress the newest frames from the sink on a worker of the pool and
+ * hand each to the server thread. A frame the server has not taken yet
+ * is replaced by the next one.
+ */
+
+static void
+StreamEncodeTask(ClientData clientData)
+{
+    VideoStream *streamPtr = (VideoStream *)clientData;
+
+    Tcl_MutexLock(&streamPtr->lock);
+    while (!streamPtr->quit) {
+        VideoBuffer *bufferPtr = VideoSinkTake(streamPtr->sinkPtr);
+        StreamFrame *framePtr = NULL, *stalePtr;
+        const unsigned char *data;
+        size_t size;
+
+        if (bufferPtr == NULL)
+            break;
+        if (!streamPtr->wanted) {
+            Tcl_MutexUnlock(&streamPtr->lock);
+            VideoBufferRelease(bufferPtr);
+            Tcl_MutexLock(&streamPtr->lock);
+            continue;
+        }
+        Tcl_MutexUnlock(&streamPtr->lock);
+        if (VideoJpegEncode(streamPtr->jpegPtr, VideoBufferFrame(bufferPtr),
+                            streamPtr->quality, &data, &size) == TCL_OK) {
+            framePtr = (StreamFrame *)VideoFramePoolAlloc(VideoBufferPool(bufferPtr),
+                                                          sizeof(StreamFrame) + size);
+        }
+        VideoBufferRelease(bufferPtr);
+        if (framePtr != NULL) {
+            framePtr->refCount = 1;
+            framePtr->size = size;
+            memcpy(framePtr->data, data, size);
+            sprintf(framePtr->head, "--" STREAM_BOUNDARY "\r\n"
+                    "Content-Type: image/jpeg\r\n"
+                    "Content-Length: %lu\r\n\r\n", (unsigned long)size);
+            framePtr->headLen = strlen(framePtr->head);
+        }
+        Tcl_MutexLock(&streamPtr->lock);
+        if (framePtr != NULL) {
+            framePtr->index = streamPtr->encoded++;
+            stalePtr = streamPtr->readyPtr;
+            streamPtr->readyPtr = framePtr;
+            Tcl_MutexUnlock(&streamPtr->lock);
+            if (stalePtr != NULL)
+                VideoFramePoolFree(stalePtr);
+            StreamWake(streamPtr);
+            Tcl_MutexLock(&streamPtr->lock);
+        }
+    }
+    streamPtr->scheduled = 0;
+    Tcl_ConditionNotify(&streamPtr->cond);
+    Tcl_MutexUnlock(&streamPtr->lock);
+}
+
+/*
+ * Take the frame compressed by the task, if there is a new one, as the
+ * newest frame for the clients. The previous newest is counted as
+ * dropped for each client that was too busy to be sent it.
+ */
+
+static void
+StreamTakeFrame(VideoStream *streamPtr)
+{
+    StreamFrame *framePtr;
+    int i;
+
+    Tcl_MutexLock(&streamPtr->lock);
+    framePtr = streamPtr->readyPtr;
+    streamPtr->readyPtr = NULL;
+    Tcl_MutexUnlock(&streamPtr->lock);
+    if (framePtr == NULL) {
+        return;
+    }
+    if (streamPtr->latestPtr != NULL) {
+        for (i = 0; i < streamPtr->clientCount; ++i) {
+            StreamClient *clientPtr = streamPtr->clients[i];
+            if (clientPtr->streaming && clientPtr->lastIndex != streamPtr->latestPtr->index) {
+                ++streamPtr->dropped;
+            }
+        }
+        StreamFrameRelease(streamPtr->latestPtr);
+    }
+    streamPtr->latestPtr = framePtr;
+}
+
+/*
+ * The server thread.
+ */
+
+static Tcl_ThreadCreateType
+StreamThreadProc(ClientData clientData)
+{
+    VideoStream *streamPtr = (VideoStream *)clientData;
+    struct pollfd *fds = NULL;
+    int fdSpace = 0;
+
+    while (!streamPtr->quit) {
+        int i, n, count = streamPtr->clientCount + 2;
+
+        if (count > fdSpace) {
+            fdSpace = count * 2;
+            fds = (struct pollfd *)ckrealloc((char *)fds, sizeof(struct pollfd) * fdSpace);
+        }
+        fds[0].fd = streamPtr->wakeSock;
+        fds[0].events = POLLIN;
+        fds[1].fd = streamPtr->listener;
+        fds[1].events = POLLIN;
+        for (i = 0; i < streamPtr->clientCount; ++i) {
+            StreamClient *clientPtr = streamPtr->clients[i];
+            fds[i + 2].fd = clientPtr->sock;
+            fds[i + 2].events = POLLIN;
+            if (clientPtr->framePtr != NULL
+                || (clientPtr->streaming && !clientPtr->responseSent)) {
+                fds[i + 2].events |= POLLOUT;
+            }
+        }
+        for (i = 0; i < count; ++i) {
+            fds[i].revents = 0;
+        }
+        n = StreamPoll(fds, count, -1);
+        if (n < 0 && !StreamWouldBlock()) {
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char buf[64];
+            while (recv(streamPtr->wakeSock, buf, sizeof(buf), 0) > 0)
+                ;
+        }
+        StreamTakeFrame(streamPtr);
+
+        /* Serve the clients polled, in place, dropping any that fail. */
+        for (i = 0, n = 0; i < count - 2; ++i) {
+            StreamClient *clientPtr = streamPtr->clients[i];
+            StreamFrame *latestPtr = streamPtr->latestPtr;
+            int ok = 1;
+
+            if (fds[i + 2].revents & (POLLIN | POLLERR | POLLHUP)) {
+                ok = ClientRead(clientPtr);
+            }
+            if (ok && clientPtr->streaming && clientPtr->framePtr == NULL
+                && latestPtr != NULL && latestPtr->index != clientPtr->lastIndex) {
+                clientPtr->lastIndex = latestPtr->index;
+                clientPtr->framePtr = latestPtr;
+                ++latestPtr->refCount;
+            }
+            if (ok && clientPtr->streaming
+                && (clientPtr->framePtr != NULL || !clientPtr->responseSent)) {
+                ok = ClientSend(streamPtr, clientPtr);
+            }
+            if (ok) {
+                streamPtr->clients[n++] = clientPtr;
+            } else {
+                ClientFree(clientPtr);
+            }
+        }
+        /* Keep any accepted after the poll set was made. */
+        for ( ; i < streamPtr->clientCount; ++i) {
+            streamPtr->clients[n++] = streamPtr->clients[i];
+        }
+        streamPtr->clientCount = n;
+        if (fds[1].revents & POLLIN) {
+            StreamAccept(streamPtr);
+        }
+
+        for (i = 0, n = 0; i < streamPtr->clientCount; ++i) {
+            n |= streamPtr->clients[i]->streaming;
+        }
+        Tcl_MutexLock(&streamPtr->lock);
+        streamPtr->wanted = n;
+        streamPtr->infoClients = streamPtr->clientCount;
+        streamPtr->infoDropped = streamPtr->dropped;
+        Tcl_MutexUnlock(&streamPtr->lock);
+    }
+
+    if (fds != NULL) {
+        ckfree((char *)fds);
+    }
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Called by the encoding task when a frame is ready, and on the widget
+ * thread to stop the server.
+ */
+
+static void
+StreamWake(ClientData clientData)
+{
+    VideoStream *streamPtr = (VideoStream *)clientData;
+    send(streamPtr->wakeSock, "", 1, 0);
+}
+
+/*
+ * Stop the server thread, after waiting for an encoding task that is
+ * running to finish, and release everything.
+ */
+
+static void
+StreamStop(VideoStream *streamPtr)
+{
+    int i, result;
+
+    Tcl_MutexLock(&streamPtr->lock);
+    streamPtr->quit = 1;
+    while (streamPtr->scheduled)
+        Tcl_ConditionWait(&streamPtr->cond, &streamPtr->lock, NULL);
+    Tcl_MutexUnlock(&streamPtr->lock);
+    if (streamPtr->threadId != NULL) {
+        StreamWake(streamPtr);
+        Tcl_JoinThread(streamPtr->threadId, &result);
+    }
+    if (streamPtr->sinkPtr != NULL) {
+        VideoSinkDestroy(streamPtr->sinkPtr);
+    }
+    for (i = 0; i < streamPtr->clientCount; ++i) {
+        ClientFree(streamPtr->clients[i]);
+    }
+    if (streamPtr->clients != NULL) {
+        ckfree((char *)streamPtr->clients);
+    }
+    if (streamPtr->latestPtr != NULL) {
+        StreamFrameRelease(streamPtr->latestPtr);
+    }
+    if (streamPtr->readyPtr != NULL) {
+        VideoFramePoolFree(streamPtr->readyPtr);
+    }
+    if (streamPtr->listener != STREAM_INVALID) {
+        StreamClose(streamPtr->listener);
+    }
+    if (streamPtr->wakeSock != STREAM_INVALID) {
+        StreamClose(streamPtr->wakeSock);
+    }
+    if (streamPtr->jpegPtr != NULL) {
+        VideoJpegDestroy(streamPtr->jpegPtr);
+    }
+    Tcl_ConditionFinalize(&streamPtr->cond);
+    Tcl_MutexFinalize(&streamPtr->lock);
+    ckfree((char *)streamPtr);
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+}
+
+static int
+StreamListen(Video *videoPtr, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *options[] = { "-quality", NULL };
+    VideoStream *streamPtr;
+    int port, quality = 80, index, n;
+
+    if (objc < 4 || (objc % 2) != 0) {
+        Tcl_WrongNumArgs(interp, 3, objv, "?-quality q? port");
+        return TCL_ERROR;
+    }
+    for (n = 3; n < objc - 1; n += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index) != TCL_OK
+            || Tcl_GetIntFromObj(interp, objv[n + 1], &quality) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (quality < 1 || quality > 100) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "invalid quality %d: must be from 1 to 100", quality));
+            return TCL_ERROR;
+        }
+    }
+    if (Tcl_GetIntFromObj(interp, objv[objc - 1], &port) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (videoPtr->streamPtr != NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "already streaming on port %d", videoPtr->streamPtr->port));
+        return TCL_ERROR;
+    }
+
+#if defined(_WIN32)
+    {
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("couldn't initialize sockets", -1));
+            return TCL_ERROR;
+        }
+    }
+#endif
+    streamPtr = (VideoStream *)ckalloc(sizeof(VideoStream));
+    memset(streamPtr, 0, sizeof(VideoStream));
+    streamPtr->videoPtr = videoPtr;
+    streamPtr->listener = streamPtr->wakeSock = STREAM_INVALID;
+    streamPtr->quality = quality;
+    if (StreamOpenSockets(interp, streamPtr, port) != TCL_OK) {
+        StreamStop(streamPtr);
+        return TCL_ERROR;
+    }
+    streamPtr->jpegPtr = VideoJpegCreate();
+    streamPtr->sinkPtr = VideoSinkCreate(videoPtr, "stream", 1, StreamFrameWake, streamPtr);
+    if (Tcl_CreateThread(&streamPtr->threadId, StreamThreadProc, (ClientData)streamPtr,
+            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+        streamPtr->threadId = NULL;
+        StreamStop(streamPtr);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("cannot create stream thread", -1));
+        return TCL_ERROR;
+    }
+    videoPtr->streamPtr = streamPtr;
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(streamPtr->port));
+    return TCL_OK;
+}
+
+static Tcl_Obj *
+StreamInfo(VideoStream *streamPtr)
+{
+    Tcl_Obj *resultObj = Tcl_NewObj();
+
+    Tcl_MutexLock(&streamPtr->lock);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("port", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(streamPtr->port));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("clients", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(streamPtr->infoClients));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("encoded", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(streamPtr->encoded));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("sent", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(streamPtr->infoSent));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("dropped", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(streamPtr->infoDropped));
+    Tcl_MutexUnlock(&streamPtr->lock);
+    return resultObj;
+}
+
+#endif /* HAVE_JPEG */
+
+/**
+ * Stop any stream server for a widget. Called when the widget is
+ * destroyed.
+ */
+
+void
+VideoStreamClose(Video *videoPtr)
+{
+#ifdef HAVE_JPEG
+    if (videoPtr->streamPtr != NULL) {
+        StreamStop(videoPtr->streamPtr);
+        videoPtr->streamPtr = NULL;
+    }
+#endif
+}
+
+/**
+ * Implement the stream widget subcommand.
+ */
+
+int
+VideoWidgetStreamCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+#ifdef HAVE_JPEG
+    Video *videoPtr = (Video *)clientData;
+    static const char *commands[] = { "close", "info", "listen", NULL };
+    enum { STREAM_CLOSE, STREAM_INFO, STREAM_LISTEN };
+    int index;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "command ?arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], commands, "command", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    switch (index) {
+    case STREAM_LISTEN:
+        return StreamListen(videoPtr, interp, objc, objv);
+    case STREAM_CLOSE:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, "");
+            return TCL_ERROR;
+        }
+        VideoStreamClose(videoPtr);
+        return TCL_OK;
+    case STREAM_INFO:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 3, objv, "");
+            return TCL_ERROR;
+        }
+        if (videoPtr->streamPtr != NULL) {
+            Tcl_SetObjResult(interp, StreamInfo(videoPtr->streamPtr));
+        }
+        return TCL_OK;
+    }
+    return TCL_OK;
+#else
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+        "streaming is not available: tkvideo was built without JPEG support", -1));
+    return TCL_ERROR;
+#endif
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
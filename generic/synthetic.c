@@ -0,0 +1,360 @@
+/* synthetic.c - test pattern video source
+ *
+ * Test pattern generator used by the synthetic video source. Each
+ * frame contains a set of colour bars that scroll horizontally, a
+ * band of noise along the bottom edge and the frame number drawn in
+ * the top left corner. This gives a source of any size and rate that
+ * needs no capture hardware and changes every pixel row per frame, so
+ * it can be used to measure the throughput of the rest of the widget.
+ * The pattern can also be delivered in the YUV formats that cameras
+ * produce, to exercise the conversion code.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include <stdio.h>
+
+#define SYNTHETIC_PREFIX      "synthetic"
+#define SYNTHETIC_MAX_SIZE    8192
+#define SYNTHETIC_MAX_RATE    1000.0
+
+/*
+ * 75% colour bars in B,G,R,A order: white, yellow, cyan, green,
+ * magenta, red, blue and black.
+ */
+
+static const unsigned char barColors[8][4] = {
+    { 0xbf, 0xbf, 0xbf, 0xff }, { 0x00, 0xbf, 0xbf, 0xff },
+    { 0xbf, 0xbf, 0x00, 0xff }, { 0x00, 0xbf, 0x00, 0xff },
+    { 0xbf, 0x00, 0xbf, 0xff }, { 0x00, 0x00, 0xbf, 0xff },
+    { 0xbf, 0x00, 0x00, 0xff }, { 0x00, 0x00, 0x00, 0xff },
+};
+
+/*
+ * 3x5 pixel digit glyphs. Each row is 3 bits, most significant bit on
+ * the left.
+ */
+
+static const unsigned char digitGlyphs[10][5] = {
+    { 7, 5, 5, 5, 7 }, { 2, 6, 2, 2, 7 }, { 7, 1, 7, 4, 7 },
+    { 7, 1, 7, 1, 7 }, { 5, 5, 7, 1, 1 }, { 7, 4, 7, 1, 7 },
+    { 7, 4, 7, 5, 7 }, { 7, 1, 1, 1, 1 }, { 7, 5, 7, 5, 7 },
+    { 7, 5, 7, 1, 7 },
+};
+
+/*
+ * Names of the output formats accepted after the frame rate.
+ */
+
+static const struct {
+    const char *name;
+    int format;
+} formatNames[] = {
+    { "bgra", VIDEO_FORMAT_BGRA }, { "yuy2", VIDEO_FORMAT_YUY2 },
+    { "uyvy", VIDEO_FORMAT_UYVY }, { "nv12", VIDEO_FORMAT_NV12 },
+    { "i420", VIDEO_FORMAT_I420 }, { NULL, 0 }
+};
+
+static void FillRect(VideoFrame *framePtr, int x, int y, int w, int h,
+                     const unsigned char *bgra);
+static void DrawCounter(VideoFrame *framePtr, Tcl_WideInt value);
+static void PackYuv(const VideoFrame *srcPtr, VideoFrame *dstPtr);
+
+/**
+ * Parse a synthetic source specification. The accepted forms are
+ * "synthetic", "synthetic:WxH" and "synthetic:WxH@rate", any of which
+ * may be followed by "/format" where format is one of bgra, yuy2, uyvy,
+ * nv12 or i420. Missing values default to 640x480 BGRA at 30 frames per
+ * second.
+ *
+ * @return TCL_OK if the specification was valid. On failure TCL_ERROR
+ *  is returned and the interpreter result describes the problem.
+ */
+
+int
+VideoSyntheticParse(Tcl_Interp *interp, const char *source, VideoSyntheticSpec *specPtr)
+{
+    const size_t prefixLen = sizeof(SYNTHETIC_PREFIX) - 1;
+    int width = 640, height = 480, n = 0, format = VIDEO_FORMAT_BGRA;
+    double rate = 30.0;
+    const char *p;
+
+    if (strncmp(source, SYNTHETIC_PREFIX, prefixLen) != 0) {
+        goto invalid;
+    }
+    p = source + prefixLen;
+    if (*p == ':') {
+        ++p;
+        if (sscanf(p, "%dx%d%n", &width, &height, &n) != 2) {
+            goto invalid;
+        }
+        p += n;
+        if (*p == '@') {
+            ++p;
+            if (sscanf(p, "%lf%n", &rate, &n) != 1) {
+                goto invalid;
+            }
+            p += n;
+        }
+    }
+    if (*p == '/') {
+        for (n = 0; formatNames[n].name != NULL; ++n) {
+            if (strcmp(p + 1, formatNames[n].name) == 0) {
+                break;
+            }
+        }
+        if (formatNames[n].name == NULL) {
+            goto invalid;
+        }
+        format = formatNames[n].format;
+        p += strlen(p);
+    }
+    if (*p != 0) {
+        goto invalid;
+    }
+    if (width < 2 || height < 2 || width > SYNTHETIC_MAX_SIZE
+        || height > SYNTHETIC_MAX_SIZE || (width & 1)) {
+        if (interp) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "invalid synthetic frame size %dx%d: width must be even"
+                " and both dimensions between 2 and %d",
+                width, height, SYNTHETIC_MAX_SIZE));
+        }
+        return TCL_ERROR;
+    }
+    if (!(rate > 0.0 && rate <= SYNTHETIC_MAX_RATE)) {
+        if (interp) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "invalid synthetic frame rate %g: must be greater than 0"
+                " and at most %g", rate, SYNTHETIC_MAX_RATE));
+        }
+        return TCL_ERROR;
+    }
+
+    specPtr->width = width;
+    specPtr->height = height;
+    specPtr->rate = rate;
+    specPtr->format = format;
+    return TCL_OK;
+
+ invalid:
+    if (interp) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "invalid video source \"%s\": must be"
+            " synthetic?:WxH?@rate??\?/format?", source));
+    }
+    return TCL_ERROR;
+}
+
+/**
+ * @return the source in its full form, "synthetic:WxH@rate/format", so
+ *  that every way of writing the same source gives the same name.
+ */
+
+Tcl_Obj *
+VideoSyntheticName(const VideoSyntheticSpec *specPtr)
+{
+    const char *format = "bgra";
+    int n;
+
+    for (n = 0; formatNames[n].name != NULL; ++n) {
+        if (formatNames[n].format == specPtr->format) {
+            format = formatNames[n].name;
+            break;
+        }
+    }
+    return Tcl_ObjPrintf("%s:%dx%d@%g/%s", SYNTHETIC_PREFIX, specPtr->width,
+                         specPtr->height, specPtr->rate, format);
+}
+
+/**
+ * Render the test pattern for the frame number held in framePtr->sequence
+ * into the frame buffer. The frame must already be laid out for its
+ * format, as by VideoFrameLayout. The pattern is drawn in BGRA; frames in
+ * the YUV formats are drawn into the work buffer, which must hold
+ * width * height * 4 bytes, and then converted. The work buffer may be
+ * NULL for BGRA frames.
+ */
+
+void
+VideoSyntheticRender(VideoFrame *framePtr, unsigned char *workPtr)
+{
+    VideoFrame *targetPtr = framePtr;
+    VideoFrame work;
+    const int width = framePtr->width;
+    const int height = framePtr->height;
+    const int noiseTop = height - height / 8;
+    const int barWidth = (width + 7) / 8;
+    const int shift = (int)((framePtr->sequence * 4) % width);
+    unsigned char *rowPtr, *dstPtr;
+    unsigned int seed;
+    int x, y;
+
+    if (framePtr->format != VIDEO_FORMAT_BGRA) {
+        VideoFrameLayout(&work, VIDEO_FORMAT_BGRA, width, height, workPtr);
+        work.sequence = framePtr->sequence;
+        work.timestamp = framePtr->timestamp;
+        framePtr = &work;
+    }
+
+    /*
+     * Build one row of scrolled bars then replicate it down the frame.
+     */
+
+    rowPtr = framePtr->data;
+    for (x = 0, dstPtr = rowPtr; x < width; ++x, dstPtr += 4) {
+        int bar = ((x + shift) % width) / barWidth;
+        memcpy(dstPtr, barColors[bar], 4);
+    }
+    for (y = 1; y < noiseTop; ++y) {
+        memcpy(framePtr->data + y * framePtr->pitch, rowPtr, width * 4);
+    }
+
+    /*
+     * Grey noise from a xorshift generator seeded by the frame number.
+     */
+
+    seed = (unsigned int)(framePtr->sequence * 2654435761u) | 1;
+    for (y = noiseTop; y < height; ++y) {
+        dstPtr = framePtr->data + y * framePtr->pitch;
+        for (x = 0; x < width; ++x, dstPtr += 4) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            dstPtr[0] = dstPtr[1] = dstPtr[2] = (unsigned char)seed;
+            dstPtr[3] = 0xff;
+        }
+    }
+
+    DrawCounter(framePtr, framePtr->sequence);
+    if (framePtr != targetPtr) {
+        PackYuv(framePtr, targetPtr);
+    }
+}
+
+/*
+ * Convert a BGRA frame to one of the YUV formats using the BT.601 studio
+ * range matrix. Chroma is averaged over each pair of pixels, or over
+ * each 2x2 block for the 4:2:0 formats.
+ */
+
+static void
+PackYuv(const VideoFrame *srcPtr, VideoFrame *dstPtr)
+{
+    const int width = srcPtr->width, height = srcPtr->height;
+    int x, y;
+
+    for (y = 0; y < height; ++y) {
+        const unsigned char *p = srcPtr->data + y * srcPtr->pitch;
+        const unsigned char *below = (y + 1 < height) ? p + srcPtr->pitch : p;
+        unsigned char *yPtr = dstPtr->data + y * dstPtr->pitch;
+        unsigned char *cPtr = NULL;
+        int chroma = 1;
+
+        switch (dstPtr->format) {
+        case VIDEO_FORMAT_NV12:
+        case VIDEO_FORMAT_I420:
+            chroma = !(y & 1);
+            cPtr = dstPtr->chroma[0] + (y / 2) * dstPtr->chromaPitch;
+            break;
+        }
+        for (x = 0; x < width; x += 2, p += 8, below += 8) {
+            const int n = (x + 1 < width) ? 4 : 0;
+            int b = p[0] + p[n], g = p[1] + p[n + 1], r = p[2] + p[n + 2], u, v;
+            int y0 = ((66 * p[2] + 129 * p[1] + 25 * p[0] + 128) >> 8) + 16;
+            int y1 = ((66 * p[n + 2] + 129 * p[n + 1] + 25 * p[n] + 128) >> 8) + 16;
+
+            if (cPtr != NULL) {
+                b = (b + below[0] + below[n] + 1) / 2;
+                g = (g + below[1] + below[n + 1] + 1) / 2;
+                r = (r + below[2] + below[n + 2] + 1) / 2;
+            }
+            u = ((-38 * r - 74 * g + 112 * b + 256) >> 9) + 128;
+            v = ((112 * r - 94 * g - 18 * b + 256) >> 9) + 128;
+
+            switch (dstPtr->format) {
+            case VIDEO_FORMAT_YUY2:
+                yPtr[x * 2] = y0; yPtr[x * 2 + 1] = u;
+                yPtr[x * 2 + 2] = y1; yPtr[x * 2 + 3] = v;
+                break;
+            case VIDEO_FORMAT_UYVY:
+                yPtr[x * 2] = u; yPtr[x * 2 + 1] = y0;
+                yPtr[x * 2 + 2] = v; yPtr[x * 2 + 3] = y1;
+                break;
+            case VIDEO_FORMAT_NV12:
+                yPtr[x] = y0;
+                if (x + 1 < width) yPtr[x + 1] = y1;
+                if (chroma) {
+                    cPtr[x] = u;
+                    cPtr[x + 1] = v;
+                }
+                break;
+            case VIDEO_FORMAT_I420:
+                yPtr[x] = y0;
+                if (x + 1 < width) yPtr[x + 1] = y1;
+                if (chroma) {
+                    cPtr[x / 2] = u;
+                    dstPtr->chroma[1][(y / 2) * dstPtr->chromaPitch + x / 2] = v;
+                }
+                break;
+            }
+        }
+    }
+}
+
+static void
+FillRect(VideoFrame *framePtr, int x, int y, int w, int h, const unsigned char *bgra)
+{
+    int i, j;
+
+    if (x + w > framePtr->width) w = framePtr->width - x;
+    if (y + h > framePtr->height) h = framePtr->height - y;
+    for (j = 0; j < h; ++j) {
+        unsigned char *dstPtr = framePtr->data + (y + j) * framePtr->pitch + x * 4;
+        for (i = 0; i < w; ++i, dstPtr += 4) {
+            memcpy(dstPtr, bgra, 4);
+        }
+    }
+}
+
+/*
+ * Draw the frame counter as white digits on a black box. The glyphs are
+ * scaled with the frame height so the number remains legible in a
+ * scaled down view of a large frame.
+ */
+
+static void
+DrawCounter(VideoFrame *framePtr, Tcl_WideInt value)
+{
+    static const unsigned char white[4] = { 0xff, 0xff, 0xff, 0xff };
+    char digits[TCL_INTEGER_SPACE];
+    int scale, len, n, row, col;
+
+    scale = framePtr->height / 96;
+    if (scale < 1) scale = 1;
+    len = sprintf(digits, "%" TCL_LL_MODIFIER "d", value);
+
+    FillRect(framePtr, 0, 0, (len * 4 + 1) * scale, 7 * scale, barColors[7]);
+    for (n = 0; n < len; ++n) {
+        const unsigned char *glyph = digitGlyphs[digits[n] - '0'];
+        for (row = 0; row < 5; ++row) {
+            for (col = 0; col < 3; ++col) {
+                if (glyph[row] & (4 >> col)) {
+                    FillRect(framePtr, (n * 4 + col + 1) * scale,
+                             (row + 1) * scale, scale, scale, white);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -20,11 +20,18 @@
 #define DEF_VIDEO_CURSOR       ""
 #define DEF_VIDEO_TAKE_FOCUS   "0"
 #define DEF_VIDEO_OUTPUT       ""
+#define DEF_VIDEO_SEGMENT      ""
+#define DEF_VIDEO_PREROLL      "0"
 #define DEF_VIDEO_ANCHOR       "center"
+#define DEF_VIDEO_IMAGE        ""
+#define DEF_VIDEO_BUFFER_COUNT "3"
 
 #define VIDEO_SOURCE_CHANGED   0x01
 #define VIDEO_GEOMETRY_CHANGED 0x02
 #define VIDEO_OUTPUT_CHANGED   0x04
+#define VIDEO_IMAGE_CHANGED    0x08
+#define VIDEO_SEGMENT_CHANGED  0x10
+#define VIDEO_PREROLL_CHANGED  0x20
 
 static Tk_OptionSpec videoOptionSpec[] = {
     {TK_OPTION_ANCHOR, "-anchor", "anchor", "Anchor",
@@ -35,13 +42,22 @@ static Tk_OptionSpec videoOptionSpec[] = {
         (char *) NULL, 0, -1, 0, (ClientData) "-background"},
     {TK_OPTION_BORDER, "-background", "background", "Background",
         DEF_VIDEO_BACKGROUND, Tk_Offset(Video, bgPtr), -1, 0, 0, 0},
+    {TK_OPTION_INT, "-buffercount", "bufferCount", "BufferCount",
+        DEF_VIDEO_BUFFER_COUNT, -1, Tk_Offset(Video, bufferCount), 0, 0, VIDEO_SOURCE_CHANGED },
     {TK_OPTION_CURSOR, "-cursor", "cursor", "Cursor",
         DEF_VIDEO_CURSOR, -1, Tk_Offset(Video, cursor),
         TK_OPTION_NULL_OK, 0, 0},
     {TK_OPTION_STRING, "-height", "height", "Height",
         DEF_VIDEO_HEIGHT, Tk_Offset(Video, heightPtr), -1, 0, 0, VIDEO_GEOMETRY_CHANGED},
+    {TK_OPTION_STRING, "-image", "image", "Image",
+        DEF_VIDEO_IMAGE, Tk_Offset(Video, imagePtr), -1,
+        TK_OPTION_NULL_OK, 0, VIDEO_IMAGE_CHANGED },
     {TK_OPTION_STRING, "-output", "output", "Output",
         DEF_VIDEO_OUTPUT, Tk_Offset(Video, outputPtr), -1, 0, 0, VIDEO_OUTPUT_CHANGED },
+    {TK_OPTION_DOUBLE, "-preroll", "preroll", "Preroll",
+        DEF_VIDEO_PREROLL, -1, Tk_Offset(Video, preroll), 0, 0, VIDEO_PREROLL_CHANGED },
+    {TK_OPTION_STRING, "-segment", "segment", "Segment",
+        DEF_VIDEO_SEGMENT, Tk_Offset(Video, segmentPtr), -1, 0, 0, VIDEO_SEGMENT_CHANGED },
     {TK_OPTION_STRING, "-source", "source", "Source",
         DEF_VIDEO_SOURCE, Tk_Offset(Video, sourcePtr), -1, 0, 0, VIDEO_SOURCE_CHANGED },
     {TK_OPTION_BOOLEAN, "-stretch", "stretch", "Stretch",
@@ -70,6 +86,18 @@ static Tk_OptionSpec videoOptionSpec[] = {
 #define REDRAW_PENDING   0x01
 #define UPDATE_V_SCROLL  0x02
 #define UPDATE_H_SCROLL  0x04
+#define REDRAW_WIDGET    0x08
+#define UPDATE_IMAGE     0x10
+#define REDRAW_FRAME     0x20
+
+/*
+ * Event queued to the widget thread when a new frame is available.
+ */
+
+typedef struct {
+    Tcl_Event header;
+    Video *videoPtr;
+} VideoFrameEvent;
 
 /* ---------------------------------------------------------------------- */
 
@@ -90,6 +118,13 @@ static int  VideoWorldChanged(ClientData clientData);
 static void VideoCalculateGeometry(Video *videoPtr);
 static void VideoUpdateVScrollbar(Video* videoPtr);
 static void VideoUpdateHScrollbar(Video* videoPtr);
+static int  VideoConfigureImage(Video *videoPtr);
+static void VideoUpdateImage(Video *videoPtr);
+static int  VideoFrameEventProc(Tcl_Event *evPtr, int flags);
+static int  VideoFrameEventDeleteProc(Tcl_Event *evPtr, ClientData clientData);
+static int  VideoWidgetPictureCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int  VideoWidgetOverlayCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int  VideoWidgetStatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 
 /* ---------------------------------------------------------------------- */
 
@@ -104,6 +139,12 @@ struct Ensemble VideoWidgetEnsemble[] = {
     { "cget",      VideoWidgetCgetCmd, NULL },
     { "xview",     VideoWidgetXviewCmd, NULL },
     { "yview",     VideoWidgetYviewCmd, NULL },
+    { "picture",   VideoWidgetPictureCmd, NULL },
+    { "overlay",   VideoWidgetOverlayCmd, NULL },
+    { "stats",     VideoWidgetStatsCmd, NULL },
+    { "stream",    VideoWidgetStreamCmd, NULL },
+    { "clip",      VideoWidgetClipCmd, NULL },
+    { "motion",    VideoWidgetMotionCmd, NULL },
     { NULL, NULL, NULL }
 };
 
@@ -121,9 +162,18 @@ Tkvideo_Init(Tcl_Interp *interp)
     if (Tk_InitStubs(interp, TK_VERSION, 0) == NULL)
         return TCL_ERROR;
 #endif
-    r = VideopInit(interp);
+    VideoConvertInit(VideoCpuFeatures());
+    VideoScaleInit(VideoCpuFeatures());
+    VideoCompositeInit(VideoCpuFeatures());
+    VideoMotionInit(VideoCpuFeatures());
+    r = VideoPoolInit(interp);
+    if (r == TCL_OK)
+        r = VideopInit(interp);
     if (r == TCL_OK) {
         Tcl_CreateObjCommand(interp, "tkvideo", VideoObjCmd, NULL, NULL);
+        Tcl_CreateObjCommand(interp, "tkvideo::repair", VideoRepairObjCmd, NULL, NULL);
+        Tcl_CreateObjCommand(interp, "tkvideo::mosaic", VideoMosaicObjCmd, NULL, NULL);
+        Tcl_CreateObjCommand(interp, "tkvideo::pool", VideoPoolObjCmd, NULL, NULL);
         r = Tcl_PkgProvide(interp, PACKAGE_NAME, PACKAGE_VERSION); 
     }
     return r;
@@ -161,6 +211,8 @@ VideoObjCmd(ClientData clientData, Tcl_Interp *interp,
     videoPtr->tkwin = tkwin;
     videoPtr->display = Tk_Display(tkwin);
     videoPtr->interp = interp;
+    videoPtr->ownerThread = Tcl_GetCurrentThread();
+    videoPtr->statsPtr = VideoStatsCreate();
     videoPtr->widgetCmd = Tcl_CreateObjCommand(interp, 
         Tk_PathName(videoPtr->tkwin), VideoWidgetObjCmd, (ClientData)videoPtr,
         VideoDeletedProc);
@@ -174,6 +226,7 @@ VideoObjCmd(ClientData clientData, Tcl_Interp *interp,
     if (Tk_InitOptions(interp, (char *)videoPtr, optionTable, tkwin) 
         != TCL_OK) {
         Tk_DestroyWindow(videoPtr->tkwin);
+        VideoStatsDestroy(videoPtr->statsPtr);
         ckfree((char *)videoPtr);
         return TCL_ERROR;
     }
@@ -224,6 +277,26 @@ VideoWidgetObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *
     return TCL_ERROR;
 }
 
+/*
+ * Find the widget data of the tkvideo widget named by an object, for
+ * commands that take other widgets as arguments.
+ */
+
+int
+VideoGetFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, Video **videoPtrPtr)
+{
+    Tcl_CmdInfo info;
+
+    if (!Tcl_GetCommandInfo(interp, Tcl_GetString(objPtr), &info)
+        || info.objProc != VideoWidgetObjCmd) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "\"%s\" is not a tkvideo widget", Tcl_GetString(objPtr)));
+        return TCL_ERROR;
+    }
+    *videoPtrPtr = (Video *)info.objClientData;
+    return TCL_OK;
+}
+
 static int
 VideoWidgetCgetCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
@@ -291,11 +364,26 @@ VideoConfigure(Tcl_Interp *interp, Video *videoPtr,
     r = Tk_SetOptions(interp, (char *)videoPtr,
         videoPtr->optionTable, objc, objv,
         videoPtr->tkwin, &savedOptions, &flags);
+    if (r == TCL_OK && (flags & VIDEO_IMAGE_CHANGED))
+        r = VideoConfigureImage(videoPtr);
+    if (r == TCL_OK && (flags & VIDEO_SEGMENT_CHANGED)) {
+        double seconds;
+        Tcl_WideInt bytes;
+        r = VideoRecordParseSegment(interp, videoPtr->segmentPtr, &seconds, &bytes);
+    }
+    if (r == TCL_OK && (flags & VIDEO_PREROLL_CHANGED))
+        r = VideoPrerollCheck(interp, videoPtr->preroll);
+    if (r == TCL_OK && (videoPtr->bufferCount < VIDEO_RING_MIN_SLOTS
+                        || videoPtr->bufferCount > VIDEO_RING_MAX_SLOTS)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "invalid buffer count %d: must be from %d to %d", videoPtr->bufferCount,
+            VIDEO_RING_MIN_SLOTS, VIDEO_RING_MAX_SLOTS));
+        r = TCL_ERROR;
+    }
     if (r == TCL_OK)
         r = VideoWorldChanged((ClientData) videoPtr);
     else
         Tk_RestoreSavedOptions(&savedOptions);
-    Tk_FreeSavedOptions(&savedOptions);
 
     if (r == TCL_OK)
         r = Tk_GetAnchorFromObj(videoPtr->interp, videoPtr->anchorPtr, &videoPtr->anchor);
@@ -315,9 +403,25 @@ VideoConfigure(Tcl_Interp *interp, Video *videoPtr,
             if (!Tk_IsMapped(tkwin)) {
                 Tk_MakeWindowExist(tkwin);
             }
-            VideopInitializeSource(videoPtr);
+            r = VideopInitializeSource(videoPtr);
+            if (r != TCL_OK) {
+                /* go back to the options, and the source, that worked */
+                Tcl_Obj *errorObj = Tcl_GetObjResult(interp);
+                Tcl_IncrRefCount(errorObj);
+                Tk_RestoreSavedOptions(&savedOptions);
+                if (flags & VIDEO_IMAGE_CHANGED)
+                    VideoConfigureImage(videoPtr);
+                VideopInitializeSource(videoPtr);
+                Tcl_SetObjResult(interp, errorObj);
+                Tcl_DecrRefCount(errorObj);
+            }
         }
+        if (r == TCL_OK && (flags & VIDEO_PREROLL_CHANGED))
+            r = VideoPrerollUpdate(videoPtr);
+    }
+    Tk_FreeSavedOptions(&savedOptions);
 
+    if (r == TCL_OK) {
         VideoCalculateGeometry(videoPtr);
 
         r = VideoWorldChanged((ClientData) videoPtr);
@@ -384,6 +488,7 @@ VideoWorldChanged(ClientData clientData)
     Tk_Window tkwin = videoPtr->tkwin;
     Tcl_Interp *interp = videoPtr->interp;
 
+    videoPtr->flags |= REDRAW_WIDGET;
     if (!(videoPtr->flags & REDRAW_PENDING)) {
         Tcl_DoWhenIdle(VideoDisplay, (ClientData)videoPtr);
         videoPtr->flags |= REDRAW_PENDING;
@@ -401,6 +506,7 @@ VideoObjEventProc(ClientData clientData, XEvent *eventPtr)
     
     if (eventPtr->type == Expose) {
 
+        videoPtr->flags |= REDRAW_WIDGET;
         if (!(videoPtr->flags & REDRAW_PENDING)) {
             Tcl_DoWhenIdle(VideoDisplay, clientData);
             videoPtr->flags |= REDRAW_PENDING;
@@ -414,7 +520,11 @@ VideoObjEventProc(ClientData clientData, XEvent *eventPtr)
     } else if (eventPtr->type == DestroyNotify) {
 
         if (videoPtr->tkwin != NULL) {
+            VideoStreamClose(videoPtr);
+            VideoMotionClose(videoPtr);
+            VideoMosaicForget(videoPtr);
             VideopDestroy(videoPtr);
+            Tcl_DeleteEvents(VideoFrameEventDeleteProc, clientData);
             Tk_FreeConfigOptions((char *)videoPtr, videoPtr->optionTable,
                 videoPtr->tkwin);
             videoPtr->tkwin = NULL;
@@ -445,12 +555,640 @@ VideoDeletedProc(ClientData clientData)
 static void
 VideoCleanup(char *memPtr)
 {
+    Video *videoPtr = (Video *)memPtr;
     VideopCleanup(memPtr);
+    if (videoPtr->stagePtr != NULL) {
+        ckfree((char *)videoPtr->stagePtr);
+    }
+    if (videoPtr->overlayPtr != NULL) {
+        VideoOverlayDestroy(videoPtr->overlayPtr);
+        Tcl_DecrRefCount(videoPtr->overlayNamePtr);
+    }
+    VideoStatsDestroy(videoPtr->statsPtr);
+#ifdef HAVE_JPEG
+    if (videoPtr->jpegPtr != NULL) {
+        VideoJpegDestroy(videoPtr->jpegPtr);
+    }
+#endif
+    Tcl_MutexFinalize(&videoPtr->notifyLock);
+    Tcl_MutexFinalize(&videoPtr->sinkLock);
     ckfree(memPtr);
 }
 
 /* ---------------------------------------------------------------------- */
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoStageFrame --
+ *
+ *      Convert a frame into the widget's RGBA staging buffer in a single
+ *      pass and blend any overlay into it. The buffer is kept between
+ *      calls and only reallocated when it needs to grow. The platform
+ *      code calls this while it holds the frame so that it can release
+ *      the frame before the photo update. The conversion is counted and
+ *      timed for the stats command.
+ *
+ * Results:
+ *      TCL_OK or TCL_ERROR if the buffer could not be allocated, in which
+ *      case the interpreter result describes the error.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int
+VideoStageFrame(Video *videoPtr, const VideoFrame *framePtr)
+{
+    size_t size = (size_t)framePtr->width * framePtr->height * 4;
+
+    videoPtr->stageTime = VideoStatsFrame(videoPtr->statsPtr, framePtr);
+    if (size > videoPtr->stageSize) {
+        unsigned char *newPtr = (unsigned char *)
+            attemptckrealloc((char *)videoPtr->stagePtr, size);
+        if (newPtr == NULL) {
+            Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+                "failed to capture image: out of memory", -1));
+            return TCL_ERROR;
+        }
+        videoPtr->stagePtr = newPtr;
+        videoPtr->stageSize = size;
+    }
+    VideoConvertToRGBA(framePtr, videoPtr->stagePtr, framePtr->width * 4);
+    if (videoPtr->overlayPtr != NULL) {
+        VideoOverlayBlend(videoPtr->overlayPtr, videoPtr->stagePtr, framePtr->width * 4,
+                          framePtr->width, framePtr->height, 1);
+    }
+    videoPtr->stageWidth = framePtr->width;
+    videoPtr->stageHeight = framePtr->height;
+    VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_CONVERT_OUT, 1);
+    return TCL_OK;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoPutStagedPhoto --
+ *
+ *      Copy the staged frame into a photo image. The staged data is in
+ *      the layout that Tk uses internally for photos so this is a single
+ *      block copy inside Tk_PhotoPutBlock.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int
+VideoPutStagedPhoto(Video *videoPtr, Tk_PhotoHandle photo)
+{
+    Tk_PhotoImageBlock block;
+
+    block.pixelPtr = videoPtr->stagePtr;
+    block.width = videoPtr->stageWidth;
+    block.height = videoPtr->stageHeight;
+    block.pitch = block.width * 4;
+    block.pixelSize = 4;
+    block.offset[0] = 0;  /* R */
+    block.offset[1] = 1;  /* G */
+    block.offset[2] = 2;  /* B */
+    block.offset[3] = 3;  /* A */
+#if TK_MAJOR_VERSION > 8 || TK_MINOR_VERSION >= 5
+    return Tk_PhotoPutBlock(videoPtr->interp, photo, &block, 0, 0,
+        block.width, block.height, TK_PHOTO_COMPOSITE_SET);
+#else
+    Tk_PhotoPutBlock(photo, &block, 0, 0, block.width, block.height,
+        TK_PHOTO_COMPOSITE_SET);
+    return TCL_OK;
+#endif
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoWidgetPictureCmd --
+ *
+ *      Implement the picture subcommand. The arguments are either an
+ *      optional name for a new image, "-into" and the name of an
+ *      existing photo to be overwritten, "-format jpeg" and an
+ *      optional "-quality" to return the frame as JPEG data without
+ *      going through a photo, or "-file" and a file name to have the
+ *      frame written to disk in the background (see writer.c).
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int
+VideoWidgetPictureCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    static const char *options[] = { "-command", "-file", "-format", "-quality", NULL };
+    enum { PICTURE_COMMAND, PICTURE_FILE, PICTURE_FORMAT, PICTURE_QUALITY };
+    Tcl_Obj *namePtr = NULL, *filePtr = NULL, *commandPtr = NULL;
+    Tcl_WideInt start;
+    int into = 0, format = -1, quality = 80, index, n, r;
+
+    if (objc == 4 && strcmp(Tcl_GetString(objv[2]), "-into") == 0) {
+        namePtr = objv[3];
+        into = 1;
+    } else if (objc >= 4 && (objc % 2) == 0) {
+        for (n = 2; n < objc; n += 2) {
+            if (Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index) != TCL_OK)
+                return TCL_ERROR;
+            switch (index) {
+                case PICTURE_COMMAND:
+                    commandPtr = objv[n + 1];
+                    break;
+                case PICTURE_FILE:
+                    filePtr = objv[n + 1];
+                    break;
+                case PICTURE_FORMAT:
+                    if (Tcl_GetIndexFromObj(interp, objv[n + 1], VideoImageFormats,
+                                            "format", 0, &format) != TCL_OK)
+                        return TCL_ERROR;
+                    break;
+                case PICTURE_QUALITY:
+                    if (Tcl_GetIntFromObj(interp, objv[n + 1], &quality) != TCL_OK)
+                        return TCL_ERROR;
+                    if (quality < 1 || quality > 100) {
+                        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                            "invalid quality %d: must be from 1 to 100", quality));
+                        return TCL_ERROR;
+                    }
+                    break;
+            }
+        }
+        if (filePtr == NULL) {
+            if (commandPtr != NULL) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                    "the -command option requires -file", -1));
+                return TCL_ERROR;
+            }
+            if (format < 0) {
+                Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                    "the -quality option requires -format", -1));
+                return TCL_ERROR;
+            }
+            if (format != VIDEO_IMAGE_JPEG) {
+                Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                    "the %s format requires -file", VideoImageFormats[format]));
+                return TCL_ERROR;
+            }
+        }
+    } else if (objc == 3) {
+        namePtr = objv[2];
+    } else if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+            "?imagename? | -into photo | -format jpeg ?-quality q? |"
+            " -file path ?-format format? ?-quality q? ?-command cmd?");
+        return TCL_ERROR;
+    }
+
+    Tcl_Preserve(clientData);
+    start = VideoStatsClock();
+    VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_PICTURE_IN, 1);
+    r = VideopGrabFrame(videoPtr);
+    if (r == TCL_OK && filePtr != NULL)
+        r = VideoStagedFile(videoPtr, filePtr, format, quality, commandPtr);
+    else if (r == TCL_OK && format >= 0)
+        r = VideoStagedJpeg(videoPtr, quality);
+    else if (r == TCL_OK)
+        r = VideoStagedPicture(videoPtr, namePtr, into);
+    if (r == TCL_OK) {
+        VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_PICTURE_OUT, 1);
+        VideoStatsLatency(videoPtr->statsPtr, VIDEO_STATS_WIDGET, VIDEO_LATENCY_PICTURE,
+                          VideoStatsClock() - start);
+    }
+    Tcl_Release(clientData);
+    return r;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoWidgetOverlayCmd --
+ *
+ *      Implement the overlay subcommand:
+ *
+ *          overlay ?imagename? ?-x pixels? ?-y pixels? ?-alpha opacity?
+ *
+ *      Naming a photo converts it into the overlay surface; an empty name
+ *      removes the overlay. The options move the overlay or change its
+ *      opacity, from 0.0 to 1.0, without converting the photo again, so
+ *      they are cheap enough to animate. Later changes to the photo are
+ *      only picked up when it is named again.
+ *
+ * Results:
+ *      A standard Tcl result. The interpreter result is the name of the
+ *      overlay photo, or an empty string if there is none.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int
+VideoWidgetOverlayCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *options[] = { "-alpha", "-x", "-y", NULL };
+    enum { OVERLAY_ALPHA, OVERLAY_X, OVERLAY_Y };
+    Video *videoPtr = (Video *)clientData;
+    VideoOverlay *overlayPtr = videoPtr->overlayPtr;
+    Tk_PhotoHandle photo = NULL;
+    int x = 0, y = 0, alpha = 255, n, index;
+    double value;
+
+    if (overlayPtr != NULL) {
+        x = overlayPtr->x;
+        y = overlayPtr->y;
+        alpha = overlayPtr->alpha;
+    }
+
+    /* An odd number of arguments means the first one names the image. */
+    n = 2 + ((objc - 2) & 1);
+    if (n == 3 && Tcl_GetCharLength(objv[2]) != 0) {
+        photo = Tk_FindPhoto(interp, Tcl_GetString(objv[2]));
+        if (photo == NULL) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "image \"%s\" doesn't exist or is not a photo image",
+                Tcl_GetString(objv[2])));
+            return TCL_ERROR;
+        }
+    }
+    for ( ; n < objc; n += 2) {
+        if (Tcl_GetIndexFromObj(interp, objv[n], options, "option", 0, &index) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        switch (index) {
+            case OVERLAY_ALPHA:
+                if (Tcl_GetDoubleFromObj(interp, objv[n + 1], &value) != TCL_OK)
+                    return TCL_ERROR;
+                if (value < 0.0 || value > 1.0) {
+                    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                        "alpha must be between 0.0 and 1.0", -1));
+                    return TCL_ERROR;
+                }
+                alpha = (int)(value * 255.0 + 0.5);
+                break;
+            case OVERLAY_X:
+                if (Tcl_GetIntFromObj(interp, objv[n + 1], &x) != TCL_OK)
+                    return TCL_ERROR;
+                break;
+            case OVERLAY_Y:
+                if (Tcl_GetIntFromObj(interp, objv[n + 1], &y) != TCL_OK)
+                    return TCL_ERROR;
+                break;
+        }
+    }
+
+    if (objc > 2) {
+        if ((objc - 2) & 1) {
+            if (photo == NULL) {
+                if (overlayPtr != NULL) {
+                    VideoOverlayDestroy(overlayPtr);
+                    Tcl_DecrRefCount(videoPtr->overlayNamePtr);
+                    videoPtr->overlayPtr = overlayPtr = NULL;
+                    videoPtr->overlayNamePtr = NULL;
+                }
+            } else {
+                if (overlayPtr == NULL)
+                    overlayPtr = VideoOverlayCreate();
+                if (VideoOverlayLoad(overlayPtr, photo) != TCL_OK) {
+                    if (videoPtr->overlayPtr == NULL)
+                        VideoOverlayDestroy(overlayPtr);
+                    Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                        "failed to set overlay: out of memory", -1));
+                    return TCL_ERROR;
+                }
+                if (videoPtr->overlayNamePtr != NULL)
+                    Tcl_DecrRefCount(videoPtr->overlayNamePtr);
+                videoPtr->overlayPtr = overlayPtr;
+                videoPtr->overlayNamePtr = objv[2];
+                Tcl_IncrRefCount(videoPtr->overlayNamePtr);
+            }
+        }
+        if (overlayPtr != NULL) {
+            overlayPtr->x = x;
+            overlayPtr->y = y;
+            overlayPtr->alpha = alpha;
+        }
+        if (VideopUpdateOverlay(videoPtr) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (videoPtr->imagePtr != NULL)
+            videoPtr->flags |= UPDATE_IMAGE;
+        VideoRedrawFrame(videoPtr);
+    }
+
+    if (videoPtr->overlayNamePtr != NULL)
+        Tcl_SetObjResult(interp, videoPtr->overlayNamePtr);
+    else
+        Tcl_ResetResult(interp);
+    return TCL_OK;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoWidgetStatsCmd --
+ *
+ *      Implement the stats subcommand:
+ *
+ *          stats ?-reset?
+ *
+ *      Returns a dictionary of the frames counted into and out of each
+ *      stage, the frames dropped by reason, the latency percentiles in
+ *      microseconds and the hits and misses of the source's frame buffer
+ *      pool. While the widget is recording the progress of the recording
+ *      is added under the record key, and while it keeps a pre-roll its
+ *      state is added under the preroll key. With -reset the counters
+ *      are restarted after they have been reported.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int
+VideoWidgetStatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    static const char *options[] = { "-reset", NULL };
+    VideoFramePool *poolPtr;
+    Tcl_Obj *resultObj;
+    int index;
+
+    if (objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+        return TCL_ERROR;
+    }
+    if (objc == 3 && Tcl_GetIndexFromObj(interp, objv[2], options, "option", 0,
+                                         &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    Tcl_MutexLock(&videoPtr->sinkLock);
+    poolPtr = (videoPtr->ringPtr != NULL) ? VideoRingPool(videoPtr->ringPtr) : NULL;
+    resultObj = VideoStatsGet(videoPtr->statsPtr, poolPtr);
+    if (objc == 3) {
+        VideoStatsReset(videoPtr->statsPtr, poolPtr);
+    }
+    Tcl_MutexUnlock(&videoPtr->sinkLock);
+    if (videoPtr->recordPtr != NULL) {
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("record", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, VideoRecordInfo(videoPtr));
+    }
+    if (videoPtr->prerollPtr != NULL) {
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("preroll", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, VideoPrerollInfo(videoPtr));
+    }
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoStagedPicture --
+ *
+ *      Deliver the staged frame to a photo image. Without the into flag
+ *      a new photo is created, using namePtr as its name if provided.
+ *      With the into flag the named photo must already exist and is
+ *      overwritten. Its handle and size are cached with the widget and
+ *      the photo is only resized when the frame size changes, so a caller
+ *      repeatedly snapping into the same image causes no script
+ *      evaluation and no image allocation. The name is still looked up
+ *      with Tk_FindPhoto on each call as the script may have deleted or
+ *      replaced the image.
+ *
+ * Results:
+ *      A standard Tcl result. The interpreter result is the image name.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int
+VideoStagedPicture(Video *videoPtr, Tcl_Obj *namePtr, int into)
+{
+    Tcl_Interp *interp = videoPtr->interp;
+    Tk_PhotoHandle photo;
+    int r;
+
+    if (!into) {
+        Tcl_Obj *objv[8];
+        int ndx = 0, n;
+
+        objv[ndx++] = Tcl_NewStringObj("image", -1);
+        objv[ndx++] = Tcl_NewStringObj("create", -1);
+        objv[ndx++] = Tcl_NewStringObj("photo", -1);
+        if (namePtr != NULL)
+            objv[ndx++] = namePtr;
+        objv[ndx++] = Tcl_NewStringObj("-height", -1);
+        objv[ndx++] = Tcl_NewIntObj(videoPtr->stageHeight);
+        objv[ndx++] = Tcl_NewStringObj("-width", -1);
+        objv[ndx++] = Tcl_NewIntObj(videoPtr->stageWidth);
+        for (n = 0; n < ndx; ++n)
+            Tcl_IncrRefCount(objv[n]);
+        r = Tcl_EvalObjv(interp, ndx, objv, 0);
+        for (n = 0; n < ndx; ++n)
+            Tcl_DecrRefCount(objv[n]);
+        if (r == TCL_OK) {
+            photo = Tk_FindPhoto(interp, Tcl_GetStringResult(interp));
+            Tk_PhotoBlank(photo);
+            r = VideoPutStagedPhoto(videoPtr, photo);
+        }
+        return r;
+    }
+
+    photo = Tk_FindPhoto(interp, Tcl_GetString(namePtr));
+    if (photo == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "image \"%s\" doesn't exist or is not a photo image",
+            Tcl_GetString(namePtr)));
+        return TCL_ERROR;
+    }
+    if (photo != videoPtr->intoPhoto) {
+        videoPtr->intoPhoto = photo;
+        Tk_PhotoGetSize(photo, &videoPtr->intoWidth, &videoPtr->intoHeight);
+    }
+    if (videoPtr->intoWidth != videoPtr->stageWidth
+        || videoPtr->intoHeight != videoPtr->stageHeight) {
+#if TK_MAJOR_VERSION > 8 || TK_MINOR_VERSION >= 5
+        if (Tk_PhotoSetSize(interp, photo, videoPtr->stageWidth,
+                            videoPtr->stageHeight) != TCL_OK) {
+            return TCL_ERROR;
+        }
+#else
+        Tk_PhotoSetSize(photo, videoPtr->stageWidth, videoPtr->stageHeight);
+#endif
+        videoPtr->intoWidth = videoPtr->stageWidth;
+        videoPtr->intoHeight = videoPtr->stageHeight;
+    }
+    r = VideoPutStagedPhoto(videoPtr, photo);
+    if (r == TCL_OK) {
+        Tcl_SetObjResult(interp, namePtr);
+    }
+    return r;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoConfigureImage --
+ *
+ *      Check the photo named by the -image option. The photo is updated
+ *      from the frame events and the current frame is shown immediately.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static int
+VideoConfigureImage(Video *videoPtr)
+{
+    const char *name = NULL;
+
+    if (videoPtr->imagePtr != NULL) {
+        name = Tcl_GetString(videoPtr->imagePtr);
+        if (Tk_FindPhoto(videoPtr->interp, name) == NULL) {
+            Tcl_SetObjResult(videoPtr->interp, Tcl_ObjPrintf(
+                "image \"%s\" doesn't exist or is not a photo image", name));
+            return TCL_ERROR;
+        }
+    }
+    if (name != NULL)
+        videoPtr->flags |= UPDATE_IMAGE;
+    return TCL_OK;
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoUpdateImage --
+ *
+ *      Copy the latest frame into the -image photo. This runs from the
+ *      idle handler so however many frames arrived since the last update
+ *      only the most recent is converted. Errors, such as the photo
+ *      having been deleted or no frame being available yet, are ignored
+ *      and leave the interpreter result untouched.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static void
+VideoUpdateImage(Video *videoPtr)
+{
+    Tcl_Interp *interp = videoPtr->interp;
+    Tcl_InterpState state;
+
+    if (videoPtr->imagePtr == NULL) {
+        return;
+    }
+    state = Tcl_SaveInterpState(interp, TCL_OK);
+    if (VideopGrabFrame(videoPtr) == TCL_OK) {
+        VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_DISPLAY_IN, 1);
+        if (VideoStagedPicture(videoPtr, videoPtr->imagePtr, 1) == TCL_OK) {
+            VideoStatsCount(videoPtr->statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_DISPLAY_OUT, 1);
+            VideoStatsLatency(videoPtr->statsPtr, VIDEO_STATS_WIDGET,
+                              VIDEO_LATENCY_CONVERT_DISPLAY,
+                              VideoStatsClock() - videoPtr->stageTime);
+        }
+    }
+    Tcl_RestoreInterpState(interp, state);
+}
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoNotifyFrame --
+ *
+ *      Called by the platform code, from any thread, each time a new
+ *      frame becomes available. The sequence number and timestamp of the
+ *      frame are recorded and an event is queued to the widget thread
+ *      unless one is already pending, so a busy interpreter sees a
+ *      single notification however many frames have been captured in
+ *      the meantime and is told about the newest of them.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void
+VideoNotifyFrame(Video *videoPtr, const VideoFrame *framePtr)
+{
+    Tcl_MutexLock(&videoPtr->notifyLock);
+    videoPtr->notifySequence = framePtr->sequence;
+    videoPtr->notifyTimestamp = framePtr->timestamp;
+    if (!videoPtr->notifyPending) {
+        VideoFrameEvent *evPtr = (VideoFrameEvent *)ckalloc(sizeof(VideoFrameEvent));
+        evPtr->header.proc = VideoFrameEventProc;
+        evPtr->videoPtr = videoPtr;
+        videoPtr->notifyPending = 1;
+        Tcl_ThreadQueueEvent(videoPtr->ownerThread, (Tcl_Event *)evPtr, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(videoPtr->ownerThread);
+    }
+    Tcl_MutexUnlock(&videoPtr->notifyLock);
+}
+
+/*
+ * Handle a frame event in the widget thread. The image update is merged
+ * with any pending redraw through the usual idle handler and a
+ * <<VideoFrame>> virtual event is sent to the widget. The event data,
+ * available as %d in a binding, is a dictionary holding the sequence
+ * number and timestamp of the newest frame.
+ */
+
+static int
+VideoFrameEventProc(Tcl_Event *evPtr, int flags)
+{
+    Video *videoPtr = ((VideoFrameEvent *)evPtr)->videoPtr;
+    Tcl_WideInt sequence, timestamp;
+    Tcl_Obj *dataObj;
+
+    if (!(flags & TCL_WINDOW_EVENTS)) {
+        return 0;
+    }
+    Tcl_MutexLock(&videoPtr->notifyLock);
+    videoPtr->notifyPending = 0;
+    sequence = videoPtr->notifySequence;
+    timestamp = videoPtr->notifyTimestamp;
+    Tcl_MutexUnlock(&videoPtr->notifyLock);
+
+    if (videoPtr->tkwin != NULL) {
+        if (videoPtr->imagePtr != NULL)
+            videoPtr->flags |= UPDATE_IMAGE;
+        if (videoPtr->drawFrames)
+            VideoRedrawFrame(videoPtr);
+        else if (videoPtr->imagePtr != NULL
+                 && !(videoPtr->flags & REDRAW_PENDING)) {
+            Tcl_DoWhenIdle(VideoDisplay, (ClientData)videoPtr);
+            videoPtr->flags |= REDRAW_PENDING;
+        }
+
+        dataObj = Tcl_NewObj();
+        Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("sequence", -1));
+        Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewWideIntObj(sequence));
+        Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("timestamp", -1));
+        Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewWideIntObj(timestamp));
+        SendVirtualEventData(videoPtr->tkwin, "VideoFrame", 0, dataObj);
+    }
+    return 1;
+}
+
+/*
+ * Arrange for the platform code to draw the latest frame into the window
+ * when the widget thread is next idle.
+ */
+
+void
+VideoRedrawFrame(Video *videoPtr)
+{
+    videoPtr->flags |= REDRAW_FRAME;
+    if (!(videoPtr->flags & REDRAW_PENDING)) {
+        Tcl_DoWhenIdle(VideoDisplay, (ClientData)videoPtr);
+        videoPtr->flags |= REDRAW_PENDING;
+    }
+}
+
+static int
+VideoFrameEventDeleteProc(Tcl_Event *evPtr, ClientData clientData)
+{
+    return (evPtr->proc == VideoFrameEventProc
+            && ((VideoFrameEvent *)evPtr)->videoPtr == (Video *)clientData);
+}
+
+/* ---------------------------------------------------------------------- */
+
 static void
 VideoDisplay(ClientData clientData)
 {
@@ -458,25 +1196,57 @@ VideoDisplay(ClientData clientData)
     Tk_Window tkwin = videoPtr->tkwin;
     Drawable d = Tk_WindowId(tkwin);
     Tk_3DBorder bg;
-
+    XRectangle rect;
+    int drawn;
 
     videoPtr->flags &= ~REDRAW_PENDING;
-    if (!Tk_IsMapped(tkwin)) {
+    if (videoPtr->flags & UPDATE_IMAGE) {
+        videoPtr->flags &= ~UPDATE_IMAGE;
+        VideoUpdateImage(videoPtr);
+    }
+    if (!(videoPtr->flags & (REDRAW_WIDGET | REDRAW_FRAME)) || !Tk_IsMapped(tkwin)) {
         return;
     }
 
-    if (videoPtr->flags & UPDATE_V_SCROLL) {
-        VideoUpdateVScrollbar(videoPtr);
-    }
+    /*
+     * Let the platform draw the latest frame, if it renders into the
+     * widget window itself, and then fill whatever it did not cover.
+     */
 
-    if (videoPtr->flags & UPDATE_H_SCROLL) {
-        VideoUpdateHScrollbar(videoPtr);
-    }
+    drawn = VideopDisplay(videoPtr, d, &rect);
+    if (videoPtr->flags & REDRAW_WIDGET) {
+        int width = Tk_Width(tkwin), height = Tk_Height(tkwin);
 
-    bg = Tk_Get3DBorderFromObj(tkwin, videoPtr->bgPtr);
+        if (videoPtr->flags & UPDATE_V_SCROLL) {
+            VideoUpdateVScrollbar(videoPtr);
+        }
+
+        if (videoPtr->flags & UPDATE_H_SCROLL) {
+            VideoUpdateHScrollbar(videoPtr);
+        }
+
+        bg = Tk_Get3DBorderFromObj(tkwin, videoPtr->bgPtr);
 
-    Tk_Fill3DRectangle(tkwin, d, bg, 0, 0,
-        Tk_Width(tkwin), Tk_Height(tkwin), 0, TK_RELIEF_FLAT);
+        if (!drawn) {
+            Tk_Fill3DRectangle(tkwin, d, bg, 0, 0,
+                width, height, 0, TK_RELIEF_FLAT);
+        } else {
+            int bottom = rect.y + rect.height, right = rect.x + rect.width;
+            if (rect.y > 0)
+                Tk_Fill3DRectangle(tkwin, d, bg, 0, 0,
+                    width, rect.y, 0, TK_RELIEF_FLAT);
+            if (bottom < height)
+                Tk_Fill3DRectangle(tkwin, d, bg, 0, bottom,
+                    width, height - bottom, 0, TK_RELIEF_FLAT);
+            if (rect.x > 0)
+                Tk_Fill3DRectangle(tkwin, d, bg, 0, rect.y,
+                    rect.x, rect.height, 0, TK_RELIEF_FLAT);
+            if (right < width)
+                Tk_Fill3DRectangle(tkwin, d, bg, right, rect.y,
+                    width - right, rect.height, 0, TK_RELIEF_FLAT);
+        }
+    }
+    videoPtr->flags &= ~(REDRAW_WIDGET | REDRAW_FRAME);
 }
 
 /*
@@ -730,6 +1500,18 @@ VideoUpdateHScrollbar(Video* videoPtr)
 
 void 
 SendVirtualEvent(Tk_Window tgtWin, const char *eventName, unsigned int state)
+{
+    SendVirtualEventData(tgtWin, eventName, state, NULL);
+}
+
+/*
+ * As SendVirtualEvent, with an object passed to bindings as %d. Tk
+ * releases the reference taken here once the event has been handled.
+ */
+
+void
+SendVirtualEventData(Tk_Window tgtWin, const char *eventName, unsigned int state,
+                     Tcl_Obj *dataObj)
 {
     XEvent event;
     XVirtualEvent *eventPtr = (XVirtualEvent *)&event;
@@ -745,10 +1527,77 @@ SendVirtualEvent(Tk_Window tgtWin, const char *eventName, unsigned int state)
     /* eventPtr->x = pointer X */
     /* eventPtr->y = pointer Y */
     Tk_GetRootCoords(tgtWin, &eventPtr->x_root, &eventPtr->y_root);
+    if (dataObj != NULL) {
+        Tcl_IncrRefCount(dataObj);
+        eventPtr->user_data = dataObj;
+    }
 
     Tk_QueueWindowEvent(&event, TCL_QUEUE_TAIL);
 }
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * VideoComputeAnchor --
+ *
+ *        Determine where to place a rectangle so that it will be properly
+ *        anchored with respect to the given window.  Used by widgets
+ *        to align a box of text inside a window.  When anchoring with
+ *        respect to one of the sides, the rectangle be placed inside of
+ *        the internal border of the window.
+ *
+ * Results:
+ *        *xPtr and *yPtr set to the upper-left corner of the rectangle
+ *        anchored in the window.
+ *
+ * Side effects:
+ *        None.
+ *
+ *---------------------------------------------------------------------------
+ */
+void
+VideoComputeAnchor(Tk_Anchor anchor, Tk_Window tkwin,
+                   int padX, int padY, int innerWidth, int innerHeight, int *xPtr, int *yPtr)
+{
+    switch (anchor) {
+        case TK_ANCHOR_NW:
+        case TK_ANCHOR_W:
+        case TK_ANCHOR_SW:
+            *xPtr = Tk_InternalBorderLeft(tkwin) + padX;
+            break;
+
+        case TK_ANCHOR_N:
+        case TK_ANCHOR_CENTER:
+        case TK_ANCHOR_S:
+            *xPtr = (Tk_Width(tkwin) - innerWidth) / 2;
+            break;
+
+        default:
+            *xPtr = Tk_Width(tkwin) - (Tk_InternalBorderRight(tkwin) + padX)
+                    - innerWidth;
+            break;
+    }
+
+    switch (anchor) {
+        case TK_ANCHOR_NW:
+        case TK_ANCHOR_N:
+        case TK_ANCHOR_NE:
+            *yPtr = Tk_InternalBorderTop(tkwin) + padY;
+            break;
+
+        case TK_ANCHOR_W:
+        case TK_ANCHOR_CENTER:
+        case TK_ANCHOR_E:
+            *yPtr = (Tk_Height(tkwin) - innerHeight) / 2;
+            break;
+
+        default:
+            *yPtr = Tk_Height(tkwin) - Tk_InternalBorderBottom(tkwin) - padY
+                    - innerHeight;
+            break;
+    }
+}
+
 void 
 SendConfigureEvent(Tk_Window tgtWin, int x, int y, int width, int height)
 {
@@ -22,6 +22,86 @@
 extern "C" {
 #endif
 
+/*
+ * Pixel formats for frames passed between the platform code and the
+ * generic frame handling code.
+ */
+
+enum {
+    VIDEO_FORMAT_BGRA,     /* 32 bit B,G,R,A byte order (RGB32 DIB) */
+    VIDEO_FORMAT_BGR24,    /* 24 bit B,G,R byte order (RGB24 DIB) */
+    VIDEO_FORMAT_YUY2,     /* packed 4:2:2 Y0,U,Y1,V */
+    VIDEO_FORMAT_UYVY,     /* packed 4:2:2 U,Y0,V,Y1 */
+    VIDEO_FORMAT_NV12,     /* 4:2:0 Y plane and an interleaved U,V plane */
+    VIDEO_FORMAT_I420,     /* 4:2:0 Y, U and V planes */
+};
+
+/*
+ * SIMD instruction sets reported by VideoCpuFeatures.
+ */
+
+#define VIDEO_CPU_SSE2   0x01
+#define VIDEO_CPU_SSSE3  0x02
+#define VIDEO_CPU_AVX2   0x04
+
+/*
+ * Description of a single uncompressed video frame. The data pointer
+ * addresses the top row of the image and pitch is the number of bytes
+ * between the start of successive rows. A bottom-up bitmap is described
+ * by pointing data at the last row in memory and using a negative pitch.
+ * For the planar YUV formats data and pitch describe the Y plane and the
+ * subsampled chroma planes are described separately.
+ */
+
+typedef struct {
+    unsigned char *data;
+    int         width;
+    int         height;
+    int         pitch;
+    int         format;     /* one of the VIDEO_FORMAT_* values */
+    unsigned char *chroma[2]; /* NV12 U,V plane, or I420 U and V planes */
+    int         chromaPitch;
+    Tcl_WideInt sequence;   /* frame number within the stream */
+    Tcl_WideInt timestamp;  /* stream time in microseconds */
+    Tcl_WideInt captured;   /* VideoStatsClock time it arrived, or 0 */
+} VideoFrame;
+
+/*
+ * An image blended over each frame. The pixels are premultiplied B,G,R,A
+ * rows of width * 4 bytes and spans holds, for each row, the first and
+ * one past the last column that is not fully transparent.
+ */
+
+typedef struct {
+    unsigned char *pixels;
+    int        *spans;
+    int         width;
+    int         height;
+    int         x;          /* position of the overlay within the frame */
+    int         y;
+    int         alpha;      /* global opacity from 0 to 255 */
+} VideoOverlay;
+
+/*
+ * Captured frames are passed from the platform's capture thread to the
+ * widget and to any sinks through a ring of reference counted buffers.
+ */
+
+typedef struct VideoRing VideoRing;
+typedef struct VideoBuffer VideoBuffer;
+typedef struct VideoFramePool VideoFramePool;
+typedef struct VideoSink VideoSink;
+typedef struct VideoStats VideoStats;
+typedef struct VideoStream VideoStream;
+typedef struct VideoJpeg VideoJpeg;
+typedef struct VideoAvi VideoAvi;
+typedef struct VideoRecord VideoRecord;
+typedef struct VideoPreroll VideoPreroll;
+typedef struct VideoMotion VideoMotion;
+typedef struct VideoSource VideoSource;
+typedef struct VideoTile VideoTile;
+typedef void (VideoSinkProc)(ClientData clientData);
+
 typedef struct {
                            /* widget core */
     Tk_Window tkwin;
@@ -52,12 +132,48 @@ typedef struct {
     Tcl_Obj *sourcePtr;
     Tcl_Obj *audioPtr;
     Tcl_Obj *outputPtr;
+    Tcl_Obj *segmentPtr;
+    double   preroll;      /* -preroll seconds of video kept */
 
     Tk_Cursor cursor;      /* support alternate cursor */
     Tcl_Obj *takeFocusPtr; /* used for keyboard traversal */
 
     ClientData platformData;
 
+    unsigned char *stagePtr;  /* RGBA staging buffer for photo updates */
+    size_t   stageSize;
+    int      stageWidth;
+    int      stageHeight;
+
+    Tk_PhotoHandle intoPhoto; /* photo last used by picture -into */
+    int      intoWidth;       /* and its size */
+    int      intoHeight;
+
+    Tcl_Obj *imagePtr;        /* -image photo updated with each frame */
+    Tcl_ThreadId ownerThread; /* thread running the widget interp */
+    Tcl_Mutex notifyLock;     /* protects the frame notification fields */
+    int      notifyPending;   /* an event is queued and not yet handled */
+    Tcl_WideInt notifySequence;  /* newest frame reported by VideoNotifyFrame */
+    Tcl_WideInt notifyTimestamp;
+    int      drawFrames;      /* platform draws frames in VideopDisplay */
+    int      bufferCount;     /* -buffercount slots in the frame ring */
+    VideoRing *ringPtr;       /* frames from the current source */
+    Tcl_Mutex sinkLock;       /* protects the sink list and ring changes */
+    VideoSink *sinkList;      /* consumers given every frame */
+    int      sinkSlots;       /* ring slots the sinks may hold */
+
+    VideoStats *statsPtr;     /* frame counters for the stats command */
+    VideoStream *streamPtr;   /* MJPEG server, or NULL */
+    VideoJpeg *jpegPtr;       /* encoder for picture -format jpeg */
+    VideoRecord *recordPtr;   /* recorder writing -output, or NULL */
+    VideoPreroll *prerollPtr; /* frames kept for clip save, or NULL */
+    VideoMotion *motionPtr;   /* motion detector, or NULL */
+    VideoTile *tileList;      /* mosaic tiles showing the widget */
+    Tcl_WideInt stageTime;    /* when the staged frame was converted */
+
+    VideoOverlay *overlayPtr; /* image blended over each frame, or NULL */
+    Tcl_Obj *overlayNamePtr;  /* name of the photo it was made from */
+
 } Video;
 
 enum {
@@ -75,8 +191,240 @@ int  VideopWidgetObjCmd(ClientData clientData, Tcl_Interp *interp,
 void VideopCalculateGeometry(Video *videoPtr);
 
 int  VideopInitializeSource(Video *videoPtr);
+int  VideopGrabFrame(Video *videoPtr);
+int  VideopDisplay(Video *videoPtr, Drawable d, XRectangle *rectPtr);
+int  VideopUpdateOverlay(Video *videoPtr);
+ClientData VideopPresenterCreate(Tk_Window tkwin, Tcl_IdleProc *redrawProc,
+                                 ClientData clientData);
+int  VideopPresent(ClientData presenter, Drawable d, const VideoFrame *framePtr);
+void VideopPresenterDestroy(ClientData presenter);
 void SendVirtualEvent(Tk_Window targetwin, const char *eventName, unsigned int state);
+void SendVirtualEventData(Tk_Window tgtWin, const char *eventName, unsigned int state,
+                          Tcl_Obj *dataObj);
 void SendConfigureEvent(Tk_Window tgtWin, int x, int y, int height, int width);
+void VideoComputeAnchor(Tk_Anchor anchor, Tk_Window tkwin, int padX, int padY,
+                        int innerWidth, int innerHeight, int *xPtr, int *yPtr);
+int  VideoStageFrame(Video *videoPtr, const VideoFrame *framePtr);
+int  VideoPutStagedPhoto(Video *videoPtr, Tk_PhotoHandle photo);
+int  VideoStagedPicture(Video *videoPtr, Tcl_Obj *namePtr, int into);
+void VideoNotifyFrame(Video *videoPtr, const VideoFrame *framePtr);
+void VideoRedrawFrame(Video *videoPtr);
+int  VideoGetFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, Video **videoPtrPtr);
+
+/* convert.c */
+int  VideoCpuFeatures(void);
+void VideoConvertInit(int features);
+const char *VideoConvertKernel(void);
+size_t VideoFrameLayout(VideoFrame *framePtr, int format, int width, int height,
+                        unsigned char *data);
+void VideoConvertToRGBA(const VideoFrame *framePtr, unsigned char *dstPtr, int dstPitch);
+void VideoConvertToBGRA(const VideoFrame *framePtr, unsigned char *dstPtr, int dstPitch);
+
+/* composite.c */
+void VideoCompositeInit(int features);
+VideoOverlay *VideoOverlayCreate(void);
+void VideoOverlayDestroy(VideoOverlay *overlayPtr);
+int  VideoOverlayLoad(VideoOverlay *overlayPtr, Tk_PhotoHandle photo);
+void VideoOverlayBlend(const VideoOverlay *overlayPtr, unsigned char *dstPtr, int dstPitch,
+                       int width, int height, int rgba);
+
+/* ring.c */
+#define VIDEO_RING_MIN_SLOTS  2
+#define VIDEO_RING_MAX_SLOTS  64
+
+VideoRing *VideoRingCreate(int slots, size_t slotSize);
+void VideoRingRetain(VideoRing *ringPtr);
+void VideoRingDestroy(VideoRing *ringPtr);
+int  VideoRingReserve(VideoRing *ringPtr, int slots);
+int  VideoRingSlots(const VideoRing *ringPtr);
+size_t VideoRingSlotSize(const VideoRing *ringPtr);
+VideoFramePool *VideoRingPool(const VideoRing *ringPtr);
+VideoFrame *VideoRingBeginWrite(VideoRing *ringPtr);
+VideoBuffer *VideoRingPublish(VideoRing *ringPtr);
+Tcl_WideInt VideoRingDropped(const VideoRing *ringPtr);
+const VideoFrame *VideoRingAcquire(VideoRing *ringPtr);
+void VideoRingRelease(VideoRing *ringPtr);
+VideoBuffer *VideoRingNewest(VideoRing *ringPtr);
+const VideoFrame *VideoBufferFrame(const VideoBuffer *bufferPtr);
+VideoFramePool *VideoBufferPool(const VideoBuffer *bufferPtr);
+void VideoBufferRetain(VideoBuffer *bufferPtr);
+void VideoBufferRelease(VideoBuffer *bufferPtr);
+VideoFrame *VideoBufferWritable(VideoBuffer *bufferPtr, VideoFrame *framePtr,
+                                unsigned char **copyPtr, size_t *copySizePtr);
+
+/* framepool.c */
+VideoFramePool *VideoFramePoolCreate(void);
+void VideoFramePoolRelease(VideoFramePool *poolPtr);
+void *VideoFramePoolAlloc(VideoFramePool *poolPtr, size_t size);
+void VideoFramePoolFree(void *buffer);
+void VideoFramePoolDiscard(void *buffer);
+void VideoFramePoolCounts(VideoFramePool *poolPtr, Tcl_WideInt *hitsPtr,
+                          Tcl_WideInt *missesPtr);
+
+/* sink.c */
+int  VideoOpenRing(Video *videoPtr, size_t slotSize);
+void VideoCloseRing(Video *videoPtr);
+VideoFrame *VideoBeginFrame(Video *videoPtr);
+void VideoPublishFrame(Video *videoPtr);
+void VideoDeliverFrame(Video *videoPtr, VideoBuffer *bufferPtr);
+VideoSink *VideoSinkCreate(Video *videoPtr, const char *name, int holds,
+                           VideoSinkProc *wakeProc, ClientData clientData);
+void VideoSinkDestroy(VideoSink *sinkPtr);
+VideoBuffer *VideoSinkTake(VideoSink *sinkPtr);
+const char *VideoSinkName(const VideoSink *sinkPtr);
+void VideoSinkCounts(VideoSink *sinkPtr, Tcl_WideInt *deliveredPtr, Tcl_WideInt *droppedPtr);
+
+/* source.c */
+#define VIDEO_ACCEPT_NONE  0    /* frames a view of a shared source accepts */
+#define VIDEO_ACCEPT_ONE   1
+#define VIDEO_ACCEPT_ALL   2
+
+typedef ClientData (VideoSourceOpenProc)(VideoSource *sourcePtr, Video *videoPtr,
+                                         ClientData clientData);
+typedef void (VideoSourceCloseProc)(ClientData clientData);
+
+VideoSource *VideoSourceAttach(Video *videoPtr, const char *name, size_t slotSize,
+                               VideoSourceOpenProc *openProc,
+                               VideoSourceCloseProc *closeProc, ClientData clientData);
+void VideoSourceDetach(VideoSource *sourcePtr, Video *videoPtr);
+ClientData VideoSourceData(VideoSource *sourcePtr);
+int  VideoSourceViews(VideoSource *sourcePtr);
+int  VideoSourceAccept(VideoSource *sourcePtr, Video *videoPtr, int accept, int force);
+VideoFrame *VideoSourceBeginFrame(VideoSource *sourcePtr);
+void VideoSourcePublish(VideoSource *sourcePtr);
+
+/* pool.c */
+#define VIDEO_STRIPE_PIXELS (1 << 21)   /* smallest frame shared out in stripes */
+#define VIDEO_STRIPE_LANES  8           /* most threads working on one frame */
+
+typedef void (VideoTaskProc)(ClientData clientData);
+typedef void (VideoStripeProc)(ClientData clientData, int lane, int first, int last);
+
+int  VideoPoolInit(Tcl_Interp *interp);
+int  VideoPoolThreads(void);
+void VideoPoolSubmit(ClientData affinity, VideoTaskProc *proc, ClientData clientData);
+void VideoPoolStripes(int rows, Tcl_WideInt pixels, VideoStripeProc *proc,
+                      ClientData clientData);
+int  VideoPoolObjCmd(ClientData clientData, Tcl_Interp *interp,
+                     int objc, Tcl_Obj *CONST objv[]);
+
+/* jpeg.c */
+VideoJpeg *VideoJpegCreate(void);
+void VideoJpegDestroy(VideoJpeg *jpegPtr);
+int  VideoJpegEncode(VideoJpeg *jpegPtr, const VideoFrame *framePtr, int quality,
+                     const unsigned char **dataPtr, size_t *sizePtr);
+int  VideoJpegEncodeRGBA(VideoJpeg *jpegPtr, const unsigned char *rgbaPtr, int width,
+                         int height, int pitch, int quality,
+                         const unsigned char **dataPtr, size_t *sizePtr);
+const char *VideoJpegError(const VideoJpeg *jpegPtr);
+int  VideoStagedJpeg(Video *videoPtr, int quality);
+
+/* stream.c */
+int  VideoWidgetStreamCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *CONST objv[]);
+void VideoStreamClose(Video *videoPtr);
+
+/* writer.c */
+#define VIDEO_IMAGE_BMP   0    /* indexes into VideoImageFormats */
+#define VIDEO_IMAGE_JPEG  1
+#define VIDEO_IMAGE_PNG   2
+#define VIDEO_IMAGE_PPM   3
+extern const char *VideoImageFormats[];
+int  VideoStagedFile(Video *videoPtr, Tcl_Obj *pathPtr, int format, int quality,
+                     Tcl_Obj *commandPtr);
+
+/* avi.c */
+VideoAvi *VideoAviCreate(const void *native, int width, int height, int rateNum,
+                         int rateDen, char *message);
+int  VideoAviWrite(VideoAvi *aviPtr, const unsigned char *data, size_t size);
+int  VideoAviClose(VideoAvi *aviPtr, char *message);
+int  VideoAviCheckpoint(VideoAvi *aviPtr);
+void VideoAviCounts(const VideoAvi *aviPtr, Tcl_WideInt *framesPtr, Tcl_WideInt *bytesPtr);
+int  VideoAviRepair(const void *native, Tcl_WideInt *framesPtr, char *message);
+
+/* record.c */
+int  VideoRecordParseSegment(Tcl_Interp *interp, Tcl_Obj *objPtr, double *secondsPtr,
+                             Tcl_WideInt *bytesPtr);
+int  VideoRecordStart(Video *videoPtr, double rate);
+int  VideoRecordStop(Video *videoPtr);
+Tcl_Obj *VideoRecordInfo(Video *videoPtr);
+int  VideoRepairObjCmd(ClientData clientData, Tcl_Interp *interp,
+                       int objc, Tcl_Obj *CONST objv[]);
+
+/* clip.c */
+int  VideoPrerollCheck(Tcl_Interp *interp, double seconds);
+int  VideoPrerollStart(Video *videoPtr, double rate);
+void VideoPrerollStop(Video *videoPtr);
+int  VideoPrerollUpdate(Video *videoPtr);
+Tcl_Obj *VideoPrerollInfo(Video *videoPtr);
+int  VideoWidgetClipCmd(ClientData clientData, Tcl_Interp *interp,
+                        int objc, Tcl_Obj *CONST objv[]);
+
+/* motion.c */
+void VideoMotionInit(int features);
+int  VideoWidgetMotionCmd(ClientData clientData, Tcl_Interp *interp,
+                          int objc, Tcl_Obj *CONST objv[]);
+void VideoMotionClose(Video *videoPtr);
+
+/* mosaic.c */
+int  VideoMosaicObjCmd(ClientData clientData, Tcl_Interp *interp,
+                       int objc, Tcl_Obj *CONST objv[]);
+void VideoMosaicForget(Video *videoPtr);
+
+/* stats.c */
+#define VIDEO_STATS_CAPTURE  0  /* counters written by the capture thread */
+#define VIDEO_STATS_WIDGET   1  /* counters written by the widget thread */
+
+#define VIDEO_STAT_CAPTURE_IN   0   /* frames arriving from the source */
+#define VIDEO_STAT_CAPTURE_OUT  1   /* frames published to the ring */
+#define VIDEO_STAT_CONVERT_IN   2
+#define VIDEO_STAT_CONVERT_OUT  3
+#define VIDEO_STAT_DISPLAY_IN   4
+#define VIDEO_STAT_DISPLAY_OUT  5
+#define VIDEO_STAT_PICTURE_IN   6
+#define VIDEO_STAT_PICTURE_OUT  7
+#define VIDEO_STAT_DROP_RING    8   /* no free slot in the ring */
+#define VIDEO_STAT_DROP_SINK    9   /* replaced in a sink mailbox */
+#define VIDEO_STAT_FRESH        10  /* distinct frames converted */
+#define VIDEO_STAT_COUNTERS     11
+
+#define VIDEO_LATENCY_CAPTURE_CONVERT  0
+#define VIDEO_LATENCY_CONVERT_DISPLAY  1
+#define VIDEO_LATENCY_PICTURE          2
+#define VIDEO_LATENCIES                3
+
+VideoStats *VideoStatsCreate(void);
+void VideoStatsDestroy(VideoStats *statsPtr);
+Tcl_WideInt VideoStatsClock(void);
+void VideoStatsCount(VideoStats *statsPtr, int block, int counter, Tcl_WideInt n);
+void VideoStatsLatency(VideoStats *statsPtr, int block, int latency, Tcl_WideInt usec);
+Tcl_WideInt VideoStatsFrame(VideoStats *statsPtr, const VideoFrame *framePtr);
+Tcl_Obj *VideoStatsGet(VideoStats *statsPtr, VideoFramePool *poolPtr);
+void VideoStatsReset(VideoStats *statsPtr, VideoFramePool *poolPtr);
+
+/* scale.c */
+typedef struct VideoScaler VideoScaler;
+
+void VideoScaleInit(int features);
+VideoScaler *VideoScalerCreate(void);
+void VideoScalerDestroy(VideoScaler *scalerPtr);
+void VideoScalerInvalidate(VideoScaler *scalerPtr);
+int  VideoScalerSetup(VideoScaler *scalerPtr, int srcWidth, int srcHeight,
+                      int dstWidth, int dstHeight);
+void VideoScaleImage(VideoScaler *scalerPtr, const unsigned char *srcPtr, int srcPitch,
+                     unsigned char *dstPtr, int dstPitch);
+
+/* synthetic.c */
+typedef struct {
+    int    width;
+    int    height;
+    double rate;           /* frames per second */
+    int    format;         /* one of the VIDEO_FORMAT_* values */
+} VideoSyntheticSpec;
+
+int  VideoSyntheticParse(Tcl_Interp *interp, const char *source, VideoSyntheticSpec *specPtr);
+Tcl_Obj *VideoSyntheticName(const VideoSyntheticSpec *specPtr);
+void VideoSyntheticRender(VideoFrame *framePtr, unsigned char *workPtr);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,905 @@
+/* writer.c - asynchronous snapshots to disk
+ *
+ *      pathName picture -file path ?-format fmt? ?-quality q? ?-command cmd?
+ *
+ * The widget thread only copies the staged frame, with any overlay
+ * already blended into it, into a buffer taken from a small pool and
+ * gives it to the worker pool (see pool.c), where a task compresses the
+ * copy to the requested format. A fixed set of writer threads, shared
+ * by all widgets, then write it to a temporary file next to the
+ * destination, flush it to the disk and rename it into place so that
+ * the destination never holds a partial image. Only then
+ * is the command called, back on the thread that asked for the picture,
+ * with the file name and a dictionary describing how long each step
+ * took.
+ *
+ * The queue is bounded. When as many pictures are outstanding as there
+ * are pooled buffers a new request fails at once rather than blocking
+ * the widget thread or growing memory without limit.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+#include "tkvideo.h"
+#include <stdio.h>
+#include <errno.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define WRITER_THREADS  2   /* threads writing files */
+#define WRITER_QUEUE    8   /* pictures queued or being written */
+
+const char *VideoImageFormats[] = { "bmp", "jpeg", "png", "ppm", NULL };
+
+/*
+ * Output of the encoders other than JPEG.
+ */
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t used;
+} WriterOutput;
+
+typedef struct WriterJob {
+    struct WriterJob *nextPtr;
+    int format;
+    int quality;
+    int width;
+    int height;
+    unsigned char *pixels;      /* pooled R,G,B,A copy of the frame */
+    size_t pixelSize;           /* allocated size of pixels */
+    WriterOutput output;        /* kept with the job, like pixels */
+#ifdef HAVE_ZLIB
+    WriterOutput filtered;      /* PNG rows with their filter bytes */
+#endif
+#ifdef HAVE_JPEG
+    VideoJpeg *jpegPtr;
+#endif
+    const unsigned char *data;  /* the compressed picture */
+    size_t dataSize;
+    char *native;               /* native name of the destination */
+    char *temporary;            /* native name of the file written */
+    Tcl_Interp *interp;         /* all of these belong to the owner thread */
+    Tcl_ThreadId ownerThread;
+    Tcl_Obj *pathPtr;
+    Tcl_Obj *commandPtr;        /* called when the file is written, or NULL */
+    Tcl_WideInt queued;         /* VideoStatsClock times of each step */
+    Tcl_WideInt started;
+    Tcl_WideInt encoded;
+    Tcl_WideInt finished;
+    size_t bytes;
+    int code;
+    char message[256];
+} WriterJob;
+
+static struct {
+    Tcl_Mutex lock;
+    Tcl_Condition cond;         /* wakes the writer threads */
+    WriterJob *headPtr;         /* compressed jobs waiting for a thread */
+    WriterJob *tailPtr;
+    WriterJob *donePtr;         /* written jobs waiting for their owners */
+    WriterJob *freePtr;         /* finished jobs keeping their buffers */
+    int outstanding;            /* jobs queued or being written */
+    int encoding;               /* jobs given to the pool to compress */
+    int started;
+    int quit;
+    unsigned int sequence;      /* makes the temporary file names unique */
+    Tcl_ThreadId threadIds[WRITER_THREADS];
+} writer;
+
+static void WriterEncodeTask(ClientData clientData);
+static Tcl_ThreadCreateType WriterThreadProc(ClientData clientData);
+static void WriterExitHandler(ClientData clientData);
+
+/* ---------------------------------------------------------------------- */
+
+static int
+Reserve(WriterOutput *outputPtr, size_t size)
+{
+    if (size > outputPtr->size) {
+        unsigned char *newPtr = (unsigned char *)
+            attemptckrealloc((char *)outputPtr->data, size);
+        if (newPtr == NULL)
+            return TCL_ERROR;
+        outputPtr->data = newPtr;
+        outputPtr->size = size;
+    }
+    return TCL_OK;
+}
+
+static unsigned char *
+PutLE32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+    return p + 4;
+}
+
+static unsigned char *
+PutBE32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+    return p + 4;
+}
+
+/*
+ * Binary PPM: a text header followed by the R,G,B samples.
+ */
+
+static int
+EncodePpm(WriterJob *jobPtr)
+{
+    WriterOutput *outPtr = &jobPtr->output;
+    const unsigned char *srcPtr = jobPtr->pixels;
+    unsigned char *dstPtr;
+    char header[64];
+    size_t n, count = (size_t)jobPtr->width * jobPtr->height;
+    int len;
+
+    len = sprintf(header, "P6\n%d %d\n255\n", jobPtr->width, jobPtr->height);
+    if (Reserve(outPtr, len + count * 3) != TCL_OK)
+        return TCL_ERROR;
+    memcpy(outPtr->data, header, len);
+    dstPtr = outPtr->data + len;
+    for (n = 0; n < count; ++n, srcPtr += 4, dstPtr += 3) {
+        dstPtr[0] = srcPtr[0];
+        dstPtr[1] = srcPtr[1];
+        dstPtr[2] = srcPtr[2];
+    }
+    outPtr->used = len + count * 3;
+    return TCL_OK;
+}
+
+/*
+ * Windows bitmap: 24 bits per pixel as B,G,R, the bottom row first and
+ * each row padded to a multiple of four bytes.
+ */
+
+static int
+EncodeBmp(WriterJob *jobPtr)
+{
+    WriterOutput *outPtr = &jobPtr->output;
+    size_t stride = ((size_t)jobPtr->width * 3 + 3) & ~(size_t)3;
+    size_t imageSize = stride * jobPtr->height;
+    unsigned char *p;
+    int x, y;
+
+    if (Reserve(outPtr, 54 + imageSize) != TCL_OK)
+        return TCL_ERROR;
+    memset(outPtr->data, 0, 54);
+    p = outPtr->data;
+    p[0] = 'B'; p[1] = 'M';
+    PutLE32(p + 2, (unsigned int)(54 + imageSize));
+    PutLE32(p + 10, 54);                        /* offset of the pixels */
+    PutLE32(p + 14, 40);                        /* BITMAPINFOHEADER */
+    PutLE32(p + 18, (unsigned int)jobPtr->width);
+    PutLE32(p + 22, (unsigned int)jobPtr->height);
+    p[26] = 1;                                  /* planes */
+    p[28] = 24;                                 /* bits per pixel */
+    PutLE32(p + 34, (unsigned int)imageSize);
+    PutLE32(p + 38, 2835);                      /* 72 dpi */
+    PutLE32(p + 42, 2835);
+
+    for (y = 0; y < jobPtr->height; ++y) {
+        const unsigned char *srcPtr = jobPtr->pixels
+            + (size_t)(jobPtr->height - 1 - y) * jobPtr->width * 4;
+        unsigned char *dstPtr = outPtr->data + 54 + (size_t)y * stride;
+        for (x = 0; x < jobPtr->width; ++x, srcPtr += 4, dstPtr += 3) {
+            dstPtr[0] = srcPtr[2];
+            dstPtr[1] = srcPtr[1];
+            dstPtr[2] = srcPtr[0];
+        }
+        memset(dstPtr, 0, stride - (size_t)jobPtr->width * 3);
+    }
+    outPtr->used = 54 + imageSize;
+    return TCL_OK;
+}
+
+#ifdef HAVE_ZLIB
+
+static unsigned char *
+PutChunk(unsigned char *p, const char *type, const unsigned char *data, unsigned int len)
+{
+    unsigned char *start = p + 4;
+    uLong crc;
+
+    p = PutBE32(p, len);
+    memcpy(p, type, 4);
+    if (data != NULL && data != p + 4)
+        memmove(p + 4, data, len);
+    p += 4 + len;
+    crc = crc32(0L, start, len + 4);
+    return PutBE32(p, (unsigned int)crc);
+}
+
+/*
+ * PNG: 8 bit R,G,B with every row using the Sub filter, which suits
+ * camera images, compressed at the fastest zlib level as one IDAT chunk.
+ */
+
+static int
+EncodePng(WriterJob *jobPtr)
+{
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+    WriterOutput *outPtr = &jobPtr->output;
+    WriterOutput *rawPtr = &jobPtr->filtered;
+    size_t rowSize = (size_t)jobPtr->width * 3 + 1;
+    size_t rawSize = rowSize * jobPtr->height;
+    unsigned char ihdr[13], *p;
+    uLongf packed;
+    z_stream zs;
+    int x, y, r;
+
+    if (Reserve(rawPtr, rawSize) != TCL_OK)
+        return TCL_ERROR;
+    for (y = 0; y < jobPtr->height; ++y) {
+        const unsigned char *srcPtr = jobPtr->pixels + (size_t)y * jobPtr->width * 4;
+        unsigned char *dstPtr = rawPtr->data + (size_t)y * rowSize;
+        unsigned char left[3] = { 0, 0, 0 };
+        *dstPtr++ = 1;
+        for (x = 0; x < jobPtr->width; ++x, srcPtr += 4, dstPtr += 3) {
+            dstPtr[0] = (unsigned char)(srcPtr[0] - left[0]);
+            dstPtr[1] = (unsigned char)(srcPtr[1] - left[1]);
+            dstPtr[2] = (unsigned char)(srcPtr[2] - left[2]);
+            left[0] = srcPtr[0];
+            left[1] = srcPtr[1];
+            left[2] = srcPtr[2];
+        }
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK)
+        return TCL_ERROR;
+    packed = deflateBound(&zs, (uLong)rawSize);
+    if (Reserve(outPtr, sizeof(signature) + 25 + 12 + packed + 12) != TCL_OK) {
+        deflateEnd(&zs);
+        return TCL_ERROR;
+    }
+    p = outPtr->data;
+    memcpy(p, signature, sizeof(signature));
+    p += sizeof(signature);
+
+    PutBE32(ihdr, (unsigned int)jobPtr->width);
+    PutBE32(ihdr + 4, (unsigned int)jobPtr->height);
+    ihdr[8] = 8;                /* bit depth */
+    ihdr[9] = 2;                /* colour type: RGB */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    p = PutChunk(p, "IHDR", ihdr, sizeof(ihdr));
+
+    /* compress straight into the IDAT chunk */
+    zs.next_in = rawPtr->data;
+    zs.avail_in = (uInt)rawSize;
+    zs.next_out = p + 8;
+    zs.avail_out = (uInt)packed;
+    r = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (r != Z_STREAM_END)
+        return TCL_ERROR;
+    p = PutChunk(p, "IDAT", p + 8, (unsigned int)zs.total_out);
+    p = PutChunk(p, "IEND", NULL, 0);
+    outPtr->used = p - outPtr->data;
+    return TCL_OK;
+}
+
+#endif /* HAVE_ZLIB */
+
+/*
+ * Compress the job's pixels. The result is left in *dataPtr, which
+ * belongs to the job and stays valid until it is used again.
+ */
+
+static int
+WriterEncode(WriterJob *jobPtr, const unsigned char **dataPtr, size_t *sizePtr)
+{
+    int r = TCL_ERROR;
+
+    strcpy(jobPtr->message, "out of memory");
+    switch (jobPtr->format) {
+        case VIDEO_IMAGE_JPEG:
+#ifdef HAVE_JPEG
+            if (jobPtr->jpegPtr == NULL)
+                jobPtr->jpegPtr = VideoJpegCreate();
+            r = VideoJpegEncodeRGBA(jobPtr->jpegPtr, jobPtr->pixels, jobPtr->width,
+                                    jobPtr->height, jobPtr->width * 4, jobPtr->quality,
+                                    dataPtr, sizePtr);
+            if (r != TCL_OK)
+                sprintf(jobPtr->message, "failed to encode image: %.200s",
+                        VideoJpegError(jobPtr->jpegPtr));
+            return r;
+#else
+            break;
+#endif
+        case VIDEO_IMAGE_PNG:
+#ifdef HAVE_ZLIB
+            r = EncodePng(jobPtr);
+#endif
+            break;
+        case VIDEO_IMAGE_BMP:
+            r = EncodeBmp(jobPtr);
+            break;
+        case VIDEO_IMAGE_PPM:
+            r = EncodePpm(jobPtr);
+            break;
+    }
+    *dataPtr = jobPtr->output.data;
+    *sizePtr = jobPtr->output.used;
+    return r;
+}
+
+/*
+ * Write the data to the temporary file, flush it to the disk and rename
+ * it over the destination. On POSIX systems the directory is flushed too
+ * so that the rename itself survives a crash.
+ */
+
+#if defined(_WIN32)
+
+static int
+WriterWrite(WriterJob *jobPtr, const unsigned char *data, size_t size)
+{
+    const WCHAR *temporary = (const WCHAR *)jobPtr->temporary;
+    HANDLE h;
+    DWORD written;
+    BOOL ok;
+
+    h = CreateFileW(temporary, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        sprintf(jobPtr->message, "couldn't open file: error %lu", GetLastError());
+        return TCL_ERROR;
+    }
+    ok = TRUE;
+    while (ok && size > 0) {
+        DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+        ok = WriteFile(h, data, chunk, &written, NULL);
+        if (ok && written == 0) {
+            /* no progress would loop for ever */
+            SetLastError(ERROR_WRITE_FAULT);
+            ok = FALSE;
+        }
+        data += written;
+        size -= written;
+    }
+    if (ok)
+        ok = FlushFileBuffers(h);
+    if (!ok)
+        sprintf(jobPtr->message, "error writing file: error %lu", GetLastError());
+    CloseHandle(h);
+    if (ok && !MoveFileExW(temporary, (const WCHAR *)jobPtr->native,
+                           MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        sprintf(jobPtr->message, "error renaming file: error %lu", GetLastError());
+        ok = FALSE;
+    }
+    if (!ok)
+        DeleteFileW(temporary);
+    return ok ? TCL_OK : TCL_ERROR;
+}
+
+#else /* !_WIN32 */
+
+static int
+WriterWrite(WriterJob *jobPtr, const unsigned char *data, size_t size)
+{
+    const char *what = "writing";
+    char *slash;
+    int fd, err = 0, r = 0;
+
+    fd = open(jobPtr->temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        sprintf(jobPtr->message, "couldn't open file: %.200s", Tcl_ErrnoMsg(errno));
+        return TCL_ERROR;
+    }
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* a write making no progress would loop for ever */
+            err = n < 0 ? errno : EIO;
+            r = -1;
+            break;
+        }
+        data += n;
+        size -= n;
+    }
+    if (r == 0) {
+        what = "flushing";
+        if ((r = fsync(fd)) != 0)
+            err = errno;
+    }
+    if (close(fd) != 0 && r == 0) {
+        err = errno;
+        r = -1;
+    }
+    if (r == 0) {
+        what = "renaming";
+        if ((r = rename(jobPtr->temporary, jobPtr->native)) != 0)
+            err = errno;
+    }
+    if (r != 0) {
+        sprintf(jobPtr->message, "error %s file: %.200s", what, Tcl_ErrnoMsg(err));
+        unlink(jobPtr->temporary);
+        return TCL_ERROR;
+    }
+
+    /* the directory entry */
+    slash = strrchr(jobPtr->native, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    fd = open(slash == NULL ? "." : (slash == jobPtr->native ? "/" : jobPtr->native),
+              O_RDONLY);
+    if (slash != NULL)
+        *slash = '/';
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    return TCL_OK;
+}
+
+#endif /* !_WIN32 */
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Call the command on the owner thread. Errors without a command to
+ * report them to are background errors.
+ */
+
+static void
+WriterDone(WriterJob *jobPtr)
+{
+    Tcl_Interp *interp = jobPtr->interp;
+
+    if (!Tcl_InterpDeleted(interp)) {
+        if (jobPtr->commandPtr != NULL) {
+            Tcl_Obj *cmdPtr = Tcl_DuplicateObj(jobPtr->commandPtr);
+            Tcl_Obj *dictPtr = Tcl_NewDictObj();
+
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("status", -1),
+                Tcl_NewStringObj(jobPtr->code == TCL_OK ? "ok" : "error", -1));
+            if (jobPtr->code != TCL_OK)
+                Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("message", -1),
+                    Tcl_NewStringObj(jobPtr->message, -1));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("format", -1),
+                Tcl_NewStringObj(VideoImageFormats[jobPtr->format], -1));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("bytes", -1),
+                Tcl_NewWideIntObj((Tcl_WideInt)jobPtr->bytes));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("wait", -1),
+                Tcl_NewWideIntObj(jobPtr->started - jobPtr->queued));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("encode", -1),
+                Tcl_NewWideIntObj(jobPtr->encoded - jobPtr->started));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("write", -1),
+                Tcl_NewWideIntObj(jobPtr->finished - jobPtr->encoded));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("total", -1),
+                Tcl_NewWideIntObj(jobPtr->finished - jobPtr->queued));
+
+            Tcl_IncrRefCount(cmdPtr);
+            Tcl_Preserve(interp);
+            if (Tcl_ListObjAppendElement(interp, cmdPtr, jobPtr->pathPtr) != TCL_OK
+                || Tcl_ListObjAppendElement(interp, cmdPtr, dictPtr) != TCL_OK
+                || Tcl_EvalObjEx(interp, cmdPtr, TCL_EVAL_GLOBAL) != TCL_OK) {
+                Tcl_BackgroundError(interp);
+            }
+            Tcl_Release(interp);
+            Tcl_DecrRefCount(cmdPtr);
+        } else if (jobPtr->code != TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error saving picture to \"%s\": %s",
+                Tcl_GetString(jobPtr->pathPtr), jobPtr->message));
+            Tcl_BackgroundError(interp);
+        }
+    }
+
+    Tcl_DecrRefCount(jobPtr->pathPtr);
+    if (jobPtr->commandPtr != NULL)
+        Tcl_DecrRefCount(jobPtr->commandPtr);
+    Tcl_Release(interp);
+
+    /* keep the job and its pixel buffer for the next picture */
+    Tcl_MutexLock(&writer.lock);
+    jobPtr->nextPtr = writer.freePtr;
+    writer.freePtr = jobPtr;
+    --writer.outstanding;
+    Tcl_MutexUnlock(&writer.lock);
+}
+
+/*
+ * One event stands for every written job of the thread it is queued to,
+ * so a burst of pictures costs a single event. The jobs are taken off
+ * the done list in the order they were written.
+ */
+
+static int
+WriterEventProc(Tcl_Event *evPtr, int flags)
+{
+    Tcl_ThreadId self = Tcl_GetCurrentThread();
+    WriterJob *jobPtr, **prevPtrPtr, *headPtr = NULL, **tailPtrPtr = &headPtr;
+
+    if (!(flags & TCL_FILE_EVENTS)) {
+        return 0;
+    }
+
+    Tcl_MutexLock(&writer.lock);
+    prevPtrPtr = &writer.donePtr;
+    while ((jobPtr = *prevPtrPtr) != NULL) {
+        if (jobPtr->ownerThread == self) {
+            *prevPtrPtr = jobPtr->nextPtr;
+            jobPtr->nextPtr = NULL;
+            *tailPtrPtr = jobPtr;
+            tailPtrPtr = &jobPtr->nextPtr;
+        } else {
+            prevPtrPtr = &jobPtr->nextPtr;
+        }
+    }
+    Tcl_MutexUnlock(&writer.lock);
+
+    while ((jobPtr = headPtr) != NULL) {
+        headPtr = jobPtr->nextPtr;
+        WriterDone(jobPtr);
+    }
+    return 1;
+}
+
+/*
+ * Put a written job on the done list, with the lock held, and queue an
+ * event to its owner unless the list already holds one of its jobs:
+ * the event queued for that job has not run yet and will take this one
+ * too.
+ */
+
+static void
+WriterFinish(WriterJob *jobPtr)
+{
+    WriterJob **prevPtrPtr = &writer.donePtr;
+    int pending = 0;
+
+    while (*prevPtrPtr != NULL) {
+        if ((*prevPtrPtr)->ownerThread == jobPtr->ownerThread)
+            pending = 1;
+        prevPtrPtr = &(*prevPtrPtr)->nextPtr;
+    }
+    jobPtr->nextPtr = NULL;
+    *prevPtrPtr = jobPtr;
+    if (!pending) {
+        Tcl_Event *evPtr = (Tcl_Event *)ckalloc(sizeof(Tcl_Event));
+        evPtr->proc = WriterEventProc;
+        Tcl_ThreadQueueEvent(jobPtr->ownerThread, evPtr, TCL_QUEUE_TAIL);
+        Tcl_ThreadAlert(jobPtr->ownerThread);
+    }
+}
+
+/*
+ * Compress a job on a worker of the pool and queue it for the writer
+ * threads, failed or not, so that its command is called either way.
+ */
+
+static void
+WriterEncodeTask(ClientData clientData)
+{
+    WriterJob *jobPtr = (WriterJob *)clientData;
+
+    jobPtr->started = VideoStatsClock();
+    jobPtr->code = WriterEncode(jobPtr, &jobPtr->data, &jobPtr->dataSize);
+    jobPtr->encoded = VideoStatsClock();
+
+    Tcl_MutexLock(&writer.lock);
+    if (writer.tailPtr != NULL)
+        writer.tailPtr->nextPtr = jobPtr;
+    else
+        writer.headPtr = jobPtr;
+    writer.tailPtr = jobPtr;
+    --writer.encoding;
+    Tcl_ConditionNotify(&writer.cond);
+    Tcl_MutexUnlock(&writer.lock);
+}
+
+static Tcl_ThreadCreateType
+WriterThreadProc(ClientData clientData)
+{
+    Tcl_MutexLock(&writer.lock);
+    for (;;) {
+        WriterJob *jobPtr;
+
+        while (writer.headPtr == NULL && !(writer.quit && writer.encoding == 0))
+            Tcl_ConditionWait(&writer.cond, &writer.lock, NULL);
+        if (writer.headPtr == NULL)
+            break;
+        jobPtr = writer.headPtr;
+        writer.headPtr = jobPtr->nextPtr;
+        if (writer.headPtr == NULL)
+            writer.tailPtr = NULL;
+        Tcl_MutexUnlock(&writer.lock);
+
+        if (jobPtr->code == TCL_OK)
+            jobPtr->code = WriterWrite(jobPtr, jobPtr->data, jobPtr->dataSize);
+        if (jobPtr->code == TCL_OK)
+            jobPtr->bytes = jobPtr->dataSize;
+        jobPtr->finished = VideoStatsClock();
+        ckfree(jobPtr->native);
+        jobPtr->native = jobPtr->temporary = NULL;
+
+        Tcl_MutexLock(&writer.lock);
+        if (!writer.quit) {
+            WriterFinish(jobPtr);
+        } else {
+            jobPtr->nextPtr = writer.freePtr;
+            writer.freePtr = jobPtr;
+        }
+    }
+    Tcl_MutexUnlock(&writer.lock);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * On exit the pictures already queued are still written, as the script
+ * was told they would be, but their commands are not called. Those the
+ * pool is still compressing are waited for: its exit handler was made
+ * first and so runs after this one.
+ */
+
+static void
+WriterExitHandler(ClientData clientData)
+{
+    int n, result;
+
+    Tcl_MutexLock(&writer.lock);
+    writer.quit = 1;
+    Tcl_ConditionNotify(&writer.cond);
+    Tcl_MutexUnlock(&writer.lock);
+    for (n = 0; n < WRITER_THREADS; ++n) {
+        Tcl_JoinThread(writer.threadIds[n], &result);
+    }
+    while (writer.freePtr != NULL) {
+        WriterJob *jobPtr = writer.freePtr;
+        writer.freePtr = jobPtr->nextPtr;
+        if (jobPtr->pixels != NULL)
+            ckfree((char *)jobPtr->pixels);
+        if (jobPtr->output.data != NULL)
+            ckfree((char *)jobPtr->output.data);
+#ifdef HAVE_ZLIB
+        if (jobPtr->filtered.data != NULL)
+            ckfree((char *)jobPtr->filtered.data);
+#endif
+#ifdef HAVE_JPEG
+        if (jobPtr->jpegPtr != NULL)
+            VideoJpegDestroy(jobPtr->jpegPtr);
+#endif
+        ckfree((char *)jobPtr);
+    }
+    writer.started = 0;
+    writer.quit = 0;
+}
+
+/*
+ * Start the writer threads, with the lock held. If one cannot be made
+ * those already running are told to quit and joined again, so that the
+ * next picture tries afresh.
+ *
+ * @return a Tcl result code, with the error in the interpreter.
+ */
+
+static int
+WriterStart(Tcl_Interp *interp)
+{
+    int n, started, result;
+
+    for (started = 0; started < WRITER_THREADS; ++started) {
+        if (Tcl_CreateThread(&writer.threadIds[started], WriterThreadProc, NULL,
+                TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK)
+            break;
+    }
+    if (started < WRITER_THREADS) {
+        writer.quit = 1;
+        Tcl_ConditionNotify(&writer.cond);
+        Tcl_MutexUnlock(&writer.lock);
+        for (n = 0; n < started; ++n) {
+            Tcl_JoinThread(writer.threadIds[n], &result);
+        }
+        Tcl_MutexLock(&writer.lock);
+        writer.quit = 0;
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "failed to create a picture writer thread", -1));
+        return TCL_ERROR;
+    }
+    writer.started = 1;
+    Tcl_CreateExitHandler(WriterExitHandler, NULL);
+    return TCL_OK;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Copy a native path, which is a wide string on Windows, with room for
+ * the temporary file name after it.
+ */
+
+static char *
+NativeCopy(Tcl_Obj *pathPtr, Tcl_Obj *temporaryPtr, char **temporary)
+{
+    const char *path = (const char *)Tcl_FSGetNativePath(pathPtr);
+    const char *other = (const char *)Tcl_FSGetNativePath(temporaryPtr);
+    size_t pathLen, otherLen;
+    char *copy;
+
+    if (path == NULL || other == NULL)
+        return NULL;
+#if defined(_WIN32)
+    pathLen = (wcslen((const WCHAR *)path) + 1) * sizeof(WCHAR);
+    otherLen = (wcslen((const WCHAR *)other) + 1) * sizeof(WCHAR);
+#else
+    pathLen = strlen(path) + 1;
+    otherLen = strlen(other) + 1;
+#endif
+    copy = ckalloc(pathLen + otherLen);
+    memcpy(copy, path, pathLen);
+    memcpy(copy + pathLen, other, otherLen);
+    *temporary = copy + pathLen;
+    return copy;
+}
+
+/**
+ * Pick the format for a file from its extension. JPEG is used for
+ * names that do not end in one of the known image extensions.
+ *
+ * @return one of the VIDEO_IMAGE values.
+ */
+
+static int
+FormatFromPath(Tcl_Obj *pathPtr)
+{
+    const char *name = Tcl_GetString(pathPtr);
+
+    if (Tcl_StringCaseMatch(name, "*.png", TCL_MATCH_NOCASE))
+        return VIDEO_IMAGE_PNG;
+    if (Tcl_StringCaseMatch(name, "*.bmp", TCL_MATCH_NOCASE))
+        return VIDEO_IMAGE_BMP;
+    if (Tcl_StringCaseMatch(name, "*.ppm", TCL_MATCH_NOCASE))
+        return VIDEO_IMAGE_PPM;
+    return VIDEO_IMAGE_JPEG;
+}
+
+/**
+ * Queue the widget's staged frame to be written to a file. The format
+ * is one of the VIDEO_IMAGE values, or -1 to choose it from the file
+ * name, and the command, which may be NULL, is called with the file
+ * name and a dictionary of timings once the file is on the disk.
+ *
+ * @return a Tcl result code; the interpreter result is the file name.
+ */
+
+int
+VideoStagedFile(Video *videoPtr, Tcl_Obj *pathPtr, int format, int quality,
+                Tcl_Obj *commandPtr)
+{
+    Tcl_Interp *interp = videoPtr->interp;
+    size_t size = (size_t)videoPtr->stageWidth * videoPtr->stageHeight * 4;
+    Tcl_Obj *temporaryPtr;
+    WriterJob *jobPtr;
+    char *native, *temporary;
+    unsigned int sequence;
+
+    if (format < 0)
+        format = FormatFromPath(pathPtr);
+#ifndef HAVE_JPEG
+    if (format == VIDEO_IMAGE_JPEG) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "JPEG is not available: tkvideo was built without JPEG support", -1));
+        return TCL_ERROR;
+    }
+#endif
+#ifndef HAVE_ZLIB
+    if (format == VIDEO_IMAGE_PNG) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+            "PNG is not available: tkvideo was built without zlib", -1));
+        return TCL_ERROR;
+    }
+#endif
+
+    /* a name of its own, so that pictures of one path don't collide */
+    Tcl_MutexLock(&writer.lock);
+    sequence = ++writer.sequence;
+    Tcl_MutexUnlock(&writer.lock);
+    temporaryPtr = Tcl_ObjPrintf("%s.%u.tmp", Tcl_GetString(pathPtr), sequence);
+    Tcl_IncrRefCount(temporaryPtr);
+    native = NativeCopy(pathPtr, temporaryPtr, &temporary);
+    Tcl_DecrRefCount(temporaryPtr);
+    if (native == NULL) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("invalid file name \"%s\"",
+            Tcl_GetString(pathPtr)));
+        return TCL_ERROR;
+    }
+
+    Tcl_MutexLock(&writer.lock);
+    if (writer.outstanding >= WRITER_QUEUE) {
+        Tcl_MutexUnlock(&writer.lock);
+        ckfree(native);
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "too many pictures waiting to be written: the limit is %d", WRITER_QUEUE));
+        return TCL_ERROR;
+    }
+    if (!writer.started && WriterStart(interp) != TCL_OK) {
+        Tcl_MutexUnlock(&writer.lock);
+        ckfree(native);
+        return TCL_ERROR;
+    }
+    jobPtr = writer.freePtr;
+    if (jobPtr != NULL)
+        writer.freePtr = jobPtr->nextPtr;
+    ++writer.outstanding;
+    Tcl_MutexUnlock(&writer.lock);
+
+    if (jobPtr == NULL) {
+        jobPtr = (WriterJob *)ckalloc(sizeof(WriterJob));
+        memset(jobPtr, 0, sizeof(WriterJob));
+    }
+    if (jobPtr->pixelSize < size) {
+        unsigned char *newPtr = (unsigned char *)
+            attemptckrealloc((char *)jobPtr->pixels, size);
+        if (newPtr == NULL) {
+            Tcl_MutexLock(&writer.lock);
+            jobPtr->nextPtr = writer.freePtr;
+            writer.freePtr = jobPtr;
+            --writer.outstanding;
+            Tcl_MutexUnlock(&writer.lock);
+            ckfree(native);
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("out of memory", -1));
+            return TCL_ERROR;
+        }
+        jobPtr->pixels = newPtr;
+        jobPtr->pixelSize = size;
+    }
+    memcpy(jobPtr->pixels, videoPtr->stagePtr, size);
+
+    jobPtr->nextPtr = NULL;
+    jobPtr->format = format;
+    jobPtr->quality = quality;
+    jobPtr->width = videoPtr->stageWidth;
+    jobPtr->height = videoPtr->stageHeight;
+    jobPtr->native = native;
+    jobPtr->temporary = temporary;
+    jobPtr->interp = interp;
+    jobPtr->ownerThread = Tcl_GetCurrentThread();
+    jobPtr->pathPtr = pathPtr;
+    Tcl_IncrRefCount(pathPtr);
+    jobPtr->commandPtr = commandPtr;
+    if (commandPtr != NULL)
+        Tcl_IncrRefCount(commandPtr);
+    jobPtr->bytes = 0;
+    jobPtr->code = TCL_OK;
+    jobPtr->message[0] = '\0';
+    jobPtr->queued = VideoStatsClock();
+    Tcl_Preserve(interp);
+
+    Tcl_MutexLock(&writer.lock);
+    ++writer.encoding;
+    Tcl_MutexUnlock(&writer.lock);
+    VideoPoolSubmit(videoPtr, WriterEncodeTask, jobPtr);
+
+    Tcl_SetObjResult(interp, pathPtr);
+    return TCL_OK;
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,948 @@
+/* unixvideo.c - synthetic source platform code for the tkvideo widget
+ *
+ * This provides the platform specific code for the tkvideo widget on
+ * systems without DirectShow. The only source available is the
+ * synthetic test pattern generator (see generic/synthetic.c) which is
+ * driven from its own capture thread at the requested frame rate, in
+ * the same way that a DirectShow graph delivers samples on its own
+ * streaming thread. This lets the generic widget code be exercised and
+ * measured without any capture hardware.
+ *
+ * Widgets showing the same source share it (see generic/source.c): the
+ * capture thread belongs to the source and renders each frame once for
+ * all of them. Each widget starts, stops and pauses on its own and the
+ * thread runs while any of them is running. The position is that of
+ * the source, so seeking in one widget moves them all, and the format
+ * and frame rate can only be changed while a single widget shows it.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "tkvideo.h"
+#include "x11render.h"
+#include <stdio.h>
+
+/*
+ * Capture thread states.
+ */
+
+enum {
+    CAPTURE_STOPPED, CAPTURE_PAUSED, CAPTURE_RUNNING
+};
+
+/**
+ * A synthetic source and its capture thread, shared by the widgets
+ * showing it.
+ */
+
+typedef struct {
+    VideoSource   *sourcePtr;
+    VideoSyntheticSpec spec;
+    Tcl_ThreadId   threadId;     /* capture thread */
+    Tcl_Mutex      lock;         /* protects all the fields below */
+    Tcl_Condition  cond;         /* wakes the capture thread */
+    int            running;      /* render frames at the source rate */
+    int            cue;          /* render one frame while not running */
+    int            quit;         /* request capture thread exit */
+    Tcl_WideInt    position;     /* number of the next frame to render */
+    Tcl_WideInt    baseFrame;    /* frame number and time used to pace */
+    Tcl_WideInt    baseTime;     /*   the capture thread */
+    unsigned char *work;         /* BGRA drawing buffer for YUV sources */
+} VideoCapture;
+
+/**
+ * Platform specific data to be added to the tkvideo widget structure
+ */
+
+typedef struct {
+    Video         *videoPtr;     /* the widget that owns this data */
+    VideoRenderer *rendererPtr;  /* draws frames into the widget window */
+    VideoSource   *sourcePtr;    /* the source shown, or NULL */
+    VideoCapture  *capturePtr;   /* its capture thread */
+    int            state;        /* one of the CAPTURE_* values */
+} VideoPlatformData;
+
+static Tcl_ThreadCreateType CaptureThreadProc(ClientData clientData);
+static ClientData CaptureOpen(VideoSource *sourcePtr, Video *videoPtr, ClientData clientData);
+static void CaptureClose(ClientData clientData);
+static void ReleasePlatformData(VideoPlatformData *platformPtr);
+static int  OpenSource(Video *videoPtr, const VideoSyntheticSpec *specPtr);
+static int  ReopenSource(Video *videoPtr, const VideoSyntheticSpec *specPtr,
+                         Tcl_WideInt position);
+static void SetCaptureState(VideoPlatformData *platformPtr, int state, int force);
+static Tcl_WideInt SourcePosition(VideoCapture *capturePtr, const Tcl_WideInt *positionPtr);
+static Tcl_WideInt GetMicroseconds(void);
+static void RedrawProc(ClientData clientData);
+
+static int VideopWidgetDevicesCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int VideopWidgetControlCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int VideopWidgetSeekCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int VideopWidgetTellCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int VideopWidgetFormatCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int VideopWidgetFramerateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+static int VideopWidgetInvalidCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
+
+struct Ensemble {
+    const char *name;          /* subcommand name */
+    Tcl_ObjCmdProc *command;   /* subcommand implementation OR */
+    struct Ensemble *ensemble; /* subcommand ensemble */
+};
+
+static struct Ensemble VideoWidgetEnsemble[] = {
+    { "configure",    VideopWidgetInvalidCmd,  NULL },  /* we need to list the platform independent */
+    { "cget",         VideopWidgetInvalidCmd,  NULL },  /* widget commands so that they appear in   */
+    { "xview",        VideopWidgetInvalidCmd,  NULL },  /* the list when an error is returned       */
+    { "yview",        VideopWidgetInvalidCmd,  NULL },  /*                                          */
+    { "devices",      VideopWidgetDevicesCmd,  NULL },
+    { "start",        VideopWidgetControlCmd,  NULL },
+    { "stop",         VideopWidgetControlCmd,  NULL },
+    { "pause",        VideopWidgetControlCmd,  NULL },
+    { "seek",         VideopWidgetSeekCmd,     NULL },
+    { "tell",         VideopWidgetTellCmd,     NULL },
+    { "stats",        VideopWidgetInvalidCmd,  NULL },
+    { "stream",       VideopWidgetInvalidCmd,  NULL },
+    { "clip",         VideopWidgetInvalidCmd,  NULL },
+    { "motion",       VideopWidgetInvalidCmd,  NULL },
+    { "picture",      VideopWidgetInvalidCmd,  NULL },
+    { "overlay",      VideopWidgetInvalidCmd,  NULL },
+    { "format",       VideopWidgetFormatCmd,   NULL },
+    { "framerate",    VideopWidgetFramerateCmd, NULL },
+    { NULL, NULL, NULL }
+};
+
+/**
+ * Platform specific package initialization. Nothing is required here.
+ * @return A tcl result code.
+ */
+
+int
+VideopInit(Tcl_Interp *interp)
+{
+    return TCL_OK;
+}
+
+/**
+ * Platform specific widget initialization. This function is called
+ * just after the Tk widget has been created and the core data
+ * structure initialized.
+ *
+ * @param videoPtr pointer to the widget instance data
+ */
+
+int
+VideopCreateWidget(Video *videoPtr)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)ckalloc(sizeof(VideoPlatformData));
+    memset(platformPtr, 0, sizeof(VideoPlatformData));
+    platformPtr->videoPtr = videoPtr;
+    videoPtr->platformData = (ClientData)platformPtr;
+    videoPtr->drawFrames = 1;
+    return TCL_OK;
+}
+
+/**
+ * Platform specific cleanup. Called once the Tk window has been
+ * destroyed to release the memory allocated in VideopCreateWidget.
+ *
+ * @param memPtr pointer to the widget instance data
+ */
+
+void
+VideopCleanup(char *memPtr)
+{
+    Video *videoPtr = (Video *)memPtr;
+    if (videoPtr->platformData != NULL) {
+        VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+        ReleasePlatformData(platformPtr);
+        ckfree((char *)platformPtr);
+        videoPtr->platformData = NULL;
+    }
+}
+
+/**
+ * Platform specific window destruction. Called just before the Tk
+ * window is destroyed. The capture thread is shut down here.
+ */
+
+void
+VideopDestroy(Video *videoPtr)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    if (VideoRecordStop(videoPtr) != TCL_OK) {
+        Tcl_BackgroundError(videoPtr->interp);
+    }
+    VideoPrerollStop(videoPtr);
+    ReleasePlatformData(platformPtr);
+    if (platformPtr->rendererPtr != NULL) {
+        VideoRendererDestroy(platformPtr->rendererPtr);
+        platformPtr->rendererPtr = NULL;
+    }
+}
+
+/**
+ * Called when the video source or the output file has been changed. Any
+ * recording is completed, any pre-roll released and the widget is
+ * detached from its source and attached to the newly configured one,
+ * which is opened unless another widget already shows it. The widget is
+ * left stopped. Recording to the -output file and keeping the -preroll
+ * begin when it is started.
+ */
+
+int
+VideopInitializeSource(Video *videoPtr)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    VideoSyntheticSpec spec;
+    const char *source = Tcl_GetString(videoPtr->sourcePtr);
+
+    if (VideoRecordStop(videoPtr) != TCL_OK) {
+        Tcl_BackgroundError(videoPtr->interp);
+    }
+    VideoPrerollStop(videoPtr);
+    ReleasePlatformData(platformPtr);
+    videoPtr->videoWidth = videoPtr->videoHeight = 0;
+
+    if (*source == 0) {
+        return TCL_OK;
+    }
+    if (VideoSyntheticParse(videoPtr->interp, source, &spec) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    return OpenSource(videoPtr, &spec);
+}
+
+/*
+ * Attach the widget to the source, which is opened if no other widget
+ * shows it. The widget starts out stopped.
+ */
+
+static int
+OpenSource(Video *videoPtr, const VideoSyntheticSpec *specPtr)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    VideoFrame frame;
+    size_t cbFrame = VideoFrameLayout(&frame, specPtr->format,
+                                      specPtr->width, specPtr->height, NULL);
+    Tcl_Obj *nameObj = VideoSyntheticName(specPtr);
+
+    Tcl_IncrRefCount(nameObj);
+    platformPtr->sourcePtr = VideoSourceAttach(videoPtr, Tcl_GetString(nameObj), cbFrame,
+                                               CaptureOpen, CaptureClose,
+                                               (ClientData)specPtr);
+    Tcl_DecrRefCount(nameObj);
+    if (platformPtr->sourcePtr == NULL) {
+        return TCL_ERROR;
+    }
+    platformPtr->capturePtr = (VideoCapture *)VideoSourceData(platformPtr->sourcePtr);
+    platformPtr->state = CAPTURE_STOPPED;
+    videoPtr->videoWidth = specPtr->width;
+    videoPtr->videoHeight = specPtr->height;
+    return TCL_OK;
+}
+
+/*
+ * Reopen the widget's source with a new size or rate, in the same state
+ * and at the given position. If the new source cannot be opened, for
+ * want of memory for its frames, the old one is opened again as it was
+ * and the error for the new one is left in the interpreter.
+ */
+
+static int
+ReopenSource(Video *videoPtr, const VideoSyntheticSpec *specPtr, Tcl_WideInt position)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    VideoSyntheticSpec oldSpec = platformPtr->capturePtr->spec;
+    Tcl_WideInt oldPosition = SourcePosition(platformPtr->capturePtr, NULL);
+    int state = platformPtr->state;
+    Tcl_Obj *errorObj;
+
+    ReleasePlatformData(platformPtr);
+    if (OpenSource(videoPtr, specPtr) == TCL_OK) {
+        SourcePosition(platformPtr->capturePtr, &position);
+        SetCaptureState(platformPtr, state, 0);
+        return TCL_OK;
+    }
+    errorObj = Tcl_GetObjResult(videoPtr->interp);
+    Tcl_IncrRefCount(errorObj);
+    if (OpenSource(videoPtr, &oldSpec) == TCL_OK) {
+        SourcePosition(platformPtr->capturePtr, &oldPosition);
+        SetCaptureState(platformPtr, state, 0);
+    }
+    Tcl_SetObjResult(videoPtr->interp, errorObj);
+    Tcl_DecrRefCount(errorObj);
+    return TCL_ERROR;
+}
+
+/*
+ * Open a source for the first widget to show it: allocate the drawing
+ * buffer and start a capture thread, which waits until a widget is
+ * started or paused.
+ */
+
+static ClientData
+CaptureOpen(VideoSource *sourcePtr, Video *videoPtr, ClientData clientData)
+{
+    const VideoSyntheticSpec *specPtr = (const VideoSyntheticSpec *)clientData;
+    VideoCapture *capturePtr = (VideoCapture *)ckalloc(sizeof(VideoCapture));
+
+    memset(capturePtr, 0, sizeof(VideoCapture));
+    capturePtr->sourcePtr = sourcePtr;
+    capturePtr->spec = *specPtr;
+    if (specPtr->format != VIDEO_FORMAT_BGRA) {
+        capturePtr->work = (unsigned char *)attemptckalloc(
+            (size_t)specPtr->width * specPtr->height * 4);
+        if (capturePtr->work == NULL) {
+            ckfree((char *)capturePtr);
+            Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+                "failed to initialize video source: out of memory", -1));
+            return NULL;
+        }
+    }
+    if (Tcl_CreateThread(&capturePtr->threadId, CaptureThreadProc,
+            (ClientData)capturePtr, TCL_THREAD_STACK_DEFAULT,
+            TCL_THREAD_JOINABLE) != TCL_OK) {
+        if (capturePtr->work != NULL) {
+            ckfree((char *)capturePtr->work);
+        }
+        ckfree((char *)capturePtr);
+        Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+            "failed to initialize video source: cannot create capture thread", -1));
+        return NULL;
+    }
+    return (ClientData)capturePtr;
+}
+
+/*
+ * Close a source once the last widget has left it: stop the capture
+ * thread and release the drawing buffer.
+ */
+
+static void
+CaptureClose(ClientData clientData)
+{
+    VideoCapture *capturePtr = (VideoCapture *)clientData;
+    int result;
+
+    Tcl_MutexLock(&capturePtr->lock);
+    capturePtr->quit = 1;
+    Tcl_ConditionNotify(&capturePtr->cond);
+    Tcl_MutexUnlock(&capturePtr->lock);
+    Tcl_JoinThread(capturePtr->threadId, &result);
+    if (capturePtr->work != NULL) {
+        ckfree((char *)capturePtr->work);
+    }
+    Tcl_ConditionFinalize(&capturePtr->cond);
+    Tcl_MutexFinalize(&capturePtr->lock);
+    ckfree((char *)capturePtr);
+}
+
+/*
+ * Detach the widget from its source, closing it if no other widget
+ * shows it.
+ */
+
+static void
+ReleasePlatformData(VideoPlatformData *platformPtr)
+{
+    if (platformPtr->sourcePtr != NULL) {
+        VideoSource *sourcePtr = platformPtr->sourcePtr;
+
+        if (VideoSourceAccept(sourcePtr, platformPtr->videoPtr,
+                              VIDEO_ACCEPT_NONE, 0) != VIDEO_ACCEPT_ALL) {
+            VideoCapture *capturePtr = platformPtr->capturePtr;
+            Tcl_MutexLock(&capturePtr->lock);
+            capturePtr->running = 0;
+            Tcl_MutexUnlock(&capturePtr->lock);
+        }
+        platformPtr->sourcePtr = NULL;
+        platformPtr->capturePtr = NULL;
+        VideoSourceDetach(sourcePtr, platformPtr->videoPtr);
+    }
+    platformPtr->state = CAPTURE_STOPPED;
+}
+
+/*
+ * The capture thread of a source. Frames are rendered into a free slot
+ * of the frame ring, outside the lock, and then published to the widgets
+ * accepting them and their sinks. If the widgets hold every other slot
+ * the frame is skipped, as a capture device drops frames when its
+ * buffers are full. Frames are paced against an absolute schedule so
+ * the rate does not drift; if rendering falls behind by more than a
+ * frame the schedule is restarted rather than bursting to catch up.
+ */
+
+static Tcl_ThreadCreateType
+CaptureThreadProc(ClientData clientData)
+{
+    VideoCapture *capturePtr = (VideoCapture *)clientData;
+    const double interval = 1000000.0 / capturePtr->spec.rate;
+    VideoFrame *framePtr;
+    Tcl_WideInt sequence;
+
+    Tcl_MutexLock(&capturePtr->lock);
+    while (!capturePtr->quit) {
+        if (capturePtr->running) {
+            Tcl_WideInt now = GetMicroseconds();
+            Tcl_WideInt due = capturePtr->baseTime + (Tcl_WideInt)
+                ((capturePtr->position - capturePtr->baseFrame) * interval);
+            if (now < due) {
+                Tcl_Time wait;
+                wait.sec = (long)((due - now) / 1000000);
+                wait.usec = (long)((due - now) % 1000000);
+                Tcl_ConditionWait(&capturePtr->cond, &capturePtr->lock, &wait);
+                continue;
+            }
+            if (now - due > (Tcl_WideInt)interval) {
+                capturePtr->baseTime = now;
+                capturePtr->baseFrame = capturePtr->position;
+            }
+        } else if (!capturePtr->cue) {
+            Tcl_ConditionWait(&capturePtr->cond, &capturePtr->lock, NULL);
+            continue;
+        }
+
+        capturePtr->cue = 0;
+        sequence = capturePtr->position++;
+        Tcl_MutexUnlock(&capturePtr->lock);
+
+        framePtr = VideoSourceBeginFrame(capturePtr->sourcePtr);
+        if (framePtr != NULL) {
+            VideoFrameLayout(framePtr, capturePtr->spec.format, capturePtr->spec.width,
+                             capturePtr->spec.height, framePtr->data);
+            framePtr->sequence = sequence;
+            framePtr->timestamp = (Tcl_WideInt)(sequence * interval);
+            VideoSyntheticRender(framePtr, capturePtr->work);
+            VideoSourcePublish(capturePtr->sourcePtr);
+        }
+
+        Tcl_MutexLock(&capturePtr->lock);
+    }
+    Tcl_MutexUnlock(&capturePtr->lock);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Set the state of a widget and run the source if any of its widgets is
+ * running. A widget paused before it has shown a frame is cued one, as a
+ * paused graph shows the first frame, and force cues one regardless, as
+ * after a seek.
+ */
+
+static void
+SetCaptureState(VideoPlatformData *platformPtr, int state, int force)
+{
+    VideoCapture *capturePtr = platformPtr->capturePtr;
+    int accept = VIDEO_ACCEPT_NONE, most;
+
+    if (state == CAPTURE_RUNNING) {
+        accept = VIDEO_ACCEPT_ALL;
+    } else if (state == CAPTURE_PAUSED || force) {
+        accept = VIDEO_ACCEPT_ONE;
+    }
+    platformPtr->state = state;
+    most = VideoSourceAccept(platformPtr->sourcePtr, platformPtr->videoPtr, accept, force);
+
+    Tcl_MutexLock(&capturePtr->lock);
+    if (most == VIDEO_ACCEPT_ALL && !capturePtr->running) {
+        capturePtr->baseTime = GetMicroseconds();
+        capturePtr->baseFrame = capturePtr->position;
+    }
+    capturePtr->running = (most == VIDEO_ACCEPT_ALL);
+    if (most == VIDEO_ACCEPT_ONE) {
+        capturePtr->cue = 1;
+    }
+    Tcl_ConditionNotify(&capturePtr->cond);
+    Tcl_MutexUnlock(&capturePtr->lock);
+}
+
+/*
+ * Read the position of a source, the number of its next frame, setting
+ * it first if positionPtr is not NULL.
+ */
+
+static Tcl_WideInt
+SourcePosition(VideoCapture *capturePtr, const Tcl_WideInt *positionPtr)
+{
+    Tcl_WideInt position;
+
+    Tcl_MutexLock(&capturePtr->lock);
+    if (positionPtr != NULL) {
+        capturePtr->position = *positionPtr;
+        capturePtr->baseFrame = *positionPtr;
+    }
+    position = capturePtr->position;
+    Tcl_MutexUnlock(&capturePtr->lock);
+    return position;
+}
+
+static Tcl_WideInt
+GetMicroseconds(void)
+{
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (Tcl_WideInt)now.sec * 1000000 + now.usec;
+}
+
+void
+VideopCalculateGeometry(Video *videoPtr)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+
+    /* frames are positioned as they are drawn in VideopDisplay */
+    if (platformPtr != NULL && platformPtr->rendererPtr != NULL) {
+        VideoRendererInvalidate(platformPtr->rendererPtr);
+    }
+}
+
+/**
+ * Draw the latest frame into the widget window. With -stretch the frame
+ * is scaled to fill the window. Otherwise it is placed according to the
+ * -anchor option and the scroll offset, as the DirectShow video window
+ * is on Windows, and clipped to the window.
+ *
+ * @param videoPtr [in] pointer to the widget instance data
+ * @param d [in] the widget window
+ * @param rectPtr [out] set to the area of the window covered by the frame
+ *
+ * @return 1 if a frame was drawn, 0 if there is nothing to show.
+ */
+
+int
+VideopDisplay(Video *videoPtr, Drawable d, XRectangle *rectPtr)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    Tk_Window tkwin = videoPtr->tkwin;
+    VideoBuffer *bufferPtr;
+    int x = 0, y = 0, srcX = 0, srcY = 0, width, height, drawn = 0;
+
+    if (platformPtr->sourcePtr == NULL) {
+        return 0;
+    }
+    if (platformPtr->rendererPtr == NULL) {
+        platformPtr->rendererPtr = VideoRendererCreate(videoPtr->tkwin, RedrawProc,
+                                                       (ClientData)videoPtr);
+        if (platformPtr->rendererPtr == NULL) {
+            return 0;
+        }
+    }
+
+    if (videoPtr->stretch) {
+        width = Tk_Width(tkwin);
+        height = Tk_Height(tkwin);
+    } else {
+        VideoComputeAnchor(videoPtr->anchor, tkwin, 0, 0,
+                           videoPtr->videoWidth, videoPtr->videoHeight, &x, &y);
+        if (videoPtr->offset.x > 0) x = -videoPtr->offset.x;
+        if (videoPtr->offset.y > 0) y = -videoPtr->offset.y;
+        if (x < 0) { srcX = -x; x = 0; }
+        if (y < 0) { srcY = -y; y = 0; }
+        width = videoPtr->videoWidth - srcX;
+        height = videoPtr->videoHeight - srcY;
+        if (width > Tk_Width(tkwin) - x) width = Tk_Width(tkwin) - x;
+        if (height > Tk_Height(tkwin) - y) height = Tk_Height(tkwin) - y;
+    }
+    if (width <= 0 || height <= 0) {
+        return 0;
+    }
+
+    bufferPtr = VideoRingNewest(videoPtr->ringPtr);
+    if (bufferPtr != NULL) {
+        const VideoFrame *framePtr = VideoBufferFrame(bufferPtr);
+        VideoStats *statsPtr = videoPtr->statsPtr;
+        Tcl_WideInt start = VideoStatsFrame(statsPtr, framePtr);
+
+        VideoStatsCount(statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_DISPLAY_IN, 1);
+        drawn = VideoRendererDraw(platformPtr->rendererPtr, d, framePtr, videoPtr->overlayPtr,
+                                  videoPtr->stretch ? width : framePtr->width,
+                                  videoPtr->stretch ? height : framePtr->height,
+                                  srcX, srcY, x, y, width, height);
+        VideoBufferRelease(bufferPtr);
+        if (drawn) {
+            VideoStatsCount(statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_CONVERT_OUT, 1);
+            VideoStatsCount(statsPtr, VIDEO_STATS_WIDGET, VIDEO_STAT_DISPLAY_OUT, 1);
+            VideoStatsLatency(statsPtr, VIDEO_STATS_WIDGET, VIDEO_LATENCY_CONVERT_DISPLAY,
+                              VideoStatsClock() - start);
+        }
+    }
+
+    if (drawn) {
+        rectPtr->x = x;
+        rectPtr->y = y;
+        rectPtr->width = width;
+        rectPtr->height = height;
+    }
+    return drawn;
+}
+
+static void
+RedrawProc(ClientData clientData)
+{
+    VideoRedrawFrame((Video *)clientData);
+}
+
+/**
+ * A mosaic (see generic/mosaic.c) presents its back buffer through a
+ * renderer of its own. The buffer is the size of the window, so it is
+ * never scaled.
+ */
+
+ClientData
+VideopPresenterCreate(Tk_Window tkwin, Tcl_IdleProc *redrawProc, ClientData clientData)
+{
+    return (ClientData)VideoRendererCreate(tkwin, redrawProc, clientData);
+}
+
+int
+VideopPresent(ClientData presenter, Drawable d, const VideoFrame *framePtr)
+{
+    return VideoRendererDraw((VideoRenderer *)presenter, d, framePtr, NULL,
+                             framePtr->width, framePtr->height, 0, 0, 0, 0,
+                             framePtr->width, framePtr->height);
+}
+
+void
+VideopPresenterDestroy(ClientData presenter)
+{
+    VideoRendererDestroy((VideoRenderer *)presenter);
+}
+
+/**
+ * The overlay is blended into each frame as it is drawn, so there is
+ * nothing to do here beyond the redraw the generic code arranges.
+ */
+
+int
+VideopUpdateOverlay(Video *videoPtr)
+{
+    return TCL_OK;
+}
+
+int
+VideopWidgetObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    struct Ensemble *ensemble = VideoWidgetEnsemble;
+    int optPtr = 1;
+    int index;
+
+    if (videoPtr->platformData == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("platform data not initialized yet", -1));
+        return TCL_ERROR;
+    }
+
+    while (optPtr < objc) {
+        if (Tcl_GetIndexFromObjStruct(interp, objv[optPtr], ensemble, sizeof(ensemble[0]), "command", 0, &index) != TCL_OK)
+        {
+            return TCL_ERROR;
+        }
+
+        if (ensemble[index].command) {
+            return ensemble[index].command(clientData, interp, objc, objv);
+        }
+        ensemble = ensemble[index].ensemble;
+        ++optPtr;
+    }
+    Tcl_WrongNumArgs(interp, optPtr, objv, "option ?arg arg...?");
+    return TCL_ERROR;
+}
+
+static int
+VideopWidgetInvalidCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_SetResult(interp, "invalid command: you should never see this", TCL_STATIC);
+    return TCL_ERROR;
+}
+
+/*
+ * There are no capture devices on this platform. The command is kept so
+ * that scripts written for Windows can still enumerate sources.
+ */
+
+static int
+VideopWidgetDevicesCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    if (objc < 2 || objc > 3
+        || (objc == 3 && strcmp("audio", Tcl_GetString(objv[2])) != 0
+            && strcmp("video", Tcl_GetString(objv[2])) != 0)) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?video | audio?");
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewListObj(0, NULL));
+    return TCL_OK;
+}
+
+static int
+VideopWidgetControlCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    int index = 0, preroll = 0;
+
+    static const char *options[] = { "start", "stop", "pause", NULL };
+    enum {Video_Start, Video_Stop, Video_Pause};
+    static const int states[] = { CAPTURE_RUNNING, CAPTURE_STOPPED, CAPTURE_PAUSED };
+
+    if (Tcl_GetIndexFromObj(interp, objv[1], options, "command", 0, &index) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (platformPtr->sourcePtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("error: no video source initialized", -1));
+        return TCL_ERROR;
+    }
+
+    Tcl_ResetResult(interp);
+    if (index == Video_Start && videoPtr->prerollPtr == NULL) {
+        if (VideoPrerollStart(videoPtr, platformPtr->capturePtr->spec.rate) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        preroll = 1;
+    }
+    if (index == Video_Start && videoPtr->recordPtr == NULL
+        && *Tcl_GetString(videoPtr->outputPtr) != 0
+        && VideoRecordStart(videoPtr, platformPtr->capturePtr->spec.rate) != TCL_OK) {
+        if (preroll) {
+            VideoPrerollStop(videoPtr);     /* started here, so undo it */
+        }
+        return TCL_ERROR;
+    }
+    SetCaptureState(platformPtr, states[index], 0);
+    if (index == Video_Stop) {
+        VideoPrerollStop(videoPtr);
+        return VideoRecordStop(videoPtr);
+    }
+    return TCL_OK;
+}
+
+/*
+ * Synthetic sources are unbounded so the stop position and the duration
+ * are reported as 0.
+ */
+
+static int
+VideopWidgetTellCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    VideoCapture *capturePtr = platformPtr->capturePtr;
+    Tcl_WideInt position;
+    Tcl_Obj *resObj;
+
+    if (objc != 2) {
+        Tcl_WrongNumArgs(interp, 2, objv, "");
+        return TCL_ERROR;
+    }
+    if (platformPtr->sourcePtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("error: no video source initialized", -1));
+        return TCL_ERROR;
+    }
+
+    Tcl_MutexLock(&capturePtr->lock);
+    position = (Tcl_WideInt)(capturePtr->position * 1000.0 / capturePtr->spec.rate);
+    Tcl_MutexUnlock(&capturePtr->lock);
+
+    resObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(position));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(0));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(0));
+    Tcl_SetObjResult(interp, resObj);
+    return TCL_OK;
+}
+
+static int
+VideopWidgetSeekCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    VideoCapture *capturePtr;
+    Tcl_WideInt t = 0;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "position");
+        return TCL_ERROR;
+    }
+    if (platformPtr->sourcePtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("error: no video source initialized", -1));
+        return TCL_ERROR;
+    }
+    if (Tcl_GetWideIntFromObj(interp, objv[2], &t) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (t < 0) {
+        t = 0;
+    }
+
+    capturePtr = platformPtr->capturePtr;
+    Tcl_MutexLock(&capturePtr->lock);
+    capturePtr->position = (Tcl_WideInt)(t * capturePtr->spec.rate / 1000.0);
+    capturePtr->baseTime = GetMicroseconds();
+    capturePtr->baseFrame = capturePtr->position;
+    Tcl_MutexUnlock(&capturePtr->lock);
+    if (platformPtr->state != CAPTURE_RUNNING) {
+        SetCaptureState(platformPtr, platformPtr->state, 1);
+    }
+
+    Tcl_ResetResult(interp);
+    return TCL_OK;
+}
+
+/*
+ * Report or change the synthetic frame size. Changing the size reopens
+ * the source, which is only possible while no other widget shows it, in
+ * the same state and at the same position. If the new size cannot be
+ * opened the widget keeps the old one.
+ */
+
+static int
+VideopWidgetFormatCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    VideoSyntheticSpec spec;
+    int r = TCL_OK;
+
+    if (objc < 2 || objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?format?");
+        return TCL_ERROR;
+    }
+    if (platformPtr->sourcePtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("error: no video source initialized", -1));
+        return TCL_ERROR;
+    }
+
+    spec = platformPtr->capturePtr->spec;
+    if (objc == 3) {
+        Tcl_Obj *specObj;
+        if (VideoSourceViews(platformPtr->sourcePtr) > 1) {
+            Tcl_SetResult(interp, "cannot change the format of a shared source", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (videoPtr->recordPtr != NULL) {
+            Tcl_SetResult(interp, "cannot change the format while recording", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (videoPtr->prerollPtr != NULL) {
+            Tcl_SetResult(interp, "cannot change the format while keeping a pre-roll",
+                          TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (sscanf(Tcl_GetString(objv[2]), "%dx%d", &spec.width, &spec.height) != 2) {
+            Tcl_SetResult(interp, "invalid format: must be WxH", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        specObj = Tcl_ObjPrintf("synthetic:%dx%d@%g", spec.width, spec.height, spec.rate);
+        Tcl_IncrRefCount(specObj);
+        r = VideoSyntheticParse(interp, Tcl_GetString(specObj), &spec);
+        Tcl_DecrRefCount(specObj);
+        if (r != TCL_OK) {
+            return r;
+        }
+        spec.format = platformPtr->capturePtr->spec.format;
+
+        r = ReopenSource(videoPtr, &spec, SourcePosition(platformPtr->capturePtr, NULL));
+        if (r == TCL_OK) {
+            SendConfigureEvent(videoPtr->tkwin, 0, 0, spec.width, spec.height);
+        }
+    }
+    if (r == TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("%dx%d", spec.width, spec.height));
+    }
+    return r;
+}
+
+static int
+VideopWidgetFramerateCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Video *videoPtr = (Video *)clientData;
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    double rate;
+
+    if (objc < 2 || objc > 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?rate?");
+        return TCL_ERROR;
+    }
+    if (platformPtr->sourcePtr == NULL) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("error: no video source initialized", -1));
+        return TCL_ERROR;
+    }
+
+    if (objc == 3) {
+        VideoSyntheticSpec spec = platformPtr->capturePtr->spec;
+        Tcl_WideInt position;
+
+        if (Tcl_GetDoubleFromObj(interp, objv[2], &rate) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (VideoSourceViews(platformPtr->sourcePtr) > 1) {
+            Tcl_SetResult(interp, "cannot change the frame rate of a shared source",
+                          TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (videoPtr->recordPtr != NULL) {
+            Tcl_SetResult(interp, "cannot change the frame rate while recording", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (videoPtr->prerollPtr != NULL) {
+            Tcl_SetResult(interp, "cannot change the frame rate while keeping a pre-roll",
+                          TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (!(rate > 0.0 && rate <= 1000.0)) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+                "invalid frame rate %g: must be greater than 0 and at most 1000", rate));
+            return TCL_ERROR;
+        }
+        position = (Tcl_WideInt)(SourcePosition(platformPtr->capturePtr, NULL)
+                                 * rate / spec.rate);
+        spec.rate = rate;
+        if (ReopenSource(videoPtr, &spec, position) != TCL_OK) {
+            return TCL_ERROR;
+        }
+    }
+    Tcl_SetObjResult(interp, Tcl_NewDoubleObj(platformPtr->capturePtr->spec.rate));
+    return TCL_OK;
+}
+
+/**
+ * Convert the latest frame into the widget staging buffer. The frame is
+ * read in place from the ring, and the reference held on it keeps the
+ * capture thread out of its slot until it is released.
+ *
+ * @param videoPtr [in] pointer to the widget instance data
+ *
+ * @return TCL_OK on success. On failure TCL_ERROR and the interpreter
+ *  result is set to describe the error.
+ */
+
+int
+VideopGrabFrame(Video *videoPtr)
+{
+    VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
+    VideoBuffer *bufferPtr;
+    int r;
+
+    if (platformPtr->sourcePtr == NULL) {
+        Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+            "error: no video source initialized", -1));
+        return TCL_ERROR;
+    }
+
+    bufferPtr = VideoRingNewest(videoPtr->ringPtr);
+    if (bufferPtr == NULL) {
+        Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj(
+            "image capture failed: no samples are being buffered", -1));
+        return TCL_ERROR;
+    }
+    r = VideoStageFrame(videoPtr, VideoBufferFrame(bufferPtr));
+    VideoBufferRelease(bufferPtr);
+    return r;
+}
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
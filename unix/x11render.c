@@ -0,0 +1,529 @@
+/* x11render.c - X11 frame renderer for the tkvideo widget
+ *
+ * Draws frames straight into a window, for a tkvideo widget or a
+ * mosaic. When the X server supports the MIT-SHM extension each frame
+ * is copied into one of two shared memory XImages and sent with
+ * XShmPutImage, so the pixels never pass through the X protocol stream.
+ * An image stays busy until the server reports that it has finished
+ * reading it. The next frame goes into the other image, and a frame
+ * that arrives while both are busy is dropped and redrawn once the
+ * server catches up, so neither the widget thread nor the capture
+ * thread ever waits for the server.
+ *
+ * Without MIT-SHM, for instance on a remote display, a single ordinary
+ * XImage is sent with XPutImage.
+ *
+ * The images may be a different size from the frame, for -stretch, in
+ * which case the frame is scaled as it is copied into the image.
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#include "x11render.h"
+#include <X11/Xutil.h>
+#ifdef HAVE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
+
+#define RENDER_IMAGES 2
+
+/*
+ * How frame pixels are written into the XImage.
+ */
+
+enum {
+    PIXEL_BGRX,     /* 32 bit image with the same byte layout as the frame */
+    PIXEL_RGBX,     /* 32 bit image with red and blue exchanged */
+    PIXEL_GENERIC,  /* anything else, one XPutPixel per pixel */
+};
+
+typedef struct {
+    XImage *imagePtr;
+    int     busy;             /* the server has not finished with it */
+#ifdef HAVE_XSHM
+    XShmSegmentInfo shminfo;
+#endif
+} RenderImage;
+
+struct VideoRenderer {
+    Tk_Window  tkwin;
+    Tcl_IdleProc *redrawProc; /* asks the owner to draw the latest frame */
+    ClientData clientData;
+    Display   *display;
+    GC         gc;
+    int        useShm;        /* shared memory images are in use */
+    int        completionType;/* event type of ShmCompletion events */
+    int        dropped;       /* a frame was dropped while both were busy */
+    int        width;         /* size of the images */
+    int        height;
+    int        next;          /* image to try first for the next frame */
+    int        pixelFormat;   /* one of the PIXEL_* values */
+    VideoScaler *scalerPtr;   /* scales frames of a different size */
+    unsigned char *work[2];   /* converted and scaled copies of a frame */
+    size_t     workSize[2];
+    RenderImage images[RENDER_IMAGES];
+};
+
+static int  CreateImages(VideoRenderer *rendererPtr, int width, int height);
+static void DestroyImages(VideoRenderer *rendererPtr);
+static void CopyFrame(VideoRenderer *rendererPtr, const VideoFrame *framePtr,
+                      const VideoOverlay *overlayPtr, XImage *imagePtr);
+static unsigned char *GetWork(VideoRenderer *rendererPtr, int index, int width, int height);
+#ifdef HAVE_XSHM
+static int  CreateShmImage(VideoRenderer *rendererPtr, RenderImage *p,
+                           int width, int height);
+static int  CompletionProc(ClientData clientData, XEvent *eventPtr);
+static int  AttachErrorProc(ClientData clientData, XErrorEvent *errEventPtr);
+#endif
+
+/**
+ * Create a renderer for a window, which must exist. redrawProc is
+ * called with clientData when a frame that was dropped because the
+ * server was busy should be drawn again.
+ *
+ * @return the new renderer, or NULL if it could not be allocated.
+ */
+
+VideoRenderer *
+VideoRendererCreate(Tk_Window tkwin, Tcl_IdleProc *redrawProc, ClientData clientData)
+{
+    VideoRenderer *rendererPtr;
+    XGCValues values;
+
+    rendererPtr = (VideoRenderer *)attemptckalloc(sizeof(VideoRenderer));
+    if (rendererPtr == NULL) {
+        return NULL;
+    }
+    memset(rendererPtr, 0, sizeof(VideoRenderer));
+    rendererPtr->tkwin = tkwin;
+    rendererPtr->redrawProc = redrawProc;
+    rendererPtr->clientData = clientData;
+    rendererPtr->display = Tk_Display(tkwin);
+    values.graphics_exposures = False;
+    rendererPtr->gc = Tk_GetGC(tkwin, GCGraphicsExposures, &values);
+    rendererPtr->scalerPtr = VideoScalerCreate();
+
+#ifdef HAVE_XSHM
+    if (XShmQueryExtension(rendererPtr->display)) {
+        rendererPtr->useShm = 1;
+        rendererPtr->completionType =
+            XShmGetEventBase(rendererPtr->display) + ShmCompletion;
+        Tk_CreateGenericHandler(CompletionProc, (ClientData)rendererPtr);
+    }
+#endif
+    return rendererPtr;
+}
+
+/**
+ * Release the images and the renderer itself.
+ */
+
+void
+VideoRendererDestroy(VideoRenderer *rendererPtr)
+{
+    int n;
+
+#ifdef HAVE_XSHM
+    if (rendererPtr->completionType != 0) {
+        Tk_DeleteGenericHandler(CompletionProc, (ClientData)rendererPtr);
+    }
+#endif
+    DestroyImages(rendererPtr);
+    Tk_FreeGC(rendererPtr->display, rendererPtr->gc);
+    VideoScalerDestroy(rendererPtr->scalerPtr);
+    for (n = 0; n < 2; ++n) {
+        if (rendererPtr->work[n] != NULL) {
+            ckfree((char *)rendererPtr->work[n]);
+        }
+    }
+    ckfree((char *)rendererPtr);
+}
+
+/**
+ * Called when the window is reconfigured. The scaling tables are only
+ * rebuilt after this or when the frame size changes.
+ */
+
+void
+VideoRendererInvalidate(VideoRenderer *rendererPtr)
+{
+    VideoScalerInvalidate(rendererPtr->scalerPtr);
+}
+
+/**
+ * Draw part of a frame into a drawable. The frame is copied into a free
+ * image of imageWidth by imageHeight pixels, scaling it if that is not
+ * the frame size, and the region of the image starting at srcX,srcY is
+ * sent to the server to be drawn at dstX,dstY. Any overlay is blended
+ * over the frame. The caller must keep the frame data valid for the
+ * duration of the call only.
+ *
+ * @return 1 if the frame was drawn or will be redrawn once an image is
+ *  free, 0 if no image could be created.
+ */
+
+int
+VideoRendererDraw(VideoRenderer *rendererPtr, Drawable d,
+                  const VideoFrame *framePtr, const VideoOverlay *overlayPtr,
+                  int imageWidth, int imageHeight,
+                  int srcX, int srcY, int dstX, int dstY, int width, int height)
+{
+    RenderImage *p = NULL;
+    int n;
+
+    if ((imageWidth != framePtr->width || imageHeight != framePtr->height)
+        && VideoScalerSetup(rendererPtr->scalerPtr, framePtr->width, framePtr->height,
+                            imageWidth, imageHeight) != TCL_OK) {
+        return 0;
+    }
+    if (imageWidth != rendererPtr->width
+        || imageHeight != rendererPtr->height
+        || rendererPtr->images[0].imagePtr == NULL) {
+        if (CreateImages(rendererPtr, imageWidth, imageHeight) != TCL_OK) {
+            return 0;
+        }
+    }
+
+    for (n = 0; n < RENDER_IMAGES; ++n) {
+        int index = (rendererPtr->next + n) % RENDER_IMAGES;
+        if (rendererPtr->images[index].imagePtr != NULL
+            && !rendererPtr->images[index].busy) {
+            p = &rendererPtr->images[index];
+            rendererPtr->next = (index + 1) % RENDER_IMAGES;
+            break;
+        }
+    }
+    if (p == NULL) {
+        rendererPtr->dropped = 1;
+        return 1;
+    }
+
+    CopyFrame(rendererPtr, framePtr, overlayPtr, p->imagePtr);
+#ifdef HAVE_XSHM
+    if (rendererPtr->useShm) {
+        XShmPutImage(rendererPtr->display, d, rendererPtr->gc, p->imagePtr,
+                     srcX, srcY, dstX, dstY, width, height, True);
+        p->busy = 1;
+        XFlush(rendererPtr->display);
+        return 1;
+    }
+#endif
+    XPutImage(rendererPtr->display, d, rendererPtr->gc, p->imagePtr,
+              srcX, srcY, dstX, dstY, width, height);
+    return 1;
+}
+
+/*
+ * (Re)create the images for a new frame size. If shared memory images
+ * cannot be created the renderer falls back to a single plain image.
+ */
+
+static int
+CreateImages(VideoRenderer *rendererPtr, int width, int height)
+{
+    Display *display = rendererPtr->display;
+    XImage *imagePtr;
+    int n;
+
+    DestroyImages(rendererPtr);
+
+#ifdef HAVE_XSHM
+    for (n = 0; rendererPtr->useShm && n < RENDER_IMAGES; ++n) {
+        if (!CreateShmImage(rendererPtr, &rendererPtr->images[n], width, height)) {
+            DestroyImages(rendererPtr);
+            rendererPtr->useShm = 0;
+        }
+    }
+#endif
+
+    if (!rendererPtr->useShm) {
+        imagePtr = XCreateImage(display, Tk_Visual(rendererPtr->tkwin),
+                                Tk_Depth(rendererPtr->tkwin), ZPixmap, 0, NULL,
+                                width, height, 32, 0);
+        if (imagePtr == NULL) {
+            return TCL_ERROR;
+        }
+        imagePtr->data = attemptckalloc(imagePtr->bytes_per_line * height);
+        if (imagePtr->data == NULL) {
+            XDestroyImage(imagePtr);
+            return TCL_ERROR;
+        }
+        rendererPtr->images[0].imagePtr = imagePtr;
+    }
+
+    imagePtr = rendererPtr->images[0].imagePtr;
+    rendererPtr->pixelFormat = PIXEL_GENERIC;
+    if (imagePtr->bits_per_pixel == 32 && imagePtr->byte_order == LSBFirst
+        && imagePtr->green_mask == 0x00ff00) {
+        if (imagePtr->red_mask == 0xff0000 && imagePtr->blue_mask == 0x0000ff)
+            rendererPtr->pixelFormat = PIXEL_BGRX;
+        else if (imagePtr->red_mask == 0x0000ff && imagePtr->blue_mask == 0xff0000)
+            rendererPtr->pixelFormat = PIXEL_RGBX;
+    }
+    rendererPtr->width = width;
+    rendererPtr->height = height;
+    rendererPtr->next = 0;
+    return TCL_OK;
+}
+
+static void
+DestroyImages(VideoRenderer *rendererPtr)
+{
+    int n;
+
+#ifdef HAVE_XSHM
+    if (rendererPtr->useShm) {
+        int attached = 0;
+        for (n = 0; n < RENDER_IMAGES; ++n) {
+            if (rendererPtr->images[n].imagePtr != NULL) {
+                XShmDetach(rendererPtr->display, &rendererPtr->images[n].shminfo);
+                attached = 1;
+            }
+        }
+        if (attached) {
+            XSync(rendererPtr->display, False);
+        }
+        for (n = 0; n < RENDER_IMAGES; ++n) {
+            RenderImage *p = &rendererPtr->images[n];
+            if (p->imagePtr != NULL) {
+                shmdt(p->shminfo.shmaddr);
+                p->imagePtr->data = NULL;
+                XDestroyImage(p->imagePtr);
+                p->imagePtr = NULL;
+            }
+            p->busy = 0;
+        }
+        rendererPtr->dropped = 0;
+        return;
+    }
+#endif
+
+    for (n = 0; n < RENDER_IMAGES; ++n) {
+        RenderImage *p = &rendererPtr->images[n];
+        if (p->imagePtr != NULL) {
+            ckfree(p->imagePtr->data);
+            p->imagePtr->data = NULL;
+            XDestroyImage(p->imagePtr);
+            p->imagePtr = NULL;
+        }
+        p->busy = 0;
+    }
+}
+
+/*
+ * Copy a frame into an image, converting the pixels to the visual's
+ * layout and scaling them to the image size. The common 24 bit
+ * TrueColor visuals have the same byte order as the conversion kernels
+ * produce for B,G,R,A or R,G,B,A output, and an unscaled frame is
+ * converted straight into the image. Otherwise the frame is converted
+ * to 32 bit pixels in the image's channel order, unless it already is,
+ * then scaled into the image. For any other visual the B,G,R,A result
+ * is written one pixel at a time. Any overlay is blended in before
+ * scaling so that it keeps its position relative to the frame.
+ */
+
+static void
+CopyFrame(VideoRenderer *rendererPtr, const VideoFrame *framePtr,
+          const VideoOverlay *overlayPtr, XImage *imagePtr)
+{
+    const int scaled = (framePtr->width != rendererPtr->width
+                        || framePtr->height != rendererPtr->height);
+    const int rgba = (rendererPtr->pixelFormat == PIXEL_RGBX);
+    const unsigned char *srcPtr = framePtr->data;
+    unsigned char *dstPtr = (unsigned char *)imagePtr->data;
+    int srcPitch = framePtr->pitch;
+    unsigned long rmax, gmax, bmax;
+    int rshift = 0, gshift = 0, bshift = 0, x, y;
+
+    if (!scaled && rendererPtr->pixelFormat != PIXEL_GENERIC) {
+        if (rgba) {
+            VideoConvertToRGBA(framePtr, dstPtr, imagePtr->bytes_per_line);
+        } else {
+            VideoConvertToBGRA(framePtr, dstPtr, imagePtr->bytes_per_line);
+        }
+        if (overlayPtr != NULL) {
+            VideoOverlayBlend(overlayPtr, dstPtr, imagePtr->bytes_per_line,
+                              framePtr->width, framePtr->height, rgba);
+        }
+        return;
+    }
+
+    if (rgba || framePtr->format != VIDEO_FORMAT_BGRA || overlayPtr != NULL) {
+        unsigned char *workPtr = GetWork(rendererPtr, 0, framePtr->width, framePtr->height);
+        if (workPtr == NULL) {
+            return;
+        }
+        if (rgba) {
+            VideoConvertToRGBA(framePtr, workPtr, framePtr->width * 4);
+        } else {
+            VideoConvertToBGRA(framePtr, workPtr, framePtr->width * 4);
+        }
+        if (overlayPtr != NULL) {
+            VideoOverlayBlend(overlayPtr, workPtr, framePtr->width * 4,
+                              framePtr->width, framePtr->height, rgba);
+        }
+        srcPtr = workPtr;
+        srcPitch = framePtr->width * 4;
+    }
+    if (scaled) {
+        if (rendererPtr->pixelFormat != PIXEL_GENERIC) {
+            VideoScaleImage(rendererPtr->scalerPtr, srcPtr, srcPitch,
+                            dstPtr, imagePtr->bytes_per_line);
+            return;
+        }
+        dstPtr = GetWork(rendererPtr, 1, rendererPtr->width, rendererPtr->height);
+        if (dstPtr == NULL) {
+            return;
+        }
+        VideoScaleImage(rendererPtr->scalerPtr, srcPtr, srcPitch,
+                        dstPtr, rendererPtr->width * 4);
+        srcPtr = dstPtr;
+        srcPitch = rendererPtr->width * 4;
+    }
+
+    rmax = imagePtr->red_mask;
+    gmax = imagePtr->green_mask;
+    bmax = imagePtr->blue_mask;
+    while (rmax && !(rmax & 1)) { rmax >>= 1; ++rshift; }
+    while (gmax && !(gmax & 1)) { gmax >>= 1; ++gshift; }
+    while (bmax && !(bmax & 1)) { bmax >>= 1; ++bshift; }
+    for (y = 0; y < rendererPtr->height; ++y, srcPtr += srcPitch) {
+        const unsigned char *p = srcPtr;
+        for (x = 0; x < rendererPtr->width; ++x, p += 4) {
+            XPutPixel(imagePtr, x, y,
+                      ((p[2] * rmax / 255) << rshift)
+                      | ((p[1] * gmax / 255) << gshift)
+                      | ((p[0] * bmax / 255) << bshift));
+        }
+    }
+}
+
+/*
+ * Return a work buffer of at least width * height 32 bit pixels.
+ */
+
+static unsigned char *
+GetWork(VideoRenderer *rendererPtr, int index, int width, int height)
+{
+    size_t size = (size_t)width * height * 4;
+
+    if (size > rendererPtr->workSize[index]) {
+        unsigned char *workPtr = (unsigned char *)
+            attemptckrealloc((char *)rendererPtr->work[index], size);
+        if (workPtr == NULL) {
+            return NULL;
+        }
+        rendererPtr->work[index] = workPtr;
+        rendererPtr->workSize[index] = size;
+    }
+    return rendererPtr->work[index];
+}
+
+#ifdef HAVE_XSHM
+
+static int
+CreateShmImage(VideoRenderer *rendererPtr, RenderImage *p, int width, int height)
+{
+    Display *display = rendererPtr->display;
+    Tk_ErrorHandler handler;
+    int failed = 0;
+
+    p->imagePtr = XShmCreateImage(display, Tk_Visual(rendererPtr->tkwin),
+                                  Tk_Depth(rendererPtr->tkwin), ZPixmap, NULL,
+                                  &p->shminfo, width, height);
+    if (p->imagePtr == NULL) {
+        return 0;
+    }
+    p->shminfo.shmid = shmget(IPC_PRIVATE,
+                              p->imagePtr->bytes_per_line * height, IPC_CREAT | 0600);
+    if (p->shminfo.shmid == -1) {
+        XDestroyImage(p->imagePtr);
+        p->imagePtr = NULL;
+        return 0;
+    }
+    p->shminfo.shmaddr = p->imagePtr->data = (char *)shmat(p->shminfo.shmid, NULL, 0);
+    if (p->shminfo.shmaddr == (char *)-1) {
+        shmctl(p->shminfo.shmid, IPC_RMID, NULL);
+        p->imagePtr->data = NULL;
+        XDestroyImage(p->imagePtr);
+        p->imagePtr = NULL;
+        return 0;
+    }
+    p->shminfo.readOnly = False;
+
+    /*
+     * Attaching fails with an X error if the server cannot reach our
+     * shared memory, for instance over a network connection.
+     */
+
+    handler = Tk_CreateErrorHandler(display, -1, -1, -1, AttachErrorProc,
+                                    (ClientData)&failed);
+    XShmAttach(display, &p->shminfo);
+    XSync(display, False);
+    Tk_DeleteErrorHandler(handler);
+
+    /* The segment is removed once both sides have detached. */
+    shmctl(p->shminfo.shmid, IPC_RMID, NULL);
+
+    if (failed) {
+        shmdt(p->shminfo.shmaddr);
+        p->imagePtr->data = NULL;
+        XDestroyImage(p->imagePtr);
+        p->imagePtr = NULL;
+        return 0;
+    }
+    p->busy = 0;
+    return 1;
+}
+
+static int
+AttachErrorProc(ClientData clientData, XErrorEvent *errEventPtr)
+{
+    *(int *)clientData = 1;
+    return 0;
+}
+
+/*
+ * Generic event handler for ShmCompletion events, which tell us that the
+ * server has finished reading an image. If a frame was dropped because
+ * both images were busy the owner is asked to draw the latest frame.
+ */
+
+static int
+CompletionProc(ClientData clientData, XEvent *eventPtr)
+{
+    VideoRenderer *rendererPtr = (VideoRenderer *)clientData;
+    XShmCompletionEvent *completionPtr = (XShmCompletionEvent *)eventPtr;
+    int n;
+
+    if (eventPtr->type != rendererPtr->completionType
+        || eventPtr->xany.display != rendererPtr->display) {
+        return 0;
+    }
+    for (n = 0; n < RENDER_IMAGES; ++n) {
+        RenderImage *p = &rendererPtr->images[n];
+        if (p->imagePtr != NULL && p->shminfo.shmseg == completionPtr->shmseg) {
+            p->busy = 0;
+            if (rendererPtr->dropped) {
+                rendererPtr->dropped = 0;
+                rendererPtr->redrawProc(rendererPtr->clientData);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#endif /* HAVE_XSHM */
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,32 @@
+/* x11render.h - X11 frame renderer for the tkvideo widget
+ *
+ * --------------------------------------------------------------------------
+ * See the file "license.terms" for information on usage and redistribution
+ * of this file, and for a DISCLAIMER OF ALL WARRANTIES.
+ * --------------------------------------------------------------------------
+ * $Id$
+ */
+
+#ifndef _x11render_h_INCLUDE
+#define _x11render_h_INCLUDE
+
+#include "tkvideo.h"
+
+typedef struct VideoRenderer VideoRenderer;
+
+VideoRenderer *VideoRendererCreate(Tk_Window tkwin, Tcl_IdleProc *redrawProc,
+                                   ClientData clientData);
+void VideoRendererDestroy(VideoRenderer *rendererPtr);
+void VideoRendererInvalidate(VideoRenderer *rendererPtr);
+int  VideoRendererDraw(VideoRenderer *rendererPtr, Drawable d,
+                       const VideoFrame *framePtr, const VideoOverlay *overlayPtr,
+                       int imageWidth, int imageHeight,
+                       int srcX, int srcY, int dstX, int dstY, int width, int height);
+
+#endif /* _x11render_h_INCLUDE */
+
+/*
+ * Local variables:
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -6,7 +6,7 @@
 #pragma comment(lib, "shlwapi")
 #endif
 
-static HRESULT CreateCompatibleSampleGrabber(IBaseFilter **ppFilter);
+static HRESULT CreateCompatibleSampleGrabber(IBaseFilter *pCaptureFilter, IBaseFilter **ppFilter);
 static HRESULT MediaType(LPCWSTR sPath, LPCGUID *ppMediaType, LPCGUID *ppMediaSubType);
 
 HRESULT 
@@ -87,7 +87,7 @@ ConstructCaptureGraph(GraphSpecification *pSpec, IGraphBuilder **ppGraph)
     // Add in a Sample Grabber to the graph
     if (SUCCEEDED(hr))
     {
-        hr = CreateCompatibleSampleGrabber(&pSpec->aFilters[SampleGrabberIndex]);
+        hr = CreateCompatibleSampleGrabber(pSpec->aFilters[CaptureFilterIndex], &pSpec->aFilters[SampleGrabberIndex]);
         if (SUCCEEDED(hr))
             hr = pGraph->AddFilter(pSpec->aFilters[SampleGrabberIndex], SAMPLE_GRABBER_NAME);
     }
@@ -358,20 +358,25 @@ DisconnectPins(IBaseFilter *pFilter)
 }
 
 /**
- * This function obtains the colour depth of the current desktop
- * window and configures an instance of the Sample Grabber filter
- * to be compatible with the desktop display. This means that we
- * will recover useful bitmaps from the grabber. This also ensures
- * that the filter is the penultimate filter in the graph and causes
- * the grabber to be placed @em after the AVI decompression filter.
+ * Create and configure an instance of the Sample Grabber filter. If the
+ * capture pin delivers one of the YUV formats that the generic conversion
+ * code handles then the grabber accepts that format, so frames stay in
+ * the native format until they are needed as RGB. Otherwise the grabber
+ * requests RGB32. This also ensures that the filter is the penultimate
+ * filter in the graph and causes the grabber to be placed @em after the
+ * AVI decompression filter.
  *
+ * @param pCaptureFilter [in] the source filter, which may be NULL
  * @param ppFilter [out] pointer is set to the newly configured
  *  sample grabber.
  */
 
 HRESULT
-CreateCompatibleSampleGrabber(IBaseFilter **ppFilter)
+CreateCompatibleSampleGrabber(IBaseFilter *pCaptureFilter, IBaseFilter **ppFilter)
 {
+    static const GUID *aNativeSubtypes[] = {
+        &MEDIASUBTYPE_YUY2, &MEDIASUBTYPE_UYVY, &MEDIASUBTYPE_NV12, &MEDIASUBTYPE_IYUV
+    };
     CComPtr<IBaseFilter> pGrabberFilter;
     HRESULT hr = pGrabberFilter.CoCreateInstance(CLSID_SampleGrabber);
     if (SUCCEEDED(hr))
@@ -380,9 +385,26 @@ CreateCompatibleSampleGrabber(IBaseFilter **ppFilter)
         AM_MEDIA_TYPE mt;
         ZeroMemory(&mt, sizeof(AM_MEDIA_TYPE));
         mt.majortype = MEDIATYPE_Video;
-        // For capture to Tk we want to force RGB32. The image conversion code
-        // can deal with RGB24 and RGB32 but not the other formats.
         mt.subtype = MEDIASUBTYPE_RGB32;
+
+        // File sources have no stream config and are left as RGB32.
+        CComPtr<IPin> pCapturePin;
+        if (pCaptureFilter
+            && SUCCEEDED(FindPinByCategory(pCaptureFilter, PIN_CATEGORY_CAPTURE, &pCapturePin)))
+        {
+            CComQIPtr<IAMStreamConfig> pConfig(pCapturePin);
+            AM_MEDIA_TYPE *pmt = NULL;
+            if (pConfig && SUCCEEDED(pConfig->GetFormat(&pmt)))
+            {
+                for (int n = 0; n < sizeof(aNativeSubtypes) / sizeof(aNativeSubtypes[0]); ++n)
+                {
+                    if (pmt->subtype == *aNativeSubtypes[n])
+                        mt.subtype = pmt->subtype;
+                }
+                FreeMediaType(pmt);
+            }
+        }
+
         CComQIPtr<ISampleGrabber> pSampleGrabber(pGrabberFilter);
         if (pSampleGrabber)
             hr = pSampleGrabber->SetMediaType(&mt);
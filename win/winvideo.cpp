@@ -38,7 +38,12 @@ typedef struct {
     IVideoWindow      *pVideoWindow;
     IAMVideoControl   *pAMVideoControl;
     IPin              *pStillPin;
-    HBITMAP            hbmOverlay;
+    ISampleGrabberCB  *pFrameNotify;
+    int                nFormat;        // layout of the grabber's samples
+    long               nWidth;
+    long               nHeight;
+    BOOL               bBottomUp;
+    Tcl_WideInt        nSequence;      // streaming thread only
     DWORD              dwRegistrationId;
     WNDPROC            wndproc;
     GraphSpecification spec;
@@ -49,14 +54,12 @@ static HRESULT ShowCapturePinProperties(GraphSpecification *pSpec, IGraphBuilder
 static HRESULT ConnectVideo(Video *videoPtr, HWND hwnd, IVideoWindow **ppVideoWindow);
 static HRESULT GetVideoSize(Video *videoPtr, long *pWidth, long *pHeight);
 static void ReleasePlatformData(VideoPlatformData *pPlatformData);
-static int GrabSample(Video *videoPtr, LPCSTR imageName);
 static int GetDeviceList(Tcl_Interp *interp, CLSID clsidCategory);
 LRESULT APIENTRY VideopWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 static Tcl_Obj *Win32Error(const char * szPrefix, HRESULT hr);
-static void ComputeAnchor(Tk_Anchor anchor, Tk_Window tkwin,
-                          int padX, int padY, int innerWidth, int innerHeight, int *xPtr, int *yPtr);
-static int PhotoToHBITMAP(Tcl_Interp *interp, const char *imageName, HBITMAP *phBitmap);
 static HRESULT AddOverlay(Video *videoPtr);
+static HRESULT CreateFrameRing(Video *videoPtr);
+static void CaptureSample(Video *videoPtr, double SampleTime, IMediaSample *pSample);
 static HRESULT WriteBitmapFile(HDC hdc, HBITMAP hbmp, LPCTSTR szFilename);
 static HRESULT VideoStart(Video *videoPtr);
 static HRESULT VideoPause(Video *videoPtr);
@@ -69,13 +72,57 @@ static int VideopWidgetDevicesCmd(ClientData clientData, Tcl_Interp *interp, int
 static int VideopWidgetControlCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 static int VideopWidgetSeekCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 static int VideopWidgetTellCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
-static int VideopWidgetPictureCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 static int VideopWidgetInvalidCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
-static int VideopWidgetOverlayCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 static int VideopWidgetStreamConfigCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 static int VideopWidgetFormatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 static int VideopWidgetVolumeCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[]);
 
+/**
+ * Sample grabber callback called on the DirectShow streaming thread for
+ * each sample. The sample is copied into the widget's frame ring, where
+ * VideopGrabFrame reads it, and the widget is told a frame is ready.
+ */
+
+class FrameNotify : public ISampleGrabberCB
+{
+public:
+    FrameNotify(Video *videoPtr) : m_lRef(1), m_videoPtr(videoPtr) {}
+
+    STDMETHODIMP QueryInterface(REFIID riid, void **ppv)
+    {
+        if (ppv == NULL)
+            return E_POINTER;
+        if (riid == IID_IUnknown || riid == IID_ISampleGrabberCB) {
+            *ppv = static_cast<ISampleGrabberCB *>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+    STDMETHODIMP_(ULONG) AddRef() { return InterlockedIncrement(&m_lRef); }
+    STDMETHODIMP_(ULONG) Release()
+    {
+        LONG lRef = InterlockedDecrement(&m_lRef);
+        if (lRef == 0)
+            delete this;
+        return lRef;
+    }
+    STDMETHODIMP SampleCB(double SampleTime, IMediaSample *pSample)
+    {
+        CaptureSample(m_videoPtr, SampleTime, pSample);
+        return S_OK;
+    }
+    STDMETHODIMP BufferCB(double SampleTime, BYTE *pBuffer, long BufferLen)
+    {
+        return E_NOTIMPL;
+    }
+
+private:
+    LONG m_lRef;
+    Video *m_videoPtr;
+};
+
 struct Ensemble {
     const char *name;          /* subcommand name */
     Tcl_ObjCmdProc *command;   /* subcommand implementation OR */
@@ -94,8 +141,12 @@ struct Ensemble VideoWidgetEnsemble[] = {
     { "pause",        VideopWidgetControlCmd,  NULL },
     { "seek",         VideopWidgetSeekCmd,     NULL },
     { "tell",         VideopWidgetTellCmd,     NULL },
-    { "picture",      VideopWidgetPictureCmd,  NULL },
-    { "overlay",      VideopWidgetOverlayCmd,  NULL }, /* this should probably be a configure option */
+    { "stats",        VideopWidgetInvalidCmd,  NULL },
+    { "stream",       VideopWidgetInvalidCmd,  NULL },
+    { "clip",         VideopWidgetInvalidCmd,  NULL },
+    { "motion",       VideopWidgetInvalidCmd,  NULL },
+    { "picture",      VideopWidgetInvalidCmd,  NULL },
+    { "overlay",      VideopWidgetInvalidCmd,  NULL },
     { "format",       VideopWidgetStreamConfigCmd, NULL }, /* this should probably be a configure option */
     { "framerate",    VideopWidgetStreamConfigCmd, NULL }, /* this should probably be a configure option */
     { "formats",      VideopWidgetFormatsCmd,  NULL }, /* this should probably be a configure option */
@@ -133,6 +184,7 @@ VideopCreateWidget(Video *videoPtr)
     videoPtr->platformData = (ClientData)platformPtr;
     if (videoPtr->platformData != NULL) {
         memset(videoPtr->platformData, 0, sizeof(VideoPlatformData));
+        platformPtr->pFrameNotify = new FrameNotify(videoPtr);
     } else {
         Tcl_Panic("out of memory");
     }
@@ -156,7 +208,11 @@ VideopCleanup(char *memPtr)
 {
     Video *videoPtr = (Video *)memPtr;
     if (videoPtr->platformData != NULL) {
-        ReleasePlatformData((VideoPlatformData *)videoPtr->platformData);
+        VideoPlatformData *pPlatformData = (VideoPlatformData *)videoPtr->platformData;
+        ReleasePlatformData(pPlatformData);
+        VideoCloseRing(videoPtr);    // the streaming thread has gone with the graph
+        if (pPlatformData->pFrameNotify != NULL)
+            pPlatformData->pFrameNotify->Release();
         ckfree((char *)videoPtr->platformData);
         videoPtr->platformData = NULL;
     }
@@ -173,6 +229,7 @@ VideopDestroy(Video *videoPtr)
 {
     VideoPlatformData *platformPtr = (VideoPlatformData *)videoPtr->platformData;
     ReleasePlatformData(platformPtr);
+    VideoCloseRing(videoPtr);    // the streaming thread has gone with the graph
     if (platformPtr->wndproc != NULL)
     {
         HWND hwnd = Tk_GetHWND(Tk_WindowId(videoPtr->tkwin)); 
@@ -196,6 +253,7 @@ VideopInitializeSource(Video *videoPtr)
 
     // Release the current graph and any pointers into it.
     ReleasePlatformData(pPlatformData);
+    VideoCloseRing(videoPtr);    // the streaming thread has gone with the graph
 
     pPlatformData->spec.nDeviceIndex = -1;
     pPlatformData->spec.nAudioIndex = -1;
@@ -231,6 +289,10 @@ VideopInitializeSource(Video *videoPtr)
 
             if (pPlatformData->pVideoWindow)
                 pPlatformData->pVideoWindow->put_BorderColor(0xffffff);
+            if (SUCCEEDED(hr))
+                hr = CreateFrameRing(videoPtr);
+            if (videoPtr->overlayPtr != NULL)
+                AddOverlay(videoPtr);
        }
     }
 
@@ -301,7 +363,7 @@ VideopCalculateGeometry(Video *videoPtr)
     } else {
         width = videoPtr->videoWidth;
         height = videoPtr->videoHeight;
-        ComputeAnchor(videoPtr->anchor, videoPtr->tkwin, 0, 0, width, height, &x, &y);
+        VideoComputeAnchor(videoPtr->anchor, videoPtr->tkwin, 0, 0, width, height, &x, &y);
     }
 
     if (pPlatformData && pPlatformData->pVideoWindow) {
@@ -311,6 +373,56 @@ VideopCalculateGeometry(Video *videoPtr)
     }
 }
 
+/**
+ * Frames are drawn by the DirectShow video renderer in its own child
+ * window so there is nothing to paint into the Tk window itself.
+ */
+
+int
+VideopDisplay(Video *videoPtr, Drawable d, XRectangle *rectPtr)
+{
+    return 0;
+}
+
+/**
+ * A mosaic (see generic/mosaic.c) draws its back buffer into its own
+ * window with GDI. The buffer is a top-down 32 bit DIB the size of the
+ * window, so there is no state to keep beyond the window itself.
+ */
+
+ClientData
+VideopPresenterCreate(Tk_Window tkwin, Tcl_IdleProc *redrawProc, ClientData clientData)
+{
+    return (ClientData)tkwin;
+}
+
+int
+VideopPresent(ClientData presenter, Drawable d, const VideoFrame *framePtr)
+{
+    HWND hwnd = Tk_GetHWND(d);
+    HDC hdc = GetDC(hwnd);
+    BITMAPINFO bmi;
+    int lines;
+
+    ZeroMemory(&bmi, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = framePtr->width;
+    bmi.bmiHeader.biHeight = -framePtr->height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    lines = SetDIBitsToDevice(hdc, 0, 0, framePtr->width, framePtr->height,
+                              0, 0, 0, framePtr->height, framePtr->data,
+                              &bmi, DIB_RGB_COLORS);
+    ReleaseDC(hwnd, hdc);
+    return lines != 0;
+}
+
+void
+VideopPresenterDestroy(ClientData presenter)
+{
+}
+
 int
 VideopWidgetObjCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
@@ -531,30 +643,6 @@ VideopWidgetSeekCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj
     return r;
 }
 
-int 
-VideopWidgetPictureCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-    Video *videoPtr = (Video *)clientData;
-    VideoPlatformData *pPlatformData = (VideoPlatformData *)videoPtr->platformData;
-    int r = TCL_OK;
-
-    if (objc < 2 || objc > 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?imagename?");
-        r = TCL_ERROR;
-    } else {
-        if (pPlatformData->pFilterGraph == NULL) {
-            Tcl_SetObjResult(interp, Tcl_NewStringObj("error: no video source initialized", -1));
-            return TCL_ERROR;
-        }
-        const char *imageName = NULL;
-        if (objc == 3) {
-            imageName = Tcl_GetString(objv[2]);
-        }
-        r = GrabSample(videoPtr, imageName);
-    }
-    return r;
-}
-
 // Any command that uses the current capture pin media structure...
 //  framerate, framerates, format, formats
 int
@@ -865,80 +953,26 @@ VideopWidgetVolumeCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_O
     return r;
 }
 
-int 
-VideopWidgetOverlayCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/**
+ * Pass the overlay to the VMR mixer, which draws it over the video in the
+ * window. Frames captured with picture have the overlay blended in by the
+ * generic code. If no graph has been built yet the overlay is applied
+ * once it is.
+ */
+
+int
+VideopUpdateOverlay(Video *videoPtr)
 {
-    Video *videoPtr = (Video *)clientData;
     VideoPlatformData *pPlatformData = (VideoPlatformData *)videoPtr->platformData;
-    int r = TCL_OK;
 
-    if (objc != 3) {
-        Tcl_WrongNumArgs(interp, 2, objv, "imagename");
-        r = TCL_ERROR;
-    } else {
-        if (pPlatformData->pFilterGraph == NULL) {
-            Tcl_SetObjResult(interp, Tcl_NewStringObj("error: no video source initialized", -1));
+    if (pPlatformData->pFilterGraph != NULL) {
+        HRESULT hr = AddOverlay(videoPtr);
+        if (FAILED(hr)) {
+            Tcl_SetObjResult(videoPtr->interp, Win32Error("failed to set overlay", hr));
             return TCL_ERROR;
         }
-        const char *imageName = NULL;
-        if (objc == 3) {
-            imageName = Tcl_GetString(objv[2]);
-        }
-        Tcl_ResetResult(interp);
-        HBITMAP hbm = NULL;
-        r = PhotoToHBITMAP(interp, imageName, &hbm);
-        if (hbm) {
-            if (pPlatformData->hbmOverlay)
-                DeleteObject(pPlatformData->hbmOverlay);
-            pPlatformData->hbmOverlay = hbm;
-        }
-        if (r == TCL_OK) {
-            HRESULT hr = AddOverlay(videoPtr);
-            if (FAILED(hr))
-                Tcl_SetObjResult(interp, Win32Error("failed to set overlay", hr));
-            r = SUCCEEDED(hr) ? TCL_OK : TCL_ERROR;
-        }
     }
-    return r;
-}
-
-int
-PhotoToHBITMAP(Tcl_Interp *interp, const char *imageName, HBITMAP *phBitmap)
-{
-    BITMAP bm;
-    int x, y;
-    unsigned char *srcPtr, *dstPtr, *bits;
-    Tk_PhotoImageBlock block;
-
-    Tk_PhotoHandle img = Tk_FindPhoto(interp, imageName);
-    Tk_PhotoGetImage(img, &block);
-
-    bits = (unsigned char *)ckalloc(block.width * block.height * sizeof(unsigned char));
-    srcPtr = block.pixelPtr;
-    for (y = block.height - 1; y >= 0; y--) 
-    {
-	    dstPtr = bits + (y * block.width);
-	    for (x = 0; x < block.width; x++) 
-        {
-	        *dstPtr++ = *(srcPtr + block.offset[2]); /* B */
-	        *dstPtr++ = *(srcPtr + block.offset[1]); /* G */
-	        *dstPtr++ = *(srcPtr + block.offset[0]); /* R */
-	        *dstPtr++ = *(srcPtr + block.offset[3]); /* A */
-	        srcPtr += block.pixelSize;
-	    }
-    }
-    bm.bmType = 0;
-    bm.bmWidth = block.width;
-    bm.bmHeight = block.height;
-    bm.bmWidthBytes = block.width * block.pixelSize;
-    bm.bmPlanes = 1;
-    bm.bmBitsPixel = 32;
-    bm.bmBits = bits;
-    
-    *phBitmap = CreateBitmapIndirect(&bm);
-    if (*phBitmap)
-        return TCL_OK;
-    return TCL_ERROR;
+    return TCL_OK;
 }
 
 HRESULT
@@ -1015,7 +1049,9 @@ VideoStart(Video *videoPtr)
         if (SUCCEEDED(hr) && pPlatformData->pVideoWindow)
             hr = pPlatformData->pVideoWindow->put_Visible(OATRUE);
         if (SUCCEEDED(hr) && pSampleGrabber)
-            hr = pSampleGrabber->SetBufferSamples(TRUE);
+            hr = pSampleGrabber->SetBufferSamples(FALSE);
+        if (SUCCEEDED(hr) && pSampleGrabber)
+            hr = pSampleGrabber->SetCallback(pPlatformData->pFrameNotify, 0);
         if (SUCCEEDED(hr) && pPlatformData->pMediaControl)
             hr = pPlatformData->pMediaControl->Run();
     }
@@ -1038,7 +1074,9 @@ VideoPause(Video *videoPtr)
         if (SUCCEEDED(hr) && pPlatformData->pVideoWindow)
             hr = pPlatformData->pVideoWindow->put_Visible(OATRUE);
         if (SUCCEEDED(hr) && pSampleGrabber)
-            hr = pSampleGrabber->SetBufferSamples(TRUE);
+            hr = pSampleGrabber->SetBufferSamples(FALSE);
+        if (SUCCEEDED(hr) && pSampleGrabber)
+            hr = pSampleGrabber->SetCallback(pPlatformData->pFrameNotify, 0);
         if (SUCCEEDED(hr) && pPlatformData->pMediaControl)
             hr = pPlatformData->pMediaControl->Pause();
     }
@@ -1058,6 +1096,8 @@ VideoStop(Video *videoPtr)
         if (SUCCEEDED( pPlatformData->pFilterGraph->FindFilterByName(SAMPLE_GRABBER_NAME, &pGrabberFilter) ))
             pGrabberFilter.QueryInterface(&pSampleGrabber);
 
+        if (SUCCEEDED(hr) && pSampleGrabber)
+            hr = pSampleGrabber->SetCallback(NULL, 0);
         if (SUCCEEDED(hr) && pSampleGrabber)
             hr = pSampleGrabber->SetBufferSamples(FALSE);
         if (SUCCEEDED(hr) && pPlatformData->pMediaControl)
@@ -1234,168 +1274,125 @@ GetVideoSize(Video *videoPtr, long *pWidth, long *pHeight)
     return hr;
 }
 
-/**
- * This function takes an image from the sample grabber and creates a
- * Tk photo using the returned data.
- *
- * @param interp [in] pointer to the tcl interpreter
- * @param pGraph [in] pointer to the filter graph
- * @param imageName [in] optional name to use for the new Tk image
- *
- * @return TCL_OK on success. On failure TCL_ERROR and the interpreter
- *  result is set to describe the error.
+/*
+ * Record the layout of the sample grabber's samples and allocate a frame
+ * ring of -buffercount slots for them. Called once the graph is built.
  */
 
-int
-GrabSample(Video *videoPtr, LPCSTR imageName)
+HRESULT
+CreateFrameRing(Video *videoPtr)
 {
     VideoPlatformData *pPlatformData = (VideoPlatformData *)videoPtr->platformData;
     CComPtr<IBaseFilter> pGrabberFilter;
     CComPtr<ISampleGrabber> pSampleGrabber;
-    Tcl_Obj *errObj = NULL;
-    int r = TCL_OK;
-
-#ifdef USE_STILL_PIN
-    // If we have a still pin hooked up, trigger it now.
-    HRESULT hr = pPlatformData->pFilterGraph->FindFilterByName(STILL_GRABBER_NAME, &pGrabberFilter);
-    if (SUCCEEDED(hr))
-    {
-        CComPtr<IBaseFilter> pCaptureFilter;
-        hr = pPlatformData->pFilterGraph->FindFilterByName(CAPTURE_FILTER_NAME, &pCaptureFilter);
-        if (SUCCEEDED(hr))
-        {
-            CComPtr<IPin> pStillPin;
-            hr = FindPinByCategory(pCaptureFilter, PIN_CATEGORY_STILL, &pStillPin);
-            if (SUCCEEDED(hr) && pStillPin)
-            {
-                CComPtr<IAMVideoControl> pAMVideoControl;
-                hr = pCaptureFilter->QueryInterface(IID_IAMVideoControl, reinterpret_cast<void **>(&pAMVideoControl));
-                if (SUCCEEDED(hr))
-                    hr = pAMVideoControl->SetMode(pStillPin, VideoControlFlag_Trigger);
-            }
-        }
-    }
-    else
-    {
-        hr = pPlatformData->pFilterGraph->FindFilterByName(SAMPLE_GRABBER_NAME, &pGrabberFilter);
-    }
-
-#else  /* USE_STILL_PIN */
-
-    HRESULT hr = pPlatformData->pFilterGraph->FindFilterByName(SAMPLE_GRABBER_NAME, &pGrabberFilter);
-
-#endif /* USE_STILL_PIN */
-
-    if (SUCCEEDED(hr))
-        hr = pGrabberFilter.QueryInterface(&pSampleGrabber);
-
     AM_MEDIA_TYPE mt;
-    ZeroMemory(&mt, sizeof(AM_MEDIA_TYPE));
+    VideoFrame frame;
 
+    // Without a grabber, as for an audio only source, there are no frames.
+    if (FAILED(pPlatformData->pFilterGraph->FindFilterByName(SAMPLE_GRABBER_NAME, &pGrabberFilter)))
+        return S_OK;
+    HRESULT hr = pGrabberFilter.QueryInterface(&pSampleGrabber);
+    ZeroMemory(&mt, sizeof(AM_MEDIA_TYPE));
     if (SUCCEEDED(hr))
         hr = pSampleGrabber->GetConnectedMediaType(&mt);
-
-    // Copy the bitmap info from the media type structure
-    VIDEOINFOHEADER *pvih = reinterpret_cast<VIDEOINFOHEADER *>(mt.pbFormat);
-    BITMAPINFOHEADER bih;
     if (SUCCEEDED(hr))
     {
-        ZeroMemory(&bih, sizeof(BITMAPINFOHEADER));
-        CopyMemory(&bih, &pvih->bmiHeader, sizeof(BITMAPINFOHEADER));
+        const BITMAPINFOHEADER *pbih = &reinterpret_cast<VIDEOINFOHEADER *>(mt.pbFormat)->bmiHeader;
+        int format = VIDEO_FORMAT_BGRA;
+        if (mt.subtype == MEDIASUBTYPE_YUY2)
+            format = VIDEO_FORMAT_YUY2;
+        else if (mt.subtype == MEDIASUBTYPE_UYVY)
+            format = VIDEO_FORMAT_UYVY;
+        else if (mt.subtype == MEDIASUBTYPE_NV12)
+            format = VIDEO_FORMAT_NV12;
+        else if (mt.subtype == MEDIASUBTYPE_IYUV)
+            format = VIDEO_FORMAT_I420;
+        else if (pbih->biBitCount == 24)
+            format = VIDEO_FORMAT_BGR24;
+        pPlatformData->nFormat = format;
+        pPlatformData->nWidth = pbih->biWidth;
+        pPlatformData->nHeight = abs(pbih->biHeight);
+        // An RGB DIB is bottom-up if biHeight is positive. YUV samples
+        // are always top-down.
+        pPlatformData->bBottomUp = (pbih->biHeight > 0 && format <= VIDEO_FORMAT_BGR24);
         if (mt.cbFormat > 0)
             CoTaskMemFree(mt.pbFormat);
+
+        size_t cbFrame = VideoFrameLayout(&frame, format, pPlatformData->nWidth,
+                                          pPlatformData->nHeight, NULL);
+        pPlatformData->nSequence = 0;
+        if (VideoOpenRing(videoPtr, cbFrame) != TCL_OK)
+            hr = E_OUTOFMEMORY;
     }
+    return hr;
+}
 
-    // Get the image data - first finding out how much space to allocate.
-    // Copy the image into the buffer.
-    long cbData = 0;
-    LPBYTE pData = NULL;
-    if (SUCCEEDED(hr))
-        hr = pSampleGrabber->GetCurrentBuffer(&cbData, NULL);
-    if (hr == E_INVALIDARG || hr == VFW_E_WRONG_STATE)
-        errObj = Tcl_NewStringObj("image capture failed: no samples are being buffered", -1);
-    if (SUCCEEDED(hr))
+/*
+ * Copy a sample into a free slot of the frame ring and publish it. This
+ * runs on the DirectShow streaming thread. The copy is the only one made
+ * of the sample: the widget converts or draws straight from the slot. If
+ * the widget thread is holding every other slot the sample is dropped.
+ */
+
+void
+CaptureSample(Video *videoPtr, double SampleTime, IMediaSample *pSample)
+{
+    VideoPlatformData *pPlatformData = (VideoPlatformData *)videoPtr->platformData;
+    VideoRing *pRing = videoPtr->ringPtr;
+    BYTE *pData = NULL;
+
+    if (pRing == NULL || FAILED(pSample->GetPointer(&pData)))
+        return;
+    VideoFrame *framePtr = VideoBeginFrame(videoPtr);
+    if (framePtr == NULL)
+        return;
+    size_t cbFrame = VideoFrameLayout(framePtr, pPlatformData->nFormat, pPlatformData->nWidth,
+                                      pPlatformData->nHeight, framePtr->data);
+    if ((size_t)pSample->GetActualDataLength() < cbFrame)
+        return;
+    memcpy(framePtr->data, pData, cbFrame);
+    if (pPlatformData->bBottomUp)
     {
-        pData = new BYTE[cbData];
-        if (pData == NULL)
-            hr = E_OUTOFMEMORY;
-        if (SUCCEEDED(hr))
-            hr = pSampleGrabber->GetCurrentBuffer(&cbData, reinterpret_cast<long*>(pData));
-        if (SUCCEEDED(hr))
-        {
-            // Create a photo image.
-            //image create photo -height n -width
-            Tcl_Obj *objv[8];
-            int      ndx = 0;
-            objv[ndx++] = Tcl_NewStringObj("image", -1);
-            objv[ndx++] = Tcl_NewStringObj("create", -1);
-            objv[ndx++] = Tcl_NewStringObj("photo", -1);
-            if (imageName != NULL)
-                objv[ndx++] = Tcl_NewStringObj(imageName, -1);
-            objv[ndx++] = Tcl_NewStringObj("-height", -1);
-            objv[ndx++] = Tcl_NewLongObj(bih.biHeight);
-            objv[ndx++] = Tcl_NewStringObj("-width", -1);
-            objv[ndx++] = Tcl_NewLongObj(bih.biWidth);
-            r = Tcl_EvalObjv(videoPtr->interp, ndx, objv, 0);
-            if (r == TCL_OK) {
-                imageName = Tcl_GetStringResult(videoPtr->interp);
-                Tk_PhotoHandle img = Tk_FindPhoto(videoPtr->interp, imageName);
-                Tk_PhotoImageBlock block;
-
-                Tk_PhotoBlank(img);
-                block.width = bih.biWidth;
-                block.height = bih.biHeight;
-                // hard coding for 24/32 bit bitmaps.
-                block.pixelSize = bih.biBitCount / 8;
-                block.pitch  = block.pixelSize * block.width;
-                block.offset[0] = 2;  /* R */
-                block.offset[1] = 1;  /* G */
-                block.offset[2] = 0;  /* B */
-#if TK_MINOR_VERSION >= 3
-                block.offset[3] = 3;
-#endif
-                block.pixelPtr = pData;
-
-#if TK_MINOR_VERSION >= 3
-                // We have to fix the alpha channel. By default it is
-                // undefined and tends to produce a transparent image.
-                for (LPBYTE p = block.pixelPtr; p < block.pixelPtr+cbData; p += block.pixelSize)
-                    *(p + block.offset[3]) = 0xff;
-#endif
-
-                // If biHeight is positive the bitmap is a bottom-up DIB.
-                if (bih.biHeight > 0)
-                {
-                    DWORD cbRow = block.pitch;
-                    LPBYTE pTmp = new BYTE[cbRow];
-                    for (int i = 0; i < block.height/2; i++)
-                    {
-                        LPBYTE pTop = block.pixelPtr + (i * cbRow);
-                        LPBYTE pBot = block.pixelPtr + ((block.height - i - 1) * cbRow);
-                        CopyMemory(pTmp, pBot, cbRow);
-                        CopyMemory(pBot, pTop, cbRow);
-                        CopyMemory(pTop, pTmp, cbRow);
-                    }
-                    delete [] pTmp;
-                }
+        // Express a bottom-up DIB as a negative pitch from the last row.
+        // The conversion then flips the image as it converts.
+        framePtr->data += (framePtr->height - 1) * framePtr->pitch;
+        framePtr->pitch = -framePtr->pitch;
+    }
+    framePtr->sequence = pPlatformData->nSequence++;
+    framePtr->timestamp = (Tcl_WideInt)(SampleTime * 1000000.0);
+    VideoPublishFrame(videoPtr);
+}
 
-                Tk_PhotoPutBlock(
-#if TK_MAJOR_VERSION >= 8 && TK_MINOR_VERSION >= 5
-                                 videoPtr->interp,
-#endif
-                                 img, &block,
-                                 0, 0, bih.biWidth, bih.biHeight, TK_PHOTO_COMPOSITE_SET);
-            }
-        }
-        delete [] pData;
-    }
-    if (FAILED(hr)) {
-        if (errObj == NULL)
-            errObj = Win32Error("failed to capture image", hr);
-        Tcl_SetObjResult(videoPtr->interp, errObj);
-        r = TCL_ERROR;
+/**
+ * This function converts the newest frame in the frame ring into the
+ * widget staging buffer ready to be copied into a Tk photo. The frame is
+ * read in place and the streaming thread does not write to its slot
+ * until it is released.
+ *
+ * @param videoPtr [in] pointer to the widget instance data
+ *
+ * @return TCL_OK on success. On failure TCL_ERROR and the interpreter
+ *  result is set to describe the error.
+ */
+
+int
+VideopGrabFrame(Video *videoPtr)
+{
+    VideoPlatformData *pPlatformData = (VideoPlatformData *)videoPtr->platformData;
+
+    if (pPlatformData->pFilterGraph == NULL || videoPtr->ringPtr == NULL) {
+        Tcl_SetObjResult(videoPtr->interp, Tcl_NewStringObj("error: no video source initialized", -1));
+        return TCL_ERROR;
     }
 
+    const VideoFrame *framePtr = VideoRingAcquire(videoPtr->ringPtr);
+    if (framePtr == NULL) {
+        Tcl_SetObjResult(videoPtr->interp,
+            Tcl_NewStringObj("image capture failed: no samples are being buffered", -1));
+        return TCL_ERROR;
+    }
+    int r = VideoStageFrame(videoPtr, framePtr);
+    VideoRingRelease(videoPtr->ringPtr);
     return r;
 }
 
@@ -1516,145 +1513,71 @@ Win32Error(const char * szPrefix, HRESULT hr)
     return msgObj;
 }
 
+
 /*
- *---------------------------------------------------------------------------
- *
- * TkComputeAnchor --
- *
- *	Determine where to place a rectangle so that it will be properly
- *	anchored with respect to the given window.  Used by widgets
- *	to align a box of text inside a window.  When anchoring with
- *	respect to one of the sides, the rectangle be placed inside of
- *	the internal border of the window.
- *
- * Results:
- *	*xPtr and *yPtr set to the upper-left corner of the rectangle
- *	anchored in the window.
- *
- * Side effects:
- *	None.
- *
- *---------------------------------------------------------------------------
+ * Hand the overlay surface to the VMR mixer. The surface is already in
+ * the B,G,R,A layout of a 32 bit bitmap so it is used as the bitmap bits
+ * directly. The mixer does not use per-pixel alpha from an HDC, but
+ * fully transparent pixels are black once premultiplied so black is
+ * used as the colour key. Without an overlay the mixer bitmap is
+ * disabled.
  */
-void
-ComputeAnchor(Tk_Anchor anchor, Tk_Window tkwin, 
-              int padX, int padY, int innerWidth, int innerHeight, int *xPtr, int *yPtr)
-{
-    switch (anchor) {
-	case TK_ANCHOR_NW:
-	case TK_ANCHOR_W:
-	case TK_ANCHOR_SW:
-	    *xPtr = Tk_InternalBorderLeft(tkwin) + padX;
-	    break;
-
-	case TK_ANCHOR_N:
-	case TK_ANCHOR_CENTER:
-	case TK_ANCHOR_S:
-	    *xPtr = (Tk_Width(tkwin) - innerWidth) / 2;
-	    break;
-
-	default:
-	    *xPtr = Tk_Width(tkwin) - (Tk_InternalBorderRight(tkwin) + padX)
-		    - innerWidth;
-	    break;
-    }
-
-    switch (anchor) {
-	case TK_ANCHOR_NW:
-	case TK_ANCHOR_N:
-	case TK_ANCHOR_NE:
-	    *yPtr = Tk_InternalBorderTop(tkwin) + padY;
-	    break;
-
-	case TK_ANCHOR_W:
-	case TK_ANCHOR_CENTER:
-	case TK_ANCHOR_E:
-	    *yPtr = (Tk_Height(tkwin) - innerHeight) / 2;
-	    break;
-
-	default:
-	    *yPtr = Tk_Height(tkwin) - Tk_InternalBorderBottom(tkwin) - padY
-		    - innerHeight;
-	    break;
-    }
-}
 
 HRESULT
 AddOverlay(Video *videoPtr)
 {
     VideoPlatformData *platformData = (VideoPlatformData *)videoPtr->platformData;
+    const VideoOverlay *overlayPtr = videoPtr->overlayPtr;
+    CComPtr<IBaseFilter> pFilter;
+    CComPtr<IVMRMixerBitmap> pMixer;
+    VMRALPHABITMAP bmpInfo;
     LONG cx, cy;
     HRESULT hr;
 
-    HWND hwnd = Tk_GetHWND(Tk_WindowId(videoPtr->tkwin)); 
-    hr = GetVideoSize(videoPtr, &cx, &cy);
+    hr = platformData->pFilterGraph->FindFilterByName(RENDERER_FILTER_NAME, &pFilter);
     if (SUCCEEDED(hr))
-    {
-        HDC hdcBitmap;
-        HDC hdc = GetDC(hwnd);
-        if (hdc == NULL)
-            hr = E_FAIL;
-        
-        if (SUCCEEDED(hr))
-        {
-            hdcBitmap = CreateCompatibleDC(hdc);
-            if (hdcBitmap == NULL)
-                hr = E_FAIL;
-            ReleaseDC(hwnd, hdc);
-        }
-    
-        BITMAP bitmap = {0};
-        if (SUCCEEDED(hr))
-        {
-            if (GetObject(platformData->hbmOverlay, sizeof(BITMAP), &bitmap) == NULL)
-            //if (GetObject(hbmTest, sizeof(BITMAP), &bitmap) == NULL)
-            {
-                DeleteDC(hdcBitmap);
-                hr = E_FAIL;
-            }
-        }
-    
-        HBITMAP hbmOld;
-        if (SUCCEEDED(hr))
-        {
-            hbmOld = (HBITMAP)SelectObject(hdcBitmap, platformData->hbmOverlay);
-            //hbmOld = (HBITMAP)SelectObject(hdcBitmap, hbmTest);
-            if (hbmOld == NULL)
-            {
-                DeleteDC(hdcBitmap);
-                hr = E_FAIL;
-            }
-        }
-    
-        VMRALPHABITMAP bmpInfo;
-        if (SUCCEEDED(hr))
-        {
-            ZeroMemory(&bmpInfo, sizeof(bmpInfo) );
-            bmpInfo.dwFlags = VMRBITMAP_HDC;
-            bmpInfo.hdc = hdcBitmap;
-    
-            // Show the entire bitmap in the top-left corner of the video image.
-            SetRect(&bmpInfo.rSrc, 0, 0, bitmap.bmWidth, bitmap.bmHeight);
-            bmpInfo.rDest.left = 0;
-            bmpInfo.rDest.top = 0;
-            bmpInfo.rDest.right = (float)bitmap.bmWidth / (float)cx;
-            bmpInfo.rDest.bottom = (float)bitmap.bmHeight / (float)cy;
-    
-            // Set the transparency value (1.0 is opaque, 0.0 is transparent).
-            bmpInfo.fAlpha = 1.0;
-
-            CComPtr<IBaseFilter> pFilter;
-            CComPtr<IVMRMixerBitmap> pMixer;
-            hr = platformData->pFilterGraph->FindFilterByName(RENDERER_FILTER_NAME, &pFilter);
-            if (SUCCEEDED(hr))
-                hr = pFilter->QueryInterface(&pMixer);
-            if (SUCCEEDED(hr))
-                hr = pMixer->SetAlphaBitmap(&bmpInfo);
-
-            DeleteObject(SelectObject(hdcBitmap, hbmOld));
-            DeleteDC(hdcBitmap);
-        }
-    }
+        hr = pFilter->QueryInterface(&pMixer);
+    if (SUCCEEDED(hr))
+        hr = GetVideoSize(videoPtr, &cx, &cy);
+    if (FAILED(hr))
+        return hr;
+
+    ZeroMemory(&bmpInfo, sizeof(bmpInfo));
+    if (overlayPtr == NULL || overlayPtr->pixels == NULL) {
+        bmpInfo.dwFlags = VMRBITMAP_DISABLE;
+        return pMixer->SetAlphaBitmap(&bmpInfo);
+    }
+
+    HWND hwnd = Tk_GetHWND(Tk_WindowId(videoPtr->tkwin));
+    HDC hdc = GetDC(hwnd);
+    if (hdc == NULL)
+        return E_FAIL;
+    HDC hdcBitmap = CreateCompatibleDC(hdc);
+    ReleaseDC(hwnd, hdc);
+    if (hdcBitmap == NULL)
+        return E_FAIL;
+
+    HBITMAP hbm = CreateBitmap(overlayPtr->width, overlayPtr->height, 1, 32,
+                               overlayPtr->pixels);
+    HBITMAP hbmOld = NULL;
+    if (hbm == NULL || (hbmOld = (HBITMAP)SelectObject(hdcBitmap, hbm)) == NULL) {
+        hr = E_FAIL;
+    } else {
+        bmpInfo.dwFlags = VMRBITMAP_HDC | VMRBITMAP_SRCCOLORKEY;
+        bmpInfo.hdc = hdcBitmap;
+        bmpInfo.clrSrcKey = RGB(0, 0, 0);
+        SetRect(&bmpInfo.rSrc, 0, 0, overlayPtr->width, overlayPtr->height);
+        bmpInfo.rDest.left = (float)overlayPtr->x / (float)cx;
+        bmpInfo.rDest.top = (float)overlayPtr->y / (float)cy;
+        bmpInfo.rDest.right = (float)(overlayPtr->x + overlayPtr->width) / (float)cx;
+        bmpInfo.rDest.bottom = (float)(overlayPtr->y + overlayPtr->height) / (float)cy;
+        bmpInfo.fAlpha = (float)overlayPtr->alpha / 255.0f;
+        hr = pMixer->SetAlphaBitmap(&bmpInfo);
+        SelectObject(hdcBitmap, hbmOld);
+    }
+    if (hbm != NULL)
+        DeleteObject(hbm);
+    DeleteDC(hdcBitmap);
     return hr;
 }
 